@@ -0,0 +1,228 @@
+/*
+ * (C) 2017 by Holger Hans Peter Freyther
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Times the loop the osmocom fds are dispatched from. Built against glib
+ * it is evpoll as the poll function of a GMainContext, with
+ * USE_NATIVE_LOOP it is evpoll_run inside of a su_root.
+ *
+ * latency: a thread writes to an eventfd or a socket while the loop is
+ * asleep and the time until the osmo_fd callback runs is recorded.
+ *
+ * iteration: one fd is always readable and a number of idle ones are
+ * registered next to it, every iteration of the loop calls back once.
+ */
+
+#include "../../src/evpoll.c"
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef USE_NATIVE_LOOP
+#include <glib.h>
+#endif
+
+#define SAMPLES		10000
+#define ITERATIONS	1000000
+#define IDLE_FDS	16
+#define PAUSE_US	200
+
+/* evpoll.c runs the parked setups and the standby updates */
+int setup_queue_run(void) { return 0; }
+void callstate_flush(void) {}
+
+static struct osmo_fd wake_fd;
+static int writer_fd;
+static bool use_socket;
+static unsigned int num_samples = SAMPLES;
+static unsigned int num_iterations = ITERATIONS;
+static unsigned int done;
+static uint64_t sent_ns;
+static uint64_t *samples;
+static uint64_t start_ns;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *_a, const void *_b)
+{
+	const uint64_t *a = _a, *b = _b;
+
+	return *a < *b ? -1 : *a > *b;
+}
+
+static void finish_latency(void)
+{
+	qsort(samples, num_samples, sizeof(*samples), cmp_u64);
+	printf("%s wakeup to callback over %u samples in us: min %.1f median %.1f p99 %.1f max %.1f\n",
+		use_socket ? "socket" : "eventfd", num_samples,
+		samples[0] / 1000.0, samples[num_samples / 2] / 1000.0,
+		samples[num_samples * 99 / 100] / 1000.0,
+		samples[num_samples - 1] / 1000.0);
+	exit(EXIT_SUCCESS);
+}
+
+static int wake_cb(struct osmo_fd *fd, unsigned int what)
+{
+	uint64_t now = now_ns(), value;
+
+	if (read(fd->fd, &value, sizeof(value)) != sizeof(value))
+		return 0;
+	samples[done] = now - (use_socket ? value : __atomic_load_n(&sent_ns, __ATOMIC_ACQUIRE));
+	__atomic_store_n(&done, done + 1, __ATOMIC_RELEASE);
+	if (done == num_samples)
+		finish_latency();
+	return 0;
+}
+
+/* wait for the callback and give the loop time to fall asleep again */
+static void *writer(void *data)
+{
+	unsigned int i;
+	uint64_t value;
+
+	for (i = 0; i < num_samples; ++i) {
+		usleep(PAUSE_US);
+		value = now_ns();
+		__atomic_store_n(&sent_ns, value, __ATOMIC_RELEASE);
+		if (!use_socket)
+			value = 1;
+		if (write(writer_fd, &value, sizeof(value)) != sizeof(value))
+			abort();
+		while (__atomic_load_n(&done, __ATOMIC_ACQUIRE) == i)
+			usleep(10);
+	}
+	return NULL;
+}
+
+static int busy_cb(struct osmo_fd *fd, unsigned int what)
+{
+	double ns;
+
+	if (++done < num_iterations)
+		return 0;
+
+	ns = (double) (now_ns() - start_ns) / num_iterations;
+	printf("%u iterations, %.0f ns each\n", num_iterations, ns);
+	exit(EXIT_SUCCESS);
+}
+
+static void register_fd(struct osmo_fd *ofd, int fd, int (*cb)(struct osmo_fd *, unsigned int))
+{
+	ofd->fd = fd;
+	ofd->when = BSC_FD_READ;
+	ofd->cb = cb;
+	if (osmo_fd_register(ofd) != 0) {
+		fprintf(stderr, "Failed to register fd(%d)\n", fd);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void setup_latency(void)
+{
+	pthread_t thread;
+	int sv[2];
+
+	samples = calloc(num_samples, sizeof(*samples));
+	if (use_socket) {
+		if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) != 0) {
+			perror("socketpair");
+			exit(EXIT_FAILURE);
+		}
+		register_fd(&wake_fd, sv[0], wake_cb);
+		writer_fd = sv[1];
+	} else {
+		register_fd(&wake_fd, eventfd(0, EFD_NONBLOCK), wake_cb);
+		writer_fd = wake_fd.fd;
+	}
+	pthread_create(&thread, NULL, writer, NULL);
+}
+
+/* the eventfd is never read so it stays readable */
+static void setup_iteration(unsigned int idle)
+{
+	struct osmo_fd *ofd;
+	unsigned int i;
+	int sv[2];
+
+	for (i = 0; i < idle; ++i) {
+		ofd = calloc(1, sizeof(*ofd));
+		if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) != 0) {
+			perror("socketpair");
+			exit(EXIT_FAILURE);
+		}
+		register_fd(ofd, sv[0], busy_cb);
+	}
+
+	register_fd(&wake_fd, eventfd(1, EFD_NONBLOCK), busy_cb);
+	start_ns = now_ns();
+}
+
+int main(int argc, char **argv)
+{
+#ifdef USE_NATIVE_LOOP
+	su_root_t *root;
+#else
+	GMainContext *ctx;
+#endif
+
+	if (argc >= 3 && strcmp(argv[1], "latency") == 0
+	    && (strcmp(argv[2], "eventfd") == 0 || strcmp(argv[2], "socket") == 0)) {
+		use_socket = strcmp(argv[2], "socket") == 0;
+		if (argc > 3)
+			num_samples = atoi(argv[3]);
+		if (num_samples < 1)
+			num_samples = 1;
+		setup_latency();
+	} else if (argc >= 2 && strcmp(argv[1], "iteration") == 0) {
+		if (argc > 3)
+			num_iterations = atoi(argv[3]);
+		setup_iteration(argc > 2 ? atoi(argv[2]) : IDLE_FDS);
+	} else {
+		fprintf(stderr, "usage: %s latency eventfd|socket [samples]\n"
+				"       %s iteration [idle fds] [iterations]\n",
+				argv[0], argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* the callbacks exit once they have enough */
+#ifdef USE_NATIVE_LOOP
+	su_init();
+	root = su_root_create(NULL);
+	evpoll_run(root);
+#else
+	ctx = g_main_context_new();
+	g_main_context_set_poll_func(ctx, (GPollFunc) evpoll);
+	for (;;)
+		g_main_context_iteration(ctx, TRUE);
+#endif
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+
+# (C) 2017 by Holger Hans Peter Freyther
+
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>
+
+"""
+Build the IMSI map of osmo-sip-connector from lines of IMSI,MSISDN.
+
+The result is written next to the output file and renamed into
+place so that a running osmo-sip-connector can be sent a SIGHUP
+without ever seeing a partial file.
+"""
+
+import argparse
+import os
+import struct
+import sys
+
+MAGIC = b"OSMOIMAP"
+VERSION = 1
+LEN = 16
+HEADER = struct.Struct("=8sIIII")
+RECORD = struct.Struct("=%ds%ds" % (LEN, LEN))
+
+
+def eytzinger(items):
+    """Reorder sorted items so that item k has children 2k and 2k+1"""
+    out = [None] * len(items)
+    source = iter(items)
+
+    def fill(k):
+        if k <= len(items):
+            fill(2 * k)
+            out[k - 1] = next(source)
+            fill(2 * k + 1)
+
+    fill(1)
+    return out
+
+
+def read_pairs(lines):
+    pairs = []
+    for nr, line in enumerate(lines, 1):
+        line = line.strip()
+        if not line or line.startswith("#"):
+            continue
+        try:
+            imsi, msisdn = [x.strip() for x in line.split(",")]
+        except ValueError:
+            sys.exit("line %d: expected IMSI,MSISDN" % nr)
+        if not imsi or not msisdn or len(imsi) > LEN or len(msisdn) > LEN:
+            sys.exit("line %d: bad length" % nr)
+        pairs.append((imsi.encode("ascii"), msisdn.encode("ascii")))
+    return pairs
+
+
+def section(pairs):
+    pairs = sorted(pairs)
+    for a, b in zip(pairs, pairs[1:]):
+        if a[0] == b[0]:
+            sys.exit("duplicate key %s" % a[0].decode("ascii"))
+    return b"".join(RECORD.pack(k, v) for k, v in eytzinger(pairs))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip())
+    parser.add_argument("input", type=argparse.FileType("r"),
+                        help="file with IMSI,MSISDN per line or -")
+    parser.add_argument("output", help="the map to write")
+    args = parser.parse_args()
+
+    pairs = read_pairs(args.input)
+    by_imsi = section(pairs)
+    by_msisdn = section([(m, i) for i, m in pairs])
+
+    header = HEADER.pack(MAGIC, VERSION, len(pairs), HEADER.size,
+                         HEADER.size + len(by_imsi))
+
+    tmp = args.output + ".tmp"
+    with open(tmp, "wb") as out:
+        out.write(header)
+        out.write(by_imsi)
+        out.write(by_msisdn)
+    os.replace(tmp, args.output)
+
+
+if __name__ == "__main__":
+    main()
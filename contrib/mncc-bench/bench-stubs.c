@@ -0,0 +1,58 @@
+/*
+ * (C) 2017 by Holger Hans Peter Freyther
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * The parts of the connector the MNCC benchmarks do not reach. Calls
+ * are neither routed nor queued and the state is not persisted.
+ */
+
+#include "app.h"
+#include "call.h"
+#include "callstate.h"
+#include "setup_queue.h"
+
+struct app_config g_app;
+void *tall_mncc_ctx;
+
+void callstate_changed(struct call *call) {}
+void callstate_released(struct call *call) {}
+void callstate_mncc_ready(struct mncc_connection *conn) {}
+
+bool imsi_map_to_imsi(struct imsi_map *map, const char *msisdn,
+			char out[IMSI_MAP_LEN + 1]) { return false; }
+bool imsi_map_to_msisdn(struct imsi_map *map, const char *imsi,
+			char out[IMSI_MAP_LEN + 1]) { return false; }
+int numbering_translate(struct numbering_set *set, const char *digits,
+			int *ton, int *npi, char *out, size_t out_len) { return 0; }
+bool ratelimit_check(struct ratelimit *rl, const char *key) { return true; }
+const struct route *route_lookup(struct routing *routing, const char *number,
+				uint32_t payload_msg_type) { return NULL; }
+char *route_rewrite(void *ctx, const struct route_table *table,
+			const struct route *route, const char *number) { return NULL; }
+const char *route_trunk_name(const struct route_table *table,
+				const struct route *route) { return NULL; }
+bool setup_queue_enabled(void) { return false; }
+bool setup_queue_add(struct setup_entry *entry) { return false; }
+void setup_queue_del(struct setup_entry *entry) {}
+struct setup_entry *setup_queue_find(void *owner, void *key) { return NULL; }
+void setup_queue_flush(void *owner) {}
+int sip_create_remote_leg(struct sip_agent *agent, struct call *call,
+			struct sip_trunk *trunk) { return 0; }
+struct sip_trunk *sip_trunk_find(struct app_config *app, const char *name) { return NULL; }
@@ -0,0 +1,191 @@
+/*
+ * (C) 2017 by Holger Hans Peter Freyther
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Times the callref lookup of the MNCC legs with many calls up. The
+ * connector sources are part of this translation unit to reach the
+ * static mncc_find_leg, the rest of the connector is in bench-stubs.c.
+ * The legs are checked against the call list while they are released
+ * and added again.
+ */
+
+#include "../../src/mncc.c"
+#include "../../src/app.c"
+#include "../../src/call.c"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define LOOKUPS		20000
+
+/* The connection never switches to the shared memory rings */
+int mncc_shm_offer(struct mncc_connection *conn, mncc_shm_recv_cb recv,
+			mncc_shm_error_cb error) { return -1; }
+void mncc_shm_accepted(struct mncc_connection *conn, const char *buf, int len) {}
+void mncc_shm_stop(struct mncc_connection *conn) {}
+int mncc_shm_sendv(struct mncc_connection *conn, const struct iovec *iov,
+			int iovcnt) { return -1; }
+
+/* The SIP side of the calls has nothing to tear down */
+static void sip_release(struct call_leg *leg)
+{
+	call_leg_release(leg);
+}
+
+/* How legs were found before conn->legs, by walking all calls */
+static struct mncc_call_leg *find_by_calls(struct mncc_connection *conn, uint32_t callref)
+{
+	struct call *call;
+
+	llist_for_each_entry(call, &g_call_list, entry) {
+		struct call_leg *legs[2] = { call->initial, call->remote };
+		int i;
+
+		for (i = 0; i < 2; ++i) {
+			struct mncc_call_leg *leg = (struct mncc_call_leg *) legs[i];
+
+			if (!legs[i] || legs[i]->type != CALL_TYPE_MNCC)
+				continue;
+			if (leg->callref == callref && leg->conn == conn)
+				return leg;
+		}
+	}
+	return NULL;
+}
+
+/* How legs were found before the index, by scanning conn->legs */
+static struct mncc_call_leg *find_by_slots(struct mncc_connection *conn, uint32_t callref)
+{
+	unsigned int i;
+
+	for (i = 0; i < conn->num_legs; ++i)
+		if (conn->legs[i].callref == callref)
+			return conn->legs[i].leg;
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t add_call(struct mncc_connection *conn)
+{
+	struct call *call;
+
+	call = call_sip_create();
+	if (!call)
+		abort();
+	call->initial->release_call = sip_release;
+	call->source = "1000";
+	call->dest = "2000";
+	if (mncc_create_remote_leg(conn, call) != 0)
+		abort();
+	return call->id;
+}
+
+static void time_lookup(struct mncc_connection *conn, const char *name,
+			struct mncc_call_leg *(*find)(struct mncc_connection *, uint32_t),
+			const uint32_t *ids, unsigned int n)
+{
+	double start = now();
+	unsigned int i, lookups = LOOKUPS;
+
+	/* the walks over all calls are slow, fewer of them do */
+	if (find != mncc_find_leg)
+		lookups /= 10;
+
+	for (i = 0; i < lookups; ++i)
+		if (!find(conn, ids[(i * 7919u) % n]))
+			abort();
+	printf("%-22s %10.3f us per lookup\n", name, (now() - start) / lookups * 1e6);
+}
+
+/* Every leg is found at its slot and nothing else */
+static void check(struct mncc_connection *conn, const uint32_t *ids, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < conn->num_legs; ++i)
+		if (conn->legs[i].leg->slot != i
+		    || conn->legs[i].leg->callref != conn->legs[i].callref)
+			abort();
+	for (i = 0; i < n; ++i)
+		if (mncc_find_leg(conn, ids[i]) != find_by_calls(conn, ids[i]))
+			abort();
+}
+
+int main(int argc, char **argv)
+{
+	struct mncc_connection *conn;
+	unsigned int n = argc > 1 ? atoi(argv[1]) : 50000, i;
+	uint32_t *ids;
+	double start;
+
+	if (n == 0) {
+		fprintf(stderr, "Usage: %s [calls]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	ids = calloc(n, sizeof(*ids));
+	tall_mncc_ctx = talloc_named_const(NULL, 0, "bench");
+	/* the slots are allocated from the connection */
+	conn = talloc_zero(tall_mncc_ctx, struct mncc_connection);
+	conn->name = "msc";
+	conn->state = MNCC_READY;
+	conn->app = &g_app;
+	conn->fd.fd = open("/dev/null", O_WRONLY);
+	conn->on_disconnect = app_mncc_disconnected;
+
+	for (i = 0; i < n; ++i)
+		ids[i] = add_call(conn);
+	printf("%u calls with %u MNCC legs\n", n, conn->num_legs);
+
+	time_lookup(conn, "walk of the calls", find_by_calls, ids, n);
+	time_lookup(conn, "scan of conn->legs", find_by_slots, ids, n);
+	time_lookup(conn, "mncc_find_leg", mncc_find_leg, ids, n);
+
+	/* release every third call and set up new ones in their place */
+	for (i = 0; i < n; i += 3) {
+		struct mncc_call_leg *leg = mncc_find_leg(conn, ids[i]);
+
+		leg->base.call->initial->release_call(leg->base.call->initial);
+		mncc_leg_release(leg);
+		if (mncc_find_leg(conn, ids[i]))
+			abort();
+	}
+	check(conn, ids, n);
+	for (i = 0; i < n; i += 3)
+		ids[i] = add_call(conn);
+	check(conn, ids, n);
+	printf("released and added %u calls, lookups agree\n", (n + 2) / 3);
+
+	conn->state = MNCC_DISCONNECTED;
+	start = now();
+	app_mncc_disconnected(conn);
+	printf("%-22s %10.3f ms\n", "disconnect", (now() - start) * 1e3);
+	if (conn->num_legs != 0 || !llist_empty(&g_call_list))
+		abort();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,183 @@
+/*
+ * (C) 2017 by Holger Hans Peter Freyther
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Times the sending of the MNCC messages without a body of their own.
+ * The old way zeroed a whole struct gsm_mncc on the stack and wrote it,
+ * now the header goes out with the body straight from a read-only
+ * template through writev or into the slot of the shared memory ring.
+ * Both are timed over a socket that a thread drains and into a slot.
+ */
+
+#include "../../src/mncc.c"
+#include "../../src/app.c"
+#include "../../src/call.c"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define MESSAGES	100000
+#define ROUNDS		3
+
+/* Like the ring, every message is copied into the one slot */
+static char slot[sizeof(struct gsm_mncc)];
+
+int mncc_shm_sendv(struct mncc_connection *conn, const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; ++i) {
+		memcpy(slot + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+	return len;
+}
+int mncc_shm_offer(struct mncc_connection *conn, mncc_shm_recv_cb recv,
+			mncc_shm_error_cb error) { return -1; }
+void mncc_shm_accepted(struct mncc_connection *conn, const char *buf, int len) {}
+void mncc_shm_stop(struct mncc_connection *conn) {}
+
+/* mncc_send and mncc_call_leg_ring before the templates */
+static void old_send(struct mncc_connection *conn, uint32_t msg_type, uint32_t callref)
+{
+	struct gsm_mncc mncc = { 0, };
+
+	mncc_fill_header(&mncc, msg_type, callref);
+	if (msg_type == MNCC_ALERT_REQ) {
+		mncc.fields |= MNCC_F_PROGRESS;
+		mncc.progress.coding = 3;
+		mncc.progress.location = 1;
+		mncc.progress.descr = 8;
+	}
+	mncc_write(conn, &mncc, callref);
+}
+
+static void new_send(struct mncc_connection *conn, uint32_t msg_type, uint32_t callref)
+{
+	if (msg_type == MNCC_ALERT_REQ)
+		mncc_send_tmpl(conn, &mncc_alert_tmpl, sizeof(mncc_alert_tmpl),
+				msg_type, callref);
+	else
+		mncc_send(conn, msg_type, callref);
+}
+
+static const struct value_string msg_types[] = {
+	{ MNCC_REL_REQ,		"MNCC_REL_REQ" },
+	{ MNCC_DISC_REQ,	"MNCC_DISC_REQ" },
+	{ MNCC_CALL_PROC_REQ,	"MNCC_CALL_PROC_REQ" },
+	{ MNCC_SETUP_RSP,	"MNCC_SETUP_RSP" },
+	{ MNCC_ALERT_REQ,	"MNCC_ALERT_REQ" },
+	{ 0, NULL },
+};
+
+/* TSC ticks where there is one, nanoseconds elsewhere */
+static uint64_t ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static void *drain(void *data)
+{
+	int fd = *(int *) data;
+	char buf[4096];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	return NULL;
+}
+
+/* The best of a few rounds, the others were disturbed */
+static double time_send(struct mncc_connection *conn,
+			void (*send)(struct mncc_connection *, uint32_t, uint32_t),
+			uint32_t msg_type)
+{
+	double best = 0;
+	uint64_t start;
+	int round, i;
+
+	for (round = 0; round < ROUNDS; ++round) {
+		start = ticks();
+		for (i = 0; i < MESSAGES; ++i)
+			send(conn, msg_type, i);
+		if (round == 0 || (double) (ticks() - start) / MESSAGES < best)
+			best = (double) (ticks() - start) / MESSAGES;
+	}
+	return best;
+}
+
+static void run(struct mncc_connection *conn, const char *transport)
+{
+	unsigned int i;
+
+	printf("%s, %zu bytes per message\n", transport, sizeof(struct gsm_mncc));
+	for (i = 0; msg_types[i].str; ++i) {
+		double old = time_send(conn, old_send, msg_types[i].value);
+		double new = time_send(conn, new_send, msg_types[i].value);
+
+		printf("  %-20s old %8.1f new %8.1f saved %8.1f\n",
+			msg_types[i].str, old, new, old - new);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct mncc_connection *conn;
+	pthread_t thread;
+	int sv[2], size = 4 * 1024 * 1024;
+
+	tall_mncc_ctx = talloc_named_const(NULL, 0, "bench");
+	conn = talloc_zero(tall_mncc_ctx, struct mncc_connection);
+	conn->name = "msc";
+	conn->state = MNCC_READY;
+	conn->app = &g_app;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) != 0) {
+		perror("socketpair");
+		return EXIT_FAILURE;
+	}
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	pthread_create(&thread, NULL, drain, &sv[1]);
+	conn->fd.fd = sv[0];
+
+#if defined(__x86_64__) || defined(__i386__)
+	printf("TSC ticks per message\n");
+#else
+	printf("nanoseconds per message\n");
+#endif
+	run(conn, "socket drained by a thread");
+	conn->shm_active = true;
+	run(conn, "slot of the shared memory ring");
+
+	close(sv[0]);
+	pthread_join(thread, NULL);
+	return conn->state == MNCC_READY ? EXIT_SUCCESS : EXIT_FAILURE;
+}
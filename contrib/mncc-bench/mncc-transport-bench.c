@@ -0,0 +1,133 @@
+/*
+ * (C) 2017 by Holger Hans Peter Freyther
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Drives MNCC messages through the read/write and the io_uring transport.
+ * A forked MSC sends MNCC_RTP_CREATE for calls the connector does not
+ * know and keeps a window of them outstanding, each is answered with a
+ * MNCC_REJ_REQ. The connector side runs the select loop like main() does
+ * and the MSC is a separate process so that strace -c without -f only
+ * counts the system calls of the connector.
+ */
+
+#include "../../src/mncc.c"
+#include "../../src/app.c"
+#include "../../src/call.c"
+#include "../../src/mncc_uring.c"
+
+#include <sys/wait.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define EXCHANGES	100000
+#define WINDOW		1
+
+int mncc_shm_sendv(struct mncc_connection *conn, const struct iovec *iov, int iovcnt) { return -1; }
+int mncc_shm_offer(struct mncc_connection *conn, mncc_shm_recv_cb recv,
+			mncc_shm_error_cb error) { return -1; }
+void mncc_shm_accepted(struct mncc_connection *conn, const char *buf, int len) {}
+void mncc_shm_stop(struct mncc_connection *conn) {}
+
+static void msc(int fd, unsigned int exchanges, unsigned int window)
+{
+	struct gsm_mncc_rtp rtp = { 0, };
+	unsigned int sent = 0, answered = 0;
+	char buf[4096];
+
+	rtp.msg_type = MNCC_RTP_CREATE;
+	while (answered < exchanges) {
+		while (sent < exchanges && sent - answered < window) {
+			rtp.callref = sent++;
+			if (write(fd, &rtp, sizeof(rtp)) != sizeof(rtp))
+				_exit(EXIT_FAILURE);
+		}
+		if (read(fd, buf, sizeof(buf)) != sizeof(struct gsm_mncc))
+			_exit(EXIT_FAILURE);
+		answered += 1;
+	}
+	_exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int exchanges = EXCHANGES, window = WINDOW;
+	struct mncc_connection *conn;
+	struct timespec start, end;
+	int sv[2], status;
+	double secs;
+	pid_t pid;
+
+	if (argc < 2 || (strcmp(argv[1], "socket") != 0 && strcmp(argv[1], "io-uring") != 0)) {
+		fprintf(stderr, "usage: %s socket|io-uring [exchanges] [window]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (argc > 2)
+		exchanges = atoi(argv[2]);
+	if (argc > 3)
+		window = atoi(argv[3]);
+	if (window < 1)
+		window = 1;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) != 0) {
+		perror("socketpair");
+		return EXIT_FAILURE;
+	}
+	pid = fork();
+	if (pid == 0) {
+		close(sv[0]);
+		msc(sv[1], exchanges, window);
+	}
+	close(sv[1]);
+
+	tall_mncc_ctx = talloc_named_const(NULL, 0, "bench");
+	INIT_LLIST_HEAD(&g_app.mncc.conns);
+	g_app.mncc.io_uring = strcmp(argv[1], "io-uring") == 0;
+	conn = mncc_connection_alloc(&g_app, "msc");
+	if (mncc_connection_adopt(conn, sv[0]) != 0 || (g_app.mncc.io_uring && !conn->uring)) {
+		fprintf(stderr, "Failed to drive the socket by %s\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (conn->tx_msgs < exchanges && conn->state == MNCC_READY) {
+		mncc_uring_flush_all();
+		osmo_select_main(0);
+	}
+	mncc_uring_flush_all();
+	waitpid(pid, &status, 0);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%s, window %u: %" PRIu64 " received, %" PRIu64 " sent in %.3f s, %.0f msgs/s\n",
+		argv[1], window, conn->rx_msgs, conn->tx_msgs, secs,
+		(conn->rx_msgs + conn->tx_msgs) / secs);
+	if (conn->uring)
+		printf("enters %" PRIu64 " recvs %" PRIu64 " sends %" PRIu64
+			" send_batches %" PRIu64 " rearms %" PRIu64 " no_bufs %" PRIu64
+			" full %" PRIu64 "\n",
+			conn->uring_stats.enters, conn->uring_stats.recvs,
+			conn->uring_stats.sends, conn->uring_stats.send_batches,
+			conn->uring_stats.rearms, conn->uring_stats.no_bufs,
+			conn->uring_stats.full);
+
+	return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS
+		? EXIT_SUCCESS : EXIT_FAILURE;
+}
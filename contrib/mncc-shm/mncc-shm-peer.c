@@ -0,0 +1,257 @@
+/*
+ * (C) 2017 by Holger Hans Peter Freyther
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * A stand-in for the MSC to try the shared memory transport. It
+ * listens on the MNCC socket, accepts the rings, answers every mobile
+ * terminated call right away and can place mobile originated calls.
+ */
+
+#include "mncc_shm_peer.h"
+#include "mncc_protocol.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int verbose;
+
+static void send_simple(struct mncc_shm_peer *peer, uint32_t msg_type, uint32_t callref)
+{
+	struct gsm_mncc mncc;
+
+	memset(&mncc, 0, sizeof(mncc));
+	mncc.msg_type = msg_type;
+	mncc.callref = callref;
+	if (mncc_shm_peer_send(peer, &mncc, sizeof(mncc)) != 0)
+		fprintf(stderr, "Failed to send 0x%x: %s\n", msg_type, strerror(errno));
+}
+
+static void send_rtp(struct mncc_shm_peer *peer, uint32_t msg_type, uint32_t callref)
+{
+	struct gsm_mncc_rtp rtp;
+
+	memset(&rtp, 0, sizeof(rtp));
+	rtp.msg_type = msg_type;
+	rtp.callref = callref;
+	rtp.ip = 0x7f000001;
+	rtp.port = 4000 + (callref % 1000) * 2;
+	rtp.payload_type = 3;
+	if (mncc_shm_peer_send(peer, &rtp, sizeof(rtp)) != 0)
+		fprintf(stderr, "Failed to send 0x%x: %s\n", msg_type, strerror(errno));
+}
+
+static void send_hello(struct mncc_shm_peer *peer)
+{
+	struct gsm_mncc_hello hello;
+
+	memset(&hello, 0, sizeof(hello));
+	hello.msg_type = MNCC_SOCKET_HELLO;
+	hello.version = MNCC_SOCK_VERSION;
+	hello.mncc_size = sizeof(struct gsm_mncc);
+	hello.data_frame_size = sizeof(struct gsm_data_frame);
+	hello.called_offset = offsetof(struct gsm_mncc, called);
+	hello.signal_offset = offsetof(struct gsm_mncc, signal);
+	hello.emergency_offset = offsetof(struct gsm_mncc, emergency);
+	hello.lchan_type_offset = offsetof(struct gsm_mncc, lchan_type);
+	mncc_shm_peer_send(peer, &hello, sizeof(hello));
+}
+
+static void place_call(struct mncc_shm_peer *peer, uint32_t callref,
+			const char *calling, const char *called)
+{
+	struct gsm_mncc mncc;
+
+	memset(&mncc, 0, sizeof(mncc));
+	mncc.msg_type = MNCC_SETUP_IND;
+	mncc.callref = callref;
+	mncc.fields = MNCC_F_CALLING | MNCC_F_CALLED;
+	snprintf(mncc.calling.number, sizeof(mncc.calling.number), "%s", calling);
+	snprintf(mncc.called.number, sizeof(mncc.called.number), "%s", called);
+	snprintf(mncc.imsi, sizeof(mncc.imsi), "90170%010u", callref);
+	if (mncc_shm_peer_send(peer, &mncc, sizeof(mncc)) != 0)
+		fprintf(stderr, "Failed to place call %u: %s\n", callref, strerror(errno));
+}
+
+static void handle(struct mncc_shm_peer *peer, const void *buf, size_t len)
+{
+	uint32_t msg_type, callref;
+
+	if (len < 8) {
+		fprintf(stderr, "Short message of %zu bytes\n", len);
+		return;
+	}
+	memcpy(&msg_type, buf, 4);
+	memcpy(&callref, (const char *) buf + 4, 4);
+	if (verbose)
+		fprintf(stderr, "%s 0x%04x callref(%u)\n",
+			peer->active ? "ring" : "socket", msg_type, callref);
+
+	switch (msg_type) {
+	case MNCC_RTP_CREATE:
+	case MNCC_RTP_CONNECT:
+		send_rtp(peer, msg_type, callref);
+		break;
+	case MNCC_SETUP_REQ:
+		send_simple(peer, MNCC_CALL_CONF_IND, callref);
+		send_simple(peer, MNCC_ALERT_IND, callref);
+		send_simple(peer, MNCC_SETUP_CNF, callref);
+		break;
+	case MNCC_SETUP_RSP:
+		send_simple(peer, MNCC_SETUP_COMPL_IND, callref);
+		break;
+	case MNCC_DISC_REQ:
+		send_simple(peer, MNCC_REL_IND, callref);
+		break;
+	case MNCC_REL_REQ:
+		send_simple(peer, MNCC_REL_CNF, callref);
+		break;
+	}
+}
+
+static int serve(int sock, unsigned int calls, const char *called)
+{
+	struct mncc_shm_peer peer;
+	char buf[4096];
+	uint32_t callref = 0x40000000;
+	int rc = -1;
+
+	mncc_shm_peer_init(&peer, sock);
+	send_hello(&peer);
+
+	for (;;) {
+		struct pollfd fds[2] = {
+			{ .fd = sock, .events = POLLIN },
+			{ .fd = peer.doorbell, .events = POLLIN },
+		};
+		const void *msg;
+		size_t len;
+		ssize_t got;
+
+		if (poll(fds, peer.active ? 2 : 1, -1) < 0 && errno != EINTR)
+			break;
+
+		/* the socket first, it carries what was sent before the accept */
+		if (fds[0].revents) {
+			got = mncc_shm_peer_read(&peer, buf, sizeof(buf));
+			if (got < 0) {
+				fprintf(stderr, "Connector is gone: %s\n", strerror(errno));
+				rc = 0;
+				break;
+			}
+			if (got == 0 && peer.active) {
+				fprintf(stderr, "Using the shared memory rings\n");
+				while (calls > 0) {
+					place_call(&peer, callref++, "1000", called);
+					calls -= 1;
+				}
+			}
+			if (got > 0)
+				handle(&peer, buf, got);
+			continue;
+		}
+
+		if (peer.active && fds[1].revents) {
+			mncc_shm_peer_ack(&peer);
+			while ((msg = mncc_shm_peer_next(&peer, &len))) {
+				handle(&peer, msg, len);
+				mncc_shm_peer_done(&peer);
+			}
+		}
+	}
+
+	fprintf(stderr, "sent(%llu) received(%llu) kicks(%llu)\n",
+		peer.sent, peer.received, peer.kicks);
+	mncc_shm_peer_close(&peer);
+	return rc;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-v] [-s PATH] [-c CALLS] [-d NUMBER]\n"
+		"  -s PATH    MNCC socket to listen on (default /tmp/bsc_mncc)\n"
+		"  -c CALLS   mobile originated calls to place once the rings are up\n"
+		"  -d NUMBER  called number of those calls (default 2000)\n"
+		"  -v         print every message\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = "/tmp/bsc_mncc";
+	const char *called = "2000";
+	unsigned int calls = 0;
+	struct sockaddr_un addr;
+	int opt, lsock, sock;
+
+	while ((opt = getopt(argc, argv, "vs:c:d:h")) != -1) {
+		switch (opt) {
+		case 'v':
+			verbose = 1;
+			break;
+		case 's':
+			path = optarg;
+			break;
+		case 'c':
+			calls = atoi(optarg);
+			break;
+		case 'd':
+			called = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	lsock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (lsock < 0) {
+		perror("socket");
+		return EXIT_FAILURE;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	unlink(path);
+	if (bind(lsock, (struct sockaddr *) &addr, sizeof(addr)) != 0
+	    || listen(lsock, 1) != 0) {
+		perror("bind");
+		return EXIT_FAILURE;
+	}
+
+	for (;;) {
+		sock = accept4(lsock, NULL, NULL, SOCK_CLOEXEC);
+		if (sock < 0) {
+			perror("accept");
+			continue;
+		}
+		fprintf(stderr, "Connector connected\n");
+		serve(sock, calls, called);
+		close(sock);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,231 @@
+/*
+ * (C) 2017 by Holger Hans Peter Freyther
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "mncc_shm_peer.h"
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+void mncc_shm_peer_init(struct mncc_shm_peer *peer, int sock)
+{
+	memset(peer, 0, sizeof(*peer));
+	peer->sock = sock;
+	peer->doorbell = -1;
+	peer->connector_doorbell = -1;
+}
+
+void mncc_shm_peer_close(struct mncc_shm_peer *peer)
+{
+	if (peer->area)
+		munmap(peer->area, sizeof(*peer->area));
+	if (peer->doorbell >= 0)
+		close(peer->doorbell);
+	if (peer->connector_doorbell >= 0)
+		close(peer->connector_doorbell);
+	mncc_shm_peer_init(peer, peer->sock);
+}
+
+static void kick(int fd)
+{
+	uint64_t one = 1;
+
+	/* a full counter still wakes up the other side */
+	if (write(fd, &one, sizeof(one)) < 0)
+		return;
+}
+
+static int reply(struct mncc_shm_peer *peer, int result)
+{
+	struct mncc_shm_accept accept = {
+		.msg_type = MNCC_SHM_ACCEPT,
+		.version = MNCC_SHM_VERSION,
+		.result = result,
+	};
+
+	if (write(peer->sock, &accept, sizeof(accept)) != sizeof(accept))
+		return -1;
+	return 0;
+}
+
+static int handle_offer(struct mncc_shm_peer *peer, const struct mncc_shm_offer *offer,
+			const int *fds, int num_fds)
+{
+	struct stat st;
+	void *area;
+	int i;
+
+	if (num_fds != 3 || peer->area
+	    || offer->version != MNCC_SHM_VERSION
+	    || offer->size != sizeof(struct mncc_shm_area)
+	    || offer->slots != MNCC_SHM_SLOTS
+	    || offer->slot_size != MNCC_SHM_SLOT_SIZE)
+		goto decline;
+
+	if (fstat(fds[0], &st) != 0 || st.st_size < sizeof(struct mncc_shm_area))
+		goto decline;
+
+	area = mmap(NULL, sizeof(struct mncc_shm_area), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fds[0], 0);
+	if (area == MAP_FAILED)
+		goto decline;
+	close(fds[0]);
+
+	peer->area = area;
+	peer->doorbell = fds[1];
+	peer->connector_doorbell = fds[2];
+	if (peer->area->magic != MNCC_SHM_MAGIC) {
+		mncc_shm_peer_close(peer);
+		return reply(peer, -EINVAL);
+	}
+
+	/* everything from now on goes through the ring */
+	if (reply(peer, 0) != 0)
+		return -1;
+	peer->active = true;
+	return 0;
+
+decline:
+	for (i = 0; i < num_fds; ++i)
+		close(fds[i]);
+	return reply(peer, -EINVAL);
+}
+
+ssize_t mncc_shm_peer_read(struct mncc_shm_peer *peer, void *buf, size_t len)
+{
+	union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg = { 0, };
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	int fds[3], num_fds = 0;
+	uint32_t msg_type;
+	ssize_t rc;
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	rc = recvmsg(peer->sock, &msg, MSG_CMSG_CLOEXEC);
+	if (rc == 0)
+		errno = ECONNRESET;
+	if (rc <= 0)
+		return -1;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (num_fds > 3)
+			num_fds = 3;
+		memcpy(fds, CMSG_DATA(cmsg), num_fds * sizeof(int));
+	}
+
+	if (rc < 4) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memcpy(&msg_type, buf, sizeof(msg_type));
+	if (msg_type != MNCC_SHM_OFFER || rc != sizeof(struct mncc_shm_offer)) {
+		while (num_fds > 0)
+			close(fds[--num_fds]);
+		return rc;
+	}
+
+	if (handle_offer(peer, buf, fds, num_fds) != 0)
+		return -1;
+	return 0;
+}
+
+int mncc_shm_peer_send(struct mncc_shm_peer *peer, const void *data, size_t len)
+{
+	struct mncc_shm_slot *slot;
+
+	if (!peer->active) {
+		if (write(peer->sock, data, len) != len)
+			return -1;
+		return 0;
+	}
+
+	if (len > sizeof(slot->data)) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	slot = mncc_shm_ring_reserve(&peer->area->from_msc);
+	if (!slot) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	memcpy(slot->data, data, len);
+	slot->len = len;
+	peer->sent += 1;
+	if (mncc_shm_ring_commit(&peer->area->from_msc)) {
+		peer->kicks += 1;
+		kick(peer->connector_doorbell);
+	}
+	return 0;
+}
+
+void mncc_shm_peer_ack(struct mncc_shm_peer *peer)
+{
+	uint64_t events;
+
+	if (read(peer->doorbell, &events, sizeof(events)) < 0)
+		return;
+}
+
+const void *mncc_shm_peer_next(struct mncc_shm_peer *peer, size_t *len)
+{
+	struct mncc_shm_ring *ring;
+	struct mncc_shm_slot *slot;
+
+	if (!peer->active)
+		return NULL;
+
+	ring = &peer->area->to_msc;
+	slot = mncc_shm_ring_peek(ring);
+	if (!slot && !mncc_shm_ring_idle(ring))
+		slot = mncc_shm_ring_peek(ring);
+	if (!slot)
+		return NULL;
+
+	/* a bad length is handed out as an empty message */
+	*len = slot->len <= sizeof(slot->data) ? slot->len : 0;
+	return slot->data;
+}
+
+void mncc_shm_peer_done(struct mncc_shm_peer *peer)
+{
+	mncc_shm_ring_release(&peer->area->to_msc);
+	peer->received += 1;
+}
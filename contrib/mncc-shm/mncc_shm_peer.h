@@ -0,0 +1,54 @@
+#pragma once
+
+#include "mncc_shm.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * MSC side of the shared memory transport of osmo-sip-connector. Read
+ * the MNCC socket through mncc_shm_peer_read() so the ring offer is
+ * picked up and send through mncc_shm_peer_send(). Once active, poll
+ * the doorbell too and take messages from the ring with
+ * mncc_shm_peer_next()/mncc_shm_peer_done().
+ *
+ * The connector sends on the socket until it has seen the accept. To
+ * keep the order, drain the socket before the ring on every wake-up.
+ */
+struct mncc_shm_peer {
+	int sock;
+	struct mncc_shm_area *area;
+	int doorbell;		/* the connector rings it, poll it */
+	int connector_doorbell;	/* we ring it */
+	bool active;
+
+	/* statistics */
+	unsigned long long sent;
+	unsigned long long received;
+	unsigned long long kicks;
+};
+
+void mncc_shm_peer_init(struct mncc_shm_peer *peer, int sock);
+void mncc_shm_peer_close(struct mncc_shm_peer *peer);
+
+/*
+ * Read one message from the socket. Returns its length, 0 if it was
+ * the ring offer and has been handled or -1 with errno set. A closed
+ * socket is reported as ECONNRESET.
+ */
+ssize_t mncc_shm_peer_read(struct mncc_shm_peer *peer, void *buf, size_t len);
+
+/* Through the ring once active, the socket before */
+int mncc_shm_peer_send(struct mncc_shm_peer *peer, const void *data, size_t len);
+
+/* Clear the doorbell after poll reported it readable */
+void mncc_shm_peer_ack(struct mncc_shm_peer *peer);
+
+/*
+ * The next message in place or NULL. Hand it back with
+ * mncc_shm_peer_done() before asking for the next one. When NULL is
+ * returned it is safe to sleep on the doorbell.
+ */
+const void *mncc_shm_peer_next(struct mncc_shm_peer *peer, size_t *len);
+void mncc_shm_peer_done(struct mncc_shm_peer *peer);
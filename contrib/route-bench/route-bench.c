@@ -0,0 +1,168 @@
+/*
+ * (C) 2017 by Holger Hans Peter Freyther
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Times the longest prefix match of the route table and its reload.
+ * A table with random prefixes is written to a temporary file, built
+ * and then looked up with numbers that mostly fall under a prefix. The
+ * reload runs on the loader thread while the lookups go on against the
+ * old table, only the swap is left to the main loop.
+ */
+
+#include "../../src/route.c"
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NUMBERS		4096
+
+struct app_config g_app;
+void *tall_mncc_ctx;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void random_digits(char *out, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; ++i)
+		out[i] = '0' + random() % 10;
+	out[len] = '\0';
+}
+
+/* Prefixes of 4 to 10 digits, some of them only for one codec */
+static char *write_table(unsigned int n, char (*prefixes)[16])
+{
+	static char path[] = "/tmp/route-bench-XXXXXX";
+	unsigned int i;
+	FILE *file;
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd < 0 || !(file = fdopen(fd, "w"))) {
+		perror("route table");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < n; ++i) {
+		random_digits(prefixes[i], 4 + random() % 7);
+		fprintf(file, "%s trunk%ld strip %ld prepend 00%s\n",
+			prefixes[i], random() % 8, random() % 3,
+			i % 16 == 0 ? " codec AMR" : "");
+	}
+	fclose(file);
+	return path;
+}
+
+static unsigned int lookup_all(struct routing *routing, char (*numbers)[24],
+				unsigned int count)
+{
+	unsigned int i, hits = 0;
+
+	for (i = 0; i < count; ++i)
+		if (route_lookup(routing, numbers[i % NUMBERS], GSM_TCHF_FRAME) != NULL)
+			hits += 1;
+	return hits;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int n = argc > 1 ? atoi(argv[1]) : 100000;
+	unsigned int lookups = argc > 2 ? atoi(argv[2]) : 2000000;
+	struct routing *routing = &g_app.routing;
+	char (*prefixes)[16], (*numbers)[24];
+	unsigned int i, hits, during = 0;
+	struct route_table *table;
+	struct pollfd pfd;
+	double start, swap;
+	char *path;
+
+	if (n == 0 || lookups == 0) {
+		fprintf(stderr, "Usage: %s [prefixes] [lookups]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	srandom(1);
+	tall_mncc_ctx = talloc_named_const(NULL, 0, "bench");
+	prefixes = calloc(n, sizeof(*prefixes));
+	numbers = calloc(NUMBERS, sizeof(*numbers));
+	path = write_table(n, prefixes);
+
+	/* numbers below a listed prefix, every eighth one at random */
+	for (i = 0; i < NUMBERS; ++i) {
+		if (i % 8 == 0)
+			random_digits(numbers[i], 12);
+		else {
+			const char *prefix = prefixes[random() % n];
+
+			strcpy(numbers[i], prefix);
+			random_digits(numbers[i] + strlen(prefix), 12 - strlen(prefix));
+		}
+	}
+
+	start = now();
+	table = route_table_load(path);
+	if (!table || table->error) {
+		fprintf(stderr, "Failed to build the table\n");
+		return EXIT_FAILURE;
+	}
+	printf("%u prefixes: %zu nodes, %zu routes, %u duplicates, %zu KiB, "
+		"built in %.1f ms\n", n, table->num_nodes, table->num_routes,
+		table->duplicates,
+		talloc_total_size(table) / 1024, (now() - start) * 1e3);
+
+	routing->table = talloc_steal(tall_mncc_ctx, table);
+	start = now();
+	hits = lookup_all(routing, numbers, lookups);
+	printf("route_lookup %.1f ns, %u of %u hit a prefix\n",
+		(now() - start) / lookups * 1e9, hits, lookups);
+
+	/* the lookups go on while the loader thread builds the new table */
+	routing->path = path;
+	if (routing_init(&g_app) != 0) {
+		fprintf(stderr, "Failed to start the loader\n");
+		return EXIT_FAILURE;
+	}
+	pfd.fd = routing->ofd.fd;
+	pfd.events = POLLIN;
+	start = now();
+	while (poll(&pfd, 1, 0) == 0) {
+		lookup_all(routing, numbers, 1000);
+		during += 1000;
+	}
+	swap = now();
+	table = routing->table;
+	route_loaded(&routing->ofd, BSC_FD_READ);
+	printf("reload: %.1f ms on the loader thread, %u lookups meanwhile, "
+		"%.1f us for the swap on the main loop\n",
+		(swap - start) * 1e3, during, (now() - swap) * 1e6);
+	if (routing->table == table || routing->reloads != 1)
+		return EXIT_FAILURE;
+
+	unlink(path);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,384 @@
+/*
+ * (C) 2017 by Holger Hans Peter Freyther
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Runs the same calls through nua and through the built-in engine. A
+ * caller sends an INVITE, ACKs the 200 and hangs up with a BYE right
+ * away while a window of calls is kept going. Without a PBX the callee
+ * is a second instance of the same engine on the loopback, it answers
+ * every INVITE with 200. Both are set up like the connector does it.
+ *
+ * With a PBX only the caller runs and the calls go to the number given,
+ * contrib/testpbx answers 9196 with its echo.
+ */
+
+#include "lsip.h"
+
+#include <osmocom/core/select.h>
+
+#include <sofia-sip/nua.h>
+#include <sofia-sip/sip_status.h>
+#include <sofia-sip/su_wait.h>
+
+#include <talloc.h>
+
+#include <arpa/inet.h>
+#include <sys/resource.h>
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CALLS		5000
+#define WINDOW		50
+#define UAC_PORT	15060
+#define UAS_PORT	15062
+#define PBX_LINGER_MS	2000
+
+static const char sdp[] =
+	"v=0\r\n"
+	"o=- 1 1 IN IP4 127.0.0.1\r\n"
+	"s=-\r\n"
+	"c=IN IP4 127.0.0.1\r\n"
+	"t=0 0\r\n"
+	"m=audio 16000 RTP/AVP 3\r\n"
+	"a=rtpmap:3 GSM/8000\r\n";
+
+static struct {
+	unsigned int calls;
+	unsigned int window;
+	const char *pbx;
+	int pbx_port;
+	const char *number;
+	char ruri[128];
+
+	unsigned int started;
+	unsigned int answered;
+	unsigned int failed;
+	unsigned int finished;
+	uint64_t setup_ns;
+
+	/* the last call finished */
+	uint64_t end;
+	double end_cpu;
+} bench;
+
+/* A call of the caller, the time of its INVITE */
+struct bench_call {
+	uint64_t start;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double cpu_secs(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+		+ ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static bool done(void)
+{
+	return bench.finished + bench.failed == bench.calls;
+}
+
+static void stop_clock(void)
+{
+	bench.end = now_ns();
+	bench.end_cpu = cpu_secs();
+}
+
+static void answered(struct bench_call *call, int status)
+{
+	if (status >= 200 && status < 300) {
+		bench.answered += 1;
+		bench.setup_ns += now_ns() - call->start;
+	} else
+		bench.failed += 1;
+}
+
+/*
+ * The built-in engine. The caller counts a call as finished once its
+ * BYE went out and the callee once it got the BYE.
+ */
+static struct lsip_engine uac, uas;
+static struct sockaddr_in uas_addr;
+static unsigned int uas_ended;
+
+static void builtin_call(void)
+{
+	struct lsip_dialog *dialog;
+	struct bench_call *call;
+
+	call = talloc_zero(NULL, struct bench_call);
+	call->start = now_ns();
+	dialog = lsip_invite(&uac, &uas_addr, bench.ruri, "1000", sdp);
+	if (!dialog) {
+		fprintf(stderr, "No dialog left after %u calls\n", bench.started);
+		exit(EXIT_FAILURE);
+	}
+	dialog->priv = call;
+	bench.started += 1;
+}
+
+static void uac_response(struct lsip_dialog *dialog, int status,
+				const struct lsip_msg *msg)
+{
+	struct bench_call *call = dialog->priv;
+
+	if (status < 200)
+		return;
+
+	answered(call, status);
+	if (status < 300)
+		bench.finished += 1;
+	talloc_free(call);
+
+	/* the BYE for a 2xx */
+	lsip_dialog_release(dialog);
+	if (bench.started < bench.calls)
+		builtin_call();
+}
+
+static void uas_invite(struct lsip_dialog *dialog, const struct lsip_msg *msg)
+{
+	dialog->priv = &uas;
+	lsip_respond(dialog, 200, "OK", "application/sdp", sdp);
+}
+
+static void ended(struct lsip_dialog *dialog, enum lsip_method method)
+{
+	if (dialog->engine == &uas)
+		uas_ended += 1;
+	lsip_dialog_release(dialog);
+}
+
+static const struct lsip_callbacks uac_callbacks = {
+	.response = uac_response,
+	.ended = ended,
+};
+
+static const struct lsip_callbacks uas_callbacks = {
+	.invite = uas_invite,
+	.ended = ended,
+};
+
+static void run_builtin(void)
+{
+	/* the INVITE transactions stay around for Timer M */
+	unsigned int dialogs = bench.calls + bench.window;
+	uint64_t end;
+	unsigned int i;
+
+	if (lsip_engine_init(&uac, NULL, dialogs, &uac_callbacks, NULL) != 0
+	    || lsip_engine_bind(&uac, "127.0.0.1", UAC_PORT) != 0) {
+		fprintf(stderr, "Failed to start the caller\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (!bench.pbx) {
+		if (lsip_engine_init(&uas, NULL, dialogs, &uas_callbacks, NULL) != 0
+		    || lsip_engine_bind(&uas, "127.0.0.1", UAS_PORT) != 0) {
+			fprintf(stderr, "Failed to start the callee\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (i = 0; i < bench.window && i < bench.calls; ++i)
+		builtin_call();
+
+	while (!done() || (!bench.pbx && uas_ended < bench.finished))
+		osmo_select_main(0);
+	stop_clock();
+
+	/* the answers to the BYEs are not reported, see if any went again */
+	if (bench.pbx) {
+		end = now_ns() + PBX_LINGER_MS * 1000000ULL;
+		while (now_ns() < end)
+			osmo_select_main(0);
+	}
+
+	printf("built-in: rx %" PRIu64 " tx %" PRIu64 " in %" PRIu64 " batches"
+		" retransmits %" PRIu64 " timeouts %" PRIu64 "\n",
+		uac.rx + uas.rx, uac.tx + uas.tx, uac.tx_batches + uas.tx_batches,
+		uac.retransmits + uas.retransmits, uac.timeouts + uas.timeouts);
+}
+
+/*
+ * nua set up like sip_agent_start and sip.c answer and hang up. The
+ * caller counts a call as finished with the answer to its BYE.
+ */
+static su_root_t *root;
+static nua_t *nua_uac, *nua_uas;
+
+static void nua_call(void)
+{
+	struct bench_call *call;
+	nua_handle_t *nh;
+
+	call = talloc_zero(NULL, struct bench_call);
+	nh = nua_handle(nua_uac, call, TAG_END());
+	call->start = now_ns();
+	nua_invite(nh,
+		SIPTAG_FROM_STR("sip:1000@127.0.0.1"),
+		SIPTAG_TO_STR(bench.ruri),
+		NUTAG_MEDIA_ENABLE(0),
+		SIPTAG_CONTENT_TYPE_STR("application/sdp"),
+		SIPTAG_PAYLOAD_STR(sdp),
+		TAG_END());
+	bench.started += 1;
+}
+
+static void bench_nua_event(nua_event_t event, int status, char const *phrase,
+			nua_t *nua, nua_magic_t *magic, nua_handle_t *nh,
+			nua_hmagic_t *hmagic, sip_t const *sip, tagi_t tags[])
+{
+	struct bench_call *call = (struct bench_call *) hmagic;
+
+	if (event == nua_r_invite) {
+		if (status < 200)
+			return;
+		answered(call, status);
+		if (status >= 300) {
+			nua_handle_destroy(nh);
+			talloc_free(call);
+			if (bench.started < bench.calls)
+				nua_call();
+			return;
+		}
+		nua_ack(nh, TAG_END());
+		nua_bye(nh, TAG_END());
+	} else if (event == nua_r_bye) {
+		if (status < 200)
+			return;
+		bench.finished += 1;
+		nua_handle_destroy(nh);
+		talloc_free(call);
+		if (bench.started < bench.calls)
+			nua_call();
+	} else if (event == nua_i_invite) {
+		nua_respond(nh, SIP_200_OK,
+			NUTAG_MEDIA_ENABLE(0),
+			SIPTAG_CONTENT_TYPE_STR("application/sdp"),
+			SIPTAG_PAYLOAD_STR(sdp),
+			TAG_END());
+	} else if (event == nua_i_bye)
+		nua_handle_destroy(nh);
+}
+
+static nua_t *nua_start(int port)
+{
+	char url[64];
+
+	snprintf(url, sizeof(url), "sip:127.0.0.1:%d", port);
+	return nua_create(root, bench_nua_event, NULL,
+				NUTAG_URL(url),
+				NUTAG_AUTOACK(0),
+				NUTAG_AUTOALERT(0),
+				NUTAG_AUTOANSWER(0),
+				TAG_END());
+}
+
+static void run_nua(void)
+{
+	unsigned int i;
+
+	su_init();
+	root = su_root_create(NULL);
+	su_root_threading(root, 0);
+
+	nua_uac = nua_start(UAC_PORT);
+	if (!nua_uac || (!bench.pbx && !(nua_uas = nua_start(UAS_PORT)))) {
+		fprintf(stderr, "Failed to start nua\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < bench.window && i < bench.calls; ++i)
+		nua_call();
+
+	while (!done())
+		su_root_step(root, 1000);
+	stop_clock();
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t start, wall;
+	double cpu;
+
+	if (argc < 2 || (strcmp(argv[1], "nua") != 0 && strcmp(argv[1], "builtin") != 0)
+	    || argc == 5 || argc == 6) {
+		fprintf(stderr, "usage: %s nua|builtin [calls] [window] [pbx port number]\n",
+			argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	bench.calls = argc > 2 ? atoi(argv[2]) : CALLS;
+	bench.window = argc > 3 ? atoi(argv[3]) : WINDOW;
+	if (bench.window < 1)
+		bench.window = 1;
+	if (argc > 6) {
+		bench.pbx = argv[4];
+		bench.pbx_port = atoi(argv[5]);
+		bench.number = argv[6];
+	} else {
+		bench.pbx = NULL;
+		bench.pbx_port = UAS_PORT;
+		bench.number = "123";
+	}
+	snprintf(bench.ruri, sizeof(bench.ruri), "sip:%s@%s:%d",
+		bench.number, bench.pbx ? bench.pbx : "127.0.0.1", bench.pbx_port);
+
+	memset(&uas_addr, 0, sizeof(uas_addr));
+	uas_addr.sin_family = AF_INET;
+	uas_addr.sin_port = htons(bench.pbx_port);
+	if (inet_pton(AF_INET, bench.pbx ? bench.pbx : "127.0.0.1", &uas_addr.sin_addr) != 1) {
+		fprintf(stderr, "The PBX needs to be an IPv4 address\n");
+		return EXIT_FAILURE;
+	}
+
+	start = now_ns();
+	cpu = cpu_secs();
+	if (strcmp(argv[1], "nua") == 0)
+		run_nua();
+	else
+		run_builtin();
+	wall = bench.end - start;
+	cpu = bench.end_cpu - cpu;
+
+	printf("%s: %u calls, window %u, %u answered, %u failed, %u finished\n",
+		argv[1], bench.calls, bench.window, bench.answered, bench.failed,
+		bench.finished);
+	printf("%.3f s, %.0f calls/s, %.1f us cpu per call, setup %.2f ms on average\n",
+		wall / 1e9, bench.calls / (wall / 1e9), cpu * 1e6 / bench.calls,
+		bench.answered ? bench.setup_ns / 1e6 / bench.answered : 0.0);
+	return bench.failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
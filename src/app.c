@@ -24,37 +24,24 @@
 #include "mncc.h"
 #include "mncc_protocol.h"
 
+#include <string.h>
+
 void app_mncc_disconnected(struct mncc_connection *conn)
 {
-	struct call *call, *tmp;
-
-	llist_for_each_entry_safe(call, tmp, &g_call_list, entry) {
-		struct call_leg *initial, *remote;
-		int has_mncc = 0;
-
-		if (call->initial && call->initial->type == CALL_TYPE_MNCC)
-			has_mncc = 1;
-		if (call->remote && call->remote->type == CALL_TYPE_MNCC)
-			has_mncc = 1;
+	/*
+	 * The connection is down and its legs are dropped right away, each
+	 * round removes at least the last slot. The other leg of the call
+	 * is released too, it keeps the call alive until then.
+	 */
+	while (conn->num_legs > 0) {
+		struct mncc_call_leg *leg = conn->legs[conn->num_legs - 1].leg;
+		struct call_leg *other = call_leg_other(&leg->base);
 
-		if (!has_mncc)
-			continue;
-
-		/*
-		 * this call has a MNCC component and we will release it now.
-		 * There might be no remote so on the release of the initial
-		 * leg the call might be gone. We may not touch call beyond
-		 * that point.
-		 */
 		LOGP(DAPP, LOGL_NOTICE,
-			"Going to release call(%u) due MNCC.\n", call->id);
-		initial = call->initial;
-		remote = call->remote;
-		call = NULL;
-		if (initial)
-			initial->release_call(initial);
-		if (remote)
-			remote->release_call(remote);
+			"Going to release call(%u) due MNCC.\n", leg->base.call->id);
+		leg->base.release_call(&leg->base);
+		if (other)
+			other->release_call(other);
 	}
 }
 
@@ -63,21 +50,127 @@ void app_mncc_disconnected(struct mncc_connection *conn)
  */
 void app_setup(struct app_config *cfg)
 {
-	cfg->mncc.conn.on_disconnect = app_mncc_disconnected;
+	struct mncc_connection *conn;
+
+	cfg->mncc.on_disconnect = app_mncc_disconnected;
+	llist_for_each_entry(conn, &cfg->mncc.conns, entry)
+		conn->on_disconnect = app_mncc_disconnected;
 }
 
 static void route_to_sip(struct call *call)
 {
-	if (sip_create_remote_leg(&g_app.sip.agent, call) != 0)
+	struct routing *routing = &g_app.routing;
+	struct sip_trunk *trunk = NULL;
+	const struct route *route;
+
+	route = route_lookup(routing, call->dest,
+				call->initial->payload_msg_type);
+	if (route) {
+		const char *name = route_trunk_name(routing->table, route);
+
+		trunk = sip_trunk_find(&g_app, name);
+		if (!trunk)
+			LOGP(DAPP, LOGL_ERROR,
+				"call(%u) routed to unknown trunk(%s)\n",
+				call->id, name);
+		call->dest = route_rewrite(call, routing->table, route, call->dest);
+		LOGP(DAPP, LOGL_DEBUG, "call(%u) routed to trunk(%s) as %s\n",
+			call->id, name, call->dest);
+	}
+
+	if (sip_create_remote_leg(&g_app.sip.agent, call, trunk) != 0)
 		call->initial->release_call(call->initial);
 }
 
+static bool prefix_match(char * const *prefixes, unsigned int num, const char *str)
+{
+	unsigned int i;
+
+	for (i = 0; i < num; ++i) {
+		if (strncmp(str, prefixes[i], strlen(prefixes[i])) == 0)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Pick the MSC for a call. A connection with a matching called number
+ * or IMSI prefix gets it even when it is down. Otherwise the ready
+ * connections take turns.
+ */
+static struct mncc_connection *steer_call(struct app_config *app, const char *dest)
+{
+	char imsi_buf[IMSI_MAP_LEN + 1];
+	const char *imsi = NULL;
+	bool imsi_known = false;
+	struct mncc_connection *conn;
+	unsigned int ready = 0, pick;
+
+	llist_for_each_entry(conn, &app->mncc.conns, entry) {
+		if (prefix_match(conn->called_prefixes, conn->num_called_prefixes, dest))
+			return conn;
+
+		/* only map the number when someone steers by IMSI */
+		if (conn->num_imsi_prefixes > 0 && !imsi_known) {
+			if (app->use_imsi_as_id)
+				imsi = dest;
+			else if (imsi_map_to_imsi(&app->imsi_map, dest, imsi_buf))
+				imsi = imsi_buf;
+			imsi_known = true;
+		}
+		if (imsi && prefix_match(conn->imsi_prefixes, conn->num_imsi_prefixes, imsi))
+			return conn;
+		if (conn->state == MNCC_READY)
+			ready += 1;
+	}
+
+	if (ready == 0)
+		return app->mncc.default_conn;
+
+	pick = app->mncc.next_conn++ % ready;
+	llist_for_each_entry(conn, &app->mncc.conns, entry) {
+		if (conn->state != MNCC_READY)
+			continue;
+		if (pick-- == 0)
+			break;
+	}
+	return conn;
+}
+
 static void route_to_mncc(struct call *call)
 {
-	if (mncc_create_remote_leg(&g_app.mncc.conn, call) != 0)
+	struct mncc_connection *conn;
+
+	/* the MSC bridges the two legs, both need to be on it */
+	if (call->initial->type == CALL_TYPE_MNCC)
+		conn = ((struct mncc_call_leg *) call->initial)->conn;
+	else
+		conn = steer_call(&g_app, call->dest);
+
+	if (mncc_create_remote_leg(conn, call) != 0)
 		call->initial->release_call(call->initial);
 }
 
+/*
+ * A number of one of our own subscribers. The call is set up as a
+ * second MNCC leg instead of going to the PBX and back.
+ */
+static bool is_local(struct app_config *app, const char *dest)
+{
+	char imsi[IMSI_MAP_LEN + 1];
+	unsigned int i;
+
+	for (i = 0; i < app->local_bridge.num_prefixes; ++i) {
+		const char *prefix = app->local_bridge.prefixes[i];
+
+		if (strncmp(dest, prefix, strlen(prefix)) == 0)
+			return true;
+	}
+
+	return app->local_bridge.imsi_map
+		&& imsi_map_to_imsi(&app->imsi_map, dest, imsi);
+}
+
 void app_route_call(struct call *call, const char *source, const char *dest)
 {
 
@@ -91,10 +184,15 @@ void app_route_call(struct call *call, const char *source, const char *dest)
 	call->source = source;
 	call->dest = dest;
 
-	if (call->initial->type == CALL_TYPE_MNCC)
-		route_to_sip(call);
-	else
+	if (call->initial->type != CALL_TYPE_MNCC)
 		route_to_mncc(call);
+	else if (is_local(&g_app, dest)) {
+		LOGP(DAPP, LOGL_DEBUG, "call(%u) to %s is bridged locally\n",
+			call->id, dest);
+		g_app.local_bridge.calls += 1;
+		route_to_mncc(call);
+	} else
+		route_to_sip(call);
 }
 
 const char *app_media_name(int ptmsg)
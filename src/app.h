@@ -2,24 +2,111 @@
 
 #include "mncc.h"
 #include "sip.h"
+#include "calltable.h"
+#include "codec.h"
+#include "imsi_map.h"
+#include "numbering.h"
+#include "ratelimit.h"
+#include "resolver.h"
+#include "route.h"
+#include "trunk.h"
+
+#define LOCAL_BRIDGE_MAX_PREFIXES	16
 
 struct call;
+struct mncc_proxy;
+struct replication;
 
 struct app_config {
 	struct {
 		const char *local_addr;
 		int local_port;
 
-		const char *remote_addr;
-		int remote_port;
 		struct sip_agent agent;
+		enum sip_engine engine;
+		unsigned int builtin_dialogs;
+
+		/* trunk group towards the PBX */
+		struct llist_head trunks;
+		struct sip_trunk *default_trunk;
+
+		unsigned int probe_interval;
+		struct osmo_timer_list probe_timer;
+		unsigned int breaker_threshold;
+		unsigned int breaker_cooldown;
+
+		struct sip_resolver resolver;
+
+		/* seconds between CRLF pings on TCP connections */
+		unsigned int tcp_keepalive;
+
+		/* answer INVITEs with a 183 once the MNCC media is known */
+		bool early_media;
+
+		/* bound socket of the service manager or a previous instance */
+		int inherited_fd;
 	} sip;
 
 	struct {
-		const char *path;
-		struct mncc_connection conn;
+		bool io_uring;
+		bool shared_memory;
+
+		/* MSCs, the default one is configured in the mncc node */
+		struct llist_head conns;
+		struct mncc_connection *default_conn;
+		void (*on_disconnect)(struct mncc_connection *);
+		bool started;
+
+		/* round-robin for calls without a matching prefix */
+		unsigned int next_conn;
 	} mncc;
 
+	/* set with --proxy, see mncc_proxy.c */
+	struct {
+		bool enabled;
+		const char *path;
+		struct mncc_proxy *proxy;
+	} mncc_proxy;
+
+	/* set with --handover, see handover.c */
+	struct {
+		bool wait;
+		const char *path;
+	} handover;
+
+	/* hot standby, see replication.c */
+	struct {
+		int role;
+		const char *path;
+		struct replication *state;
+	} replication;
+
+	/* calls of a crashed instance, see calltable.c */
+	struct call_table call_table;
+
+	struct {
+		unsigned int max_length;
+	} setup_queue;
+
+	struct {
+		struct ratelimit mncc;
+		struct ratelimit sip;
+	} rate_limit;
+
+	struct routing routing;
+	struct numbering numbering;
+	struct imsi_map imsi_map;
+	struct codec_policy codecs;
+
+	/* MNCC to MNCC calls that do not go through the PBX */
+	struct {
+		bool imsi_map;
+		unsigned int num_prefixes;
+		char *prefixes[LOCAL_BRIDGE_MAX_PREFIXES];
+
+		uint64_t calls;
+	} local_bridge;
+
 	int use_imsi_as_id;
 };
 
@@ -0,0 +1,238 @@
+/*
+ * (C) 2017 by Holger Hans Peter Freyther
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "auth.h"
+#include "logging.h"
+
+#include <talloc.h>
+
+#include <sofia-sip/su_md5.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+void sip_auth_reset(struct sip_auth *auth)
+{
+	auth->valid = false;
+	talloc_free(auth->realm);
+	talloc_free(auth->nonce);
+	talloc_free(auth->opaque);
+	auth->realm = auth->nonce = auth->opaque = NULL;
+	auth->ha1[0] = '\0';
+}
+
+void sip_auth_set(struct sip_auth *auth, void *ctx,
+			const char *username, const char *password)
+{
+	sip_auth_reset(auth);
+	talloc_free(auth->username);
+	talloc_free(auth->password);
+	auth->username = username ? talloc_strdup(ctx, username) : NULL;
+	auth->password = password ? talloc_strdup(ctx, password) : NULL;
+}
+
+/* value of a name=value or name="value" parameter of the challenge */
+static char *find_param(void *ctx, const char * const *params, const char *name)
+{
+	size_t len = strlen(name);
+	const char *value;
+	size_t vlen;
+
+	for (; params && *params; ++params) {
+		if (strncasecmp(*params, name, len) != 0 || (*params)[len] != '=')
+			continue;
+
+		value = *params + len + 1;
+		vlen = strlen(value);
+		if (vlen >= 2 && value[0] == '"' && value[vlen - 1] == '"')
+			return talloc_strndup(ctx, value + 1, vlen - 2);
+		return talloc_strdup(ctx, value);
+	}
+	return NULL;
+}
+
+static bool has_token(const char *list, const char *token)
+{
+	size_t len = strlen(token);
+
+	while (list && *list) {
+		list += strspn(list, " ,");
+		if (strncasecmp(list, token, len) == 0
+		    && (list[len] == '\0' || list[len] == ',' || list[len] == ' '))
+			return true;
+		list += strcspn(list, ",");
+	}
+	return false;
+}
+
+static void compute_ha1(struct sip_auth *auth)
+{
+	su_md5_t md5;
+
+	su_md5_init(&md5);
+	su_md5_strupdate(&md5, auth->username);
+	su_md5_update(&md5, ":", 1);
+	su_md5_strupdate(&md5, auth->realm);
+	su_md5_update(&md5, ":", 1);
+	su_md5_strupdate(&md5, auth->password);
+	su_md5_hexdigest(&md5, auth->ha1);
+}
+
+/*
+ * Remember the digest challenge of a 401/407. Returns 1 if the request
+ * should be sent again with credentials, 0 if the challenge can not be
+ * answered. answered is the nonce the request was sent with, if any. A
+ * new challenge for that nonce means that the credentials are wrong
+ * unless the PBX marked it as stale. The cached nonce of the trunk may
+ * already be newer when several requests were challenged at once.
+ */
+int sip_auth_challenge(struct sip_auth *auth, void *ctx,
+			const sip_t *sip, int status, const char *answered)
+{
+	const sip_www_authenticate_t *au;
+	char *realm, *nonce, *algorithm, *qop, *stale;
+	bool retry = true;
+
+	if (!auth->username || !auth->password)
+		return 0;
+
+	au = status == 407 ? sip->sip_proxy_authenticate : sip->sip_www_authenticate;
+	if (!au || !au->au_scheme || strcasecmp(au->au_scheme, "Digest") != 0) {
+		LOGP(DSIP, LOGL_ERROR, "No digest challenge in %d\n", status);
+		auth->failures += 1;
+		return 0;
+	}
+
+	realm = find_param(ctx, au->au_params, "realm");
+	nonce = find_param(ctx, au->au_params, "nonce");
+	algorithm = find_param(ctx, au->au_params, "algorithm");
+	qop = find_param(ctx, au->au_params, "qop");
+	stale = find_param(ctx, au->au_params, "stale");
+
+	if (!realm || !nonce || (algorithm && strcasecmp(algorithm, "MD5") != 0)) {
+		LOGP(DSIP, LOGL_ERROR, "Unsupported digest challenge algorithm(%s)\n",
+			algorithm ? algorithm : "MD5");
+		auth->failures += 1;
+		sip_auth_reset(auth);
+		retry = false;
+		goto out;
+	}
+
+	/* the body would have to be part of the digest, RFC 2069 is no answer */
+	if (qop && !has_token(qop, "auth")) {
+		LOGP(DSIP, LOGL_ERROR, "Unsupported digest challenge qop(%s) in realm(%s)\n",
+			qop, realm);
+		auth->failures += 1;
+		sip_auth_reset(auth);
+		retry = false;
+		goto out;
+	}
+
+	/* our answer to the same nonce was rejected */
+	if (answered && strcmp(answered, nonce) == 0
+	    && !(stale && strcasecmp(stale, "true") == 0)) {
+		LOGP(DSIP, LOGL_ERROR, "Credentials of user(%s) rejected in realm(%s)\n",
+			auth->username, realm);
+		auth->failures += 1;
+		sip_auth_reset(auth);
+		retry = false;
+		goto out;
+	}
+
+	auth->challenges += 1;
+	if (!auth->realm || strcmp(auth->realm, realm) != 0) {
+		talloc_free(auth->realm);
+		auth->realm = realm;
+		realm = NULL;
+		compute_ha1(auth);
+	}
+
+	talloc_free(auth->nonce);
+	talloc_free(auth->opaque);
+	auth->nonce = nonce;
+	nonce = NULL;
+	auth->opaque = find_param(ctx, au->au_params, "opaque");
+	auth->qop_auth = has_token(qop, "auth");
+	auth->proxy = status == 407;
+	auth->nc = 0;
+	auth->valid = true;
+
+out:
+	talloc_free(realm);
+	talloc_free(nonce);
+	talloc_free(algorithm);
+	talloc_free(qop);
+	talloc_free(stale);
+	return retry;
+}
+
+/*
+ * The Authorization value for a request using the cached challenge or
+ * NULL if there is none. Each use counts up the nonce count so the PBX
+ * can accept the same nonce for many INVITEs.
+ */
+char *sip_auth_header(struct sip_auth *auth, void *ctx,
+			const char *method, const char *uri)
+{
+	char ha2[33], response[33], cnonce[17], nc[9];
+	su_md5_t md5;
+
+	if (!auth->valid)
+		return NULL;
+
+	su_md5_init(&md5);
+	su_md5_strupdate(&md5, method);
+	su_md5_update(&md5, ":", 1);
+	su_md5_strupdate(&md5, uri);
+	su_md5_hexdigest(&md5, ha2);
+
+	auth->nc += 1;
+	snprintf(nc, sizeof(nc), "%08x", auth->nc);
+	snprintf(cnonce, sizeof(cnonce), "%08lx%08lx", random(), random());
+
+	su_md5_init(&md5);
+	su_md5_update(&md5, auth->ha1, 32);
+	su_md5_update(&md5, ":", 1);
+	su_md5_strupdate(&md5, auth->nonce);
+	su_md5_update(&md5, ":", 1);
+	if (auth->qop_auth) {
+		su_md5_strupdate(&md5, nc);
+		su_md5_update(&md5, ":", 1);
+		su_md5_strupdate(&md5, cnonce);
+		su_md5_update(&md5, ":auth:", 6);
+	}
+	su_md5_update(&md5, ha2, 32);
+	su_md5_hexdigest(&md5, response);
+
+	return talloc_asprintf(ctx,
+			"Digest username=\"%s\", realm=\"%s\", nonce=\"%s\", "
+			"uri=\"%s\", response=\"%s\", algorithm=MD5%s%s%s%s%s%s%s%s",
+			auth->username, auth->realm, auth->nonce, uri, response,
+			auth->opaque ? ", opaque=\"" : "",
+			auth->opaque ? auth->opaque : "",
+			auth->opaque ? "\"" : "",
+			auth->qop_auth ? ", qop=auth, nc=" : "",
+			auth->qop_auth ? nc : "",
+			auth->qop_auth ? ", cnonce=\"" : "",
+			auth->qop_auth ? cnonce : "",
+			auth->qop_auth ? "\"" : "");
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <sofia-sip/sip.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Digest credentials of a trunk and the last challenge of the PBX.
+ * The HA1 only depends on the credentials and the realm and is kept
+ * until one of them changes. As long as the PBX accepts the cached
+ * nonce every INVITE is sent with an Authorization right away. The
+ * strings are allocated from the trunk.
+ */
+struct sip_auth {
+	/* configuration */
+	char *username;
+	char *password;
+
+	/* cached challenge */
+	bool valid;
+	bool proxy;		/* from a 407 */
+	bool qop_auth;
+	char *realm;
+	char *nonce;
+	char *opaque;
+	uint32_t nc;
+	char ha1[33];
+
+	/* statistics */
+	uint64_t challenges;
+	uint64_t proactive;
+	uint64_t failures;
+};
+
+void sip_auth_set(struct sip_auth *auth, void *ctx,
+			const char *username, const char *password);
+void sip_auth_reset(struct sip_auth *auth);
+
+int sip_auth_challenge(struct sip_auth *auth, void *ctx,
+			const sip_t *sip, int status, const char *answered);
+char *sip_auth_header(struct sip_auth *auth, void *ctx,
+			const char *method, const char *uri);
@@ -19,6 +19,7 @@
  */
 
 #include "call.h"
+#include "callstate.h"
 #include "logging.h"
 
 #include <talloc.h>
@@ -83,10 +84,12 @@ void call_leg_release(struct call_leg *leg)
 	talloc_free(leg);
 	if (!call->initial && !call->remote) {
 		uint32_t id = call->id;
+		callstate_released(call);
 		llist_del(&call->entry);
 		talloc_free(call);
 		LOGP(DAPP, LOGL_DEBUG, "call(%u) released.\n", id);
-	}
+	} else
+		callstate_changed(call);
 }
 
 struct call *call_mncc_create(void)
@@ -110,6 +113,7 @@ struct call *call_mncc_create(void)
 	call->initial->type = CALL_TYPE_MNCC;
 	call->initial->call = call;
 	llist_add(&call->entry, &g_call_list);
+	callstate_changed(call);
 	return call;
 }
 
@@ -134,6 +138,34 @@ struct call *call_sip_create(void)
 	call->initial->type = CALL_TYPE_SIP;
 	call->initial->call = call;
 	llist_add(&call->entry, &g_call_list);
+	callstate_changed(call);
+	return call;
+}
+
+/* Ids of a previous instance are not handed out again */
+void calls_reserve_id(unsigned int id)
+{
+	if (id > last_call_id)
+		last_call_id = id;
+}
+
+/* A call of a previous instance, the legs are added by the caller */
+struct call *call_restore(unsigned int id, const char *source, const char *dest)
+{
+	struct call *call;
+
+	call = talloc_zero(tall_mncc_ctx, struct call);
+	if (!call) {
+		LOGP(DCALL, LOGL_ERROR, "Failed to allocate memory for call\n");
+		return NULL;
+	}
+	calls_reserve_id(id);
+	call->id = id;
+	call->source = talloc_strdup(call, source);
+	call->dest = talloc_strdup(call, dest);
+
+	llist_add(&call->entry, &g_call_list);
+	callstate_changed(call);
 	return call;
 }
 
@@ -149,6 +181,13 @@ struct call_leg *call_leg_other(struct call_leg *leg)
 	return NULL;
 }
 
+/* Both legs are on the MNCC side and the MSC bridges the media */
+bool call_is_mncc_bridge(struct call *call)
+{
+	return call->initial && call->initial->type == CALL_TYPE_MNCC
+		&& call->remote && call->remote->type == CALL_TYPE_MNCC;
+}
+
 const char *call_leg_type(struct call_leg *leg)
 {
 	return get_value_string(call_type_vals, leg->type);
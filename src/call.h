@@ -1,6 +1,7 @@
 #pragma once
 
 #include "mncc_protocol.h"
+#include "pacer.h"
 
 #include <osmocom/core/linuxlist.h>
 #include <osmocom/core/timer.h>
@@ -9,10 +10,13 @@
 #include <stdbool.h>
 
 struct sip_agent;
+struct sip_trunk;
 struct mncc_connection;
 
 
 struct nua_handle_s;
+struct lsip_dialog;
+struct sip_leg_ops;
 
 struct call_leg;
 
@@ -30,6 +34,10 @@ struct call {
 
 	const char *source;
 	const char *dest;
+
+	/* changed in this loop iteration, see callstate.c */
+	struct llist_head state_entry;
+	bool state_dirty;
 };
 
 enum {
@@ -52,11 +60,19 @@ struct call_leg {
 	uint32_t	payload_type;
 	uint32_t	payload_msg_type;
 
+	/* bitmap of the offered enum codec */
+	uint32_t	codec_caps;
+
         /**
          * Remote started to ring/alert
          */
         void (*ring_call)(struct call_leg *);
 
+        /**
+         * Media of the other leg is known before it picked up
+         */
+        void (*early_media)(struct call_leg *);
+
         /**
          * Remote picked up
          */
@@ -91,14 +107,30 @@ struct sip_call_leg {
 
 	/* back pointer */
 	struct sip_agent *agent;
+	const struct sip_leg_ops *ops;	/* of the engine below */
 
 	/* per instance members */
 	struct nua_handle_s *nua_handle;
+	struct lsip_dialog *dialog;	/* instead of the handle, built-in engine */
+	const char *call_id;		/* of the nua dialog */
+	uint32_t cseq;			/* of our last INVITE on the nua dialog */
 	enum sip_cc_state state;
 	enum sip_dir dir;
 
+	/* mt field, trunk in use and the ones already tried */
+	struct sip_trunk *trunk;
+	uint32_t tried_trunks;
+	bool alerted;
+	bool auth_retried;
+	char *auth_nonce;		/* our INVITE was sent with */
+	bool invite_pending;
+
+	/* mt field, waiting for the INVITE pacer */
+	struct pacer_entry pacer_entry;
+
 	/* mo field */
 	const char *wanted_codec;
+	bool early_media;
 
 	/* mt field */
 	const char *sdp_payload;
@@ -118,30 +150,38 @@ enum mncc_dir {
 struct mncc_call_leg {
 	struct call_leg base;
 
+	/* what every MNCC message of the leg looks at */
 	enum mncc_cc_state state;
 	enum mncc_dir dir;
-
 	uint32_t callref;
-	struct gsm_mncc_number called;
-	struct gsm_mncc_number calling;
-	char imsi[16];
+	struct mncc_connection *conn;
+	unsigned int slot;		/* in conn->legs */
+	int rsp_wanted;
+
+	/* media of the other leg is already connected */
+	bool rtp_connected;
 
 	struct osmo_timer_list cmd_timeout;
-	int rsp_wanted;
 
-	struct mncc_connection *conn;
+	/* only read at the setup and for the VTY */
+	struct gsm_mncc_number called;
+	struct gsm_mncc_number calling;
+	char imsi[16];
 };
 
 extern struct llist_head g_call_list;
 void calls_init(void);
 
 struct call_leg *call_leg_other(struct call_leg *leg);
+bool call_is_mncc_bridge(struct call *call);
 
 void call_leg_release(struct call_leg *leg);
 
 
 struct call *call_mncc_create(void);
 struct call *call_sip_create(void);
+struct call *call_restore(unsigned int id, const char *source, const char *dest);
+void calls_reserve_id(unsigned int id);
 
 const char *call_leg_type(struct call_leg *leg);
 const char *call_leg_state(struct call_leg *leg);
@@ -0,0 +1,445 @@
+/*
+ * (C) 2017 by Holger Hans Peter Freyther
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "callstate.h"
+#include "app.h"
+#include "call.h"
+#include "logging.h"
+#include "lsip.h"
+#include "mncc.h"
+#include "sip.h"
+#include "sip_builtin.h"
+
+#include <talloc.h>
+
+#include <netinet/in.h>
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+extern void *tall_mncc_ctx;
+
+static LLIST_HEAD(sinks);
+
+/* the calls changed and the ones released since the last flush */
+static LLIST_HEAD(dirty_calls);
+static uint32_t *released;
+static unsigned int num_released;
+static unsigned int max_released;
+
+/* MNCC releases of a previous instance waiting for their MSC */
+struct stale_release {
+	struct llist_head entry;
+	char conn[16];
+	uint32_t callref;
+	bool reject;
+};
+
+static LLIST_HEAD(stale_releases);
+
+void callstate_sink_add(struct callstate_sink *sink)
+{
+	llist_add_tail(&sink->entry, &sinks);
+}
+
+void callstate_sink_del(struct callstate_sink *sink)
+{
+	llist_del(&sink->entry);
+}
+
+/*
+ * Called for every event of a call. The record is only made when
+ * the loop iteration is over so a call is sent once per iteration.
+ */
+void callstate_changed(struct call *call)
+{
+	if (call->state_dirty || llist_empty(&sinks))
+		return;
+
+	call->state_dirty = true;
+	llist_add_tail(&call->state_entry, &dirty_calls);
+}
+
+void callstate_released(struct call *call)
+{
+	if (call->state_dirty) {
+		llist_del(&call->state_entry);
+		call->state_dirty = false;
+	}
+
+	if (llist_empty(&sinks))
+		return;
+
+	if (num_released == max_released) {
+		unsigned int size = max_released ? max_released * 2 : 64;
+		uint32_t *ids;
+
+		ids = talloc_realloc(tall_mncc_ctx, released, uint32_t, size);
+		if (!ids) {
+			LOGP(DAPP, LOGL_ERROR, "Failed to note the release of call(%u)\n",
+				call->id);
+			return;
+		}
+		released = ids;
+		max_released = size;
+	}
+	released[num_released++] = call->id;
+}
+
+void callstate_flush(void)
+{
+	struct callstate_record rec;
+	struct callstate_sink *sink;
+	struct call *call, *tmp;
+	unsigned int i;
+
+	if (llist_empty(&dirty_calls) && num_released == 0)
+		return;
+
+	for (i = 0; i < num_released; ++i)
+		llist_for_each_entry(sink, &sinks, entry)
+			sink->remove(sink, released[i]);
+	num_released = 0;
+
+	llist_for_each_entry_safe(call, tmp, &dirty_calls, state_entry) {
+		llist_del(&call->state_entry);
+		call->state_dirty = false;
+
+		callstate_fill(&rec, call);
+		llist_for_each_entry(sink, &sinks, entry)
+			sink->update(sink, &rec);
+	}
+
+	llist_for_each_entry(sink, &sinks, entry)
+		sink->flush(sink);
+}
+
+static void copy_str(char *dst, size_t size, const char *src)
+{
+	snprintf(dst, size, "%s", src ? src : "");
+}
+
+static void fill_mncc(struct callstate_leg *out, struct mncc_call_leg *leg)
+{
+	out->state = leg->state;
+	out->dir = leg->dir;
+	out->callref = leg->callref;
+	copy_str(out->conn, sizeof(out->conn), leg->conn->name);
+	copy_str(out->imsi, sizeof(out->imsi), leg->imsi);
+}
+
+static void fill_sip(struct callstate_leg *out, struct callstate_dialog *dlg,
+			struct sip_call_leg *leg)
+{
+	out->state = leg->state;
+	out->dir = leg->dir;
+
+	if (leg->dialog) {
+		struct lsip_dialog *dialog = leg->dialog;
+
+		out->flags |= CALLSTATE_F_BUILTIN;
+		if (dialog->uac)
+			out->flags |= CALLSTATE_F_UAC;
+		copy_str(dlg->call_id, sizeof(dlg->call_id), dialog->call_id);
+		copy_str(dlg->local_tag, sizeof(dlg->local_tag), dialog->local_tag);
+		copy_str(dlg->remote_tag, sizeof(dlg->remote_tag), dialog->remote_tag);
+		copy_str(dlg->local_uri, sizeof(dlg->local_uri), dialog->local_uri);
+		copy_str(dlg->remote_uri, sizeof(dlg->remote_uri), dialog->remote_uri);
+		copy_str(dlg->remote_target, sizeof(dlg->remote_target),
+			dialog->remote_target);
+		copy_str(dlg->route_set, sizeof(dlg->route_set), dialog->route_set);
+		dlg->local_cseq = dialog->local_cseq;
+		dlg->peer_ip = dialog->peer.sin_addr.s_addr;
+		dlg->peer_port = dialog->peer.sin_port;
+	} else if (leg->nua_handle) {
+		sip_to_t const *local = nua_handle_local(leg->nua_handle);
+		sip_to_t const *remote = nua_handle_remote(leg->nua_handle);
+
+		/* nua keeps the rest of the dialog to itself */
+		if (leg->dir == SIP_DIR_MT)
+			out->flags |= CALLSTATE_F_UAC;
+		copy_str(dlg->call_id, sizeof(dlg->call_id), leg->call_id);
+		dlg->local_cseq = leg->cseq;
+		if (local) {
+			copy_str(dlg->local_tag, sizeof(dlg->local_tag), local->a_tag);
+			snprintf(dlg->local_uri, sizeof(dlg->local_uri),
+				URL_PRINT_FORMAT, URL_PRINT_ARGS(local->a_url));
+		}
+		if (remote) {
+			copy_str(dlg->remote_tag, sizeof(dlg->remote_tag), remote->a_tag);
+			snprintf(dlg->remote_uri, sizeof(dlg->remote_uri),
+				URL_PRINT_FORMAT, URL_PRINT_ARGS(remote->a_url));
+		}
+	}
+}
+
+static void fill_leg(struct callstate_leg *out, struct callstate_dialog *dlg,
+			struct call_leg *leg)
+{
+	if (!leg)
+		return;
+
+	out->type = leg->type;
+	out->flags = CALLSTATE_F_PRESENT;
+	out->rtp_ip = leg->ip;
+	out->rtp_port = leg->port;
+	out->payload_type = leg->payload_type;
+	out->payload_msg_type = leg->payload_msg_type;
+
+	switch (leg->type) {
+	case CALL_TYPE_MNCC:
+		fill_mncc(out, (struct mncc_call_leg *) leg);
+		break;
+	case CALL_TYPE_SIP:
+		fill_sip(out, dlg, (struct sip_call_leg *) leg);
+		break;
+	}
+}
+
+void callstate_fill(struct callstate_record *rec, struct call *call)
+{
+	memset(rec, 0, sizeof(*rec));
+	rec->id = call->id;
+	copy_str(rec->source, sizeof(rec->source), call->source);
+	copy_str(rec->dest, sizeof(rec->dest), call->dest);
+	fill_leg(&rec->initial, &rec->dialog, call->initial);
+	fill_leg(&rec->remote, &rec->dialog, call->remote);
+}
+
+/* The dialog part is left out for calls without a SIP leg */
+unsigned int callstate_record_len(const struct callstate_record *rec)
+{
+	if (rec->initial.type == CALL_TYPE_SIP || rec->remote.type == CALL_TYPE_SIP)
+		return sizeof(*rec);
+	return offsetof(struct callstate_record, dialog);
+}
+
+/* All calls to a single sink, e.g. a standby that just connected */
+void callstate_snapshot(struct callstate_sink *sink)
+{
+	struct callstate_record rec;
+	struct call *call;
+
+	llist_for_each_entry(call, &g_call_list, entry) {
+		callstate_fill(&rec, call);
+		sink->update(sink, &rec);
+	}
+}
+
+static void send_stale_release(struct mncc_connection *conn, uint32_t callref,
+				bool reject)
+{
+	LOGP(DAPP, LOGL_NOTICE, "Releasing stale callref(%u) on MNCC %s\n",
+		callref, conn->name);
+	mncc_release_stale(conn, callref, reject);
+}
+
+/* The MSC most likely dropped the call already, make sure it did */
+static void recover_mncc(struct app_config *app, const struct callstate_leg *leg)
+{
+	struct mncc_connection *conn;
+	struct stale_release *stale;
+	bool reject;
+
+	if (leg->callref == 0)
+		return;
+
+	reject = leg->state == MNCC_CC_INITIAL && leg->dir == MNCC_DIR_MO;
+	conn = mncc_connection_find(app, leg->conn);
+	if (!conn)
+		conn = app->mncc.default_conn;
+	if (conn->state == MNCC_READY)
+		return send_stale_release(conn, leg->callref, reject);
+
+	stale = talloc_zero(tall_mncc_ctx, struct stale_release);
+	if (!stale)
+		return;
+	copy_str(stale->conn, sizeof(stale->conn), conn->name);
+	stale->callref = leg->callref;
+	stale->reject = reject;
+	llist_add_tail(&stale->entry, &stale_releases);
+}
+
+void callstate_mncc_ready(struct mncc_connection *conn)
+{
+	struct stale_release *stale, *tmp;
+
+	llist_for_each_entry_safe(stale, tmp, &stale_releases, entry) {
+		if (strcmp(stale->conn, conn->name) != 0)
+			continue;
+		send_stale_release(conn, stale->callref, stale->reject);
+		llist_del(&stale->entry);
+		talloc_free(stale);
+	}
+}
+
+/*
+ * A confirmed dialog of the built-in engine is ended with a BYE. An
+ * early one would need the INVITE transaction and nua dialogs can not
+ * be recreated, these are left to the timers of the peer.
+ */
+static void load_dialog(struct lsip_dialog *saved, const struct callstate_leg *leg,
+			const struct callstate_dialog *dlg)
+{
+	memset(saved, 0, sizeof(*saved));
+	saved->uac = !!(leg->flags & CALLSTATE_F_UAC);
+	copy_str(saved->call_id, sizeof(saved->call_id), dlg->call_id);
+	copy_str(saved->local_tag, sizeof(saved->local_tag), dlg->local_tag);
+	copy_str(saved->remote_tag, sizeof(saved->remote_tag), dlg->remote_tag);
+	copy_str(saved->local_uri, sizeof(saved->local_uri), dlg->local_uri);
+	copy_str(saved->remote_uri, sizeof(saved->remote_uri), dlg->remote_uri);
+	copy_str(saved->remote_target, sizeof(saved->remote_target), dlg->remote_target);
+	copy_str(saved->route_set, sizeof(saved->route_set), dlg->route_set);
+	saved->local_cseq = dlg->local_cseq;
+	saved->peer.sin_family = AF_INET;
+	saved->peer.sin_addr.s_addr = dlg->peer_ip;
+	saved->peer.sin_port = dlg->peer_port;
+}
+
+static void recover_sip(struct app_config *app, const struct callstate_record *rec,
+			const struct callstate_leg *leg)
+{
+	const struct callstate_dialog *dlg = &rec->dialog;
+	struct lsip_engine *engine = app->sip.agent.builtin;
+	struct lsip_dialog saved, *dialog;
+
+	if (leg->state != SIP_CC_CONNECTED
+	    || ((leg->flags & CALLSTATE_F_BUILTIN) && !engine)) {
+		LOGP(DAPP, LOGL_NOTICE, "Leaving call-id(%s) of call(%u) to the peer\n",
+			dlg->call_id, rec->id);
+		return;
+	}
+
+	/* nua has no dialog to restore, the BYE goes out on its own */
+	if (!(leg->flags & CALLSTATE_F_BUILTIN)) {
+		if (sip_release_dialog(&app->sip.agent, dlg) < 0)
+			LOGP(DAPP, LOGL_ERROR, "No dialog to end call-id(%s) of call(%u)\n",
+				dlg->call_id, rec->id);
+		return;
+	}
+
+	load_dialog(&saved, leg, dlg);
+	dialog = lsip_dialog_restore(engine, &saved);
+	if (!dialog) {
+		LOGP(DAPP, LOGL_ERROR, "No dialog to end call-id(%s) of call(%u)\n",
+			dlg->call_id, rec->id);
+		return;
+	}
+
+	LOGP(DAPP, LOGL_NOTICE, "Sending BYE for call-id(%s) of call(%u)\n",
+		dlg->call_id, rec->id);
+	lsip_dialog_release(dialog);
+}
+
+static void recover_leg(struct app_config *app, const struct callstate_record *rec,
+			const struct callstate_leg *leg)
+{
+	if (!(leg->flags & CALLSTATE_F_PRESENT))
+		return;
+
+	switch (leg->type) {
+	case CALL_TYPE_MNCC:
+		recover_mncc(app, leg);
+		break;
+	case CALL_TYPE_SIP:
+		recover_sip(app, rec, leg);
+		break;
+	}
+}
+
+/*
+ * A call of another instance that can not be continued here. Both
+ * sides are told to drop it instead of waiting for their timers.
+ */
+void callstate_recover(struct app_config *app, const struct callstate_record *rec)
+{
+	LOGP(DAPP, LOGL_NOTICE, "Releasing call(%u) from %s to %s of the previous instance\n",
+		rec->id, rec->source, rec->dest);
+	calls_reserve_id(rec->id);
+	recover_leg(app, rec, &rec->initial);
+	recover_leg(app, rec, &rec->remote);
+}
+
+/* Only connected legs on sockets we got from the previous instance */
+static bool can_restore(struct app_config *app, const struct callstate_leg *leg)
+{
+	struct mncc_connection *conn;
+
+	if (!(leg->flags & CALLSTATE_F_PRESENT))
+		return false;
+
+	switch (leg->type) {
+	case CALL_TYPE_MNCC:
+		conn = mncc_connection_find(app, leg->conn);
+		return leg->state == MNCC_CC_CONNECTED && conn && conn->state == MNCC_READY;
+	case CALL_TYPE_SIP:
+		return leg->state == SIP_CC_CONNECTED && (leg->flags & CALLSTATE_F_BUILTIN)
+			&& app->sip.agent.builtin;
+	}
+	return false;
+}
+
+static struct call_leg *restore_leg(struct app_config *app, struct call *call,
+				const struct callstate_record *rec,
+				const struct callstate_leg *leg)
+{
+	struct lsip_dialog saved;
+
+	if (leg->type == CALL_TYPE_MNCC)
+		return mncc_leg_restore(mncc_connection_find(app, leg->conn), call, leg);
+
+	load_dialog(&saved, leg, &rec->dialog);
+	return sip_builtin_leg_restore(&app->sip.agent, call, leg->dir, &saved);
+}
+
+/*
+ * A call handed over by the previous instance. Connected calls go on
+ * as if nothing happened, the others are released.
+ */
+void callstate_restore(struct app_config *app, const struct callstate_record *rec)
+{
+	struct call *call;
+
+	if (!can_restore(app, &rec->initial) || !can_restore(app, &rec->remote))
+		return callstate_recover(app, rec);
+
+	call = call_restore(rec->id, rec->source, rec->dest);
+	if (!call)
+		return callstate_recover(app, rec);
+
+	call->initial = restore_leg(app, call, rec, &rec->initial);
+	if (!call->initial) {
+		callstate_released(call);
+		llist_del(&call->entry);
+		talloc_free(call);
+		return callstate_recover(app, rec);
+	}
+
+	call->remote = restore_leg(app, call, rec, &rec->remote);
+	if (!call->remote) {
+		/* the first leg is released the usual way */
+		call->initial->release_call(call->initial);
+		return recover_leg(app, rec, &rec->remote);
+	}
+
+	LOGP(DAPP, LOGL_NOTICE, "Continuing call(%u) from %s to %s\n",
+		rec->id, rec->source, rec->dest);
+}
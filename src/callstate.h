@@ -0,0 +1,94 @@
+#pragma once
+
+#include <osmocom/core/linuxlist.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct app_config;
+struct call;
+struct mncc_connection;
+
+/*
+ * A fixed layout snapshot of a call. It is what the standby mirrors
+ * and what a restarted connector needs to clean up after the old one.
+ * Strings are NUL terminated and cut to the size of the field.
+ */
+#define CALLSTATE_VERSION	1
+
+/* the leg record is in use */
+#define CALLSTATE_F_PRESENT	0x01
+/* the dialog of the SIP leg belongs to the built-in engine */
+#define CALLSTATE_F_BUILTIN	0x02
+/* the dialog of the SIP leg was created by us */
+#define CALLSTATE_F_UAC		0x04
+
+struct callstate_leg {
+	uint8_t		type;		/* CALL_TYPE_* */
+	uint8_t		state;		/* MNCC_CC_* or SIP_CC_* */
+	uint8_t		dir;
+	uint8_t		flags;
+	uint32_t	callref;
+	uint32_t	rtp_ip;
+	uint16_t	rtp_port;
+	uint16_t	reserved;
+	uint32_t	payload_type;
+	uint32_t	payload_msg_type;
+	char		conn[16];	/* name of the MNCC connection */
+	char		imsi[16];
+};
+
+/* sized like struct lsip_dialog */
+struct callstate_dialog {
+	char		call_id[96];
+	char		local_tag[24];
+	char		remote_tag[64];
+	char		local_uri[160];
+	char		remote_uri[160];
+	char		remote_target[160];
+	char		route_set[512];
+	uint32_t	local_cseq;
+	uint32_t	peer_ip;	/* network byte order */
+	uint16_t	peer_port;	/* network byte order */
+	uint16_t	reserved;
+};
+
+struct callstate_record {
+	uint32_t	id;
+	uint32_t	reserved;
+	char		source[32];
+	char		dest[32];
+	struct callstate_leg initial;
+	struct callstate_leg remote;
+
+	/* of the SIP leg, calls without one end here */
+	struct callstate_dialog dialog;
+};
+
+/*
+ * Gets the calls that changed since the last loop iteration. The
+ * records are only valid during the callback.
+ */
+struct callstate_sink {
+	struct llist_head entry;
+	void (*update)(struct callstate_sink *sink, const struct callstate_record *rec);
+	void (*remove)(struct callstate_sink *sink, uint32_t id);
+	/* after the last update of the iteration */
+	void (*flush)(struct callstate_sink *sink);
+};
+
+void callstate_sink_add(struct callstate_sink *sink);
+void callstate_sink_del(struct callstate_sink *sink);
+
+void callstate_changed(struct call *call);
+void callstate_released(struct call *call);
+void callstate_flush(void);
+
+void callstate_fill(struct callstate_record *rec, struct call *call);
+unsigned int callstate_record_len(const struct callstate_record *rec);
+/* every call to the update of a single sink, without the flush */
+void callstate_snapshot(struct callstate_sink *sink);
+
+void callstate_recover(struct app_config *app, const struct callstate_record *rec);
+void callstate_restore(struct app_config *app, const struct callstate_record *rec);
+void callstate_mncc_ready(struct mncc_connection *conn);
@@ -0,0 +1,245 @@
+/*
+ * (C) 2017 by Holger Hans Peter Freyther
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "calltable.h"
+#include "app.h"
+#include "logging.h"
+
+#include <talloc.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+extern void *tall_mncc_ctx;
+
+static unsigned int slot_bucket(uint32_t id)
+{
+	return (id * 2654435761u) & (CALL_TABLE_HASH_SIZE - 1);
+}
+
+static struct call_table_slot *find_slot(struct call_table *table, uint32_t id)
+{
+	struct call_table_slot *slot;
+
+	llist_for_each_entry(slot, &table->hash[slot_bucket(id)], entry)
+		if (slot->id == id)
+			return slot;
+	return NULL;
+}
+
+/* A crash half way leaves an empty slot instead of a torn record */
+static void write_record(struct callstate_record *out, const struct callstate_record *rec)
+{
+	unsigned int len = callstate_record_len(rec);
+
+	__atomic_store_n(&out->id, 0, __ATOMIC_RELAXED);
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	memcpy((char *) out + sizeof(out->id), (const char *) rec + sizeof(rec->id),
+		len - sizeof(rec->id));
+	if (len < sizeof(*out))
+		memset((char *) out + len, 0, sizeof(*out) - len);
+	__atomic_store_n(&out->id, rec->id, __ATOMIC_RELEASE);
+}
+
+static void sink_update(struct callstate_sink *sink, const struct callstate_record *rec)
+{
+	struct call_table *table = container_of(sink, struct call_table, sink);
+	struct call_table_slot *slot;
+
+	slot = find_slot(table, rec->id);
+	if (!slot) {
+		if (llist_empty(&table->free_slots)) {
+			table->full += 1;
+			return;
+		}
+		slot = llist_entry(table->free_slots.next, struct call_table_slot, entry);
+		llist_del(&slot->entry);
+		slot->id = rec->id;
+		llist_add(&slot->entry, &table->hash[slot_bucket(rec->id)]);
+		table->used += 1;
+	}
+
+	write_record(&table->records[slot - table->slots], rec);
+	table->updates += 1;
+}
+
+static void sink_remove(struct callstate_sink *sink, uint32_t id)
+{
+	struct call_table *table = container_of(sink, struct call_table, sink);
+	struct call_table_slot *slot;
+
+	slot = find_slot(table, id);
+	if (!slot)
+		return;
+
+	__atomic_store_n(&table->records[slot - table->slots].id, 0, __ATOMIC_RELEASE);
+	llist_del(&slot->entry);
+	llist_add(&slot->entry, &table->free_slots);
+	table->used -= 1;
+	table->removes += 1;
+}
+
+/* the records are in the page cache already */
+static void sink_flush(struct callstate_sink *sink)
+{
+}
+
+/* The calls a previous instance left behind, NULL if there are none */
+static struct callstate_record *read_previous(int fd, const char *path,
+						unsigned int *num)
+{
+	const struct call_table_header *hdr;
+	const struct callstate_record *records;
+	struct callstate_record *calls = NULL;
+	unsigned int i, slots;
+	struct stat st;
+	void *base;
+
+	*num = 0;
+	if (fstat(fd, &st) != 0 || st.st_size < CALL_TABLE_OFFSET)
+		return NULL;
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	hdr = base;
+	if (memcmp(hdr->magic, CALL_TABLE_MAGIC, sizeof(hdr->magic)) != 0
+	    || hdr->version != CALLSTATE_VERSION
+	    || hdr->record_size != sizeof(struct callstate_record)) {
+		LOGP(DAPP, LOGL_ERROR, "Call table %s has a bad header, ignoring it\n",
+			path);
+		munmap(base, st.st_size);
+		return NULL;
+	}
+
+	slots = (st.st_size - CALL_TABLE_OFFSET) / sizeof(struct callstate_record);
+	if (hdr->num_slots < slots)
+		slots = hdr->num_slots;
+	records = (const void *) ((const char *) base + CALL_TABLE_OFFSET);
+
+	for (i = 0; i < slots; ++i) {
+		if (records[i].id == 0)
+			continue;
+		if (*num % 64 == 0) {
+			struct callstate_record *more;
+
+			more = talloc_realloc(tall_mncc_ctx, calls,
+						struct callstate_record, *num + 64);
+			if (!more)
+				break;
+			calls = more;
+		}
+		calls[(*num)++] = records[i];
+	}
+
+	munmap(base, st.st_size);
+	return calls;
+}
+
+static int map_table(struct call_table *table, int fd)
+{
+	struct call_table_header *hdr;
+	unsigned int i;
+
+	/* a fresh and sparse file */
+	table->len = CALL_TABLE_OFFSET + table->num_slots * sizeof(struct callstate_record);
+	if (ftruncate(fd, 0) != 0 || ftruncate(fd, table->len) != 0) {
+		LOGP(DAPP, LOGL_ERROR, "Failed to size call table %s: %s\n",
+			table->path, strerror(errno));
+		return -1;
+	}
+
+	table->base = mmap(NULL, table->len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (table->base == MAP_FAILED) {
+		LOGP(DAPP, LOGL_ERROR, "Failed to map call table %s: %s\n",
+			table->path, strerror(errno));
+		table->base = NULL;
+		return -1;
+	}
+
+	hdr = table->base;
+	memcpy(hdr->magic, CALL_TABLE_MAGIC, sizeof(hdr->magic));
+	hdr->version = CALLSTATE_VERSION;
+	hdr->record_size = sizeof(struct callstate_record);
+	hdr->num_slots = table->num_slots;
+	table->records = (void *) ((char *) table->base + CALL_TABLE_OFFSET);
+
+	table->slots = talloc_zero_array(tall_mncc_ctx, struct call_table_slot,
+					table->num_slots);
+	if (!table->slots) {
+		munmap(table->base, table->len);
+		table->base = NULL;
+		return -1;
+	}
+
+	for (i = 0; i < CALL_TABLE_HASH_SIZE; ++i)
+		INIT_LLIST_HEAD(&table->hash[i]);
+	INIT_LLIST_HEAD(&table->free_slots);
+	for (i = 0; i < table->num_slots; ++i)
+		llist_add_tail(&table->slots[i].entry, &table->free_slots);
+	return 0;
+}
+
+int call_table_start(struct app_config *app, bool recover)
+{
+	struct call_table *table = &app->call_table;
+	struct callstate_record *calls;
+	unsigned int i, num;
+	int fd, rc;
+
+	if (!table->path)
+		return 0;
+
+	fd = open(table->path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		LOGP(DAPP, LOGL_ERROR, "Failed to open call table %s: %s\n",
+			table->path, strerror(errno));
+		return -1;
+	}
+
+	calls = read_previous(fd, table->path, &num);
+	rc = map_table(table, fd);
+	close(fd);
+	if (rc == 0) {
+		table->sink.update = sink_update;
+		table->sink.remove = sink_remove;
+		table->sink.flush = sink_flush;
+		callstate_sink_add(&table->sink);
+		LOGP(DAPP, LOGL_NOTICE, "Call table %s with %u slots\n",
+			table->path, table->num_slots);
+	}
+
+	/* MNCC releases wait for the hello of their MSC */
+	if (recover && num > 0) {
+		LOGP(DAPP, LOGL_NOTICE, "Releasing %u calls of the previous instance\n", num);
+		for (i = 0; i < num; ++i)
+			callstate_recover(app, &calls[i]);
+		table->recovered += num;
+	}
+
+	talloc_free(calls);
+	return rc;
+}
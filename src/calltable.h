@@ -0,0 +1,62 @@
+#pragma once
+
+#include "callstate.h"
+
+#include <osmocom/core/linuxlist.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct app_config;
+
+#define CALL_TABLE_MAGIC	"OSMOCTBL"
+#define CALL_TABLE_HASH_SIZE	4096	/* power of two */
+/* the records start here, the header is padded to a cache line */
+#define CALL_TABLE_OFFSET	64
+
+/**
+ * On disk format in host byte order. A record is in use when its id
+ * is not zero. The id is written last so a record torn by a crash is
+ * an empty slot.
+ */
+struct call_table_header {
+	char magic[8];
+	uint32_t version;		/* CALLSTATE_VERSION */
+	uint32_t record_size;
+	uint32_t num_slots;
+	uint32_t reserved;
+};
+
+/* Where a call lives in the file */
+struct call_table_slot {
+	struct llist_head entry;	/* hash bucket or free list */
+	uint32_t id;
+};
+
+/*
+ * The calls of this instance in a file mapped with MAP_SHARED. The
+ * page cache keeps it when the process dies, nothing is synced.
+ */
+struct call_table {
+	const char *path;
+	unsigned int num_slots;
+
+	void *base;
+	size_t len;
+	struct callstate_record *records;
+	struct call_table_slot *slots;
+	struct llist_head hash[CALL_TABLE_HASH_SIZE];
+	struct llist_head free_slots;
+	unsigned int used;
+	struct callstate_sink sink;
+
+	/* statistics */
+	uint64_t updates;
+	uint64_t removes;
+	uint64_t full;
+	uint64_t recovered;
+};
+
+/* releases the calls left by a previous instance if recover is set */
+int call_table_start(struct app_config *app, bool recover);
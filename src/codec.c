@@ -0,0 +1,159 @@
+/*
+ * (C) 2017 by Holger Hans Peter Freyther
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "codec.h"
+#include "mncc_protocol.h"
+
+#include <osmocom/gsm/protocol/gsm_04_08.h>
+
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+
+/* the SDP encoding names */
+const struct value_string codec_names[] = {
+	{ CODEC_GSM_FR,		"GSM"		},
+	{ CODEC_GSM_EFR,	"GSM-EFR"	},
+	{ CODEC_GSM_HR,		"GSM-HR-08"	},
+	{ CODEC_AMR,		"AMR"		},
+	{ 0, NULL },
+};
+
+const struct value_string channel_rate_names[] = {
+	{ CHANNEL_RATE_FULL,	"full"		},
+	{ CHANNEL_RATE_DUAL,	"dual"		},
+	{ CHANNEL_RATE_HALF,	"half"		},
+	{ 0, NULL },
+};
+
+static const uint32_t codec_msg_types[_NUM_CODECS] = {
+	[CODEC_GSM_FR]		= GSM_TCHF_FRAME,
+	[CODEC_GSM_EFR]		= GSM_TCHF_FRAME_EFR,
+	[CODEC_GSM_HR]		= GSM_TCHH_FRAME,
+	[CODEC_AMR]		= GSM_TCH_FRAME_AMR,
+};
+
+/* SDP encoding names are case insensitive */
+int codec_from_name(const char *name)
+{
+	int i;
+
+	for (i = 0; i < _NUM_CODECS; ++i)
+		if (strcasecmp(name, codec_names[i].str) == 0)
+			return i;
+	return -1;
+}
+
+uint32_t codec_payload_msg_type(enum codec codec)
+{
+	return codec_msg_types[codec];
+}
+
+static void add_version(struct codec_choice *choice, int *nr, int version)
+{
+	if (*nr < ARRAY_SIZE(choice->speech_ver) - 1)
+		choice->speech_ver[(*nr)++] = version;
+}
+
+/*
+ * The speech versions of the allowed codecs in preference order. The
+ * half rate ones are left out for TCH/F only and moved to the front
+ * when TCH/H is preferred.
+ */
+static void compile_choice(struct codec_policy *policy, uint32_t caps,
+				struct codec_choice *choice)
+{
+	bool full = false, half = false;
+	int i, pass, nr = 0;
+
+	/* the RTP codec is the first allowed one the channel can carry */
+	choice->codec = -1;
+	for (pass = 0; pass < 2 && choice->codec < 0; ++pass) {
+		for (i = 0; i < policy->num_prefs; ++i) {
+			enum codec codec = policy->prefs[i];
+
+			if (!(caps & (1 << codec)))
+				continue;
+			if (codec == CODEC_GSM_HR && policy->rate == CHANNEL_RATE_FULL)
+				continue;
+			if (pass == 0 && policy->rate == CHANNEL_RATE_HALF
+			    && codec != CODEC_GSM_HR && codec != CODEC_AMR)
+				continue;
+			choice->codec = codec;
+			break;
+		}
+	}
+
+	for (pass = 0; pass < 2; ++pass) {
+		bool want_half = policy->rate == CHANNEL_RATE_HALF ? pass == 0 : pass == 1;
+
+		if (want_half && policy->rate == CHANNEL_RATE_FULL)
+			continue;
+
+		for (i = 0; i < policy->num_prefs; ++i) {
+			enum codec codec = policy->prefs[i];
+
+			if (!(caps & (1 << codec)))
+				continue;
+
+			switch (codec) {
+			case CODEC_GSM_FR:
+				if (!want_half)
+					add_version(choice, &nr, GSM48_BCAP_SV_FR), full = true;
+				break;
+			case CODEC_GSM_EFR:
+				if (!want_half)
+					add_version(choice, &nr, GSM48_BCAP_SV_EFR), full = true;
+				break;
+			case CODEC_GSM_HR:
+				if (want_half)
+					add_version(choice, &nr, GSM48_BCAP_SV_HR), half = true;
+				break;
+			case CODEC_AMR:
+				if (want_half)
+					add_version(choice, &nr, GSM48_BCAP_SV_AMR_H), half = true;
+				else
+					add_version(choice, &nr, GSM48_BCAP_SV_AMR_F), full = true;
+				break;
+			default:
+				break;
+			}
+		}
+	}
+	choice->speech_ver[nr] = -1;
+	if (nr == 0)
+		choice->codec = -1;
+
+	if (full && half)
+		choice->radio = policy->rate == CHANNEL_RATE_HALF ?
+			GSM48_BCAP_RRQ_DUAL_HR : GSM48_BCAP_RRQ_DUAL_FR;
+	else if (half)
+		choice->radio = GSM48_BCAP_RRQ_DUAL_HR;
+	else
+		choice->radio = GSM48_BCAP_RRQ_FR_ONLY;
+}
+
+void codec_policy_compile(struct codec_policy *policy)
+{
+	uint32_t caps;
+
+	for (caps = 0; caps < ARRAY_SIZE(policy->choice); ++caps)
+		compile_choice(policy, caps, &policy->choice[caps]);
+}
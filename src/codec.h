@@ -0,0 +1,52 @@
+#pragma once
+
+#include <osmocom/core/utils.h>
+
+#include <stdint.h>
+
+enum codec {
+	CODEC_GSM_FR,
+	CODEC_GSM_EFR,
+	CODEC_GSM_HR,
+	CODEC_AMR,
+	_NUM_CODECS
+};
+
+#define CODEC_CAPS_ALL	((1 << _NUM_CODECS) - 1)
+
+enum channel_rate {
+	CHANNEL_RATE_FULL,	/* TCH/F only */
+	CHANNEL_RATE_DUAL,	/* TCH/F preferred */
+	CHANNEL_RATE_HALF,	/* TCH/H preferred */
+};
+
+/* What to do for one combination of offered codecs */
+struct codec_choice {
+	int8_t codec;		/* -1 if nothing matches */
+	uint8_t radio;
+	int8_t speech_ver[8];	/* terminated by -1 */
+};
+
+/**
+ * The preference list and channel rate policy. Every possible set
+ * of offered codecs is resolved when the config changes so a call
+ * only indexes the table with the bitmap of its offer.
+ */
+struct codec_policy {
+	enum codec prefs[_NUM_CODECS];
+	unsigned int num_prefs;
+	enum channel_rate rate;
+
+	struct codec_choice choice[1 << _NUM_CODECS];
+
+	/* statistics */
+	uint64_t selected[_NUM_CODECS];
+	uint64_t unmatched;
+};
+
+extern const struct value_string codec_names[];
+extern const struct value_string channel_rate_names[];
+
+int codec_from_name(const char *name);
+uint32_t codec_payload_msg_type(enum codec codec);
+void codec_policy_compile(struct codec_policy *policy);
@@ -19,13 +19,26 @@
  */
 
 #include "evpoll.h"
+#include "logging.h"
+#include "setup_queue.h"
+#include "callstate.h"
+#include "mncc_uring.h"
 
 #include <osmocom/core/linuxlist.h>
 #include <osmocom/core/select.h>
 #include <osmocom/core/timer.h>
+#include <osmocom/core/utils.h>
 
 #include <sys/select.h>
 
+#ifdef USE_NATIVE_LOOP
+#include <sys/epoll.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#endif
+
 /* based on osmo_select_main GPLv2+ so combined compatible with AGPLv3+ */
 int evpoll(struct pollfd *fds, nfds_t nfds, int timeout)
 {
@@ -33,6 +46,22 @@ int evpoll(struct pollfd *fds, nfds_t nfds, int timeout)
 	fd_set readset, writeset, exceptset;
 	int maxfd, rc, i;
 
+	/*
+	 * All events of the previous iteration have been dispatched, it
+	 * is time for the parked call setups. Do not block if some are
+	 * left over.
+	 */
+	if (setup_queue_run() > 0)
+		timeout = 0;
+
+	/* the calls changed by this iteration to the standby */
+	callstate_flush();
+
+#ifdef USE_IO_URING
+	/* the MNCC messages of this iteration in one go */
+	mncc_uring_flush_all();
+#endif
+
 	FD_ZERO(&readset);
 	FD_ZERO(&writeset);
 	FD_ZERO(&exceptset);
@@ -107,3 +136,154 @@ int evpoll(struct pollfd *fds, nfds_t nfds, int timeout)
 
 	return rc;
 }
+
+#ifdef USE_NATIVE_LOOP
+/*
+ * Without glib the su_root of sofia is the loop. The osmocom fds are
+ * kept in an epoll set that su_root waits on like on any other fd and
+ * the osmocom timers bound how long it may sleep. Only the fds that
+ * changed since the last iteration are touched.
+ */
+static struct {
+	int epfd;
+	su_wait_t wait;
+	int maxfd;
+	uint32_t events[FD_SETSIZE];
+
+	/*
+	 * An osmocom callback ran and might have closed an fd and got
+	 * the same number again. epoll forgot about the old one, so all
+	 * fds are put in again on the next iteration.
+	 */
+	bool dirty;
+} native = { .epfd = -1, .maxfd = -1 };
+
+static void native_sync_fds(void)
+{
+	fd_set readset, writeset, exceptset;
+	struct epoll_event ev;
+	int maxfd, fd, rc;
+
+	FD_ZERO(&readset);
+	FD_ZERO(&writeset);
+	FD_ZERO(&exceptset);
+	maxfd = osmo_fd_fill_fds(&readset, &writeset, &exceptset);
+
+	for (fd = 0; fd <= OSMO_MAX(maxfd, native.maxfd); ++fd) {
+		uint32_t events = 0;
+		int op;
+
+		if (fd <= maxfd) {
+			if (FD_ISSET(fd, &readset))
+				events |= EPOLLIN;
+			if (FD_ISSET(fd, &writeset))
+				events |= EPOLLOUT;
+			if (FD_ISSET(fd, &exceptset))
+				events |= EPOLLPRI;
+		}
+
+		if (events == native.events[fd] && (!events || !native.dirty))
+			continue;
+
+		if (!events)
+			op = EPOLL_CTL_DEL;
+		else if (!native.events[fd])
+			op = EPOLL_CTL_ADD;
+		else
+			op = EPOLL_CTL_MOD;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = events;
+		ev.data.fd = fd;
+		rc = epoll_ctl(native.epfd, op, fd, &ev);
+		if (rc != 0 && op == EPOLL_CTL_MOD && errno == ENOENT)
+			rc = epoll_ctl(native.epfd, EPOLL_CTL_ADD, fd, &ev);
+		if (rc != 0 && op != EPOLL_CTL_DEL)
+			LOGP(DAPP, LOGL_ERROR, "Failed to watch fd(%d): %s\n",
+				fd, strerror(errno));
+		native.events[fd] = events;
+	}
+
+	native.maxfd = maxfd;
+	native.dirty = false;
+}
+
+static int native_wakeup(su_root_magic_t *magic, su_wait_t *wait,
+				su_wakeup_arg_t *arg)
+{
+	struct epoll_event events[32];
+	fd_set readset, writeset, exceptset;
+	int i, rc;
+
+	rc = epoll_wait(native.epfd, events, ARRAY_SIZE(events), 0);
+	if (rc <= 0)
+		return 0;
+
+	FD_ZERO(&readset);
+	FD_ZERO(&writeset);
+	FD_ZERO(&exceptset);
+	for (i = 0; i < rc; ++i) {
+		int fd = events[i].data.fd;
+
+		if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+			FD_SET(fd, &readset);
+		if (events[i].events & EPOLLOUT)
+			FD_SET(fd, &writeset);
+		if (events[i].events & EPOLLPRI)
+			FD_SET(fd, &exceptset);
+	}
+
+	/* call registered callback functions */
+	osmo_fd_disp_fds(&readset, &writeset, &exceptset);
+	native.dirty = true;
+	return 0;
+}
+
+int evpoll_run(su_root_t *root)
+{
+	su_duration_t timeout;
+	struct timeval *tv;
+
+	native.epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (native.epfd < 0) {
+		LOGP(DAPP, LOGL_ERROR, "Failed to create epoll fd: %s\n",
+			strerror(errno));
+		return -1;
+	}
+
+	if (su_wait_create(&native.wait, native.epfd, SU_WAIT_IN) != 0
+	    || su_root_register(root, &native.wait, native_wakeup, NULL, 0) < 0) {
+		LOGP(DAPP, LOGL_ERROR, "Failed to register with su_root\n");
+		return -1;
+	}
+
+	for (;;) {
+		timeout = SU_WAIT_FOREVER;
+
+		/* the parked call setups, see evpoll() */
+		if (setup_queue_run() > 0)
+			timeout = 0;
+
+		osmo_timers_check();
+		osmo_timers_prepare();
+		tv = osmo_timers_nearest();
+		if (tv && timeout != 0)
+			timeout = tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
+
+		native_sync_fds();
+		callstate_flush();
+#ifdef USE_IO_URING
+		mncc_uring_flush_all();
+#endif
+
+		/* sofia sleeps on its own fds, its timers and ours */
+		su_root_step(root, timeout);
+
+		/* fire timers */
+		if (osmo_timers_update() > 0)
+			native.dirty = true;
+	}
+
+	return 0;
+}
+#endif
@@ -6,3 +6,13 @@
  * integrate with external event loop, e.g. glib
  */
 int evpoll(struct pollfd *fds, nfds_t nfds, int timeout);
+
+#ifdef USE_NATIVE_LOOP
+#include <sofia-sip/su_wait.h>
+
+/*
+ * run sofia's root as the only loop with the osmocom fds and timers
+ * inside of it. Only returns on error.
+ */
+int evpoll_run(su_root_t *root);
+#endif
@@ -0,0 +1,465 @@
+/*
+ * (C) 2017 by Holger Hans Peter Freyther
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Upgrades without losing the sockets. A new instance started with
+ * --handover waits on the handover-path. On SIGUSR2 the running one
+ * connects, passes its SIP and MNCC sockets and its calls and exits.
+ * Datagrams and MNCC messages arriving in between stay queued in the
+ * sockets and are read by the new instance.
+ */
+
+#include "handover.h"
+#include "app.h"
+#include "call.h"
+#include "logging.h"
+#include "lsip.h"
+#include "mncc.h"
+#include "replication.h"
+
+#include <osmocom/core/socket.h>
+
+#include <talloc.h>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* sd_listen_fds(3) */
+#define LISTEN_FDS_START	3
+
+extern void *tall_mncc_ctx;
+
+/* the waiting instance */
+static struct {
+	struct app_config *app;
+	void (*done)(struct app_config *app);
+
+	struct osmo_fd listen_fd;
+	struct osmo_fd link;
+
+	int fds[HANDOVER_MAX_FDS];
+	struct handover_fd fd_info[HANDOVER_MAX_FDS];
+	unsigned int num_fds;
+
+	struct callstate_record *calls;
+	unsigned int num_calls;
+	unsigned int max_calls;
+} ho;
+
+/* the sending instance */
+struct handover_sink {
+	struct callstate_sink sink;
+	int fd;
+	uint32_t calls;
+};
+
+void handover_inherit(struct app_config *app)
+{
+	const char *pid = getenv("LISTEN_PID");
+	const char *fds = getenv("LISTEN_FDS");
+	int i, num, type;
+	socklen_t len;
+
+	if (!pid || !fds || atoi(pid) != getpid())
+		return;
+	num = atoi(fds);
+
+	/* not for our children */
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+
+	for (i = 0; i < num; ++i) {
+		int fd = LISTEN_FDS_START + i;
+
+		len = sizeof(type);
+		if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0
+		    && type == SOCK_DGRAM && app->sip.inherited_fd < 0) {
+			LOGP(DAPP, LOGL_NOTICE, "Using inherited socket(%d) for SIP\n", fd);
+			app->sip.inherited_fd = fd;
+			continue;
+		}
+
+		/* the VTY binds its own socket */
+		LOGP(DAPP, LOGL_ERROR, "Closing inherited socket(%d), only SIP over UDP is taken\n",
+			fd);
+		close(fd);
+	}
+}
+
+/*
+ * Sending side
+ */
+static int send_msg(int fd, uint16_t type, uint16_t num, const void *data,
+			unsigned int len, const int *fds, unsigned int num_fds)
+{
+	char cbuf[CMSG_SPACE(sizeof(int) * HANDOVER_MAX_FDS)];
+	struct handover_hdr hdr = {
+		.version = HANDOVER_VERSION,
+		.type = type,
+		.num = num,
+	};
+	struct iovec iov[2] = {
+		{ &hdr, sizeof(hdr) },
+		{ (void *) data, len },
+	};
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = len ? 2 : 1,
+	};
+	struct cmsghdr *cmsg;
+
+	if (num_fds > 0) {
+		memset(cbuf, 0, sizeof(cbuf));
+		msg.msg_control = cbuf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
+	}
+
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(hdr) + len) {
+		LOGP(DAPP, LOGL_ERROR, "Failed to send the handover: %s\n",
+			strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void sink_update(struct callstate_sink *sink, const struct callstate_record *rec)
+{
+	struct handover_sink *ho_sink = container_of(sink, struct handover_sink, sink);
+
+	if (send_msg(ho_sink->fd, HANDOVER_CALL, 0, rec, callstate_record_len(rec),
+			NULL, 0) == 0)
+		ho_sink->calls += 1;
+}
+
+static void add_fd(struct handover_fd *info, int *fds, unsigned int *num,
+			int kind, const char *name, int fd)
+{
+	if (*num == HANDOVER_MAX_FDS)
+		return;
+
+	memset(&info[*num], 0, sizeof(info[*num]));
+	info[*num].kind = kind;
+	snprintf(info[*num].name, sizeof(info[*num].name), "%s", name);
+	fds[*num] = fd;
+	*num += 1;
+}
+
+/*
+ * exit() closes the fds in ascending order. With the link on top the
+ * new instance sees its end once the VTY and sofia ports are free.
+ */
+static int link_on_top(int sock)
+{
+	struct rlimit lim;
+	int top, fd;
+
+	if (getrlimit(RLIMIT_NOFILE, &lim) != 0 || lim.rlim_cur < 2)
+		return sock;
+	top = lim.rlim_cur > 65536 ? 65535 : lim.rlim_cur - 1;
+
+	fd = fcntl(sock, F_DUPFD_CLOEXEC, top);
+	if (fd < 0)
+		return sock;
+	close(sock);
+	return fd;
+}
+
+void handover_send(struct app_config *app)
+{
+	struct lsip_engine *engine = app->sip.agent.builtin;
+	struct handover_fd info[HANDOVER_MAX_FDS];
+	int fds[HANDOVER_MAX_FDS];
+	struct handover_sink sink = { .calls = 0 };
+	struct mncc_connection *conn;
+	unsigned int num = 0;
+	int sock;
+
+	sock = osmo_sock_unix_init(SOCK_SEQPACKET, 0, app->handover.path,
+					OSMO_SOCK_F_CONNECT);
+	if (sock < 0) {
+		LOGP(DAPP, LOGL_ERROR, "No connector waiting on %s\n",
+			app->handover.path);
+		return;
+	}
+	sock = link_on_top(sock);
+
+	/* nothing may stay queued in this process */
+	if (engine) {
+		lsip_engine_flush(engine);
+		add_fd(info, fds, &num, HANDOVER_FD_SIP, "sip", engine->ofd.fd);
+	} else
+		LOGP(DAPP, LOGL_NOTICE, "The sofia SIP socket is bound again by the new instance\n");
+
+	/* messages already taken by io_uring or a ring would be lost */
+	llist_for_each_entry(conn, &app->mncc.conns, entry) {
+		if (conn->state != MNCC_READY)
+			continue;
+		if (conn->uring || conn->shm_active) {
+			LOGP(DAPP, LOGL_NOTICE, "MNCC %s can not be handed over\n",
+				conn->name);
+			continue;
+		}
+		add_fd(info, fds, &num, HANDOVER_FD_MNCC, conn->name, conn->fd.fd);
+	}
+
+	if (send_msg(sock, HANDOVER_FDS, num, info, num * sizeof(info[0]),
+			fds, num) != 0) {
+		close(sock);
+		return;
+	}
+
+	/* the standby follows the new instance instead of taking over */
+	callstate_flush();
+	if (app->replication.state)
+		replication_handover(app->replication.state);
+
+	/* from here on the sockets belong to the new instance */
+	sink.fd = sock;
+	sink.sink.update = sink_update;
+	callstate_snapshot(&sink.sink);
+	send_msg(sock, HANDOVER_DONE, 0, &sink.calls, sizeof(sink.calls), NULL, 0);
+
+	/* the link is closed last, see link_on_top() */
+	LOGP(DAPP, LOGL_NOTICE, "Handed over %u calls, exiting\n", sink.calls);
+	exit(0);
+}
+
+/*
+ * Waiting side
+ */
+static void take_fds(struct msghdr *msg, const char *data, unsigned int len,
+			unsigned int num)
+{
+	struct cmsghdr *cmsg;
+	unsigned int i, num_fds;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < num_fds; ++i) {
+			int fd;
+
+			memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(fd));
+			if (i >= num || (i + 1) * sizeof(ho.fd_info[0]) > len
+			    || ho.num_fds == HANDOVER_MAX_FDS) {
+				close(fd);
+				continue;
+			}
+			memcpy(&ho.fd_info[ho.num_fds], data + i * sizeof(ho.fd_info[0]),
+				sizeof(ho.fd_info[0]));
+			ho.fd_info[ho.num_fds].name[sizeof(ho.fd_info[0].name) - 1] = '\0';
+			ho.fds[ho.num_fds++] = fd;
+		}
+	}
+}
+
+static void take_call(const char *data, unsigned int len)
+{
+	struct callstate_record *rec;
+
+	if (len < offsetof(struct callstate_record, dialog) || len > sizeof(*rec))
+		return;
+
+	if (ho.num_calls == ho.max_calls) {
+		unsigned int size = ho.max_calls ? ho.max_calls * 2 : 64;
+		struct callstate_record *calls;
+
+		calls = talloc_realloc(tall_mncc_ctx, ho.calls, struct callstate_record, size);
+		if (!calls) {
+			LOGP(DAPP, LOGL_ERROR, "No memory for the handed over calls\n");
+			return;
+		}
+		ho.calls = calls;
+		ho.max_calls = size;
+	}
+
+	rec = &ho.calls[ho.num_calls++];
+	memset(rec, 0, sizeof(*rec));
+	memcpy(rec, data, len);
+}
+
+static void adopt_fds(struct app_config *app)
+{
+	struct mncc_connection *conn;
+	unsigned int i;
+
+	for (i = 0; i < ho.num_fds; ++i) {
+		int fd = ho.fds[i];
+
+		switch (ho.fd_info[i].kind) {
+		case HANDOVER_FD_SIP:
+			if (app->sip.inherited_fd >= 0)
+				close(app->sip.inherited_fd);
+			app->sip.inherited_fd = fd;
+			continue;
+		case HANDOVER_FD_MNCC:
+			conn = mncc_connection_find(app, ho.fd_info[i].name);
+			if (conn && mncc_connection_adopt(conn, fd) == 0)
+				continue;
+			break;
+		}
+
+		LOGP(DAPP, LOGL_ERROR, "Dropping handed over socket of %s\n",
+			ho.fd_info[i].name);
+		close(fd);
+	}
+	ho.num_fds = 0;
+}
+
+/*
+ * The old instance is gone once its link is closed and the ports it
+ * did not hand over are free again, see link_on_top().
+ */
+static void finish(void)
+{
+	struct app_config *app = ho.app;
+	unsigned int i;
+
+	osmo_fd_unregister(&ho.link);
+	close(ho.link.fd);
+	ho.link.fd = -1;
+
+	adopt_fds(app);
+	ho.done(app);
+
+	for (i = 0; i < ho.num_calls; ++i)
+		callstate_restore(app, &ho.calls[i]);
+	LOGP(DAPP, LOGL_NOTICE, "Took over %u calls\n", ho.num_calls);
+
+	talloc_free(ho.calls);
+	ho.calls = NULL;
+	ho.num_calls = ho.max_calls = 0;
+}
+
+static int link_read(struct osmo_fd *fd, unsigned int what)
+{
+	char buf[sizeof(struct handover_hdr) + sizeof(struct callstate_record)];
+	char cbuf[CMSG_SPACE(sizeof(int) * HANDOVER_MAX_FDS)];
+	struct iovec iov = { buf, sizeof(buf) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct handover_hdr hdr;
+	uint32_t calls;
+	int rc;
+
+	rc = recvmsg(fd->fd, &msg, MSG_CMSG_CLOEXEC);
+	if (rc <= 0) {
+		finish();
+		return 0;
+	}
+
+	if (rc < sizeof(hdr))
+		return 0;
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (hdr.version != HANDOVER_VERSION) {
+		LOGP(DAPP, LOGL_ERROR, "Handover version %u, expected %u\n",
+			hdr.version, HANDOVER_VERSION);
+		return 0;
+	}
+
+	switch (hdr.type) {
+	case HANDOVER_FDS:
+		take_fds(&msg, buf + sizeof(hdr), rc - sizeof(hdr), hdr.num);
+		break;
+	case HANDOVER_CALL:
+		take_call(buf + sizeof(hdr), rc - sizeof(hdr));
+		break;
+	case HANDOVER_DONE:
+		if (rc - sizeof(hdr) < sizeof(calls))
+			break;
+		memcpy(&calls, buf + sizeof(hdr), sizeof(calls));
+		if (calls != ho.num_calls)
+			LOGP(DAPP, LOGL_ERROR, "Got %u of %u handed over calls\n",
+				ho.num_calls, calls);
+		break;
+	}
+	return 0;
+}
+
+static int link_accept(struct osmo_fd *fd, unsigned int what)
+{
+	int sock;
+
+	sock = accept(fd->fd, NULL, NULL);
+	if (sock < 0) {
+		LOGP(DAPP, LOGL_ERROR, "Failed to accept the handover: %s\n",
+			strerror(errno));
+		return 0;
+	}
+
+	/* a single handover per instance */
+	osmo_fd_unregister(&ho.listen_fd);
+	close(ho.listen_fd.fd);
+	ho.listen_fd.fd = -1;
+	unlink(ho.app->handover.path);
+
+	LOGP(DAPP, LOGL_NOTICE, "Running connector is handing over\n");
+	ho.link.fd = sock;
+	ho.link.when = BSC_FD_READ;
+	ho.link.cb = link_read;
+	if (osmo_fd_register(&ho.link) != 0) {
+		close(sock);
+		ho.link.fd = -1;
+	}
+	return 0;
+}
+
+int handover_wait(struct app_config *app, void (*done)(struct app_config *app))
+{
+	const char *path = app->handover.path;
+	int rc;
+
+	ho.app = app;
+	ho.done = done;
+	ho.link.fd = -1;
+
+	ho.listen_fd.cb = link_accept;
+	unlink(path);
+	rc = osmo_sock_unix_init_ofd(&ho.listen_fd, SOCK_SEQPACKET, 0, path,
+					OSMO_SOCK_F_BIND);
+	if (rc < 0) {
+		LOGP(DAPP, LOGL_ERROR, "Failed to wait for the handover on %s\n", path);
+		return -1;
+	}
+
+	LOGP(DAPP, LOGL_NOTICE, "Waiting for the handover on %s, send SIGUSR2 "
+		"to the running connector\n", path);
+	return 0;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "callstate.h"
+
+#include <stdint.h>
+
+struct app_config;
+
+#define HANDOVER_VERSION	1
+#define HANDOVER_MAX_FDS	16
+
+enum {
+	HANDOVER_FDS,		/* struct handover_fd each, the fds as SCM_RIGHTS */
+	HANDOVER_CALL,		/* a struct callstate_record */
+	HANDOVER_DONE,		/* the number of calls sent */
+};
+
+enum {
+	HANDOVER_FD_SIP,
+	HANDOVER_FD_MNCC,
+};
+
+struct handover_hdr {
+	uint32_t	version;
+	uint16_t	type;
+	uint16_t	num;
+};
+
+struct handover_fd {
+	uint8_t		kind;
+	uint8_t		reserved[3];
+	char		name[16];	/* of the MNCC connection */
+};
+
+/* sockets of the service manager, see sd_listen_fds(3) */
+void handover_inherit(struct app_config *app);
+
+/* the running instance hands its sockets and calls to the waiting one */
+void handover_send(struct app_config *app);
+int handover_wait(struct app_config *app, void (*done)(struct app_config *app));
@@ -0,0 +1,199 @@
+/*
+ * (C) 2017 by Holger Hans Peter Freyther
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "imsi_map.h"
+#include "logging.h"
+
+#include <talloc.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+extern void *tall_mncc_ctx;
+
+static int imsi_map_file_destructor(struct imsi_map_file *file)
+{
+	munmap(file->base, file->len);
+	return 0;
+}
+
+static bool section_valid(const struct imsi_map_header *hdr, size_t len,
+				uint32_t offset)
+{
+	if (offset < sizeof(*hdr) || offset % sizeof(uint32_t) != 0)
+		return false;
+	if (offset > len)
+		return false;
+	return (len - offset) / sizeof(struct imsi_map_record) >= hdr->count;
+}
+
+static struct imsi_map_file *map_file(const char *path)
+{
+	const struct imsi_map_header *hdr;
+	struct imsi_map_file *file;
+	struct stat st;
+	void *base;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		LOGP(DAPP, LOGL_ERROR, "Failed to open IMSI map %s: %s\n",
+			path, strerror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &st) != 0 || st.st_size < sizeof(*hdr)) {
+		LOGP(DAPP, LOGL_ERROR, "IMSI map %s is too short\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	/* the mapping stays valid after the close */
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		LOGP(DAPP, LOGL_ERROR, "Failed to map IMSI map %s: %s\n",
+			path, strerror(errno));
+		return NULL;
+	}
+
+	hdr = base;
+	if (memcmp(hdr->magic, IMSI_MAP_MAGIC, sizeof(hdr->magic)) != 0
+	    || hdr->version != IMSI_MAP_VERSION
+	    || !section_valid(hdr, st.st_size, hdr->imsi_offset)
+	    || !section_valid(hdr, st.st_size, hdr->msisdn_offset)) {
+		LOGP(DAPP, LOGL_ERROR, "IMSI map %s has a bad header\n", path);
+		munmap(base, st.st_size);
+		return NULL;
+	}
+
+	/* every lookup touches a different part of the file */
+	madvise(base, st.st_size, MADV_RANDOM);
+
+	file = talloc_zero(tall_mncc_ctx, struct imsi_map_file);
+	if (!file) {
+		munmap(base, st.st_size);
+		return NULL;
+	}
+
+	file->base = base;
+	file->len = st.st_size;
+	file->count = hdr->count;
+	file->by_imsi = (const void *) ((const char *) base + hdr->imsi_offset);
+	file->by_msisdn = (const void *) ((const char *) base + hdr->msisdn_offset);
+	talloc_set_destructor(file, imsi_map_file_destructor);
+	return file;
+}
+
+/*
+ * Map the configured file and replace the current one. A new file
+ * should be renamed into place as the old one might still be mapped.
+ * On failure the current file stays in use.
+ */
+int imsi_map_reload(struct imsi_map *map)
+{
+	struct imsi_map_file *file;
+
+	if (!map->path) {
+		talloc_free(map->file);
+		map->file = NULL;
+		return 0;
+	}
+
+	file = map_file(map->path);
+	if (!file) {
+		map->reload_failures += 1;
+		return -1;
+	}
+
+	LOGP(DAPP, LOGL_NOTICE, "IMSI map %s loaded with %u subscribers\n",
+		map->path, file->count);
+	talloc_free(map->file);
+	map->file = file;
+	map->reloads += 1;
+	return 0;
+}
+
+/*
+ * The records are in Eytzinger order. Descend left or right depending
+ * on the comparison and undo the right turns after the last left one
+ * to find the lower bound.
+ */
+static const struct imsi_map_record *search(const struct imsi_map_record *records,
+						uint32_t count, const char *key)
+{
+	uint64_t k = 1;
+
+	while (k <= count) {
+		__builtin_prefetch(&records[4 * k - 1]);
+		k = 2 * k + (memcmp(records[k - 1].key, key, IMSI_MAP_LEN) < 0);
+	}
+	k >>= __builtin_ffsll(~k);
+
+	if (k == 0 || memcmp(records[k - 1].key, key, IMSI_MAP_LEN) != 0)
+		return NULL;
+	return &records[k - 1];
+}
+
+static bool lookup(struct imsi_map *map, bool by_imsi, const char *str,
+			char out[IMSI_MAP_LEN + 1])
+{
+	const struct imsi_map_record *record;
+	char key[IMSI_MAP_LEN];
+
+	if (!map->file)
+		return false;
+
+	map->lookups += 1;
+	if (strlen(str) > IMSI_MAP_LEN) {
+		map->misses += 1;
+		return false;
+	}
+
+	strncpy(key, str, sizeof(key));
+	record = search(by_imsi ? map->file->by_imsi : map->file->by_msisdn,
+			map->file->count, key);
+	if (!record) {
+		map->misses += 1;
+		return false;
+	}
+
+	memcpy(out, record->value, IMSI_MAP_LEN);
+	out[IMSI_MAP_LEN] = '\0';
+	map->hits += 1;
+	return true;
+}
+
+bool imsi_map_to_msisdn(struct imsi_map *map, const char *imsi,
+			char out[IMSI_MAP_LEN + 1])
+{
+	return lookup(map, true, imsi, out);
+}
+
+bool imsi_map_to_imsi(struct imsi_map *map, const char *msisdn,
+			char out[IMSI_MAP_LEN + 1])
+{
+	return lookup(map, false, msisdn, out);
+}
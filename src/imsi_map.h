@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define IMSI_MAP_MAGIC		"OSMOIMAP"
+#define IMSI_MAP_VERSION	1
+#define IMSI_MAP_LEN		16
+
+/**
+ * On disk format as written by contrib/imsi-map.py, in host byte
+ * order. Both sections hold count records in Eytzinger order of
+ * their key. Keys and values are NUL padded.
+ */
+struct imsi_map_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+	uint32_t imsi_offset;
+	uint32_t msisdn_offset;
+};
+
+struct imsi_map_record {
+	char key[IMSI_MAP_LEN];
+	char value[IMSI_MAP_LEN];
+};
+
+/* A mapped file. It is unmapped when freed */
+struct imsi_map_file {
+	void *base;
+	size_t len;
+	uint32_t count;
+	const struct imsi_map_record *by_imsi;
+	const struct imsi_map_record *by_msisdn;
+};
+
+struct imsi_map {
+	const char *path;
+	struct imsi_map_file *file;
+
+	/* statistics */
+	uint64_t lookups;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t reloads;
+	uint64_t reload_failures;
+};
+
+int imsi_map_reload(struct imsi_map *map);
+bool imsi_map_to_msisdn(struct imsi_map *map, const char *imsi,
+			char out[IMSI_MAP_LEN + 1]);
+bool imsi_map_to_imsi(struct imsi_map *map, const char *msisdn,
+			char out[IMSI_MAP_LEN + 1]);
@@ -0,0 +1,1678 @@
+/*
+ * (C) 2017 by Holger Hans Peter Freyther
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * A small SIP stack for a B2BUA talking UDP to a single PBX. It knows
+ * INVITE, ACK, BYE, CANCEL, INFO and OPTIONS and nothing else. There
+ * is no allocation per call, transactions and dialogs come from tables
+ * sized at start and all timers run on one wheel.
+ */
+
+#define _GNU_SOURCE
+
+#include "lsip.h"
+#include "logging.h"
+
+#include <osmocom/core/utils.h>
+
+#include <talloc.h>
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+static const struct value_string method_names[] = {
+	{ LSIP_INVITE,		"INVITE"	},
+	{ LSIP_ACK,		"ACK"		},
+	{ LSIP_BYE,		"BYE"		},
+	{ LSIP_CANCEL,		"CANCEL"	},
+	{ LSIP_INFO,		"INFO"		},
+	{ LSIP_OPTIONS,		"OPTIONS"	},
+	{ 0, NULL },
+};
+
+static void send_cancel(struct lsip_dialog *dialog);
+static int send_bye(struct lsip_dialog *dialog);
+static void flush_out(struct lsip_engine *engine);
+
+/*
+ * Parsing
+ */
+static enum lsip_method parse_method(const char *p, unsigned int len)
+{
+	int i;
+
+	for (i = 0; method_names[i].str; ++i) {
+		if (strlen(method_names[i].str) == len
+		    && memcmp(method_names[i].str, p, len) == 0)
+			return method_names[i].value;
+	}
+	return LSIP_UNKNOWN;
+}
+
+/* The start of the next line. A bare LF is accepted as well */
+static char *next_line(char *p, char *end, char **content_end)
+{
+	char *lf = memchr(p, '\n', end - p);
+
+	if (!lf)
+		return NULL;
+	*content_end = (lf > p && lf[-1] == '\r') ? lf - 1 : lf;
+	return lf + 1;
+}
+
+static bool name_is(const char *name, unsigned int len,
+			const char *full, const char *compact)
+{
+	if (strlen(full) == len && strncasecmp(name, full, len) == 0)
+		return true;
+	return compact && len == 1 && strncasecmp(name, compact, 1) == 0;
+}
+
+static struct lsip_str *header_slot(struct lsip_msg *msg, const char *name,
+					unsigned int len)
+{
+	if (name_is(name, len, "Via", "v")) {
+		if (msg->num_via == LSIP_MAX_VIA)
+			return NULL;
+		return &msg->via[msg->num_via++];
+	}
+	if (name_is(name, len, "From", "f"))
+		return &msg->from;
+	if (name_is(name, len, "To", "t"))
+		return &msg->to;
+	if (name_is(name, len, "Call-ID", "i"))
+		return &msg->call_id;
+	if (name_is(name, len, "CSeq", NULL))
+		return &msg->cseq_value;
+	if (name_is(name, len, "Contact", "m"))
+		return &msg->contact;
+	if (name_is(name, len, "Record-Route", NULL)) {
+		if (msg->num_rr == LSIP_MAX_RR)
+			return NULL;
+		return &msg->record_route[msg->num_rr++];
+	}
+	return NULL;
+}
+
+/* The end of the first value of a header, a ',' outside of quotes and <> */
+static const char *value_end(const struct lsip_str *hdr)
+{
+	const char *p = hdr->p, *end = hdr->p + hdr->len;
+	bool quoted = false, bracket = false;
+
+	for (; p < end; ++p) {
+		if (*p == '"')
+			quoted = !quoted;
+		else if (!quoted && *p == '<')
+			bracket = true;
+		else if (!quoted && *p == '>')
+			bracket = false;
+		else if (!quoted && !bracket && *p == ',')
+			break;
+	}
+	return p;
+}
+
+/* A ;name=value parameter of the first value of the header */
+static bool find_param(const struct lsip_str *hdr, const char *name,
+			struct lsip_str *out)
+{
+	const char *p = hdr->p, *end = value_end(hdr);
+	size_t len = strlen(name);
+	bool quoted = false, bracket = false;
+
+	for (; p < end; ++p) {
+		const char *v;
+
+		if (*p == '"')
+			quoted = !quoted;
+		if (quoted)
+			continue;
+		if (*p == '<')
+			bracket = true;
+		else if (*p == '>')
+			bracket = false;
+		if (bracket || *p != ';')
+			continue;
+
+		v = p + 1;
+		while (v < end && (*v == ' ' || *v == '\t'))
+			++v;
+		if (end - v <= len || strncasecmp(v, name, len) != 0 || v[len] != '=')
+			continue;
+
+		v += len + 1;
+		out->p = v;
+		while (v < end && *v != ';' && *v != ',' && *v != ' ' && *v != '\t')
+			++v;
+		out->len = v - out->p;
+		return true;
+	}
+	return false;
+}
+
+/* The URI of a name-addr or addr-spec */
+static struct lsip_str addr_uri(const struct lsip_str *hdr)
+{
+	const char *p = hdr->p, *end = value_end(hdr);
+	const char *lt = NULL;
+	struct lsip_str uri;
+	bool quoted = false;
+
+	for (; p < end; ++p) {
+		if (*p == '"')
+			quoted = !quoted;
+		else if (!quoted && *p == '<') {
+			lt = p;
+			break;
+		}
+	}
+
+	if (lt) {
+		const char *gt = memchr(lt, '>', end - lt);
+
+		uri.p = lt + 1;
+		uri.len = (gt ? gt : end) - uri.p;
+		return uri;
+	}
+
+	uri.p = hdr->p;
+	p = memchr(hdr->p, ';', end - hdr->p);
+	uri.len = (p ? p : end) - uri.p;
+	return uri;
+}
+
+static struct lsip_str uri_user(struct lsip_str uri)
+{
+	struct lsip_str user = { uri.p, 0 };
+	const char *at, *colon;
+
+	colon = memchr(uri.p, ':', uri.len);
+	if (!colon)
+		return user;
+	at = memchr(colon, '@', uri.p + uri.len - colon);
+	if (!at)
+		return user;
+	user.p = colon + 1;
+	user.len = at - user.p;
+	return user;
+}
+
+/*
+ * Parse a datagram in place. The buffer needs room for one more
+ * byte as the body is NUL terminated.
+ */
+int lsip_parse(char *buf, unsigned int len, struct lsip_msg *msg)
+{
+	char *p = buf, *end = buf + len, *line_end, *next;
+	struct lsip_str *last = NULL;
+	long content_length = -1;
+	char *cseq_end;
+
+	memset(msg, 0, sizeof(*msg));
+
+	next = next_line(p, end, &line_end);
+	if (!next)
+		return -1;
+
+	if (line_end - p >= 12 && memcmp(p, "SIP/2.0 ", 8) == 0) {
+		msg->status = strtol(p + 8, NULL, 10);
+		if (msg->status < 100 || msg->status > 699)
+			return -1;
+	} else {
+		char *sp1, *sp2;
+
+		sp1 = memchr(p, ' ', line_end - p);
+		if (!sp1)
+			return -1;
+		sp2 = memchr(sp1 + 1, ' ', line_end - sp1 - 1);
+		if (!sp2 || line_end - sp2 != 8 || memcmp(sp2 + 1, "SIP/2.0", 7) != 0)
+			return -1;
+
+		msg->request = true;
+		msg->method = parse_method(p, sp1 - p);
+		msg->ruri.p = sp1 + 1;
+		msg->ruri.len = sp2 - sp1 - 1;
+	}
+	p = next;
+
+	for (;;) {
+		char *colon, *name_end, *value;
+
+		next = next_line(p, end, &line_end);
+		if (!next)
+			return -1;
+		if (line_end == p) {
+			p = next;
+			break;
+		}
+
+		/* a folded line continues the previous header */
+		if (*p == ' ' || *p == '\t') {
+			if (last)
+				last->len = line_end - last->p;
+			p = next;
+			continue;
+		}
+
+		colon = memchr(p, ':', line_end - p);
+		if (!colon)
+			return -1;
+		name_end = colon;
+		while (name_end > p && (name_end[-1] == ' ' || name_end[-1] == '\t'))
+			--name_end;
+		value = colon + 1;
+		while (value < line_end && (*value == ' ' || *value == '\t'))
+			++value;
+
+		if (name_is(p, name_end - p, "Content-Length", "l")) {
+			content_length = strtol(value, NULL, 10);
+			last = NULL;
+		} else {
+			last = header_slot(msg, p, name_end - p);
+			if (last) {
+				last->p = value;
+				last->len = line_end - value;
+			}
+		}
+		p = next;
+	}
+
+	if (msg->num_via == 0 || !msg->from.p || !msg->to.p
+	    || !msg->call_id.p || !msg->cseq_value.p)
+		return -1;
+
+	msg->cseq = strtoul(msg->cseq_value.p, &cseq_end, 10);
+	while (cseq_end < msg->cseq_value.p + msg->cseq_value.len && *cseq_end == ' ')
+		++cseq_end;
+	if (!msg->request)
+		msg->method = parse_method(cseq_end,
+				msg->cseq_value.p + msg->cseq_value.len - cseq_end);
+
+	find_param(&msg->via[0], "branch", &msg->branch);
+	find_param(&msg->from, "tag", &msg->from_tag);
+	find_param(&msg->to, "tag", &msg->to_tag);
+	msg->from_user = uri_user(addr_uri(&msg->from));
+	msg->to_user = uri_user(addr_uri(&msg->to));
+	if (msg->contact.p)
+		msg->contact = addr_uri(&msg->contact);
+
+	msg->body = p;
+	msg->body_len = end - p;
+	if (content_length >= 0) {
+		if (content_length > msg->body_len)
+			return -1;
+		msg->body_len = content_length;
+	}
+	buf[msg->body - buf + msg->body_len] = '\0';
+	return 0;
+}
+
+static bool str_equal(const struct lsip_str *str, const char *cstr)
+{
+	return strlen(cstr) == str->len && memcmp(str->p, cstr, str->len) == 0;
+}
+
+static void str_copy(char *dst, size_t size, const struct lsip_str *str)
+{
+	snprintf(dst, size, "%.*s", (int) str->len, str->p);
+}
+
+/*
+ * Timer wheel. One tick is LSIP_TICK_MS and a timer hangs in the slot
+ * of its expiry. Timers longer than the wheel stay in their slot until
+ * the right round.
+ */
+static uint64_t current_tick(struct lsip_engine *engine)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((now.tv_sec - engine->start.tv_sec) * 1000
+		+ (now.tv_nsec - engine->start.tv_nsec) / 1000000) / LSIP_TICK_MS;
+}
+
+static void timer_stop(struct lsip_engine *engine, struct lsip_timer *timer)
+{
+	if (!timer->pending)
+		return;
+	llist_del(&timer->entry);
+	timer->pending = false;
+	engine->timers -= 1;
+}
+
+static void timer_start(struct lsip_engine *engine, struct lsip_timer *timer,
+			unsigned int ms)
+{
+	uint64_t ticks = (ms + LSIP_TICK_MS - 1) / LSIP_TICK_MS;
+
+	timer_stop(engine, timer);
+
+	/* nothing to catch up on after an idle time */
+	if (engine->timers == 0)
+		engine->now = current_tick(engine);
+
+	timer->expires = current_tick(engine) + OSMO_MAX(ticks, 1);
+	llist_add_tail(&timer->entry, &engine->wheel[timer->expires % LSIP_WHEEL_SLOTS]);
+	timer->pending = true;
+	engine->timers += 1;
+
+	if (!osmo_timer_pending(&engine->tick))
+		osmo_timer_schedule(&engine->tick, 0, LSIP_TICK_MS * 1000);
+}
+
+static void wheel_tick(void *data)
+{
+	struct lsip_engine *engine = data;
+	uint64_t target = current_tick(engine);
+
+	while (engine->now < target) {
+		struct lsip_timer *timer, *tmp;
+		LLIST_HEAD(expired);
+
+		engine->now += 1;
+		llist_for_each_entry_safe(timer, tmp,
+				&engine->wheel[engine->now % LSIP_WHEEL_SLOTS], entry) {
+			if (timer->expires <= engine->now)
+				llist_move_tail(&timer->entry, &expired);
+		}
+
+		/* a callback might stop any of the other timers */
+		while (!llist_empty(&expired)) {
+			timer = llist_entry(expired.next, struct lsip_timer, entry);
+			timer_stop(engine, timer);
+			timer->cb(timer);
+		}
+	}
+
+	flush_out(engine);
+	if (engine->timers > 0)
+		osmo_timer_schedule(&engine->tick, 0, LSIP_TICK_MS * 1000);
+}
+
+/*
+ * Sending. Everything produced in one iteration of the main loop is
+ * handed to the kernel with a single sendmmsg.
+ */
+static void flush_out(struct lsip_engine *engine)
+{
+	struct mmsghdr msgs[LSIP_BATCH];
+	struct iovec iov[LSIP_BATCH];
+	unsigned int i, sent = 0;
+	int rc;
+
+	if (engine->num_out == 0)
+		return;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < engine->num_out; ++i) {
+		iov[i].iov_base = engine->out_buf[i];
+		iov[i].iov_len = engine->out_len[i];
+		msgs[i].msg_hdr.msg_name = &engine->out_addr[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(engine->out_addr[i]);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (sent < engine->num_out) {
+		rc = sendmmsg(engine->ofd.fd, &msgs[sent], engine->num_out - sent, 0);
+		if (rc <= 0) {
+			LOGP(DSIP, LOGL_ERROR, "Failed to send %u SIP messages: %s\n",
+				engine->num_out - sent, strerror(errno));
+			/* skip the one that failed */
+			sent += 1;
+			continue;
+		}
+		sent += rc;
+		engine->tx += rc;
+	}
+
+	engine->tx_batches += 1;
+	engine->num_out = 0;
+	engine->ofd.when &= ~BSC_FD_WRITE;
+}
+
+static void queue_msg(struct lsip_engine *engine, const struct sockaddr_in *to,
+			const char *data, unsigned int len)
+{
+	if (engine->num_out == LSIP_BATCH)
+		flush_out(engine);
+
+	engine->out_addr[engine->num_out] = *to;
+	memcpy(engine->out_buf[engine->num_out], data, len);
+	engine->out_len[engine->num_out] = len;
+	engine->num_out += 1;
+	engine->ofd.when |= BSC_FD_WRITE;
+}
+
+struct msg_buf {
+	char *data;
+	unsigned int len;
+	unsigned int size;
+	bool overflow;
+};
+
+static void bprintf(struct msg_buf *buf, const char *fmt, ...)
+{
+	va_list ap;
+	int rc;
+
+	if (buf->overflow)
+		return;
+
+	va_start(ap, fmt);
+	rc = vsnprintf(buf->data + buf->len, buf->size - buf->len, fmt, ap);
+	va_end(ap);
+
+	if (rc < 0 || rc >= buf->size - buf->len) {
+		buf->overflow = true;
+		return;
+	}
+	buf->len += rc;
+}
+
+static void random_hex(char *out, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t i;
+
+	for (i = 0; i < len; ++i)
+		out[i] = hex[random() & 15];
+	out[len] = '\0';
+}
+
+static uint32_t hash_str(const char *p, size_t len)
+{
+	uint32_t hash = 2166136261u;
+
+	while (len--) {
+		hash ^= (uint8_t) *p++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/*
+ * Dialogs
+ */
+static struct lsip_dialog *dialog_alloc(struct lsip_engine *engine,
+					const char *call_id, bool uac)
+{
+	struct lsip_dialog *dialog;
+
+	if (llist_empty(&engine->free_dialogs)) {
+		engine->dialogs_exhausted += 1;
+		return NULL;
+	}
+
+	dialog = llist_entry(engine->free_dialogs.next, struct lsip_dialog, entry);
+	llist_del(&dialog->entry);
+	memset(dialog, 0, sizeof(*dialog));
+	dialog->engine = engine;
+	dialog->uac = uac;
+	dialog->local_cseq = 1;
+	snprintf(dialog->call_id, sizeof(dialog->call_id), "%s", call_id);
+	random_hex(dialog->local_tag, 8);
+	llist_add(&dialog->entry, &engine->dialog_hash[
+			hash_str(dialog->call_id, strlen(dialog->call_id))
+				& engine->dialog_hash_mask]);
+	engine->dialogs_used += 1;
+	return dialog;
+}
+
+static void dialog_maybe_free(struct lsip_dialog *dialog)
+{
+	if (dialog->priv || dialog->num_txns > 0)
+		return;
+
+	llist_del(&dialog->entry);
+	llist_add(&dialog->entry, &dialog->engine->free_dialogs);
+	dialog->engine = NULL;
+}
+
+static struct lsip_dialog *dialog_find(struct lsip_engine *engine,
+					const struct lsip_str *call_id,
+					const struct lsip_str *local_tag)
+{
+	struct llist_head *bucket;
+	struct lsip_dialog *dialog;
+
+	bucket = &engine->dialog_hash[hash_str(call_id->p, call_id->len)
+					& engine->dialog_hash_mask];
+	llist_for_each_entry(dialog, bucket, entry) {
+		if (str_equal(call_id, dialog->call_id)
+		    && str_equal(local_tag, dialog->local_tag))
+			return dialog;
+	}
+	return NULL;
+}
+
+/* Record-Route in order for the UAS and reversed for the UAC */
+static void set_route_set(struct lsip_dialog *dialog, const struct lsip_msg *msg,
+				bool reverse)
+{
+	struct msg_buf buf = { dialog->route_set, 0, sizeof(dialog->route_set), false };
+	unsigned int i;
+
+	dialog->route_set[0] = '\0';
+	for (i = 0; i < msg->num_rr; ++i) {
+		const struct lsip_str *rr;
+
+		rr = &msg->record_route[reverse ? msg->num_rr - i - 1 : i];
+		bprintf(&buf, "%s%.*s", i ? ", " : "", (int) rr->len, rr->p);
+	}
+
+	if (buf.overflow) {
+		LOGP(DSIP, LOGL_ERROR, "Route set of call-id(%s) too large\n",
+			dialog->call_id);
+		dialog->route_set[0] = '\0';
+	}
+}
+
+/*
+ * Transactions
+ */
+static void txn_retrans_expired(struct lsip_timer *timer);
+static void txn_timeout_expired(struct lsip_timer *timer);
+
+static struct lsip_txn *txn_alloc(struct lsip_engine *engine,
+				struct lsip_dialog *dialog, enum lsip_txn_type type,
+				enum lsip_method method, const char *branch)
+{
+	struct lsip_txn *txn;
+
+	if (llist_empty(&engine->free_txns)) {
+		engine->txns_exhausted += 1;
+		return NULL;
+	}
+
+	/* the buffers are not cleared, they are always written before use */
+	txn = llist_entry(engine->free_txns.next, struct lsip_txn, entry);
+	llist_del(&txn->entry);
+	txn->engine = engine;
+	txn->dialog = dialog;
+	txn->type = type;
+	txn->state = LSIP_TXN_TRYING;
+	txn->method = method;
+	txn->cseq = 0;
+	txn->interval = LSIP_T1;
+	txn->hdrs_len = 0;
+	txn->to_tag = false;
+	txn->cancelled = false;
+	txn->len = 0;
+	snprintf(txn->branch, sizeof(txn->branch), "%s", branch);
+	llist_add(&txn->entry, &engine->txn_hash[
+			hash_str(txn->branch, strlen(txn->branch))
+				& engine->txn_hash_mask]);
+
+	if (dialog)
+		dialog->num_txns += 1;
+	engine->txns_used += 1;
+	return txn;
+}
+
+static void txn_free(struct lsip_txn *txn)
+{
+	struct lsip_engine *engine = txn->engine;
+	struct lsip_dialog *dialog = txn->dialog;
+
+	timer_stop(engine, &txn->retrans);
+	timer_stop(engine, &txn->timeout);
+	llist_del(&txn->entry);
+	llist_add(&txn->entry, &engine->free_txns);
+	txn->engine = NULL;
+	txn->dialog = NULL;
+
+	if (!dialog)
+		return;
+	if (dialog->invite_txn == txn)
+		dialog->invite_txn = NULL;
+	dialog->num_txns -= 1;
+	dialog_maybe_free(dialog);
+}
+
+static struct lsip_txn *txn_find(struct lsip_engine *engine,
+				const struct lsip_str *branch,
+				enum lsip_method method, bool server)
+{
+	struct llist_head *bucket;
+	struct lsip_txn *txn;
+
+	if (branch->len == 0)
+		return NULL;
+
+	bucket = &engine->txn_hash[hash_str(branch->p, branch->len)
+					& engine->txn_hash_mask];
+	llist_for_each_entry(txn, bucket, entry) {
+		bool is_server = txn->type == LSIP_TXN_SERVER_INVITE
+					|| txn->type == LSIP_TXN_SERVER;
+
+		if (txn->method == method && is_server == server
+		    && str_equal(branch, txn->branch))
+			return txn;
+	}
+	return NULL;
+}
+
+static void send_txn(struct lsip_txn *txn)
+{
+	if (txn->len > 0)
+		queue_msg(txn->engine, &txn->peer, txn->buf, txn->len);
+}
+
+static void make_branch(char *branch)
+{
+	/* the magic cookie of RFC 3261 and 64 random bits */
+	memcpy(branch, "z9hG4bK", 7);
+	random_hex(branch + 7, 16);
+}
+
+static void append_via(struct msg_buf *buf, struct lsip_engine *engine,
+			const char *branch)
+{
+	bprintf(buf, "Via: SIP/2.0/UDP %s:%u;rport;branch=%s\r\n",
+		engine->local_host, ntohs(engine->local.sin_port), branch);
+}
+
+static void append_body(struct msg_buf *buf, const char *content_type,
+			const char *body)
+{
+	if (!body) {
+		bprintf(buf, "Content-Length: 0\r\n\r\n");
+		return;
+	}
+
+	bprintf(buf, "Content-Type: %s\r\nContent-Length: %zu\r\n\r\n%s",
+		content_type, strlen(body), body);
+}
+
+/* Send a new client transaction and start Timer A/B or E/F */
+static int txn_send_request(struct lsip_txn *txn, struct msg_buf *buf)
+{
+	struct lsip_engine *engine = txn->engine;
+
+	if (buf->overflow) {
+		LOGP(DSIP, LOGL_ERROR, "%s does not fit into a datagram\n",
+			get_value_string(method_names, txn->method));
+		txn_free(txn);
+		return -1;
+	}
+
+	txn->len = buf->len;
+	send_txn(txn);
+	timer_start(engine, &txn->retrans, txn->interval);
+	timer_start(engine, &txn->timeout, 64 * LSIP_T1);
+	return 0;
+}
+
+/*
+ * A request within the dialog. All of them go to the address the
+ * dialog was set up with, the PBX is the only peer of the engine.
+ */
+static struct lsip_txn *dialog_request(struct lsip_dialog *dialog,
+					enum lsip_method method,
+					const char *content_type, const char *body)
+{
+	struct lsip_engine *engine = dialog->engine;
+	struct lsip_txn *txn;
+	struct msg_buf buf;
+	char branch[24];
+
+	make_branch(branch);
+	txn = txn_alloc(engine, dialog, LSIP_TXN_CLIENT, method, branch);
+	if (!txn)
+		return NULL;
+
+	txn->cseq = ++dialog->local_cseq;
+	txn->peer = dialog->peer;
+
+	buf = (struct msg_buf) { txn->buf, 0, sizeof(txn->buf), false };
+	bprintf(&buf, "%s %s SIP/2.0\r\n",
+		get_value_string(method_names, method), dialog->remote_target);
+	append_via(&buf, engine, txn->branch);
+	bprintf(&buf, "Max-Forwards: 70\r\n");
+	if (dialog->route_set[0])
+		bprintf(&buf, "Route: %s\r\n", dialog->route_set);
+	bprintf(&buf, "From: <%s>;tag=%s\r\n"
+			"To: <%s>;tag=%s\r\n"
+			"Call-ID: %s\r\n"
+			"CSeq: %u %s\r\n",
+		dialog->local_uri, dialog->local_tag,
+		dialog->remote_uri, dialog->remote_tag,
+		dialog->call_id,
+		txn->cseq, get_value_string(method_names, method));
+	append_body(&buf, content_type, body);
+
+	if (txn_send_request(txn, &buf) != 0)
+		return NULL;
+	return txn;
+}
+
+static int send_bye(struct lsip_dialog *dialog)
+{
+	if (dialog->state != LSIP_DLG_CONFIRMED)
+		return -1;
+
+	dialog->state = LSIP_DLG_TERMINATED;
+	return dialog_request(dialog, LSIP_BYE, NULL, NULL) ? 0 : -1;
+}
+
+/* The CANCEL is a copy of the INVITE with the same branch */
+static void send_cancel(struct lsip_dialog *dialog)
+{
+	struct lsip_engine *engine = dialog->engine;
+	struct lsip_txn *invite = dialog->invite_txn, *txn;
+	struct msg_buf buf;
+
+	dialog->cancel_pending = false;
+	dialog->state = LSIP_DLG_TERMINATED;
+
+	/* wait 64*T1 for the 487 before giving up on the INVITE, RFC 3261 9.1 */
+	invite->cancelled = true;
+	timer_start(engine, &invite->timeout, 64 * LSIP_T1);
+
+	txn = txn_alloc(engine, dialog, LSIP_TXN_CLIENT, LSIP_CANCEL, invite->branch);
+	if (!txn)
+		return;
+
+	txn->cseq = invite->cseq;
+	txn->peer = dialog->peer;
+
+	buf = (struct msg_buf) { txn->buf, 0, sizeof(txn->buf), false };
+	bprintf(&buf, "CANCEL %s SIP/2.0\r\n", dialog->remote_uri);
+	append_via(&buf, engine, txn->branch);
+	bprintf(&buf, "Max-Forwards: 70\r\n"
+			"From: <%s>;tag=%s\r\n"
+			"To: <%s>\r\n"
+			"Call-ID: %s\r\n"
+			"CSeq: %u CANCEL\r\n"
+			"Content-Length: 0\r\n\r\n",
+		dialog->local_uri, dialog->local_tag,
+		dialog->remote_uri,
+		dialog->call_id,
+		txn->cseq);
+	txn_send_request(txn, &buf);
+}
+
+/*
+ * The ACK to a final response to our INVITE. It replaces the INVITE
+ * in the transaction so that a retransmitted response is answered
+ * with the same ACK again.
+ */
+static void send_ack(struct lsip_txn *txn, const struct lsip_msg *msg)
+{
+	struct lsip_dialog *dialog = txn->dialog;
+	struct lsip_engine *engine = txn->engine;
+	bool success = msg->status < 300;
+	struct msg_buf buf;
+	char branch[24];
+
+	/* the ACK of a 2xx is a transaction of its own */
+	if (success)
+		make_branch(branch);
+
+	buf = (struct msg_buf) { txn->buf, 0, sizeof(txn->buf), false };
+	bprintf(&buf, "ACK %s SIP/2.0\r\n",
+		success ? dialog->remote_target : dialog->remote_uri);
+	append_via(&buf, engine, success ? branch : txn->branch);
+	bprintf(&buf, "Max-Forwards: 70\r\n");
+	if (success && dialog->route_set[0])
+		bprintf(&buf, "Route: %s\r\n", dialog->route_set);
+	bprintf(&buf, "From: <%s>;tag=%s\r\n"
+			"To: %.*s\r\n"
+			"Call-ID: %s\r\n"
+			"CSeq: %u ACK\r\n"
+			"Content-Length: 0\r\n\r\n",
+		dialog->local_uri, dialog->local_tag,
+		(int) msg->to.len, msg->to.p,
+		dialog->call_id,
+		txn->cseq);
+
+	if (buf.overflow) {
+		LOGP(DSIP, LOGL_ERROR, "ACK of call-id(%s) does not fit\n",
+			dialog->call_id);
+		txn->len = 0;
+		return;
+	}
+	txn->len = buf.len;
+	send_txn(txn);
+}
+
+/* Keep what is needed to answer the request, RFC 3261 8.2.6.2 */
+static int txn_copy_request(struct lsip_txn *txn, const struct lsip_msg *msg,
+				const struct sockaddr_in *from)
+{
+	struct msg_buf buf = { txn->hdrs, 0, sizeof(txn->hdrs), false };
+	unsigned int i;
+
+	txn->peer = *from;
+	txn->cseq = msg->cseq;
+
+	for (i = 0; i < msg->num_via; ++i)
+		bprintf(&buf, "Via: %.*s\r\n", (int) msg->via[i].len, msg->via[i].p);
+	if (msg->method == LSIP_INVITE) {
+		for (i = 0; i < msg->num_rr; ++i)
+			bprintf(&buf, "Record-Route: %.*s\r\n",
+				(int) msg->record_route[i].len, msg->record_route[i].p);
+	}
+	bprintf(&buf, "From: %.*s\r\nCall-ID: %.*s\r\nCSeq: %.*s\r\n",
+		(int) msg->from.len, msg->from.p,
+		(int) msg->call_id.len, msg->call_id.p,
+		(int) msg->cseq_value.len, msg->cseq_value.p);
+
+	if (buf.overflow || msg->to.len >= sizeof(txn->to))
+		return -1;
+
+	txn->hdrs_len = buf.len;
+	str_copy(txn->to, sizeof(txn->to), &msg->to);
+	txn->to_tag = msg->to_tag.len > 0;
+	return 0;
+}
+
+static int build_response(struct lsip_txn *txn, int status, const char *phrase,
+				const char *tag, const char *content_type,
+				const char *body)
+{
+	struct lsip_engine *engine = txn->engine;
+	struct msg_buf buf = { txn->buf, 0, sizeof(txn->buf), false };
+
+	bprintf(&buf, "SIP/2.0 %d %s\r\n%.*s", status, phrase,
+		(int) txn->hdrs_len, txn->hdrs);
+	if (txn->to_tag || status == 100)
+		bprintf(&buf, "To: %s\r\n", txn->to);
+	else
+		bprintf(&buf, "To: %s;tag=%s\r\n", txn->to, tag);
+	if (txn->method == LSIP_INVITE && status > 100 && status < 300)
+		bprintf(&buf, "Contact: <sip:%s:%u>\r\n",
+			engine->local_host, ntohs(engine->local.sin_port));
+	if (txn->method == LSIP_OPTIONS || status == 501)
+		bprintf(&buf, "Allow: INVITE, ACK, BYE, CANCEL, INFO, OPTIONS\r\n");
+	append_body(&buf, content_type, body);
+
+	if (buf.overflow) {
+		LOGP(DSIP, LOGL_ERROR, "%d response does not fit into a datagram\n",
+			status);
+		txn->len = 0;
+		return -1;
+	}
+	txn->len = buf.len;
+	return 0;
+}
+
+/*
+ * Answer a request other than INVITE right away. The answer is kept
+ * for Timer J to absorb retransmissions. Without a free transaction
+ * the answer is sent statelessly.
+ */
+static void answer_request(struct lsip_engine *engine, struct lsip_dialog *dialog,
+				const struct lsip_msg *msg, const struct sockaddr_in *from,
+				int status, const char *phrase)
+{
+	struct lsip_txn stateless, *txn = NULL;
+	char branch[48], tag[9];
+
+	if (msg->branch.len > 0 && msg->branch.len < sizeof(branch)) {
+		str_copy(branch, sizeof(branch), &msg->branch);
+		txn = txn_alloc(engine, dialog, LSIP_TXN_SERVER, msg->method, branch);
+	}
+	if (!txn) {
+		txn = &stateless;
+		memset(txn, 0, offsetof(struct lsip_txn, hdrs));
+		txn->engine = engine;
+		txn->method = msg->method;
+	}
+
+	if (dialog)
+		snprintf(tag, sizeof(tag), "%s", dialog->local_tag);
+	else
+		random_hex(tag, 8);
+
+	if (txn_copy_request(txn, msg, from) != 0
+	    || build_response(txn, status, phrase, tag, NULL, NULL) != 0) {
+		LOGP(DSIP, LOGL_ERROR, "Failed to answer %s with %d\n",
+			get_value_string(method_names, msg->method), status);
+		if (txn != &stateless)
+			txn_free(txn);
+		return;
+	}
+
+	send_txn(txn);
+	if (txn == &stateless)
+		return;
+
+	txn->state = LSIP_TXN_COMPLETED;
+	timer_start(engine, &txn->timeout, 64 * LSIP_T1);
+}
+
+static void txn_retrans_expired(struct lsip_timer *timer)
+{
+	struct lsip_txn *txn = container_of(timer, struct lsip_txn, retrans);
+	struct lsip_engine *engine = txn->engine;
+
+	engine->retransmits += 1;
+	send_txn(txn);
+
+	/* only an INVITE keeps on doubling, RFC 3261 17.1.1.2 */
+	txn->interval *= 2;
+	if (txn->type != LSIP_TXN_CLIENT_INVITE)
+		txn->interval = OSMO_MIN(txn->interval, LSIP_T2);
+	timer_start(engine, &txn->retrans, txn->interval);
+}
+
+static void txn_timeout_expired(struct lsip_timer *timer)
+{
+	struct lsip_txn *txn = container_of(timer, struct lsip_txn, timeout);
+	struct lsip_engine *engine = txn->engine;
+	struct lsip_dialog *dialog = txn->dialog;
+	bool report;
+
+	switch (txn->type) {
+	case LSIP_TXN_CLIENT_INVITE:
+		if (txn->state != LSIP_TXN_TRYING && txn->state != LSIP_TXN_PROCEEDING)
+			break;
+
+		engine->timeouts += 1;
+		report = dialog->priv != NULL;
+		if (txn->state == LSIP_TXN_PROCEEDING && !txn->cancelled) {
+			/* Timer C, the 487 is ACKed and Timer D frees the INVITE */
+			send_cancel(dialog);
+		} else {
+			/* Timer B, or no final response to our CANCEL either */
+			dialog->state = LSIP_DLG_TERMINATED;
+			txn_free(txn);
+		}
+		if (report)
+			engine->cb->response(dialog, 408, NULL);
+		return;
+	case LSIP_TXN_SERVER_INVITE:
+		if (txn->state == LSIP_TXN_ACCEPTED) {
+			/* the ACK never came, end the dialog again */
+			engine->timeouts += 1;
+			LOGP(DSIP, LOGL_ERROR, "No ACK for call-id(%s)\n", dialog->call_id);
+			send_bye(dialog);
+			report = dialog->priv != NULL;
+			txn_free(txn);
+			if (report)
+				engine->cb->ended(dialog, LSIP_BYE);
+			return;
+		}
+		/* Timer H instead of Timer I */
+		if (txn->retrans.pending)
+			engine->timeouts += 1;
+		break;
+	case LSIP_TXN_CLIENT:
+		/* Timer F instead of Timer K */
+		if (txn->state != LSIP_TXN_COMPLETED)
+			engine->timeouts += 1;
+		break;
+	case LSIP_TXN_SERVER:
+		break;
+	}
+
+	txn_free(txn);
+}
+
+/*
+ * Receiving
+ */
+static void handle_response(struct lsip_engine *engine, const struct lsip_msg *msg)
+{
+	struct lsip_dialog *dialog;
+	struct lsip_txn *txn;
+
+	txn = txn_find(engine, &msg->branch, msg->method, false);
+	if (!txn) {
+		LOGP(DSIP, LOGL_DEBUG, "No transaction for %d response\n", msg->status);
+		return;
+	}
+
+	if (txn->type == LSIP_TXN_CLIENT) {
+		if (txn->state == LSIP_TXN_COMPLETED)
+			return;
+		if (msg->status < 200) {
+			txn->state = LSIP_TXN_PROCEEDING;
+			txn->interval = LSIP_T2;
+			return;
+		}
+		txn->state = LSIP_TXN_COMPLETED;
+		timer_stop(engine, &txn->retrans);
+		timer_start(engine, &txn->timeout, LSIP_T4);
+		return;
+	}
+
+	/* the final response again, our ACK got lost */
+	if (txn->state == LSIP_TXN_COMPLETED || txn->state == LSIP_TXN_ACCEPTED) {
+		if (msg->status >= 200)
+			send_txn(txn);
+		return;
+	}
+
+	dialog = txn->dialog;
+	timer_stop(engine, &txn->retrans);
+	if (msg->to_tag.len > 0)
+		str_copy(dialog->remote_tag, sizeof(dialog->remote_tag), &msg->to_tag);
+
+	if (msg->status < 200) {
+		txn->state = LSIP_TXN_PROCEEDING;
+		if (!txn->cancelled)
+			timer_start(engine, &txn->timeout, LSIP_TIMER_C);
+		dialog->got_provisional = true;
+		if (dialog->cancel_pending)
+			send_cancel(dialog);
+		if (msg->status > 100 && dialog->priv)
+			engine->cb->response(dialog, msg->status, msg);
+		return;
+	}
+
+	if (msg->status < 300) {
+		set_route_set(dialog, msg, true);
+		if (msg->contact.len > 0)
+			str_copy(dialog->remote_target, sizeof(dialog->remote_target),
+				&msg->contact);
+		dialog->state = LSIP_DLG_CONFIRMED;
+		txn->state = LSIP_TXN_ACCEPTED;
+		send_ack(txn, msg);
+		/* Timer M, answer the retransmissions of the 2xx */
+		timer_start(engine, &txn->timeout, 64 * LSIP_T1);
+
+		/* released while waiting for the answer, hang up again */
+		if (!dialog->priv) {
+			send_bye(dialog);
+			return;
+		}
+	} else {
+		dialog->state = LSIP_DLG_TERMINATED;
+		txn->state = LSIP_TXN_COMPLETED;
+		send_ack(txn, msg);
+		/* Timer D */
+		timer_start(engine, &txn->timeout, 32000);
+		if (!dialog->priv)
+			return;
+	}
+
+	engine->cb->response(dialog, msg->status, msg);
+}
+
+static void handle_invite(struct lsip_engine *engine, const struct lsip_msg *msg,
+				const struct sockaddr_in *from)
+{
+	struct lsip_dialog *dialog;
+	struct lsip_txn *txn;
+	struct lsip_str uri;
+	char call_id[96], branch[48];
+
+	if (msg->branch.len == 0 || msg->branch.len >= sizeof(branch)
+	    || msg->call_id.len >= sizeof(call_id)) {
+		answer_request(engine, NULL, msg, from, 400, "Bad Request");
+		return;
+	}
+
+	str_copy(call_id, sizeof(call_id), &msg->call_id);
+	str_copy(branch, sizeof(branch), &msg->branch);
+
+	dialog = dialog_alloc(engine, call_id, false);
+	if (!dialog) {
+		answer_request(engine, NULL, msg, from, 503, "Service Unavailable");
+		return;
+	}
+
+	txn = txn_alloc(engine, dialog, LSIP_TXN_SERVER_INVITE, LSIP_INVITE, branch);
+	if (!txn) {
+		dialog_maybe_free(dialog);
+		answer_request(engine, NULL, msg, from, 503, "Service Unavailable");
+		return;
+	}
+
+	dialog->invite_txn = txn;
+	dialog->peer = *from;
+	str_copy(dialog->remote_tag, sizeof(dialog->remote_tag), &msg->from_tag);
+	uri = addr_uri(&msg->from);
+	str_copy(dialog->remote_uri, sizeof(dialog->remote_uri), &uri);
+	uri = addr_uri(&msg->to);
+	str_copy(dialog->local_uri, sizeof(dialog->local_uri), &uri);
+	if (msg->contact.len > 0)
+		str_copy(dialog->remote_target, sizeof(dialog->remote_target),
+			&msg->contact);
+	else
+		snprintf(dialog->remote_target, sizeof(dialog->remote_target),
+			"%s", dialog->remote_uri);
+	set_route_set(dialog, msg, false);
+
+	/* answer retransmissions with the last response from now on */
+	if (txn_copy_request(txn, msg, from) != 0
+	    || build_response(txn, 100, "Trying", dialog->local_tag, NULL, NULL) != 0) {
+		LOGP(DSIP, LOGL_ERROR, "INVITE of call-id(%s) too large\n", call_id);
+		txn_free(txn);
+		return;
+	}
+	send_txn(txn);
+	txn->state = LSIP_TXN_PROCEEDING;
+
+	engine->cb->invite(dialog, msg);
+
+	/* not taken by the owner */
+	if (!dialog->priv)
+		lsip_dialog_release(dialog);
+}
+
+static void handle_ack(struct lsip_engine *engine, const struct lsip_msg *msg)
+{
+	struct lsip_dialog *dialog;
+	struct lsip_txn *txn;
+
+	/* the ACK of a negative answer, Timer I */
+	txn = txn_find(engine, &msg->branch, LSIP_INVITE, true);
+	if (txn && txn->state == LSIP_TXN_COMPLETED) {
+		timer_stop(engine, &txn->retrans);
+		timer_start(engine, &txn->timeout, LSIP_T4);
+		return;
+	}
+
+	/* the ACK of a 2xx, it has a branch of its own */
+	dialog = dialog_find(engine, &msg->call_id, &msg->to_tag);
+	if (!dialog || !dialog->invite_txn)
+		return;
+	txn = dialog->invite_txn;
+	if (txn->type == LSIP_TXN_SERVER_INVITE && txn->state == LSIP_TXN_ACCEPTED)
+		txn_free(txn);
+}
+
+static void handle_cancel(struct lsip_engine *engine, const struct lsip_msg *msg,
+				const struct sockaddr_in *from)
+{
+	struct lsip_dialog *dialog;
+	struct lsip_txn *invite;
+
+	invite = txn_find(engine, &msg->branch, LSIP_INVITE, true);
+	if (!invite) {
+		answer_request(engine, NULL, msg, from, 481, "Call/Transaction Does Not Exist");
+		return;
+	}
+
+	dialog = invite->dialog;
+	answer_request(engine, dialog, msg, from, 200, "OK");
+	if (invite->state != LSIP_TXN_PROCEEDING)
+		return;
+
+	lsip_respond(dialog, 487, "Request Terminated", NULL, NULL);
+	if (dialog->priv)
+		engine->cb->ended(dialog, LSIP_CANCEL);
+}
+
+static void handle_request(struct lsip_engine *engine, const struct lsip_msg *msg,
+				const struct sockaddr_in *from)
+{
+	struct lsip_dialog *dialog;
+	struct lsip_txn *txn;
+
+	if (msg->method == LSIP_ACK) {
+		handle_ack(engine, msg);
+		return;
+	}
+
+	/* a retransmission, send the last answer again */
+	txn = txn_find(engine, &msg->branch, msg->method, true);
+	if (txn) {
+		engine->retransmits += 1;
+		send_txn(txn);
+		return;
+	}
+
+	switch (msg->method) {
+	case LSIP_INVITE:
+		/* there is no re-INVITE, the media never moves */
+		if (msg->to_tag.len > 0)
+			answer_request(engine, NULL, msg, from, 488, "Not Acceptable Here");
+		else
+			handle_invite(engine, msg, from);
+		break;
+	case LSIP_CANCEL:
+		handle_cancel(engine, msg, from);
+		break;
+	case LSIP_BYE:
+	case LSIP_INFO:
+		dialog = dialog_find(engine, &msg->call_id, &msg->to_tag);
+		if (!dialog || dialog->state == LSIP_DLG_TERMINATED) {
+			answer_request(engine, NULL, msg, from, 481,
+					"Call/Transaction Does Not Exist");
+			break;
+		}
+
+		answer_request(engine, dialog, msg, from, 200, "OK");
+		if (msg->method == LSIP_BYE) {
+			dialog->state = LSIP_DLG_TERMINATED;
+			if (dialog->priv)
+				engine->cb->ended(dialog, LSIP_BYE);
+		}
+		break;
+	case LSIP_OPTIONS:
+		answer_request(engine, NULL, msg, from, 200, "OK");
+		break;
+	default:
+		answer_request(engine, NULL, msg, from, 501, "Not Implemented");
+		break;
+	}
+}
+
+static void handle_datagram(struct lsip_engine *engine, char *data,
+				unsigned int len, const struct sockaddr_in *from)
+{
+	struct lsip_msg msg;
+
+	engine->rx += 1;
+	if (lsip_parse(data, len, &msg) != 0) {
+		LOGP(DSIP, LOGL_DEBUG, "Dropping malformed SIP message from %s:%u\n",
+			inet_ntoa(from->sin_addr), ntohs(from->sin_port));
+		engine->rx_bad += 1;
+		return;
+	}
+
+	if (msg.request)
+		handle_request(engine, &msg, from);
+	else
+		handle_response(engine, &msg);
+}
+
+static int engine_fd_cb(struct osmo_fd *fd, unsigned int what)
+{
+	struct lsip_engine *engine = fd->data;
+	struct sockaddr_in addrs[LSIP_BATCH];
+	struct mmsghdr msgs[LSIP_BATCH];
+	struct iovec iov[LSIP_BATCH];
+	int i, rc;
+
+	if (what & BSC_FD_READ) {
+		memset(msgs, 0, sizeof(msgs));
+		for (i = 0; i < LSIP_BATCH; ++i) {
+			iov[i].iov_base = engine->rx_buf[i];
+			iov[i].iov_len = LSIP_MAX_RX;
+			msgs[i].msg_hdr.msg_name = &addrs[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		rc = recvmmsg(fd->fd, msgs, LSIP_BATCH, MSG_DONTWAIT, NULL);
+		if (rc < 0 && errno != EAGAIN && errno != EINTR)
+			LOGP(DSIP, LOGL_ERROR, "Failed to receive SIP: %s\n",
+				strerror(errno));
+
+		for (i = 0; i < rc; ++i) {
+			if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+				engine->rx_bad += 1;
+				continue;
+			}
+			handle_datagram(engine, engine->rx_buf[i], msgs[i].msg_len,
+					&addrs[i]);
+		}
+	}
+
+	/* everything the batch produced goes out in one go */
+	flush_out(engine);
+	return 0;
+}
+
+/*
+ * API
+ */
+static unsigned int hash_size(unsigned int count)
+{
+	unsigned int size = 16;
+
+	while (size < count)
+		size <<= 1;
+	return size;
+}
+
+int lsip_engine_init(struct lsip_engine *engine, void *ctx,
+			unsigned int max_dialogs,
+			const struct lsip_callbacks *cb, void *priv)
+{
+	unsigned int i, size;
+
+	memset(engine, 0, sizeof(*engine));
+	engine->cb = cb;
+	engine->priv = priv;
+	engine->ofd.fd = -1;
+
+	/* an INVITE, a CANCEL or BYE and an INFO or two per dialog */
+	engine->num_dialogs = max_dialogs;
+	engine->num_txns = max_dialogs * 4;
+	engine->dialogs = talloc_zero_array(ctx, struct lsip_dialog, engine->num_dialogs);
+	engine->txns = talloc_zero_array(ctx, struct lsip_txn, engine->num_txns);
+
+	size = hash_size(engine->num_dialogs);
+	engine->dialog_hash = talloc_array(ctx, struct llist_head, size);
+	engine->dialog_hash_mask = size - 1;
+	for (i = 0; engine->dialog_hash && i < size; ++i)
+		INIT_LLIST_HEAD(&engine->dialog_hash[i]);
+
+	size = hash_size(engine->num_txns);
+	engine->txn_hash = talloc_array(ctx, struct llist_head, size);
+	engine->txn_hash_mask = size - 1;
+	for (i = 0; engine->txn_hash && i < size; ++i)
+		INIT_LLIST_HEAD(&engine->txn_hash[i]);
+
+	engine->rx_buf = talloc_size(ctx, LSIP_BATCH * sizeof(*engine->rx_buf));
+
+	if (!engine->dialogs || !engine->txns || !engine->dialog_hash
+	    || !engine->txn_hash || !engine->rx_buf) {
+		LOGP(DSIP, LOGL_ERROR, "Failed to allocate SIP tables for %u dialogs\n",
+			max_dialogs);
+		return -1;
+	}
+
+	INIT_LLIST_HEAD(&engine->free_dialogs);
+	for (i = 0; i < engine->num_dialogs; ++i)
+		llist_add_tail(&engine->dialogs[i].entry, &engine->free_dialogs);
+
+	INIT_LLIST_HEAD(&engine->free_txns);
+	for (i = 0; i < engine->num_txns; ++i) {
+		struct lsip_txn *txn = &engine->txns[i];
+
+		txn->retrans.cb = txn_retrans_expired;
+		txn->timeout.cb = txn_timeout_expired;
+		llist_add_tail(&txn->entry, &engine->free_txns);
+	}
+
+	for (i = 0; i < LSIP_WHEEL_SLOTS; ++i)
+		INIT_LLIST_HEAD(&engine->wheel[i]);
+	clock_gettime(CLOCK_MONOTONIC, &engine->start);
+	engine->tick.cb = wheel_tick;
+	engine->tick.data = engine;
+
+	/* Call-IDs and tags must not repeat after a restart */
+	srandom(engine->start.tv_nsec ^ getpid());
+	return 0;
+}
+
+static int engine_register(struct lsip_engine *engine, int fd)
+{
+	engine->ofd.fd = fd;
+	engine->ofd.when = BSC_FD_READ;
+	engine->ofd.cb = engine_fd_cb;
+	engine->ofd.data = engine;
+	if (osmo_fd_register(&engine->ofd) != 0) {
+		close(fd);
+		engine->ofd.fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+int lsip_engine_bind(struct lsip_engine *engine, const char *addr, int port)
+{
+	int fd;
+
+	memset(&engine->local, 0, sizeof(engine->local));
+	engine->local.sin_family = AF_INET;
+	engine->local.sin_port = htons(port);
+	if (inet_pton(AF_INET, addr, &engine->local.sin_addr) != 1) {
+		LOGP(DSIP, LOGL_ERROR, "SIP address %s is not an IPv4 address\n", addr);
+		return -1;
+	}
+
+	fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		LOGP(DSIP, LOGL_ERROR, "Failed to create SIP socket: %s\n",
+			strerror(errno));
+		return -1;
+	}
+
+	if (bind(fd, (struct sockaddr *) &engine->local, sizeof(engine->local)) != 0) {
+		LOGP(DSIP, LOGL_ERROR, "Failed to bind SIP to %s:%d: %s\n",
+			addr, port, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	snprintf(engine->local_host, sizeof(engine->local_host), "%s", addr);
+	return engine_register(engine, fd);
+}
+
+/*
+ * A bound socket of a previous instance or of the service manager.
+ * Whatever queued up in it is read on the next iteration.
+ */
+int lsip_engine_adopt(struct lsip_engine *engine, int fd)
+{
+	socklen_t len = sizeof(engine->local);
+
+	if (getsockname(fd, (struct sockaddr *) &engine->local, &len) != 0
+	    || engine->local.sin_family != AF_INET) {
+		LOGP(DSIP, LOGL_ERROR, "Inherited SIP socket(%d) is not IPv4 UDP\n", fd);
+		close(fd);
+		return -1;
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	inet_ntop(AF_INET, &engine->local.sin_addr, engine->local_host,
+			sizeof(engine->local_host));
+	return engine_register(engine, fd);
+}
+
+/* Sends what is queued right away instead of on the next iteration */
+void lsip_engine_flush(struct lsip_engine *engine)
+{
+	flush_out(engine);
+}
+
+struct lsip_dialog *lsip_invite(struct lsip_engine *engine,
+				const struct sockaddr_in *peer, const char *ruri,
+				const char *from_user, const char *sdp)
+{
+	struct lsip_dialog *dialog;
+	struct lsip_txn *txn;
+	struct msg_buf buf;
+	char call_id[64], branch[24];
+
+	random_hex(call_id, 24);
+	snprintf(call_id + 24, sizeof(call_id) - 24, "@%s", engine->local_host);
+	dialog = dialog_alloc(engine, call_id, true);
+	if (!dialog)
+		return NULL;
+
+	make_branch(branch);
+	txn = txn_alloc(engine, dialog, LSIP_TXN_CLIENT_INVITE, LSIP_INVITE, branch);
+	if (!txn) {
+		dialog_maybe_free(dialog);
+		return NULL;
+	}
+
+	dialog->invite_txn = txn;
+	dialog->peer = *peer;
+	snprintf(dialog->local_uri, sizeof(dialog->local_uri), "sip:%s@%s:%u",
+		from_user, engine->local_host, ntohs(engine->local.sin_port));
+	snprintf(dialog->remote_uri, sizeof(dialog->remote_uri), "%s", ruri);
+	snprintf(dialog->remote_target, sizeof(dialog->remote_target), "%s", ruri);
+	txn->cseq = dialog->local_cseq;
+	txn->peer = *peer;
+
+	buf = (struct msg_buf) { txn->buf, 0, sizeof(txn->buf), false };
+	bprintf(&buf, "INVITE %s SIP/2.0\r\n", ruri);
+	append_via(&buf, engine, txn->branch);
+	bprintf(&buf, "Max-Forwards: 70\r\n"
+			"From: <%s>;tag=%s\r\n"
+			"To: <%s>\r\n"
+			"Call-ID: %s\r\n"
+			"CSeq: %u INVITE\r\n"
+			"Contact: <%s>\r\n"
+			"Allow: INVITE, ACK, BYE, CANCEL, INFO, OPTIONS\r\n",
+		dialog->local_uri, dialog->local_tag,
+		dialog->remote_uri,
+		dialog->call_id,
+		txn->cseq,
+		dialog->local_uri);
+	append_body(&buf, "application/sdp", sdp);
+
+	if (txn_send_request(txn, &buf) != 0)
+		return NULL;
+	return dialog;
+}
+
+int lsip_respond(struct lsip_dialog *dialog, int status, const char *phrase,
+			const char *content_type, const char *body)
+{
+	struct lsip_txn *txn = dialog->invite_txn;
+	struct lsip_engine *engine = dialog->engine;
+	int rc = 0;
+
+	if (!txn || txn->type != LSIP_TXN_SERVER_INVITE
+	    || txn->state != LSIP_TXN_PROCEEDING)
+		return -1;
+
+	/* the INVITE must be answered no matter what */
+	if (build_response(txn, status, phrase, dialog->local_tag,
+				content_type, body) != 0) {
+		status = 500;
+		build_response(txn, status, "Server Internal Error",
+				dialog->local_tag, NULL, NULL);
+		rc = -1;
+	}
+	send_txn(txn);
+
+	if (status < 200)
+		return rc;
+
+	/* Timer G and H, or the 2xx retransmissions until the ACK */
+	txn->interval = LSIP_T1;
+	timer_start(engine, &txn->retrans, txn->interval);
+	timer_start(engine, &txn->timeout, 64 * LSIP_T1);
+	if (status < 300) {
+		txn->state = LSIP_TXN_ACCEPTED;
+		dialog->state = LSIP_DLG_CONFIRMED;
+	} else {
+		txn->state = LSIP_TXN_COMPLETED;
+		dialog->state = LSIP_DLG_TERMINATED;
+	}
+	return rc;
+}
+
+int lsip_cancel(struct lsip_dialog *dialog)
+{
+	struct lsip_txn *txn = dialog->invite_txn;
+
+	if (!dialog->uac || !txn || dialog->state == LSIP_DLG_TERMINATED)
+		return -1;
+	if (txn->state != LSIP_TXN_TRYING && txn->state != LSIP_TXN_PROCEEDING)
+		return -1;
+
+	/* a CANCEL must not overtake the INVITE, RFC 3261 9.1 */
+	if (!dialog->got_provisional) {
+		dialog->cancel_pending = true;
+		return 0;
+	}
+
+	send_cancel(dialog);
+	return 0;
+}
+
+/*
+ * Recreate a confirmed dialog of another instance from its identity,
+ * e.g. to end it with a BYE after a restart. The caller owns it until
+ * lsip_dialog_release().
+ */
+struct lsip_dialog *lsip_dialog_restore(struct lsip_engine *engine,
+					const struct lsip_dialog *saved)
+{
+	struct lsip_dialog *dialog;
+
+	dialog = dialog_alloc(engine, saved->call_id, saved->uac);
+	if (!dialog)
+		return NULL;
+
+	memcpy(dialog->local_tag, saved->local_tag, sizeof(dialog->local_tag));
+	memcpy(dialog->remote_tag, saved->remote_tag, sizeof(dialog->remote_tag));
+	memcpy(dialog->local_uri, saved->local_uri, sizeof(dialog->local_uri));
+	memcpy(dialog->remote_uri, saved->remote_uri, sizeof(dialog->remote_uri));
+	memcpy(dialog->remote_target, saved->remote_target, sizeof(dialog->remote_target));
+	memcpy(dialog->route_set, saved->route_set, sizeof(dialog->route_set));
+	dialog->local_cseq = saved->local_cseq;
+	dialog->peer = saved->peer;
+	dialog->state = LSIP_DLG_CONFIRMED;
+	dialog->priv = saved->priv;
+	return dialog;
+}
+
+int lsip_bye(struct lsip_dialog *dialog)
+{
+	return send_bye(dialog);
+}
+
+int lsip_info(struct lsip_dialog *dialog, const char *content_type,
+		const char *body)
+{
+	if (dialog->state != LSIP_DLG_CONFIRMED)
+		return -1;
+	return dialog_request(dialog, LSIP_INFO, content_type, body) ? 0 : -1;
+}
+
+/*
+ * The owner is done with the dialog. Whatever is still pending is
+ * ended on the wire and the dialog goes back to the table once the
+ * last transaction is gone.
+ */
+void lsip_dialog_release(struct lsip_dialog *dialog)
+{
+	struct lsip_txn *txn = dialog->invite_txn;
+
+	dialog->priv = NULL;
+	if (txn && txn->state <= LSIP_TXN_PROCEEDING) {
+		if (txn->type == LSIP_TXN_SERVER_INVITE)
+			lsip_respond(dialog, 480, "Temporarily Unavailable", NULL, NULL);
+		else
+			lsip_cancel(dialog);
+	}
+	else if (dialog->state == LSIP_DLG_CONFIRMED)
+		send_bye(dialog);
+
+	dialog_maybe_free(dialog);
+}
+
+unsigned int lsip_dialogs_in_use(struct lsip_engine *engine)
+{
+	struct lsip_dialog *dialog;
+	unsigned int unused = 0;
+
+	llist_for_each_entry(dialog, &engine->free_dialogs, entry)
+		unused += 1;
+	return engine->num_dialogs - unused;
+}
+
+unsigned int lsip_txns_in_use(struct lsip_engine *engine)
+{
+	struct lsip_txn *txn;
+	unsigned int unused = 0;
+
+	llist_for_each_entry(txn, &engine->free_txns, entry)
+		unused += 1;
+	return engine->num_txns - unused;
+}
@@ -0,0 +1,244 @@
+#pragma once
+
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/select.h>
+#include <osmocom/core/timer.h>
+
+#include <netinet/in.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/* requests larger than this need TCP, RFC 3261 18.1.1 */
+#define LSIP_MAX_MSG		1400
+#define LSIP_MAX_RX		4096
+#define LSIP_MAX_VIA		8
+#define LSIP_MAX_RR		8
+#define LSIP_BATCH		32
+
+#define LSIP_TICK_MS		50
+#define LSIP_WHEEL_SLOTS	1024
+
+#define LSIP_T1			500
+#define LSIP_T2			4000
+#define LSIP_T4			5000
+#define LSIP_TIMER_C		180000
+
+enum lsip_method {
+	LSIP_UNKNOWN,
+	LSIP_INVITE,
+	LSIP_ACK,
+	LSIP_BYE,
+	LSIP_CANCEL,
+	LSIP_INFO,
+	LSIP_OPTIONS,
+};
+
+/* Points into the receive buffer */
+struct lsip_str {
+	const char *p;
+	unsigned int len;
+};
+
+/**
+ * A received message parsed in place. Only the headers needed by a
+ * B2BUA with a single peer are looked at, the rest is skipped.
+ */
+struct lsip_msg {
+	bool request;
+	enum lsip_method method;	/* of the request or of the CSeq */
+	struct lsip_str ruri;
+	int status;
+
+	struct lsip_str via[LSIP_MAX_VIA];
+	unsigned int num_via;
+	struct lsip_str branch;
+	struct lsip_str from, from_tag, from_user;
+	struct lsip_str to, to_tag, to_user;
+	struct lsip_str call_id;
+	struct lsip_str cseq_value;
+	uint32_t cseq;
+	struct lsip_str contact;	/* the URI only */
+	struct lsip_str record_route[LSIP_MAX_RR];
+	unsigned int num_rr;
+
+	/* NUL terminated in the receive buffer */
+	const char *body;
+	unsigned int body_len;
+};
+
+struct lsip_timer {
+	struct llist_head entry;
+	uint64_t expires;		/* in ticks */
+	bool pending;
+	void (*cb)(struct lsip_timer *timer);
+};
+
+enum lsip_txn_type {
+	LSIP_TXN_CLIENT_INVITE,
+	LSIP_TXN_CLIENT,
+	LSIP_TXN_SERVER_INVITE,
+	LSIP_TXN_SERVER,
+};
+
+enum lsip_txn_state {
+	LSIP_TXN_TRYING,
+	LSIP_TXN_PROCEEDING,
+	LSIP_TXN_COMPLETED,	/* final non-2xx, absorbing retransmissions */
+	LSIP_TXN_ACCEPTED,	/* 2xx to an INVITE, waiting for the ACK or absorbing retransmissions */
+};
+
+struct lsip_dialog;
+
+/**
+ * A transaction of RFC 3261 section 17 for UDP. The message that
+ * might need to be sent again lives in the transaction: the request
+ * of a client transaction, the last response of a server one.
+ */
+struct lsip_txn {
+	struct llist_head entry;	/* hash bucket or free list */
+	struct lsip_engine *engine;
+	struct lsip_dialog *dialog;
+
+	enum lsip_txn_type type;
+	enum lsip_txn_state state;
+	enum lsip_method method;
+	char branch[48];
+	uint32_t cseq;
+	struct sockaddr_in peer;
+
+	struct lsip_timer retrans;	/* A, E, G and the 2xx one */
+	struct lsip_timer timeout;	/* B, C, D, F, H, J, L, M */
+	unsigned int interval;
+
+	/* server side copy of Via, From, Call-ID and CSeq of the request */
+	char hdrs[1024];
+	unsigned int hdrs_len;
+	char to[192];
+	bool to_tag;
+
+	/* client INVITE: a CANCEL was sent, no Timer C any more */
+	bool cancelled;
+
+	char buf[LSIP_MAX_MSG];
+	unsigned int len;
+};
+
+enum lsip_dialog_state {
+	LSIP_DLG_EARLY,
+	LSIP_DLG_CONFIRMED,
+	LSIP_DLG_TERMINATED,
+};
+
+/**
+ * The dialog created by an INVITE. It stays around until the owner
+ * released it and the last transaction using it is gone.
+ */
+struct lsip_dialog {
+	struct llist_head entry;	/* hash bucket or free list */
+	struct lsip_engine *engine;
+	void *priv;			/* NULL once released */
+
+	enum lsip_dialog_state state;
+	bool uac;
+	bool got_provisional;
+	bool cancel_pending;
+	unsigned int num_txns;
+
+	char call_id[96];
+	char local_tag[24];
+	char remote_tag[64];
+	char local_uri[160];
+	char remote_uri[160];
+	char remote_target[160];
+	char route_set[512];
+	uint32_t local_cseq;
+	struct sockaddr_in peer;
+
+	struct lsip_txn *invite_txn;
+};
+
+struct lsip_callbacks {
+	/* a new INVITE. The dialog is released if priv is not set */
+	void (*invite)(struct lsip_dialog *dialog, const struct lsip_msg *msg);
+	/* a response to our INVITE, msg is NULL for a timeout */
+	void (*response)(struct lsip_dialog *dialog, int status,
+				const struct lsip_msg *msg);
+	/* the remote ended the dialog with a BYE or CANCEL */
+	void (*ended)(struct lsip_dialog *dialog, enum lsip_method method);
+};
+
+struct lsip_engine {
+	struct osmo_fd ofd;
+	struct sockaddr_in local;
+	char local_host[32];
+	const struct lsip_callbacks *cb;
+	void *priv;
+
+	/* preallocated tables */
+	struct lsip_txn *txns;
+	unsigned int num_txns;
+	struct llist_head free_txns;
+	struct llist_head *txn_hash;
+	unsigned int txn_hash_mask;
+
+	struct lsip_dialog *dialogs;
+	unsigned int num_dialogs;
+	struct llist_head free_dialogs;
+	struct llist_head *dialog_hash;
+	unsigned int dialog_hash_mask;
+
+	/* timer wheel */
+	struct llist_head wheel[LSIP_WHEEL_SLOTS];
+	uint64_t now;
+	unsigned int timers;
+	struct timespec start;
+	struct osmo_timer_list tick;
+
+	/* one recvmmsg worth of messages */
+	char (*rx_buf)[LSIP_MAX_RX + 1];
+
+	/* messages waiting for sendmmsg */
+	struct sockaddr_in out_addr[LSIP_BATCH];
+	char out_buf[LSIP_BATCH][LSIP_MAX_MSG];
+	unsigned int out_len[LSIP_BATCH];
+	unsigned int num_out;
+
+	/* statistics */
+	uint64_t rx;
+	uint64_t rx_bad;
+	uint64_t tx;
+	uint64_t tx_batches;
+	uint64_t retransmits;
+	uint64_t timeouts;
+	uint64_t txns_used;
+	uint64_t txns_exhausted;
+	uint64_t dialogs_used;
+	uint64_t dialogs_exhausted;
+};
+
+int lsip_parse(char *buf, unsigned int len, struct lsip_msg *msg);
+
+int lsip_engine_init(struct lsip_engine *engine, void *ctx,
+			unsigned int max_dialogs,
+			const struct lsip_callbacks *cb, void *priv);
+int lsip_engine_bind(struct lsip_engine *engine, const char *addr, int port);
+int lsip_engine_adopt(struct lsip_engine *engine, int fd);
+void lsip_engine_flush(struct lsip_engine *engine);
+
+struct lsip_dialog *lsip_invite(struct lsip_engine *engine,
+				const struct sockaddr_in *peer, const char *ruri,
+				const char *from_user, const char *sdp);
+int lsip_respond(struct lsip_dialog *dialog, int status, const char *phrase,
+			const char *content_type, const char *body);
+int lsip_cancel(struct lsip_dialog *dialog);
+int lsip_bye(struct lsip_dialog *dialog);
+int lsip_info(struct lsip_dialog *dialog, const char *content_type,
+		const char *body);
+void lsip_dialog_release(struct lsip_dialog *dialog);
+struct lsip_dialog *lsip_dialog_restore(struct lsip_engine *engine,
+					const struct lsip_dialog *saved);
+
+unsigned int lsip_dialogs_in_use(struct lsip_engine *engine);
+unsigned int lsip_txns_in_use(struct lsip_engine *engine);
@@ -21,11 +21,15 @@
 #define _GNU_SOURCE
 
 #include "evpoll.h"
+#include "handover.h"
 #include "vty.h"
 #include "logging.h"
 #include "mncc.h"
+#include "mncc_proxy.h"
+#include "replication.h"
 #include "app.h"
 #include "call.h"
+#include "setup_queue.h"
 
 #include <osmocom/core/application.h>
 #include <osmocom/core/utils.h>
@@ -38,8 +42,13 @@
 
 #include <talloc.h>
 
+#ifndef USE_NATIVE_LOOP
 #include <sofia-sip/su_glib.h>
+#endif
 
+#include <sys/signalfd.h>
+
+#include <signal.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <getopt.h>
@@ -76,11 +85,60 @@ static const struct log_info mncc_sip_info = {
 	.num_cat = ARRAY_SIZE(mncc_sip_categories),
 };
 
+static struct osmo_fd signal_fd;
+
+static int signal_read(struct osmo_fd *fd, unsigned int what)
+{
+	struct signalfd_siginfo info;
+
+	if (read(fd->fd, &info, sizeof(info)) != sizeof(info))
+		return 0;
+
+	if (info.ssi_signo == SIGUSR2) {
+		LOGP(DAPP, LOGL_NOTICE, "Handing over on signal %u\n", info.ssi_signo);
+		handover_send(&g_app);
+		return 0;
+	}
+
+	LOGP(DAPP, LOGL_NOTICE, "Reloading tables on signal %u\n", info.ssi_signo);
+	imsi_map_reload(&g_app.imsi_map);
+	routing_reload(&g_app.routing);
+	return 0;
+}
+
+/*
+ * SIGHUP reloads the tables and SIGUSR2 hands over to a new instance.
+ * They are blocked and read from a signalfd so that they run from the
+ * main loop. This needs to happen before any thread is started.
+ */
+static void signals_init(void)
+{
+	sigset_t mask;
+
+	signal(SIGHUP, SIG_DFL);
+	signal(SIGUSR2, SIG_DFL);
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGUSR2);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+
+	signal_fd.fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signal_fd.fd < 0) {
+		LOGP(DAPP, LOGL_ERROR, "Failed to create signalfd\n");
+		return;
+	}
+	signal_fd.when = BSC_FD_READ;
+	signal_fd.cb = signal_read;
+	osmo_fd_register(&signal_fd);
+}
+
 static void print_help(void)
 {
 	printf("Osmo MNCC to SIP bridge\n");
 	printf("  -h --hekp\tthis text\n");
 	printf("  -c --config-file NAME\tThe config file to use [%s]\n", config_file);
+	printf("  -p --proxy\tShare the MNCC socket with connectors on the proxy-path\n");
+	printf("  -H --handover\tTake over the sockets and calls of the connector running\n");
 }
 
 static void handle_options(int argc, char **argv)
@@ -90,10 +148,12 @@ static void handle_options(int argc, char **argv)
 		static struct option long_options[] = {
 			{"help", 0, 0, 'h'},
 			{"config-file", 1, 0, 'c'},
+			{"proxy", 0, 0, 'p'},
+			{"handover", 0, 0, 'H'},
 			{NULL, 0, 0, 0}
 		};
 
-		c = getopt_long(argc, argv, "hc:",
+		c = getopt_long(argc, argv, "hc:pH",
 			long_options, &option_index);
 		if (c == -1)
 			break;
@@ -105,19 +165,64 @@ static void handle_options(int argc, char **argv)
 		case 'c':
 			config_file = optarg;
 			break;
+		case 'p':
+			g_app.mncc_proxy.enabled = true;
+			break;
+		case 'H':
+			g_app.handover.wait = true;
+			break;
 		}
 	}
 }
 
+/* MNCC and SIP, a standby only starts them when it takes over */
+static void start_signalling(struct app_config *app)
+{
+	int rc;
+
+	mncc_connections_start(app);
+
+	rc = sip_agent_start(&app->sip.agent);
+	if (rc < 0)
+		LOGP(DSIP, LOGL_ERROR,
+			"Failed to initialize SIP. Running broken\n");
+}
+
+static int start_vty(void)
+{
+	return telnet_init_dynif(tall_mncc_ctx, NULL,
+				vty_get_bind_addr(), OSMO_VTY_PORT_MNCC_SIP);
+}
+
+/* The previous instance is gone and its VTY port is free */
+static void handover_done(struct app_config *app)
+{
+	if (start_vty() < 0)
+		LOGP(DAPP, LOGL_ERROR, "Failed to bind the VTY after the handover\n");
+	start_signalling(app);
+	/* the calls arrive from the previous instance, nothing to release */
+	call_table_start(app, false);
+}
+
+/* The mirrored calls were released already, see replication.c */
+static void standby_takeover(struct app_config *app)
+{
+	start_signalling(app);
+	call_table_start(app, false);
+}
+
 int main(int argc, char **argv)
 {
 	int rc;
+#ifndef USE_NATIVE_LOOP
 	GMainLoop *loop;
+#endif
 
 	/* initialize osmocom */
 	tall_mncc_ctx = talloc_named_const(NULL, 0, "MNCC CTX");
 	osmo_init_ignore_signals();
 	osmo_init_logging(&mncc_sip_info);
+	signals_init();
 	osmo_stats_init(tall_mncc_ctx);
 
 	mncc_sip_vty_init();
@@ -135,24 +240,46 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	rc = telnet_init_dynif(tall_mncc_ctx, NULL,
-				vty_get_bind_addr(), OSMO_VTY_PORT_MNCC_SIP);
-	if (rc < 0)
+	/* before anything else could take the fds */
+	handover_inherit(&g_app);
+
+	if (!g_app.handover.wait && start_vty() < 0)
 		exit(1);
 
-	mncc_connection_init(&g_app.mncc.conn, &g_app);
-	mncc_connection_start(&g_app.mncc.conn);
+	/* the proxy only forwards MNCC and has no calls of its own */
+	if (g_app.mncc_proxy.enabled) {
+		if (mncc_proxy_start(&g_app) < 0)
+			exit(1);
+		while (1)
+			osmo_select_main(0);
+	}
 
 	/* sofia sip */
 	sip_agent_init(&g_app.sip.agent, &g_app);
-	rc = sip_agent_start(&g_app.sip.agent);
-	if (rc < 0)
-		LOGP(DSIP, LOGL_ERROR,
-			"Failed to initialize SIP. Running broken\n");
 
 	calls_init();
+	setup_queue_init();
 	app_setup(&g_app);
+	routing_init(&g_app);
+	sip_resolver_init(&g_app);
+
+	if (replication_start(&g_app, standby_takeover) < 0) {
+		LOGP(DAPP, LOGL_ERROR, "Failed to start the replication\n");
+		exit(1);
+	}
+	if (g_app.handover.wait) {
+		if (handover_wait(&g_app, handover_done) < 0)
+			exit(1);
+	} else if (g_app.replication.role != REPLICATION_STANDBY) {
+		start_signalling(&g_app);
+		call_table_start(&g_app, true);
+	}
 
+#ifdef USE_NATIVE_LOOP
+	/* sofia-sip and libosmocore on one loop */
+	if (evpoll_run(g_app.sip.agent.root) < 0)
+		exit(1);
+#else
 	/* marry sofia-sip to glib and glib to libosmocore */
 	loop = g_main_loop_new(NULL, FALSE);
 	g_source_attach(su_glib_root_gsource(g_app.sip.agent.root),
@@ -163,6 +290,7 @@ int main(int argc, char **argv)
 					(GPollFunc) evpoll);
 	g_main_loop_run(loop);
 	g_main_loop_unref(loop);
+#endif
 
 	return EXIT_SUCCESS;
 }
@@ -23,21 +23,39 @@
 #include "app.h"
 #include "logging.h"
 #include "call.h"
+#include "callstate.h"
+#include "setup_queue.h"
+#include "mncc_uring.h"
+#include "mncc_shm.h"
 
 #include <osmocom/gsm/protocol/gsm_03_40.h>
+#include <osmocom/gsm/protocol/gsm_04_08.h>
 
 #include <osmocom/core/socket.h>
 #include <osmocom/core/utils.h>
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
 #include <errno.h>
+#include <time.h>
 #include <unistd.h>
 
+/* messages read from the socket per wake-up before yielding */
+#define MNCC_READ_BATCH	16
+
 extern void *tall_mncc_ctx;
 
+/* A parked MNCC_SETUP_IND, see setup_queue.c */
+struct mncc_setup_entry {
+	struct setup_entry base;
+	struct mncc_connection *conn;
+	struct gsm_mncc mncc;
+};
+
 static void close_connection(struct mncc_connection *conn);
+static void mncc_dispatch(struct mncc_connection *conn, char *buf, int rc);
 
 static void mncc_leg_release(struct mncc_call_leg *leg)
 {
@@ -82,41 +100,206 @@ static void stop_cmd_timer(struct mncc_call_leg *leg, uint32_t got_res)
 	osmo_timer_del(&leg->cmd_timeout);
 }
 
-static struct mncc_call_leg *mncc_find_leg(uint32_t callref)
+/*
+ * The index has twice the room of conn->legs and is probed linearly,
+ * the runs stay short without tombstones.
+ */
+static unsigned int leg_hash(struct mncc_connection *conn, uint32_t callref)
 {
-	struct call *call;
+	return (callref * 2654435761u) & (conn->leg_index_size - 1);
+}
 
-	llist_for_each_entry(call, &g_call_list, entry) {
-		if (call->initial && call->initial->type == CALL_TYPE_MNCC) {
-			struct mncc_call_leg *leg = (struct mncc_call_leg *) call->initial;
-			if (leg->callref == callref)
-				return leg;
-		}
-		if (call->remote && call->remote->type == CALL_TYPE_MNCC) {
-			struct mncc_call_leg *leg = (struct mncc_call_leg *) call->remote;
-			if (leg->callref == callref)
-				return leg;
-		}
+static void leg_index_add(struct mncc_connection *conn, unsigned int slot)
+{
+	unsigned int i = leg_hash(conn, conn->legs[slot].callref);
+
+	while (conn->leg_index[i])
+		i = (i + 1) & (conn->leg_index_size - 1);
+	conn->leg_index[i] = slot + 1;
+}
+
+/* where the slot is in the index, it must be there */
+static unsigned int leg_index_pos(struct mncc_connection *conn, unsigned int slot)
+{
+	unsigned int i = leg_hash(conn, conn->legs[slot].callref);
+
+	while (conn->leg_index[i] != slot + 1)
+		i = (i + 1) & (conn->leg_index_size - 1);
+	return i;
+}
+
+/* Move the entries behind the hole up so that no probe stops early */
+static void leg_index_del(struct mncc_connection *conn, unsigned int slot)
+{
+	unsigned int mask = conn->leg_index_size - 1;
+	unsigned int hole = leg_index_pos(conn, slot);
+	unsigned int i = hole, home;
+
+	for (;;) {
+		i = (i + 1) & mask;
+		if (!conn->leg_index[i])
+			break;
+		home = leg_hash(conn, conn->legs[conn->leg_index[i] - 1].callref);
+		/* stays if its home lies cyclically in (hole, i] */
+		if (((i - home) & mask) < ((i - hole) & mask))
+			continue;
+		conn->leg_index[hole] = conn->leg_index[i];
+		hole = i;
 	}
+	conn->leg_index[hole] = 0;
+}
+
+static int leg_index_grow(struct mncc_connection *conn, unsigned int size)
+{
+	uint32_t *index;
+	unsigned int i;
+
+	index = talloc_zero_array(conn, uint32_t, size);
+	if (!index)
+		return -1;
+
+	talloc_free(conn->leg_index);
+	conn->leg_index = index;
+	conn->leg_index_size = size;
+	for (i = 0; i < conn->num_legs; ++i)
+		leg_index_add(conn, i);
+	return 0;
+}
+
+/* The MSCs allocate their callrefs independently */
+static struct mncc_call_leg *mncc_find_leg(struct mncc_connection *conn, uint32_t callref)
+{
+	unsigned int i, slot;
+
+	if (!conn->leg_index)
+		return NULL;
 
+	i = leg_hash(conn, callref);
+	while ((slot = conn->leg_index[i])) {
+		if (conn->legs[slot - 1].callref == callref)
+			return conn->legs[slot - 1].leg;
+		i = (i + 1) & (conn->leg_index_size - 1);
+	}
 	return NULL;
 }
 
+/* The last slot moves into the hole */
+static int mncc_leg_detach(struct mncc_call_leg *leg)
+{
+	struct mncc_connection *conn = leg->conn;
+	unsigned int last = conn->num_legs - 1;
+
+	leg_index_del(conn, leg->slot);
+	if (leg->slot != last) {
+		conn->leg_index[leg_index_pos(conn, last)] = leg->slot + 1;
+		conn->legs[leg->slot] = conn->legs[last];
+		conn->legs[leg->slot].leg->slot = leg->slot;
+	}
+	conn->num_legs -= 1;
+	return 0;
+}
+
+static int mncc_leg_attach(struct mncc_connection *conn, struct mncc_call_leg *leg,
+				uint32_t callref)
+{
+	if (conn->num_legs == conn->max_legs) {
+		unsigned int max = conn->max_legs ? conn->max_legs * 2 : 64;
+		struct mncc_leg_slot *legs;
+
+		legs = talloc_realloc(conn, conn->legs, struct mncc_leg_slot, max);
+		if (!legs)
+			goto fail;
+		conn->legs = legs;
+		if (leg_index_grow(conn, max * 2) != 0)
+			goto fail;
+		conn->max_legs = max;
+	}
+
+	leg->conn = conn;
+	leg->callref = callref;
+	leg->slot = conn->num_legs;
+	conn->legs[conn->num_legs].callref = callref;
+	conn->legs[conn->num_legs].leg = leg;
+	leg_index_add(conn, conn->num_legs);
+	conn->num_legs += 1;
+	talloc_set_destructor(leg, mncc_leg_detach);
+	return 0;
+
+fail:
+	LOGP(DMNCC, LOGL_ERROR, "Failed to track leg(%u) on MNCC %s\n",
+		callref, conn->name);
+	return -1;
+}
+
 static void mncc_fill_header(struct gsm_mncc *mncc, uint32_t msg_type, uint32_t callref)
 {
 	mncc->msg_type = msg_type;
 	mncc->callref = callref;
 }
 
+static int mncc_send_iov(struct mncc_connection *conn, const struct iovec *iov, int iovcnt)
+{
+	conn->tx_msgs += 1;
+	if (conn->shm_active)
+		return mncc_shm_sendv(conn, iov, iovcnt);
+#ifdef USE_IO_URING
+	if (conn->uring)
+		return mncc_uring_sendv(conn, iov, iovcnt);
+#endif
+	return writev(conn->fd.fd, iov, iovcnt);
+}
+
+static int mncc_send_raw(struct mncc_connection *conn, const void *data, size_t len)
+{
+	struct iovec iov = { .iov_base = (void *) data, .iov_len = len };
+
+	return mncc_send_iov(conn, &iov, 1);
+}
+
+/*
+ * Read-only bodies of the messages we send. Only the header is built
+ * per message and the body goes out straight from the template.
+ */
+static const struct gsm_mncc mncc_empty_tmpl;
+static const struct gsm_mncc_rtp mncc_rtp_tmpl;
+
+/* GSM 04.08 10.5.4.21 */
+static const struct gsm_mncc mncc_alert_tmpl = {
+	.fields = MNCC_F_PROGRESS,
+	.progress = {
+		.coding = 3,		/* Standard defined for the GSMßPLMNS */
+		.location = 1,		/* Private network serving the local user */
+		.descr = 8,		/* In-band information or appropriate pattern now available */
+	},
+};
+
+struct mncc_hdr {
+	uint32_t msg_type;
+	uint32_t callref;
+};
+
+static bool mncc_send_tmpl(struct mncc_connection *conn, const void *tmpl, size_t len,
+				uint32_t msg_type, uint32_t callref)
+{
+	struct mncc_hdr hdr = { .msg_type = msg_type, .callref = callref };
+	struct iovec iov[2] = {
+		{ .iov_base = &hdr, .iov_len = sizeof(hdr) },
+		{ .iov_base = (char *) tmpl + sizeof(hdr), .iov_len = len - sizeof(hdr) },
+	};
+
+	if (mncc_send_iov(conn, iov, 2) != len) {
+		LOGP(DMNCC, LOGL_ERROR, "Failed to send message call(%u)\n", callref);
+		close_connection(conn);
+		return false;
+	}
+	return true;
+}
+
 static void mncc_write(struct mncc_connection *conn, struct gsm_mncc *mncc, uint32_t callref)
 {
 	int rc;
 
-	/*
-	 * TODO: we need to put cause in here for release or such? shall we return a
-	 * static struct?
-	 */
-	rc = write(conn->fd.fd, mncc, sizeof(*mncc));
+	rc = mncc_send_raw(conn, mncc, sizeof(*mncc));
 	if (rc != sizeof(*mncc)) {
 		LOGP(DMNCC, LOGL_ERROR, "Failed to send message call(%u)\n", callref);
 		close_connection(conn);
@@ -125,25 +308,12 @@ static void mncc_write(struct mncc_connection *conn, struct gsm_mncc *mncc, uint
 
 static void mncc_send(struct mncc_connection *conn, uint32_t msg_type, uint32_t callref)
 {
-	struct gsm_mncc mncc = { 0, };
-
-	mncc_fill_header(&mncc, msg_type, callref);
-	mncc_write(conn, &mncc, callref);
+	mncc_send_tmpl(conn, &mncc_empty_tmpl, sizeof(mncc_empty_tmpl), msg_type, callref);
 }
 
 static void mncc_rtp_send(struct mncc_connection *conn, uint32_t msg_type, uint32_t callref)
 {
-	int rc;
-	struct gsm_mncc_rtp mncc = { 0, };
-
-	mncc.msg_type = msg_type;
-	mncc.callref = callref;
-
-	rc = write(conn->fd.fd, &mncc, sizeof(mncc));
-	if (rc != sizeof(mncc)) {
-		LOGP(DMNCC, LOGL_ERROR, "Failed to send message call(%u)\n", callref);
-		close_connection(conn);
-	}
+	mncc_send_tmpl(conn, &mncc_rtp_tmpl, sizeof(mncc_rtp_tmpl), msg_type, callref);
 }
 
 static bool send_rtp_connect(struct mncc_call_leg *leg, struct call_leg *other)
@@ -164,13 +334,37 @@ static bool send_rtp_connect(struct mncc_call_leg *leg, struct call_leg *other)
 	 * FIXME: mncc.payload_msg_type should already be compatible.. but
 	 * payload_type should be different..
 	 */
-	rc = write(leg->conn->fd.fd, &mncc, sizeof(mncc));
+	rc = mncc_send_raw(leg->conn, &mncc, sizeof(mncc));
 	if (rc != sizeof(mncc)) {
 		LOGP(DMNCC, LOGL_ERROR, "Failed to send message leg(%u)\n",
 			leg->callref);
 		close_connection(leg->conn);
 		return false;
 	}
+	leg->rtp_connected = true;
+	return true;
+}
+
+static bool send_bridge(struct mncc_call_leg *leg, struct call_leg *_other)
+{
+	struct gsm_mncc_bridge mncc = { 0, };
+	struct mncc_call_leg *other;
+	int rc;
+
+	OSMO_ASSERT(_other->type == CALL_TYPE_MNCC);
+	other = (struct mncc_call_leg *) _other;
+
+	mncc.msg_type = MNCC_BRIDGE;
+	mncc.callref[0] = other->callref;
+	mncc.callref[1] = leg->callref;
+
+	rc = mncc_send_raw(leg->conn, &mncc, sizeof(mncc));
+	if (rc != sizeof(mncc)) {
+		LOGP(DMNCC, LOGL_ERROR, "Failed to send bridge leg(%u)\n",
+			leg->callref);
+		close_connection(leg->conn);
+		return false;
+	}
 	return true;
 }
 
@@ -185,7 +379,8 @@ static void mncc_call_leg_connect(struct call_leg *_leg)
 	other = call_leg_other(_leg);
 	OSMO_ASSERT(other);
 
-	if (!send_rtp_connect(leg, other))
+	/* the bridge was sent with the setup confirm of the other leg */
+	if (!call_is_mncc_bridge(_leg->call) && !send_rtp_connect(leg, other))
 		return;
 
 	start_cmd_timer(leg, MNCC_SETUP_COMPL_IND);
@@ -194,21 +389,15 @@ static void mncc_call_leg_connect(struct call_leg *_leg)
 
 static void mncc_call_leg_ring(struct call_leg *_leg)
 {
-	struct gsm_mncc out_mncc = { 0, };
 	struct mncc_call_leg *leg;
 	struct call_leg *other_leg;
 
 	OSMO_ASSERT(_leg->type == CALL_TYPE_MNCC);
 	leg = (struct mncc_call_leg *) _leg;
 
-	mncc_fill_header(&out_mncc, MNCC_ALERT_REQ, leg->callref);
-	/* GSM 04.08 10.5.4.21 */
-	out_mncc.fields |= MNCC_F_PROGRESS;
-	out_mncc.progress.coding = 3; /* Standard defined for the GSMßPLMNS */
-	out_mncc.progress.location = 1; /* Private network serving the local user */
-	out_mncc.progress.descr = 8; /* In-band information or appropriate pattern now available */
-
-	mncc_write(leg->conn, &out_mncc, leg->callref);
+	if (!mncc_send_tmpl(leg->conn, &mncc_alert_tmpl, sizeof(mncc_alert_tmpl),
+				MNCC_ALERT_REQ, leg->callref))
+		return;
 
 	/*
 	 * If we have remote IP/port let's connect it already.
@@ -219,6 +408,12 @@ static void mncc_call_leg_ring(struct call_leg *_leg)
 		send_rtp_connect(leg, other_leg);
 }
 
+/* A callref of a previous instance, there is no leg for it */
+void mncc_release_stale(struct mncc_connection *conn, uint32_t callref, bool reject)
+{
+	mncc_send(conn, reject ? MNCC_REJ_REQ : MNCC_REL_REQ, callref);
+}
+
 static void mncc_call_leg_release(struct call_leg *_leg)
 {
 	struct mncc_call_leg *leg;
@@ -262,16 +457,97 @@ static void mncc_call_leg_release(struct call_leg *_leg)
 	}
 }
 
+/* A connected leg of a previous instance on a socket it handed over */
+struct call_leg *mncc_leg_restore(struct mncc_connection *conn, struct call *call,
+					const struct callstate_leg *rec)
+{
+	struct mncc_call_leg *leg;
+
+	leg = talloc_zero(call, struct mncc_call_leg);
+	if (!leg) {
+		LOGP(DMNCC, LOGL_ERROR, "Failed to allocate leg call(%u)\n",
+			call->id);
+		return NULL;
+	}
+
+	leg->base.type = CALL_TYPE_MNCC;
+	leg->base.connect_call = mncc_call_leg_connect;
+	leg->base.ring_call = mncc_call_leg_ring;
+	leg->base.release_call = mncc_call_leg_release;
+	leg->base.call = call;
+	leg->base.ip = rec->rtp_ip;
+	leg->base.port = rec->rtp_port;
+	leg->base.payload_type = rec->payload_type;
+	leg->base.payload_msg_type = rec->payload_msg_type;
+
+	if (mncc_leg_attach(conn, leg, rec->callref) != 0) {
+		talloc_free(leg);
+		return NULL;
+	}
+	leg->state = rec->state;
+	leg->dir = rec->dir;
+	leg->rtp_connected = true;
+	memcpy(leg->imsi, rec->imsi, sizeof(leg->imsi));
+	return &leg->base;
+}
+
 static void close_connection(struct mncc_connection *conn)
 {
-	osmo_fd_unregister(&conn->fd);
+	mncc_shm_stop(conn);
+#ifdef USE_IO_URING
+	if (conn->uring)
+		mncc_uring_stop(conn);
+	else
+#endif
+		osmo_fd_unregister(&conn->fd);
 	close(conn->fd.fd);
 	osmo_timer_schedule(&conn->reconnect, 5, 0);
 	conn->state = MNCC_DISCONNECTED;
+	setup_queue_flush(conn);
 	if (conn->on_disconnect)
 		conn->on_disconnect(conn);
 }
 
+/*
+ * Normalize a number for SIP with the configured rules. A number that
+ * is international after the rules gets a '+'. Without a matching rule
+ * only the called number does.
+ */
+static char *mo_number(struct mncc_call_leg *leg, int field,
+			const struct gsm_mncc_number *number)
+{
+	struct numbering_set *set;
+	char digits[NUMBERING_MAX_LEN + 1];
+	int ton = number->type, npi = number->plan, rc;
+
+	set = &leg->conn->app->numbering.sets[NUMBERING_MO][field];
+	rc = numbering_translate(set, number->number, &ton, &npi,
+				digits, sizeof(digits));
+	if (rc < 0)
+		LOGP(DMNCC, LOGL_ERROR, "leg(%u) number %s too long after rules\n",
+			leg->callref, number->number);
+	if (rc <= 0) {
+		if (field == NUMBERING_CALLING)
+			return talloc_asprintf(leg, "%.32s", number->number);
+		snprintf(digits, sizeof(digits), "%s", number->number);
+	}
+
+	if (ton == GSM340_TYPE_INTERNATIONAL)
+		return talloc_asprintf(leg, "+%.32s", digits);
+	return talloc_asprintf(leg, "%.32s", digits);
+}
+
+/* The PBX sees the MSISDN if the IMSI is in the map */
+static char *imsi_source(struct mncc_call_leg *leg)
+{
+	char imsi[IMSI_MAP_LEN + 1], msisdn[IMSI_MAP_LEN + 1];
+
+	snprintf(imsi, sizeof(imsi), "%.16s", leg->imsi);
+	if (imsi_map_to_msisdn(&leg->conn->app->imsi_map, imsi, msisdn))
+		return talloc_strdup(leg, msisdn);
+	return talloc_strdup(leg, imsi);
+}
+
 static void continue_mo_call(struct mncc_call_leg *leg)
 {
 	char *dest, *source;
@@ -280,15 +556,12 @@ static void continue_mo_call(struct mncc_call_leg *leg)
 	mncc_send(leg->conn, MNCC_CALL_PROC_REQ, leg->callref);
 	leg->state = MNCC_CC_PROCEEDING;
 
-	if (leg->called.type == GSM340_TYPE_INTERNATIONAL)
-		dest = talloc_asprintf(leg, "+%.32s", leg->called.number);
-	else
-		dest = talloc_asprintf(leg, "%.32s", leg->called.number);
+	dest = mo_number(leg, NUMBERING_CALLED, &leg->called);
 
 	if (leg->conn->app->use_imsi_as_id)
-		source = talloc_asprintf(leg, "%.16s", leg->imsi);
+		source = imsi_source(leg);
 	else
-		source = talloc_asprintf(leg, "%.32s", leg->calling.number);
+		source = mo_number(leg, NUMBERING_CALLING, &leg->calling);
 
 	app_route_call(leg->base.call, source, dest);
 }
@@ -304,6 +577,17 @@ static void continue_mt_call(struct mncc_call_leg *leg)
 
 	/* assume the type is compatible */
 	other_leg->payload_type = leg->base.payload_type;
+
+	/*
+	 * The address of the SIP side is known from the offer. Connect the
+	 * media now and let the other leg answer with ours so that tones
+	 * and announcements are heard before the call is answered.
+	 */
+	if (!other_leg->early_media || other_leg->port == 0 || other_leg->ip == 0)
+		return;
+	if (!send_rtp_connect(leg, other_leg))
+		return;
+	other_leg->early_media(other_leg);
 }
 
 static void continue_call(struct mncc_call_leg *leg)
@@ -313,24 +597,13 @@ static void continue_call(struct mncc_call_leg *leg)
 	return continue_mt_call(leg);
 }
 
-static void check_rtp_connect(struct mncc_connection *conn, char *buf, int rc)
+static void check_rtp_connect(struct mncc_connection *conn, struct mncc_call_leg *leg,
+				char *buf, int rc)
 {
 	struct gsm_mncc_rtp *rtp;
-	struct mncc_call_leg *leg;
 	struct call_leg *other_leg;
 
-	if (rc < sizeof(*rtp)) {
-		LOGP(DMNCC, LOGL_ERROR, "gsm_mncc_rtp of wrong size %d < %zu\n",
-			rc, sizeof(*rtp));
-		return close_connection(conn);
-	}
-
 	rtp = (struct gsm_mncc_rtp *) buf;
-	leg = mncc_find_leg(rtp->callref);
-	if (!leg) {
-		LOGP(DMNCC, LOGL_ERROR, "leg(%u) can not be found\n", rtp->callref);
-		return mncc_send(conn, MNCC_REJ_REQ, rtp->callref);
-	}
 
 	/* extract information about where the RTP is */
 	if (rtp->ip != 0 || rtp->port != 0 || rtp->payload_type != 0)
@@ -344,23 +617,12 @@ static void check_rtp_connect(struct mncc_connection *conn, char *buf, int rc)
 	leg->base.release_call(&leg->base);
 }
 
-static void check_rtp_create(struct mncc_connection *conn, char *buf, int rc)
+static void check_rtp_create(struct mncc_connection *conn, struct mncc_call_leg *leg,
+				char *buf, int rc)
 {
 	struct gsm_mncc_rtp *rtp;
-	struct mncc_call_leg *leg;
-
-	if (rc < sizeof(*rtp)) {
-		LOGP(DMNCC, LOGL_ERROR, "gsm_mncc_rtp of wrong size %d < %zu\n",
-			rc, sizeof(*rtp));
-		return close_connection(conn);
-	}
 
 	rtp = (struct gsm_mncc_rtp *) buf;
-	leg = mncc_find_leg(rtp->callref);
-	if (!leg) {
-		LOGP(DMNCC, LOGL_ERROR, "call(%u) can not be found\n", rtp->callref);
-		return mncc_send(conn, MNCC_REJ_REQ, rtp->callref);
-	}
 
 	/* extract information about where the RTP is */
 	leg->base.ip = rtp->ip;
@@ -395,12 +657,6 @@ static void check_setup(struct mncc_connection *conn, char *buf, int rc)
 	struct call *call;
 	struct mncc_call_leg *leg;
 
-	if (rc != sizeof(*data)) {
-		LOGP(DMNCC, LOGL_ERROR, "gsm_mncc of wrong size %d vs. %zu\n",
-			rc, sizeof(*data));
-		return close_connection(conn);
-	}
-
 	data = (struct gsm_mncc *) buf;
 
 	/* screen arguments */
@@ -424,6 +680,15 @@ static void check_setup(struct mncc_connection *conn, char *buf, int rc)
 		return mncc_send(conn, MNCC_REJ_REQ, data->callref);
 	}
 
+	/* a single handset hammering us with call attempts */
+	if (!ratelimit_check(&conn->app->rate_limit.mncc,
+			data->imsi[0] ? data->imsi : data->calling.number)) {
+		LOGP(DMNCC, LOGL_ERROR,
+			"MNCC leg(%u) IMSI(%.16s) above call rate limit\n",
+			data->callref, data->imsi);
+		return mncc_send(conn, MNCC_REJ_REQ, data->callref);
+	}
+
 	/* Create an RTP port and then allocate a call */
 	call = call_mncc_create();
 	if (!call) {
@@ -436,8 +701,10 @@ static void check_setup(struct mncc_connection *conn, char *buf, int rc)
 	leg->base.connect_call = mncc_call_leg_connect;
 	leg->base.ring_call = mncc_call_leg_ring;
 	leg->base.release_call = mncc_call_leg_release;
-	leg->callref = data->callref;
-	leg->conn = conn;
+	if (mncc_leg_attach(conn, leg, data->callref) != 0) {
+		call_leg_release(&leg->base);
+		return mncc_send(conn, MNCC_REJ_REQ, data->callref);
+	}
 	leg->state = MNCC_CC_INITIAL;
 	leg->dir = MNCC_DIR_MO;
 	memcpy(&leg->called, &data->called, sizeof(leg->called));
@@ -447,42 +714,89 @@ static void check_setup(struct mncc_connection *conn, char *buf, int rc)
 	LOGP(DMNCC, LOGL_DEBUG,
 		"Created call(%u) with MNCC leg(%u) IMSI(%.16s)\n",
 		call->id, leg->callref, data->imsi);
+	conn->mo_calls += 1;
 
 	start_cmd_timer(leg, MNCC_RTP_CREATE);
 	mncc_rtp_send(conn, MNCC_RTP_CREATE, data->callref);
 }
 
-static struct mncc_call_leg *find_leg(struct mncc_connection *conn,
-					char *buf, int rc, struct gsm_mncc **mncc)
+static void run_setup_entry(struct setup_entry *_entry)
 {
-	struct mncc_call_leg *leg;
+	struct mncc_setup_entry *entry = (struct mncc_setup_entry *) _entry;
 
-	if (rc != sizeof(**mncc)) {
-		LOGP(DMNCC, LOGL_ERROR, "gsm_mncc of wrong size %d vs. %zu\n",
-			rc, sizeof(**mncc));
-		close_connection(conn);
-		return NULL;
-	}
+	check_setup(entry->conn, (char *) &entry->mncc, sizeof(entry->mncc));
+	talloc_free(entry);
+}
 
-	*mncc = (struct gsm_mncc *) buf;
-	leg = mncc_find_leg((*mncc)->callref);
-	if (!leg) {
-		LOGP(DMNCC, LOGL_ERROR, "call(%u) can not be found\n", (*mncc)->callref);
-		return NULL;
+static void drop_setup_entry(struct setup_entry *_entry)
+{
+	struct mncc_setup_entry *entry = (struct mncc_setup_entry *) _entry;
+
+	LOGP(DMNCC, LOGL_ERROR, "Dropping queued setup leg(%u)\n",
+		entry->mncc.callref);
+	if (entry->conn->state == MNCC_READY)
+		mncc_send(entry->conn, MNCC_REJ_REQ, entry->mncc.callref);
+	talloc_free(entry);
+}
+
+/*
+ * Park the setup until the releases of this loop iteration have
+ * been handled.
+ */
+static void queue_setup(struct mncc_connection *conn, struct mncc_call_leg *unused,
+			char *buf, int rc)
+{
+	struct mncc_setup_entry *entry;
+	struct gsm_mncc *data;
+
+	if (!setup_queue_enabled())
+		return check_setup(conn, buf, rc);
+
+	data = (struct gsm_mncc *) buf;
+	entry = talloc_zero(tall_mncc_ctx, struct mncc_setup_entry);
+	if (!entry) {
+		LOGP(DMNCC, LOGL_ERROR,
+			"MNCC leg(%u) failed to queue setup\n", data->callref);
+		return mncc_send(conn, MNCC_REJ_REQ, data->callref);
 	}
 
-	return leg;
+	entry->base.owner = conn;
+	entry->base.key = (void *) (uintptr_t) data->callref;
+	entry->base.run = run_setup_entry;
+	entry->base.drop = drop_setup_entry;
+	entry->conn = conn;
+	memcpy(&entry->mncc, data, sizeof(entry->mncc));
+
+	if (!setup_queue_add(&entry->base))
+		drop_setup_entry(&entry->base);
 }
 
-static void check_disc_ind(struct mncc_connection *conn, char *buf, int rc)
+/* The MSC released a call whose MNCC_SETUP_IND is still parked */
+static bool cancel_queued_setup(struct mncc_connection *conn, uint32_t callref,
+				uint32_t msg_type)
+{
+	struct mncc_setup_entry *entry;
+
+	entry = (struct mncc_setup_entry *) setup_queue_find(conn,
+					(void *) (uintptr_t) callref);
+	if (!entry)
+		return false;
+
+	LOGP(DMNCC, LOGL_NOTICE, "Canceled queued setup leg(%u)\n", callref);
+	setup_queue_del(&entry->base);
+	if (msg_type == MNCC_DISC_IND)
+		mncc_send(conn, MNCC_REL_REQ, callref);
+	talloc_free(entry);
+	return true;
+}
+
+static void check_disc_ind(struct mncc_connection *conn, struct mncc_call_leg *leg,
+			char *buf, int rc)
 {
 	struct gsm_mncc *data;
-	struct mncc_call_leg *leg;
 	struct call_leg *other_leg;
 
-	leg = find_leg(conn, buf, rc, &data);
-	if (!leg)
-		return;
+	data = (struct gsm_mncc *) buf;
 
 	LOGP(DMNCC,
 		LOGL_DEBUG, "leg(%u) was disconnected. Releasing\n", data->callref);
@@ -495,14 +809,12 @@ static void check_disc_ind(struct mncc_connection *conn, char *buf, int rc)
 		other_leg->release_call(other_leg);
 }
 
-static void check_rel_ind(struct mncc_connection *conn, char *buf, int rc)
+static void check_rel_ind(struct mncc_connection *conn, struct mncc_call_leg *leg,
+			char *buf, int rc)
 {
 	struct gsm_mncc *data;
-	struct mncc_call_leg *leg;
 
-	leg = find_leg(conn, buf, rc, &data);
-	if (!leg)
-		return;
+	data = (struct gsm_mncc *) buf;
 
 	if (leg->base.in_release)
 		stop_cmd_timer(leg, MNCC_REL_IND);
@@ -516,43 +828,33 @@ static void check_rel_ind(struct mncc_connection *conn, char *buf, int rc)
 	mncc_leg_release(leg);
 }
 
-static void check_rel_cnf(struct mncc_connection *conn, char *buf, int rc)
+static void check_rel_cnf(struct mncc_connection *conn, struct mncc_call_leg *leg,
+			char *buf, int rc)
 {
 	struct gsm_mncc *data;
-	struct mncc_call_leg *leg;
 
-	leg = find_leg(conn, buf, rc, &data);
-	if (!leg)
-		return;
+	data = (struct gsm_mncc *) buf;
 
 	stop_cmd_timer(leg, MNCC_REL_CNF);
 	LOGP(DMNCC, LOGL_DEBUG, "leg(%u) was cnf released.\n", data->callref);
 	mncc_leg_release(leg);
 }
 
-static void check_stp_cmpl_ind(struct mncc_connection *conn, char *buf, int rc)
+static void check_stp_cmpl_ind(struct mncc_connection *conn, struct mncc_call_leg *leg,
+			char *buf, int rc)
 {
-	struct gsm_mncc *data;
-	struct mncc_call_leg *leg;
-
-	leg = find_leg(conn, buf, rc, &data);
-	if (!leg)
-		return;
-
 	LOGP(DMNCC, LOGL_NOTICE, "leg(%u) is now connected.\n", leg->callref);
 	stop_cmd_timer(leg, MNCC_SETUP_COMPL_IND);
 	leg->state = MNCC_CC_CONNECTED;
 }
 
-static void check_rej_ind(struct mncc_connection *conn, char *buf, int rc)
+static void check_rej_ind(struct mncc_connection *conn, struct mncc_call_leg *leg,
+			char *buf, int rc)
 {
 	struct gsm_mncc *data;
-	struct mncc_call_leg *leg;
 	struct call_leg *other_leg;
 
-	leg = find_leg(conn, buf, rc, &data);
-	if (!leg)
-		return;
+	data = (struct gsm_mncc *) buf;
 
 	other_leg = call_leg_other(&leg->base);
 	if (other_leg)
@@ -561,14 +863,19 @@ static void check_rej_ind(struct mncc_connection *conn, char *buf, int rc)
 	mncc_leg_release(leg);
 }
 
-static void check_cnf_ind(struct mncc_connection *conn, char *buf, int rc)
+static void check_cnf_ind(struct mncc_connection *conn, struct mncc_call_leg *leg,
+			char *buf, int rc)
 {
 	struct gsm_mncc *data;
-	struct mncc_call_leg *leg;
 
-	leg = find_leg(conn, buf, rc, &data);
-	if (!leg)
+	data = (struct gsm_mncc *) buf;
+
+	/* the MSC will connect the media of both legs */
+	if (call_is_mncc_bridge(leg->base.call)) {
+		LOGP(DMNCC, LOGL_DEBUG,
+			"leg(%u) confirmed. bridged locally.\n", leg->callref);
 		return;
+	}
 
 	LOGP(DMNCC, LOGL_DEBUG,
 		"leg(%u) confirmend. creating RTP socket.\n",
@@ -578,16 +885,11 @@ static void check_cnf_ind(struct mncc_connection *conn, char *buf, int rc)
 	mncc_rtp_send(conn, MNCC_RTP_CREATE, data->callref);
 }
 
-static void check_alrt_ind(struct mncc_connection *conn, char *buf, int rc)
+static void check_alrt_ind(struct mncc_connection *conn, struct mncc_call_leg *leg,
+			char *buf, int rc)
 {
-	struct gsm_mncc *data;
-	struct mncc_call_leg *leg;
 	struct call_leg *other_leg;
 
-	leg = find_leg(conn, buf, rc, &data);
-	if (!leg)
-		return;
-
 	LOGP(DMNCC, LOGL_DEBUG,
 		"leg(%u) is alerting.\n", leg->callref);
 
@@ -602,29 +904,26 @@ static void check_alrt_ind(struct mncc_connection *conn, char *buf, int rc)
 	other_leg->ring_call(other_leg);
 }
 
-static void check_hold_ind(struct mncc_connection *conn, char *buf, int rc)
+static void check_hold_ind(struct mncc_connection *conn, struct mncc_call_leg *leg,
+			char *buf, int rc)
 {
-	struct gsm_mncc *data;
-	struct mncc_call_leg *leg;
-
-	leg = find_leg(conn, buf, rc, &data);
-	if (!leg)
-		return;
-
 	LOGP(DMNCC, LOGL_DEBUG,
 		"leg(%u) is req hold. rejecting.\n", leg->callref);
 	mncc_send(leg->conn, MNCC_HOLD_REJ, leg->callref);
 }
 
-static void check_stp_cnf(struct mncc_connection *conn, char *buf, int rc)
+static void check_retrieve_ind(struct mncc_connection *conn, struct mncc_call_leg *leg,
+			char *buf, int rc)
 {
-	struct gsm_mncc *data;
-	struct mncc_call_leg *leg;
-	struct call_leg *other_leg;
+	LOGP(DMNCC, LOGL_DEBUG,
+		"leg(%u) is req retrieve. rejecting.\n", leg->callref);
+	mncc_send(leg->conn, MNCC_RETRIEVE_REJ, leg->callref);
+}
 
-	leg = find_leg(conn, buf, rc, &data);
-	if (!leg)
-		return;
+static void check_stp_cnf(struct mncc_connection *conn, struct mncc_call_leg *leg,
+			char *buf, int rc)
+{
+	struct call_leg *other_leg;
 
 	LOGP(DMNCC, LOGL_DEBUG, "leg(%u) setup completed\n", leg->callref);
 
@@ -636,7 +935,10 @@ static void check_stp_cnf(struct mncc_connection *conn, char *buf, int rc)
 		return;
 	}
 
-	if (!send_rtp_connect(leg, other_leg))
+	if (call_is_mncc_bridge(leg->base.call)) {
+		if (!send_bridge(leg, other_leg))
+			return;
+	} else if (!leg->rtp_connected && !send_rtp_connect(leg, other_leg))
 		return;
 	leg->state = MNCC_CC_CONNECTED;
 	mncc_send(leg->conn, MNCC_SETUP_COMPL_REQ, leg->callref);
@@ -644,16 +946,14 @@ static void check_stp_cnf(struct mncc_connection *conn, char *buf, int rc)
 	other_leg->connect_call(other_leg);
 }
 
-static void check_dtmf_start(struct mncc_connection *conn, char *buf, int rc)
+static void check_dtmf_start(struct mncc_connection *conn, struct mncc_call_leg *leg,
+			char *buf, int rc)
 {
 	struct gsm_mncc out_mncc = { 0, };
 	struct gsm_mncc *data;
-	struct mncc_call_leg *leg;
 	struct call_leg *other_leg;
 
-	leg = find_leg(conn, buf, rc, &data);
-	if (!leg)
-		return;
+	data = (struct gsm_mncc *) buf;
 
 	LOGP(DMNCC, LOGL_DEBUG, "leg(%u) DTMF key=%c\n", leg->callref, data->keypad);
 
@@ -667,15 +967,13 @@ static void check_dtmf_start(struct mncc_connection *conn, char *buf, int rc)
 	mncc_write(conn, &out_mncc, leg->callref);
 }
 
-static void check_dtmf_stop(struct mncc_connection *conn, char *buf, int rc)
+static void check_dtmf_stop(struct mncc_connection *conn, struct mncc_call_leg *leg,
+			char *buf, int rc)
 {
 	struct gsm_mncc out_mncc = { 0, };
 	struct gsm_mncc *data;
-	struct mncc_call_leg *leg;
 
-	leg = find_leg(conn, buf, rc, &data);
-	if (!leg)
-		return;
+	data = (struct gsm_mncc *) buf;
 
 	LOGP(DMNCC, LOGL_DEBUG, "leg(%u) DTMF key=%c\n", leg->callref, data->keypad);
 
@@ -685,16 +983,11 @@ static void check_dtmf_stop(struct mncc_connection *conn, char *buf, int rc)
 	mncc_write(conn, &out_mncc, leg->callref);
 }
 
-static void check_hello(struct mncc_connection *conn, char *buf, int rc)
+static void check_hello(struct mncc_connection *conn, struct mncc_call_leg *unused,
+			char *buf, int rc)
 {
 	struct gsm_mncc_hello *hello;
 
-	if (rc != sizeof(*hello)) {
-		LOGP(DMNCC, LOGL_ERROR, "Hello shorter than expected %d vs. %zu\n",
-			rc, sizeof(*hello));
-		return close_connection(conn);
-	}
-
 	hello = (struct gsm_mncc_hello *) buf;
 	LOGP(DMNCC, LOGL_NOTICE, "Got hello message version %d\n", hello->version);
 
@@ -705,6 +998,62 @@ static void check_hello(struct mncc_connection *conn, char *buf, int rc)
 	}
 
 	conn->state = MNCC_READY;
+	callstate_mncc_ready(conn);
+
+	/* calls are set up on the socket until the MSC accepted */
+	if (conn->app->mncc.shared_memory)
+		mncc_shm_offer(conn, mncc_dispatch, close_connection);
+}
+
+/*
+ * Denormalize a SIP user for MNCC. The rules see the digits without
+ * a leading '+' which makes the number international instead. The
+ * whole user part is passed as unknown/ISDN without a matching rule.
+ */
+static void mt_number(struct app_config *app, int field, const char *user,
+			struct gsm_mncc_number *number)
+{
+	struct numbering_set *set = &app->numbering.sets[NUMBERING_MT][field];
+	int ton = GSM340_TYPE_UNKNOWN, npi = GSM340_PLAN_ISDN;
+	const char *digits = user;
+	int rc;
+
+	if (digits[0] == '+') {
+		ton = GSM340_TYPE_INTERNATIONAL;
+		digits += 1;
+	}
+
+	rc = numbering_translate(set, digits, &ton, &npi,
+				number->number, sizeof(number->number));
+	if (rc > 0) {
+		number->type = ton;
+		number->plan = npi;
+		return;
+	}
+
+	if (rc < 0)
+		LOGP(DMNCC, LOGL_ERROR, "number %s too long after rules\n", user);
+	number->plan = 1;
+	number->type = 0x0;
+	strncpy(number->number, user, sizeof(number->number));
+}
+
+static void set_bearer_cap(struct codec_policy *policy, struct call_leg *other,
+				struct gsm_mncc *mncc)
+{
+	const struct codec_choice *choice = &policy->choice[other->codec_caps];
+	int i;
+
+	if (choice->codec < 0)
+		return;
+
+	mncc->fields |= MNCC_F_BEARER_CAP;
+	mncc->bearer_cap.transfer = GSM48_BCAP_ITCAP_SPEECH;
+	mncc->bearer_cap.mode = GSM48_BCAP_TMOD_CIRCUIT;
+	mncc->bearer_cap.coding = GSM48_BCAP_CODING_GSM_STD;
+	mncc->bearer_cap.radio = choice->radio;
+	for (i = 0; i < ARRAY_SIZE(choice->speech_ver); ++i)
+		mncc->bearer_cap.speech_ver[i] = choice->speech_ver[i];
 }
 
 int mncc_create_remote_leg(struct mncc_connection *conn, struct call *call)
@@ -713,6 +1062,12 @@ int mncc_create_remote_leg(struct mncc_connection *conn, struct call *call)
 	struct gsm_mncc mncc = { 0, };
 	int rc;
 
+	if (conn->state != MNCC_READY) {
+		LOGP(DMNCC, LOGL_ERROR, "MNCC %s not ready for call(%u)\n",
+			conn->name, call->id);
+		return -1;
+	}
+
 	leg = talloc_zero(call, struct mncc_call_leg);
 	if (!leg) {
 		LOGP(DMNCC, LOGL_ERROR, "Failed to allocate leg call(%u)\n",
@@ -726,9 +1081,10 @@ int mncc_create_remote_leg(struct mncc_connection *conn, struct call *call)
 	leg->base.release_call = mncc_call_leg_release;
 	leg->base.call = call;
 
-	leg->callref = call->id;
-
-	leg->conn = conn;
+	if (mncc_leg_attach(conn, leg, call->id) != 0) {
+		talloc_free(leg);
+		return -1;
+	}
 	leg->state = MNCC_CC_INITIAL;
 	leg->dir = MNCC_DIR_MT;
 
@@ -736,126 +1092,264 @@ int mncc_create_remote_leg(struct mncc_connection *conn, struct call *call)
 	mncc.callref = leg->callref;
 
 	mncc.fields |= MNCC_F_CALLING;
-	mncc.calling.plan = 1;
-	mncc.calling.type = 0x0;
-	strncpy(mncc.calling.number, call->source, sizeof(mncc.calling.number));
+	mt_number(conn->app, NUMBERING_CALLING, call->source, &mncc.calling);
 
 	if (conn->app->use_imsi_as_id) {
-		snprintf(mncc.imsi, 15, "%s", call->dest);
+		char imsi[IMSI_MAP_LEN + 1];
+		const char *dest = call->dest;
+
+		if (imsi_map_to_imsi(&conn->app->imsi_map, call->dest, imsi))
+			dest = imsi;
+		snprintf(mncc.imsi, sizeof(mncc.imsi), "%s", dest);
 	} else {
 		mncc.fields |= MNCC_F_CALLED;
-		mncc.called.plan = 1;
-		mncc.called.type = 0x0;
-		strncpy(mncc.called.number, call->dest, sizeof(mncc.called.number));
+		mt_number(conn->app, NUMBERING_CALLED, call->dest, &mncc.called);
 	}
 
+	/* request the channel and speech versions matching the offer */
+	if (conn->app->codecs.num_prefs > 0)
+		set_bearer_cap(&conn->app->codecs, call->initial, &mncc);
+
 	/*
 	 * TODO/FIXME:
-	 *  - Determine/request channel based on offered audio codecs
 	 *  - Screening, redirect?
-	 *  - Synth. the bearer caps based on codecs?
 	 */
-	rc = write(conn->fd.fd, &mncc, sizeof(mncc));
+	rc = mncc_send_raw(conn, &mncc, sizeof(mncc));
 	if (rc != sizeof(mncc)) {
 		LOGP(DMNCC, LOGL_ERROR, "Failed to send message leg(%u)\n",
 			leg->callref);
-		close_connection(conn);
+		/* not part of the call yet, gone before the disconnect */
 		talloc_free(leg);
+		close_connection(conn);
 		return -1;
 	}
 
 	call->remote = &leg->base;
+	conn->mt_calls += 1;
 	return 0;
 }
 
+#ifdef USE_IO_URING
+/* hand the socket over, the plain osmo_fd stays as a fallback */
+static void start_uring(struct mncc_connection *conn)
+{
+	if (!conn->app->mncc.io_uring)
+		return;
+
+	osmo_fd_unregister(&conn->fd);
+	if (mncc_uring_start(conn, mncc_dispatch, close_connection) != 0) {
+		LOGP(DMNCC, LOGL_ERROR, "Failed to use io_uring, using plain reads\n");
+		osmo_fd_register(&conn->fd);
+	}
+}
+#endif
+
 static void mncc_reconnect(void *data)
 {
 	int rc;
 	struct mncc_connection *conn = data;
 
 	rc = osmo_sock_unix_init_ofd(&conn->fd, SOCK_SEQPACKET, 0,
-					conn->app->mncc.path, OSMO_SOCK_F_CONNECT);
+					conn->path, OSMO_SOCK_F_CONNECT);
 	if (rc < 0) {
 		LOGP(DMNCC, LOGL_ERROR, "Failed to connect(%s). Retrying\n",
-			conn->app->mncc.path);
+			conn->path);
 		conn->state = MNCC_DISCONNECTED;
 		osmo_timer_schedule(&conn->reconnect, 5, 0);
 		return;
 	}
 
-	LOGP(DMNCC, LOGL_NOTICE, "Reconnected to %s\n", conn->app->mncc.path);
+	LOGP(DMNCC, LOGL_NOTICE, "Reconnected to %s\n", conn->path);
 	conn->state = MNCC_WAIT_VERSION;
+	conn->reconnects += 1;
+
+#ifdef USE_IO_URING
+	start_uring(conn);
+#endif
 }
 
-static int mncc_data(struct osmo_fd *fd, unsigned int what)
+/*
+ * The socket of a previous instance. The MSC said hello to it already
+ * and keeps the calls as long as the socket stays open.
+ */
+int mncc_connection_adopt(struct mncc_connection *conn, int fd)
 {
-	char buf[4096];
-	uint32_t msg_type;
-	int rc;
-	struct mncc_connection *conn = fd->data;
+	if (conn->state != MNCC_DISCONNECTED)
+		return -1;
 
-	rc = read(fd->fd, buf, sizeof(buf));
-	if (rc <= 0) {
-		LOGP(DMNCC, LOGL_ERROR, "Failed to read %d/%s. Re-connecting.\n",
-			rc, strerror(errno));
-		goto bad_data;
-	}
-	if (rc <= 4) {
-		LOGP(DMNCC, LOGL_ERROR, "Data too short with: %d\n", rc);
-		goto bad_data;
+	osmo_timer_del(&conn->reconnect);
+	conn->fd.fd = fd;
+	conn->fd.when = BSC_FD_READ;
+	if (osmo_fd_register(&conn->fd) != 0) {
+		conn->fd.fd = -1;
+		return -1;
 	}
 
+	LOGP(DMNCC, LOGL_NOTICE, "Took over the MNCC socket of %s\n", conn->name);
+	conn->state = MNCC_READY;
+
+#ifdef USE_IO_URING
+	start_uring(conn);
+#endif
+	return 0;
+}
+
+static void check_shm_accept(struct mncc_connection *conn, struct mncc_call_leg *unused,
+				char *buf, int rc)
+{
+	mncc_shm_accepted(conn, buf, rc);
+}
+
+/* the leg of the callref is looked up before the handler runs */
+#define MNCC_RX_LEG		0x01
+/* answer an unknown callref with a MNCC_REJ_REQ */
+#define MNCC_RX_REJECT		0x02
+/* the message may be longer than size */
+#define MNCC_RX_MIN_SIZE	0x04
+/* an unknown callref might still be a parked setup */
+#define MNCC_RX_CANCEL		0x08
+
+struct mncc_rx_handler {
+	const char *name;
+	uint16_t size;
+	uint16_t flags;
+	void (*cb)(struct mncc_connection *conn, struct mncc_call_leg *leg,
+			char *buf, int rc);
+};
+
+#define MNCC_RX(type, handler, len, fl) \
+	[type] = { .name = #type, .size = len, .flags = fl, .cb = handler }
+
+/*
+ * Indexed by the message type. The size and the leg are checked once
+ * in mncc_dispatch() so the handlers can rely on both.
+ */
+static const struct mncc_rx_handler rx_handlers[] = {
+	MNCC_RX(MNCC_SETUP_IND, queue_setup, sizeof(struct gsm_mncc), 0),
+	MNCC_RX(MNCC_SETUP_CNF, check_stp_cnf, sizeof(struct gsm_mncc), MNCC_RX_LEG),
+	MNCC_RX(MNCC_SETUP_COMPL_IND, check_stp_cmpl_ind, sizeof(struct gsm_mncc), MNCC_RX_LEG),
+	MNCC_RX(MNCC_CALL_CONF_IND, check_cnf_ind, sizeof(struct gsm_mncc), MNCC_RX_LEG),
+	MNCC_RX(MNCC_ALERT_IND, check_alrt_ind, sizeof(struct gsm_mncc), MNCC_RX_LEG),
+	MNCC_RX(MNCC_DISC_IND, check_disc_ind, sizeof(struct gsm_mncc),
+		MNCC_RX_LEG | MNCC_RX_CANCEL),
+	MNCC_RX(MNCC_REL_IND, check_rel_ind, sizeof(struct gsm_mncc),
+		MNCC_RX_LEG | MNCC_RX_CANCEL),
+	MNCC_RX(MNCC_REL_CNF, check_rel_cnf, sizeof(struct gsm_mncc), MNCC_RX_LEG),
+	MNCC_RX(MNCC_REJ_IND, check_rej_ind, sizeof(struct gsm_mncc), MNCC_RX_LEG),
+	MNCC_RX(MNCC_START_DTMF_IND, check_dtmf_start, sizeof(struct gsm_mncc), MNCC_RX_LEG),
+	MNCC_RX(MNCC_STOP_DTMF_IND, check_dtmf_stop, sizeof(struct gsm_mncc), MNCC_RX_LEG),
+	MNCC_RX(MNCC_HOLD_IND, check_hold_ind, sizeof(struct gsm_mncc), MNCC_RX_LEG),
+	MNCC_RX(MNCC_RETRIEVE_IND, check_retrieve_ind, sizeof(struct gsm_mncc), MNCC_RX_LEG),
+	MNCC_RX(MNCC_RTP_CREATE, check_rtp_create, sizeof(struct gsm_mncc_rtp),
+		MNCC_RX_LEG | MNCC_RX_REJECT | MNCC_RX_MIN_SIZE),
+	MNCC_RX(MNCC_RTP_CONNECT, check_rtp_connect, sizeof(struct gsm_mncc_rtp),
+		MNCC_RX_LEG | MNCC_RX_REJECT | MNCC_RX_MIN_SIZE),
+	MNCC_RX(MNCC_SOCKET_HELLO, check_hello, sizeof(struct gsm_mncc_hello), 0),
+	MNCC_RX(MNCC_SHM_ACCEPT, check_shm_accept, 0, MNCC_RX_MIN_SIZE),
+};
+
+static struct mncc_rx_stats rx_stats[ARRAY_SIZE(rx_handlers)];
+static struct mncc_rx_stats rx_unhandled;
+
+static void mncc_dispatch(struct mncc_connection *conn, char *buf, int rc)
+{
+	const struct mncc_rx_handler *handler;
+	struct mncc_call_leg *leg = NULL;
+	struct mncc_rx_stats *stats;
+	struct timespec start, end;
+	uint32_t msg_type, callref;
+	uint64_t nsec;
+
+	conn->rx_msgs += 1;
 	memcpy(&msg_type, buf, 4);
-	switch (msg_type) {
-	case MNCC_SOCKET_HELLO:
-		check_hello(conn, buf, rc);
-		break;
-	case MNCC_SETUP_IND:
-		check_setup(conn, buf, rc);
-		break;
-	case MNCC_RTP_CREATE:
-		check_rtp_create(conn, buf, rc);
-		break;
-	case MNCC_RTP_CONNECT:
-		check_rtp_connect(conn, buf, rc);
-		break;
-	case MNCC_DISC_IND:
-		check_disc_ind(conn, buf, rc);
-		break;
-	case MNCC_REL_IND:
-		check_rel_ind(conn, buf, rc);
-		break;
-	case MNCC_REJ_IND:
-		check_rej_ind(conn, buf, rc);
-		break;
-	case MNCC_REL_CNF:
-		check_rel_cnf(conn, buf, rc);
-		break;
-	case MNCC_SETUP_COMPL_IND:
-		check_stp_cmpl_ind(conn, buf, rc);
-		break;
-	case MNCC_SETUP_CNF:
-		check_stp_cnf(conn, buf, rc);
-		break;
-	case MNCC_CALL_CONF_IND:
-		check_cnf_ind(conn, buf, rc);
-		break;
-	case MNCC_ALERT_IND:
-		check_alrt_ind(conn, buf, rc);
-		break;
-	case MNCC_HOLD_IND:
-		check_hold_ind(conn, buf, rc);
-		break;
-	case MNCC_START_DTMF_IND:
-		check_dtmf_start(conn, buf, rc);
-		break;
-	case MNCC_STOP_DTMF_IND:
-		check_dtmf_stop(conn, buf, rc);
-		break;
-	default:
+	if (msg_type >= ARRAY_SIZE(rx_handlers) || !rx_handlers[msg_type].cb) {
 		LOGP(DMNCC, LOGL_ERROR, "Unhandled message type %d/0x%x\n",
 			msg_type, msg_type);
-		break;
+		rx_unhandled.count += 1;
+		return;
+	}
+
+	handler = &rx_handlers[msg_type];
+	stats = &rx_stats[msg_type];
+	if (rc < handler->size
+	    || (rc != handler->size && !(handler->flags & MNCC_RX_MIN_SIZE))) {
+		LOGP(DMNCC, LOGL_ERROR, "%s of wrong size %d vs. %u\n",
+			handler->name, rc, handler->size);
+		stats->bad_size += 1;
+		return close_connection(conn);
+	}
+
+	if (handler->flags & MNCC_RX_LEG) {
+		memcpy(&callref, buf + 4, 4);
+		leg = mncc_find_leg(conn, callref);
+		if (!leg && (handler->flags & MNCC_RX_CANCEL)
+		    && cancel_queued_setup(conn, callref, msg_type))
+			return;
+		if (!leg) {
+			LOGP(DMNCC, LOGL_ERROR, "leg(%u) can not be found\n", callref);
+			stats->unknown_leg += 1;
+			if (handler->flags & MNCC_RX_REJECT)
+				mncc_send(conn, MNCC_REJ_REQ, callref);
+			return;
+		}
+	}
+
+	if (leg)
+		callstate_changed(leg->base.call);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	handler->cb(conn, leg, buf, rc);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	nsec = (end.tv_sec - start.tv_sec) * 1000000000ULL
+		+ end.tv_nsec - start.tv_nsec;
+	stats->count += 1;
+	stats->nsec += nsec;
+	if (nsec > stats->max_nsec)
+		stats->max_nsec = nsec;
+}
+
+void mncc_rx_stats_foreach(mncc_rx_stats_cb cb, void *data)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(rx_handlers); ++i) {
+		if (rx_handlers[i].cb)
+			cb(rx_handlers[i].name, &rx_stats[i], data);
+	}
+	cb("unhandled", &rx_unhandled, data);
+}
+
+/*
+ * Drain a batch of messages per wake-up. Releases are handled as
+ * they come in while new setups are parked in the setup queue and
+ * run after everything else of this loop iteration.
+ */
+static int mncc_data(struct osmo_fd *fd, unsigned int what)
+{
+	char buf[4096];
+	int i, rc;
+	struct mncc_connection *conn = fd->data;
+
+	for (i = 0; i < MNCC_READ_BATCH; ++i) {
+		rc = recv(fd->fd, buf, sizeof(buf), i == 0 ? 0 : MSG_DONTWAIT);
+		if (rc < 0 && i > 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (rc <= 0) {
+			LOGP(DMNCC, LOGL_ERROR, "Failed to read %d/%s. Re-connecting.\n",
+				rc, strerror(errno));
+			goto bad_data;
+		}
+		if (rc <= 4) {
+			LOGP(DMNCC, LOGL_ERROR, "Data too short with: %d\n", rc);
+			goto bad_data;
+		}
+
+		mncc_dispatch(conn, buf, rc);
+
+		/* the connection might have been closed by the handler */
+		if (conn->state == MNCC_DISCONNECTED)
+			break;
 	}
 	return 0;
 
@@ -864,20 +1358,95 @@ bad_data:
 	return 0;
 }
 
-void mncc_connection_init(struct mncc_connection *conn, struct app_config *cfg)
+void mncc_connections_init(struct app_config *app)
+{
+	INIT_LLIST_HEAD(&app->mncc.conns);
+	app->mncc.default_conn = mncc_connection_alloc(app, "default");
+	app->mncc.default_conn->path = talloc_strdup(app->mncc.default_conn,
+							"/tmp/bsc_mncc");
+}
+
+static void mncc_connection_start(struct mncc_connection *conn)
 {
+	/* handed over by a previous instance */
+	if (conn->state != MNCC_DISCONNECTED)
+		return;
+
+	LOGP(DMNCC, LOGL_NOTICE, "Scheduling MNCC connect to %s\n", conn->path);
+	osmo_timer_schedule(&conn->reconnect, 0, 0);
+}
+
+void mncc_connections_start(struct app_config *app)
+{
+	struct mncc_connection *conn;
+
+	app->mncc.started = true;
+	llist_for_each_entry(conn, &app->mncc.conns, entry)
+		mncc_connection_start(conn);
+}
+
+/* Connections added after the start connect right away */
+struct mncc_connection *mncc_connection_alloc(struct app_config *app, const char *name)
+{
+	struct mncc_connection *conn;
+
+	conn = talloc_zero(tall_mncc_ctx, struct mncc_connection);
+	if (!conn)
+		return NULL;
+
+	conn->name = talloc_strdup(conn, name);
 	conn->reconnect.cb = mncc_reconnect;
 	conn->reconnect.data = conn;
 	conn->fd.cb = mncc_data;
 	conn->fd.data = conn;
-	conn->app = cfg;
+	conn->fd.fd = -1;
+	conn->app = app;
 	conn->state = MNCC_DISCONNECTED;
+	conn->on_disconnect = app->mncc.on_disconnect;
+
+	llist_add_tail(&conn->entry, &app->mncc.conns);
+	if (app->mncc.started)
+		mncc_connection_start(conn);
+	return conn;
 }
 
-void mncc_connection_start(struct mncc_connection *conn)
+struct mncc_connection *mncc_connection_find(struct app_config *app, const char *name)
 {
-	LOGP(DMNCC, LOGL_NOTICE, "Scheduling MNCC connect\n");
-	osmo_timer_schedule(&conn->reconnect, 0, 0);
+	struct mncc_connection *conn;
+
+	llist_for_each_entry(conn, &app->mncc.conns, entry) {
+		if (strcmp(conn->name, name) == 0)
+			return conn;
+	}
+
+	return NULL;
+}
+
+/* A call the MSC bridges locally has two callrefs and counts twice */
+unsigned int mncc_connection_calls(struct mncc_connection *conn)
+{
+	return conn->num_legs;
+}
+
+/* The caller makes sure that no call is using the connection */
+void mncc_connection_free(struct mncc_connection *conn)
+{
+	if (conn->state != MNCC_DISCONNECTED) {
+		mncc_shm_stop(conn);
+#ifdef USE_IO_URING
+		if (conn->uring)
+			mncc_uring_stop(conn);
+		else
+#endif
+			osmo_fd_unregister(&conn->fd);
+		close(conn->fd.fd);
+		conn->state = MNCC_DISCONNECTED;
+	}
+	/* nothing is sent for the parked setups on the closed socket */
+	setup_queue_flush(conn);
+	osmo_timer_del(&conn->reconnect);
+	llist_del(&conn->entry);
+	talloc_free(conn);
 }
 
 const struct value_string mncc_conn_state_vals[] = {
@@ -1,13 +1,22 @@
 #pragma once
 
+#include <osmocom/core/linuxlist.h>
 #include <osmocom/core/select.h>
 #include <osmocom/core/timer.h>
 #include <osmocom/core/utils.h>
 
+#include <stdbool.h>
 #include <stdint.h>
 
 struct app_config;
 struct call;
+struct mncc_uring;
+struct mncc_shm;
+struct call_leg;
+struct callstate_leg;
+struct mncc_call_leg;
+
+#define MNCC_STEER_MAX_PREFIXES	16
 
 enum {
 	MNCC_DISCONNECTED,
@@ -15,7 +24,20 @@ enum {
 	MNCC_READY,
 };
 
+/*
+ * A callref lookup only reads this dense array of the connection
+ * instead of following every call to its legs.
+ */
+struct mncc_leg_slot {
+	uint32_t callref;
+	struct mncc_call_leg *leg;
+};
+
 struct mncc_connection {
+	struct llist_head entry;
+	const char *name;
+	const char *path;
+
 	int state;
 	struct app_config *app;
 	struct osmo_fd fd;
@@ -24,13 +46,78 @@ struct mncc_connection {
 
 	uint32_t last_callref;
 
+	/* the legs on this connection, see mncc_find_leg */
+	struct mncc_leg_slot *legs;
+	unsigned int num_legs;
+	unsigned int max_legs;
+	/* open addressing by callref, slot + 1 in conn->legs or 0 if free */
+	uint32_t *leg_index;
+	unsigned int leg_index_size;
+
+	/* calls from SIP with a matching called number or IMSI come here */
+	unsigned int num_called_prefixes;
+	char *called_prefixes[MNCC_STEER_MAX_PREFIXES];
+	unsigned int num_imsi_prefixes;
+	char *imsi_prefixes[MNCC_STEER_MAX_PREFIXES];
+
+	/* statistics */
+	uint64_t reconnects;
+	uint64_t rx_msgs;
+	uint64_t tx_msgs;
+	uint64_t mo_calls;
+	uint64_t mt_calls;
+
+	/* set while the socket is driven by io_uring, see mncc_uring.c */
+	struct mncc_uring *uring;
+	struct {
+		uint64_t enters;
+		uint64_t recvs;
+		uint64_t sends;
+		uint64_t send_batches;
+		uint64_t rearms;
+		uint64_t no_bufs;
+		uint64_t full;
+	} uring_stats;
+
+	/* shared memory rings, used for sending once accepted */
+	struct mncc_shm *shm;
+	bool shm_active;
+	struct {
+		uint64_t sent;
+		uint64_t received;
+		uint64_t kicks;
+		uint64_t wakeups;
+		uint64_t full;
+	} shm_stats;
+
 	/* callback for application logic */
 	void (*on_disconnect)(struct mncc_connection *);
 };
 
-void mncc_connection_init(struct mncc_connection *conn, struct app_config *cfg);
-void mncc_connection_start(struct mncc_connection *conn);
+/* per MNCC message type, see rx_handlers in mncc.c */
+struct mncc_rx_stats {
+	uint64_t count;
+	uint64_t bad_size;
+	uint64_t unknown_leg;
+	uint64_t nsec;
+	uint64_t max_nsec;
+};
+
+typedef void (*mncc_rx_stats_cb)(const char *name, const struct mncc_rx_stats *stats,
+					void *data);
+
+void mncc_connections_init(struct app_config *app);
+void mncc_connections_start(struct app_config *app);
+struct mncc_connection *mncc_connection_alloc(struct app_config *app, const char *name);
+struct mncc_connection *mncc_connection_find(struct app_config *app, const char *name);
+void mncc_connection_free(struct mncc_connection *conn);
+int mncc_connection_adopt(struct mncc_connection *conn, int fd);
+unsigned int mncc_connection_calls(struct mncc_connection *conn);
 
 int mncc_create_remote_leg(struct mncc_connection *conn, struct call *call);
+struct call_leg *mncc_leg_restore(struct mncc_connection *conn, struct call *call,
+					const struct callstate_leg *rec);
+void mncc_release_stale(struct mncc_connection *conn, uint32_t callref, bool reject);
+void mncc_rx_stats_foreach(mncc_rx_stats_cb cb, void *data);
 
 extern const struct value_string mncc_conn_state_vals[];
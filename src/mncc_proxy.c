@@ -0,0 +1,644 @@
+/*
+ * (C) 2017 by Holger Hans Peter Freyther
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "mncc_proxy.h"
+#include "mncc_protocol.h"
+#include "mncc_shm.h"
+#include "mncc.h"
+#include "app.h"
+#include "logging.h"
+
+#include <osmocom/core/socket.h>
+
+#include <talloc.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+extern void *tall_mncc_ctx;
+
+#define PROXY_READ_BATCH	32
+
+/* the callref of every call related message follows the type */
+struct proxy_hdr {
+	uint32_t msg_type;
+	uint32_t callref;
+};
+
+/* A message the socket of a worker had no room for */
+struct proxy_msg {
+	struct llist_head entry;
+	unsigned int len;
+	char data[0];
+};
+
+static void close_msc(struct mncc_proxy *proxy);
+
+static unsigned int msc_bucket(uint32_t callref)
+{
+	return (callref * 2654435761u) & (MNCC_PROXY_HASH_SIZE - 1);
+}
+
+static unsigned int worker_bucket(struct mncc_proxy_worker *worker, uint32_t callref)
+{
+	return ((callref ^ (worker->nr << 20)) * 2654435761u) & (MNCC_PROXY_HASH_SIZE - 1);
+}
+
+static struct mncc_proxy_call *find_msc_call(struct mncc_proxy *proxy, uint32_t callref)
+{
+	struct mncc_proxy_call *call;
+
+	llist_for_each_entry(call, &proxy->msc_hash[msc_bucket(callref)], msc_entry)
+		if (call->msc_callref == callref)
+			return call;
+	return NULL;
+}
+
+static struct mncc_proxy_call *find_worker_call(struct mncc_proxy_worker *worker,
+						uint32_t callref)
+{
+	struct mncc_proxy *proxy = worker->proxy;
+	struct mncc_proxy_call *call;
+
+	llist_for_each_entry(call, &proxy->worker_hash[worker_bucket(worker, callref)],
+				worker_entry)
+		if (call->worker == worker && call->worker_callref == callref)
+			return call;
+	return NULL;
+}
+
+static struct mncc_proxy_call *call_alloc(struct mncc_proxy_worker *worker,
+					uint32_t msc_callref, uint32_t worker_callref)
+{
+	struct mncc_proxy *proxy = worker->proxy;
+	struct mncc_proxy_call *call;
+
+	call = talloc_zero(proxy, struct mncc_proxy_call);
+	if (!call)
+		return NULL;
+
+	call->worker = worker;
+	call->msc_callref = msc_callref;
+	call->worker_callref = worker_callref;
+	llist_add(&call->msc_entry, &proxy->msc_hash[msc_bucket(msc_callref)]);
+	llist_add(&call->worker_entry,
+		&proxy->worker_hash[worker_bucket(worker, worker_callref)]);
+	proxy->calls += 1;
+	worker->calls += 1;
+	return call;
+}
+
+static void call_free(struct mncc_proxy *proxy, struct mncc_proxy_call *call)
+{
+	llist_del(&call->msc_entry);
+	llist_del(&call->worker_entry);
+	if (call->worker)
+		call->worker->calls -= 1;
+	proxy->calls -= 1;
+	talloc_free(call);
+}
+
+/* A callref for a SETUP_REQ. The MSC uses the upper half for its own */
+static uint32_t next_callref(struct mncc_proxy *proxy)
+{
+	do {
+		proxy->next_callref = (proxy->next_callref + 1) & 0x7fffffff;
+	} while (proxy->next_callref == 0 || find_msc_call(proxy, proxy->next_callref));
+
+	return proxy->next_callref;
+}
+
+static int send_msc(struct mncc_proxy *proxy, const void *buf, int len)
+{
+	int rc;
+
+	rc = write(proxy->msc_fd.fd, buf, len);
+	if (rc != len) {
+		LOGP(DMNCC, LOGL_ERROR, "Failed to send to the MSC: %s\n",
+			strerror(errno));
+		close_msc(proxy);
+		return -1;
+	}
+	proxy->tx_msgs += 1;
+	return 0;
+}
+
+static void send_msc_empty(struct mncc_proxy *proxy, uint32_t msg_type, uint32_t callref)
+{
+	struct gsm_mncc mncc = { 0, };
+
+	mncc.msg_type = msg_type;
+	mncc.callref = callref;
+	send_msc(proxy, &mncc, sizeof(mncc));
+}
+
+/*
+ * The worker is still referenced by the caller of send_worker, it is
+ * closed from the timer. Its calls are released towards the MSC then.
+ */
+static void fail_worker(struct mncc_proxy_worker *worker)
+{
+	worker->failed = true;
+	worker->ready = false;
+	worker->fd.when &= ~BSC_FD_WRITE;
+	osmo_timer_schedule(&worker->close, 0, 0);
+}
+
+static void queue_worker(struct mncc_proxy_worker *worker, const void *buf, int len)
+{
+	struct proxy_msg *msg = NULL;
+
+	if (worker->out_queued + len <= MNCC_PROXY_MAX_QUEUE)
+		msg = talloc_size(worker, sizeof(*msg) + len);
+	if (!msg) {
+		LOGP(DMNCC, LOGL_ERROR, "Worker(%u) is not draining %u bytes, closing it\n",
+			worker->nr, worker->out_queued);
+		return fail_worker(worker);
+	}
+
+	msg->len = len;
+	memcpy(msg->data, buf, len);
+	llist_add_tail(&msg->entry, &worker->out_queue);
+	worker->out_queued += len;
+	worker->queued_msgs += 1;
+	worker->fd.when |= BSC_FD_WRITE;
+}
+
+/* A slow worker must not block the MSC, what does not fit is queued */
+static void send_worker(struct mncc_proxy_worker *worker, const void *buf, int len)
+{
+	int rc;
+
+	if (worker->failed)
+		return;
+
+	/* a message must not overtake the queued ones */
+	if (!llist_empty(&worker->out_queue))
+		return queue_worker(worker, buf, len);
+
+	rc = send(worker->fd.fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return queue_worker(worker, buf, len);
+	if (rc != len) {
+		LOGP(DMNCC, LOGL_ERROR, "Failed to send to worker(%u): %s\n",
+			worker->nr, strerror(errno));
+		return fail_worker(worker);
+	}
+	worker->tx_msgs += 1;
+}
+
+/* Until the socket is full, the rest goes out when it is writable again */
+static void drain_worker(struct mncc_proxy_worker *worker)
+{
+	struct proxy_msg *msg, *tmp;
+	int rc;
+
+	llist_for_each_entry_safe(msg, tmp, &worker->out_queue, entry) {
+		rc = send(worker->fd.fd, msg->data, msg->len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (rc != msg->len) {
+			LOGP(DMNCC, LOGL_ERROR, "Failed to send to worker(%u): %s\n",
+				worker->nr, strerror(errno));
+			return fail_worker(worker);
+		}
+
+		worker->tx_msgs += 1;
+		worker->out_queued -= msg->len;
+		llist_del(&msg->entry);
+		talloc_free(msg);
+	}
+	worker->fd.when &= ~BSC_FD_WRITE;
+}
+
+static void send_hello(struct mncc_proxy_worker *worker)
+{
+	struct mncc_proxy *proxy = worker->proxy;
+
+	send_worker(worker, proxy->hello, proxy->hello_len);
+	if (!worker->failed)
+		worker->ready = true;
+}
+
+static bool msc_final(uint32_t msg_type)
+{
+	switch (msg_type) {
+	case MNCC_REL_IND:
+	case MNCC_REL_CNF:
+	case MNCC_REJ_IND:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool worker_final(uint32_t msg_type)
+{
+	switch (msg_type) {
+	case MNCC_REL_CNF:
+	case MNCC_REJ_REQ:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Spread the calls of the MSC by their callref over the ready workers */
+static struct mncc_proxy_worker *pick_worker(struct mncc_proxy *proxy, uint32_t callref)
+{
+	struct mncc_proxy_worker *worker;
+	unsigned int ready = 0, nr;
+
+	llist_for_each_entry(worker, &proxy->workers, entry)
+		if (worker->ready)
+			ready += 1;
+	if (ready == 0)
+		return NULL;
+
+	nr = (callref * 2654435761u) % ready;
+	llist_for_each_entry(worker, &proxy->workers, entry) {
+		if (!worker->ready)
+			continue;
+		if (nr-- == 0)
+			return worker;
+	}
+	return NULL;
+}
+
+static void close_worker(struct mncc_proxy_worker *worker)
+{
+	struct mncc_proxy *proxy = worker->proxy;
+	struct mncc_proxy_call *call, *tmp;
+	unsigned int i;
+
+	LOGP(DMNCC, LOGL_NOTICE, "Worker(%u) is gone with %u calls\n",
+		worker->nr, worker->calls);
+
+	osmo_timer_del(&worker->close);
+	osmo_fd_unregister(&worker->fd);
+	close(worker->fd.fd);
+	llist_del(&worker->entry);
+
+	/* the MSC still has the calls, release them there */
+	for (i = 0; i < MNCC_PROXY_HASH_SIZE && worker->calls > 0; ++i) {
+		llist_for_each_entry_safe(call, tmp, &proxy->worker_hash[i], worker_entry) {
+			if (call->worker != worker)
+				continue;
+			llist_del_init(&call->worker_entry);
+			call->worker = NULL;
+			worker->calls -= 1;
+			proxy->orphaned += 1;
+			if (proxy->msc_state == MNCC_READY)
+				send_msc_empty(proxy, MNCC_DISC_REQ, call->msc_callref);
+		}
+	}
+
+	/* the queued messages are children of the worker */
+	talloc_free(worker);
+}
+
+static void close_worker_cb(void *data)
+{
+	close_worker(data);
+}
+
+static void handle_orphan(struct mncc_proxy *proxy, struct mncc_proxy_call *call,
+				uint32_t msg_type)
+{
+	if (msg_type == MNCC_DISC_IND)
+		send_msc_empty(proxy, MNCC_REL_REQ, call->msc_callref);
+	else if (msc_final(msg_type))
+		call_free(proxy, call);
+}
+
+static void msc_hello(struct mncc_proxy *proxy, char *buf, int len)
+{
+	struct gsm_mncc_hello *hello = (struct gsm_mncc_hello *) buf;
+	struct mncc_proxy_worker *worker;
+
+	if (len < sizeof(*hello) || len > sizeof(proxy->hello)) {
+		LOGP(DMNCC, LOGL_ERROR, "Hello of unexpected size %d\n", len);
+		return close_msc(proxy);
+	}
+	if (hello->version != MNCC_SOCK_VERSION) {
+		LOGP(DMNCC, LOGL_NOTICE, "Incompatible version(%d) expected %d\n",
+			hello->version, MNCC_SOCK_VERSION);
+		return close_msc(proxy);
+	}
+
+	LOGP(DMNCC, LOGL_NOTICE, "Got hello message version %d\n", hello->version);
+	memcpy(proxy->hello, buf, len);
+	proxy->hello_len = len;
+	proxy->msc_state = MNCC_READY;
+
+	/* workers that connected early only get it now */
+	llist_for_each_entry(worker, &proxy->workers, entry)
+		if (!worker->ready)
+			send_hello(worker);
+}
+
+static void msc_message(struct mncc_proxy *proxy, char *buf, int len)
+{
+	struct proxy_hdr *hdr = (struct proxy_hdr *) buf;
+	struct mncc_proxy_worker *worker;
+	struct mncc_proxy_call *call;
+	uint32_t msg_type = hdr->msg_type;
+
+	if (msg_type == MNCC_SOCKET_HELLO)
+		return msc_hello(proxy, buf, len);
+	if (proxy->msc_state != MNCC_READY || len < sizeof(*hdr))
+		return;
+
+	call = find_msc_call(proxy, hdr->callref);
+	if (!call) {
+		if (msg_type != MNCC_SETUP_IND) {
+			LOGP(DMNCC, LOGL_DEBUG, "Unknown callref(%u) for %s\n",
+				hdr->callref, get_mncc_name(msg_type));
+			proxy->unknown_callref += 1;
+			return;
+		}
+
+		worker = pick_worker(proxy, hdr->callref);
+		if (!worker) {
+			LOGP(DMNCC, LOGL_ERROR, "No worker for callref(%u)\n",
+				hdr->callref);
+			proxy->no_worker += 1;
+			return send_msc_empty(proxy, MNCC_REJ_REQ, hdr->callref);
+		}
+		call = call_alloc(worker, hdr->callref, hdr->callref);
+		if (!call)
+			return send_msc_empty(proxy, MNCC_REJ_REQ, hdr->callref);
+		worker->mo_calls += 1;
+	}
+
+	if (!call->worker)
+		return handle_orphan(proxy, call, msg_type);
+
+	worker = call->worker;
+	hdr->callref = call->worker_callref;
+	if (msc_final(msg_type))
+		call_free(proxy, call);
+	send_worker(worker, buf, len);
+}
+
+static int msc_data(struct osmo_fd *fd, unsigned int what)
+{
+	struct mncc_proxy *proxy = fd->data;
+	char buf[4096];
+	int i, rc;
+
+	for (i = 0; i < PROXY_READ_BATCH; ++i) {
+		rc = recv(fd->fd, buf, sizeof(buf), i == 0 ? 0 : MSG_DONTWAIT);
+		if (rc < 0 && i > 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (rc <= 4) {
+			LOGP(DMNCC, LOGL_ERROR, "Failed to read %d/%s. Re-connecting.\n",
+				rc, strerror(errno));
+			close_msc(proxy);
+			break;
+		}
+
+		proxy->rx_msgs += 1;
+		msc_message(proxy, buf, rc);
+		if (proxy->msc_state == MNCC_DISCONNECTED)
+			break;
+	}
+	return 0;
+}
+
+/* Without the MSC all calls are gone. The workers notice by the close */
+static void close_msc(struct mncc_proxy *proxy)
+{
+	struct mncc_proxy_worker *worker, *wtmp;
+	struct mncc_proxy_call *call, *tmp;
+	unsigned int i;
+
+	if (proxy->msc_state == MNCC_DISCONNECTED)
+		return;
+
+	osmo_fd_unregister(&proxy->msc_fd);
+	close(proxy->msc_fd.fd);
+	proxy->msc_fd.fd = -1;
+	proxy->msc_state = MNCC_DISCONNECTED;
+	osmo_timer_schedule(&proxy->reconnect, 5, 0);
+
+	for (i = 0; i < MNCC_PROXY_HASH_SIZE; ++i)
+		llist_for_each_entry_safe(call, tmp, &proxy->msc_hash[i], msc_entry)
+			call_free(proxy, call);
+
+	llist_for_each_entry_safe(worker, wtmp, &proxy->workers, entry)
+		close_worker(worker);
+}
+
+static void msc_reconnect(void *data)
+{
+	struct mncc_proxy *proxy = data;
+	const char *path = proxy->app->mncc.default_conn->path;
+	int rc;
+
+	rc = osmo_sock_unix_init_ofd(&proxy->msc_fd, SOCK_SEQPACKET, 0,
+					path, OSMO_SOCK_F_CONNECT);
+	if (rc < 0) {
+		LOGP(DMNCC, LOGL_ERROR, "Failed to connect(%s). Retrying\n", path);
+		osmo_timer_schedule(&proxy->reconnect, 5, 0);
+		return;
+	}
+
+	LOGP(DMNCC, LOGL_NOTICE, "Reconnected to %s\n", path);
+	proxy->msc_state = MNCC_WAIT_VERSION;
+	proxy->msc_reconnects += 1;
+}
+
+/* An offer of shared memory rings is declined, the fds were dropped by recv */
+static void decline_shm(struct mncc_proxy_worker *worker)
+{
+	struct mncc_shm_accept accept = {
+		.msg_type = MNCC_SHM_ACCEPT,
+		.version = MNCC_SHM_VERSION,
+		.result = -EOPNOTSUPP,
+	};
+
+	send_worker(worker, &accept, sizeof(accept));
+}
+
+static void worker_message(struct mncc_proxy_worker *worker, char *buf, int len)
+{
+	struct mncc_proxy *proxy = worker->proxy;
+	struct proxy_hdr *hdr = (struct proxy_hdr *) buf;
+	struct mncc_proxy_call *call;
+	uint32_t msg_type = hdr->msg_type;
+
+	if (msg_type == MNCC_SHM_OFFER)
+		return decline_shm(worker);
+	if (proxy->msc_state != MNCC_READY || len < sizeof(*hdr))
+		return;
+
+	call = find_worker_call(worker, hdr->callref);
+	if (!call) {
+		if (msg_type != MNCC_SETUP_REQ) {
+			LOGP(DMNCC, LOGL_DEBUG, "Unknown callref(%u) of worker(%u) for %s\n",
+				hdr->callref, worker->nr, get_mncc_name(msg_type));
+			proxy->unknown_callref += 1;
+			return;
+		}
+
+		call = call_alloc(worker, next_callref(proxy), hdr->callref);
+		if (!call)
+			return;
+		worker->mt_calls += 1;
+	}
+
+	/* both legs of a local bridge belong to the same worker */
+	if (msg_type == MNCC_BRIDGE) {
+		struct gsm_mncc_bridge *bridge = (struct gsm_mncc_bridge *) buf;
+		struct mncc_proxy_call *other;
+
+		if (len < sizeof(*bridge))
+			return;
+		other = find_worker_call(worker, bridge->callref[1]);
+		if (!other) {
+			proxy->unknown_callref += 1;
+			return;
+		}
+		bridge->callref[1] = other->msc_callref;
+	}
+
+	hdr->callref = call->msc_callref;
+	if (worker_final(msg_type))
+		call_free(proxy, call);
+	send_msc(proxy, buf, len);
+}
+
+static int worker_data(struct osmo_fd *fd, unsigned int what)
+{
+	struct mncc_proxy_worker *worker = fd->data;
+	struct mncc_proxy *proxy = worker->proxy;
+	char buf[4096];
+	int i, rc;
+
+	if (what & BSC_FD_WRITE)
+		drain_worker(worker);
+	if (!(what & BSC_FD_READ) || worker->failed)
+		return 0;
+
+	for (i = 0; i < PROXY_READ_BATCH; ++i) {
+		rc = recv(fd->fd, buf, sizeof(buf), i == 0 ? 0 : MSG_DONTWAIT);
+		if (rc < 0 && i > 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (rc <= 4) {
+			close_worker(worker);
+			break;
+		}
+
+		worker->rx_msgs += 1;
+		worker_message(worker, buf, rc);
+
+		/* a failed send to the MSC closes the workers as well */
+		if (proxy->msc_state == MNCC_DISCONNECTED || worker->failed)
+			break;
+	}
+	return 0;
+}
+
+static int worker_accept(struct osmo_fd *fd, unsigned int what)
+{
+	struct mncc_proxy *proxy = fd->data;
+	struct mncc_proxy_worker *worker;
+	int sock;
+
+	sock = accept(fd->fd, NULL, NULL);
+	if (sock < 0) {
+		LOGP(DMNCC, LOGL_ERROR, "Failed to accept a worker: %s\n",
+			strerror(errno));
+		return 0;
+	}
+
+	worker = talloc_zero(proxy, struct mncc_proxy_worker);
+	if (!worker) {
+		close(sock);
+		return 0;
+	}
+	worker->proxy = proxy;
+	worker->nr = proxy->next_worker_nr++;
+	worker->fd.fd = sock;
+	worker->fd.when = BSC_FD_READ;
+	worker->fd.cb = worker_data;
+	worker->fd.data = worker;
+	worker->close.cb = close_worker_cb;
+	worker->close.data = worker;
+	INIT_LLIST_HEAD(&worker->out_queue);
+	if (osmo_fd_register(&worker->fd) != 0) {
+		close(sock);
+		talloc_free(worker);
+		return 0;
+	}
+	llist_add_tail(&worker->entry, &proxy->workers);
+
+	LOGP(DMNCC, LOGL_NOTICE, "Worker(%u) connected\n", worker->nr);
+	if (proxy->msc_state == MNCC_READY)
+		send_hello(worker);
+	return 0;
+}
+
+int mncc_proxy_start(struct app_config *app)
+{
+	struct mncc_proxy *proxy;
+	unsigned int i;
+	int rc;
+
+	proxy = talloc_zero(tall_mncc_ctx, struct mncc_proxy);
+	if (!proxy)
+		return -1;
+
+	proxy->app = app;
+	proxy->msc_state = MNCC_DISCONNECTED;
+	proxy->msc_fd.fd = -1;
+	proxy->msc_fd.cb = msc_data;
+	proxy->msc_fd.data = proxy;
+	proxy->reconnect.cb = msc_reconnect;
+	proxy->reconnect.data = proxy;
+	INIT_LLIST_HEAD(&proxy->workers);
+	for (i = 0; i < MNCC_PROXY_HASH_SIZE; ++i) {
+		INIT_LLIST_HEAD(&proxy->msc_hash[i]);
+		INIT_LLIST_HEAD(&proxy->worker_hash[i]);
+	}
+
+	proxy->listen_fd.cb = worker_accept;
+	proxy->listen_fd.data = proxy;
+	unlink(app->mncc_proxy.path);
+	rc = osmo_sock_unix_init_ofd(&proxy->listen_fd, SOCK_SEQPACKET, 0,
+					app->mncc_proxy.path, OSMO_SOCK_F_BIND);
+	if (rc < 0) {
+		LOGP(DMNCC, LOGL_ERROR, "Failed to listen on %s\n",
+			app->mncc_proxy.path);
+		talloc_free(proxy);
+		return -1;
+	}
+
+	LOGP(DMNCC, LOGL_NOTICE, "Proxying %s for workers on %s\n",
+		app->mncc.default_conn->path, app->mncc_proxy.path);
+	app->mncc_proxy.proxy = proxy;
+	osmo_timer_schedule(&proxy->reconnect, 0, 0);
+	return 0;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/select.h>
+#include <osmocom/core/timer.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct app_config;
+
+#define MNCC_PROXY_HASH_SIZE	4096	/* power of two */
+/* bytes queued behind a slow worker before it is closed */
+#define MNCC_PROXY_MAX_QUEUE	(1024 * 1024)
+
+/*
+ * The proxy mode owns the MNCC socket of the MSC and spreads the
+ * calls over connector processes. The workers are unmodified
+ * connectors that use the listen socket of the proxy as their MNCC
+ * socket-path. A call stays with its worker until it is released.
+ */
+struct mncc_proxy_worker {
+	struct llist_head entry;
+	struct mncc_proxy *proxy;
+	struct osmo_fd fd;
+	unsigned int nr;
+
+	/* the hello of the MSC has been passed on */
+	bool ready;
+	unsigned int calls;
+
+	/* messages the socket had no room for, in order */
+	struct llist_head out_queue;
+	unsigned int out_queued;
+	/* a send failed, the worker is closed from the timer */
+	bool failed;
+	struct osmo_timer_list close;
+
+	/* statistics */
+	uint64_t rx_msgs;
+	uint64_t tx_msgs;
+	uint64_t queued_msgs;
+	uint64_t mo_calls;
+	uint64_t mt_calls;
+};
+
+/*
+ * Calls from the MSC keep their callref. The callrefs the workers pick
+ * for their SETUP_REQ are only unique per worker and are mapped to a
+ * callref of the proxy.
+ */
+struct mncc_proxy_call {
+	struct llist_head msc_entry;	/* by msc_callref */
+	struct llist_head worker_entry;	/* by worker and worker_callref */
+	struct mncc_proxy_worker *worker; /* NULL once the worker is gone */
+	uint32_t msc_callref;
+	uint32_t worker_callref;
+};
+
+struct mncc_proxy {
+	struct app_config *app;
+
+	/* towards the MSC */
+	struct osmo_fd msc_fd;
+	struct osmo_timer_list reconnect;
+	int msc_state;
+	char hello[128];
+	unsigned int hello_len;
+
+	/* towards the workers */
+	struct osmo_fd listen_fd;
+	struct llist_head workers;
+	unsigned int next_worker_nr;
+
+	struct llist_head msc_hash[MNCC_PROXY_HASH_SIZE];
+	struct llist_head worker_hash[MNCC_PROXY_HASH_SIZE];
+	unsigned int calls;
+	uint32_t next_callref;
+
+	/* statistics */
+	uint64_t msc_reconnects;
+	uint64_t rx_msgs;
+	uint64_t tx_msgs;
+	uint64_t unknown_callref;
+	uint64_t no_worker;
+	uint64_t orphaned;
+};
+
+int mncc_proxy_start(struct app_config *app);
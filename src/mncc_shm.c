@@ -0,0 +1,388 @@
+/*
+ * (C) 2017 by Holger Hans Peter Freyther
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include "mncc_shm.h"
+#include "mncc.h"
+#include "logging.h"
+
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/select.h>
+#include <osmocom/core/timer.h>
+
+#include <talloc.h>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+extern void *tall_mncc_ctx;
+
+/* messages queued behind a full ring before the MSC is given up on */
+#define SHM_OVERFLOW_MAX	4096
+/* the MSC does not tell us when it made room, look again after this */
+#define SHM_RETRY_US		1000
+
+/* A message waiting for room in the ring towards the MSC */
+struct shm_overflow {
+	struct llist_head entry;
+	uint32_t len;
+	char data[MNCC_SHM_SLOT_SIZE - 8];
+};
+
+struct mncc_shm {
+	struct mncc_connection *conn;
+	mncc_shm_recv_cb recv;
+	mncc_shm_error_cb error;
+
+	struct mncc_shm_area *area;
+	int memfd;
+	int msc_doorbell;
+	struct osmo_fd doorbell;
+	bool active;
+
+	/* in order, nothing may overtake them */
+	struct llist_head overflow;
+	unsigned int num_overflow;
+	struct osmo_timer_list retry;
+};
+
+static void shm_free(struct mncc_shm *shm)
+{
+	osmo_timer_del(&shm->retry);
+	if (shm->doorbell.fd >= 0) {
+		if (shm->active)
+			osmo_fd_unregister(&shm->doorbell);
+		close(shm->doorbell.fd);
+	}
+	if (shm->msc_doorbell >= 0)
+		close(shm->msc_doorbell);
+	if (shm->area)
+		munmap(shm->area, sizeof(*shm->area));
+	if (shm->memfd >= 0)
+		close(shm->memfd);
+	talloc_free(shm);
+}
+
+static void kick(int fd)
+{
+	uint64_t one = 1;
+
+	if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		LOGP(DMNCC, LOGL_ERROR, "Failed to ring the doorbell: %s\n",
+			strerror(errno));
+}
+
+static void commit_slot(struct mncc_shm *shm)
+{
+	struct mncc_connection *conn = shm->conn;
+
+	conn->shm_stats.sent += 1;
+	if (mncc_shm_ring_commit(&shm->area->to_msc)) {
+		conn->shm_stats.kicks += 1;
+		kick(shm->msc_doorbell);
+	}
+}
+
+/* Move what fits from the overflow into the ring */
+static void drain_overflow(struct mncc_shm *shm)
+{
+	struct shm_overflow *msg, *tmp;
+	struct mncc_shm_slot *slot;
+
+	llist_for_each_entry_safe(msg, tmp, &shm->overflow, entry) {
+		slot = mncc_shm_ring_reserve(&shm->area->to_msc);
+		if (!slot)
+			break;
+		memcpy(slot->data, msg->data, msg->len);
+		slot->len = msg->len;
+		commit_slot(shm);
+		llist_del(&msg->entry);
+		shm->num_overflow -= 1;
+		talloc_free(msg);
+	}
+
+	if (!llist_empty(&shm->overflow))
+		osmo_timer_schedule(&shm->retry, 0, SHM_RETRY_US);
+}
+
+static void retry_cb(void *data)
+{
+	drain_overflow(data);
+}
+
+/*
+ * Handle what the MSC put into the ring. The messages are dispatched
+ * from the shared memory and the slot is released afterwards. After a
+ * full ring worth we yield and ring our own doorbell to come back.
+ */
+static int doorbell_cb(struct osmo_fd *fd, unsigned int what)
+{
+	struct mncc_shm *shm = fd->data;
+	struct mncc_connection *conn = shm->conn;
+	struct mncc_shm_ring *ring = &shm->area->from_msc;
+	struct mncc_shm_slot *slot;
+	unsigned int count = 0;
+	uint64_t events;
+
+	if (read(fd->fd, &events, sizeof(events)) < 0 && errno != EAGAIN)
+		LOGP(DMNCC, LOGL_ERROR, "Failed to read the doorbell: %s\n",
+			strerror(errno));
+	conn->shm_stats.wakeups += 1;
+
+	/* the MSC is awake and might have made room */
+	if (!llist_empty(&shm->overflow))
+		drain_overflow(shm);
+
+	do {
+		while ((slot = mncc_shm_ring_peek(ring))) {
+			uint32_t len = slot->len;
+
+			if (len <= 4 || len > sizeof(slot->data)) {
+				LOGP(DMNCC, LOGL_ERROR, "Bad message length %u in the ring\n",
+					len);
+				shm->error(conn);
+				return 0;
+			}
+
+			conn->shm_stats.received += 1;
+			shm->recv(conn, slot->data, len);
+
+			/* the connection might have been closed by the handler */
+			if (conn->shm != shm)
+				return 0;
+			mncc_shm_ring_release(ring);
+
+			if (++count == MNCC_SHM_SLOTS) {
+				kick(fd->fd);
+				return 0;
+			}
+		}
+	} while (!mncc_shm_ring_idle(ring));
+	return 0;
+}
+
+/*
+ * Create the rings and offer them to the MSC. Until the accept we keep
+ * using the socket. An MSC that does not know the offer ignores it.
+ */
+int mncc_shm_offer(struct mncc_connection *conn, mncc_shm_recv_cb recv,
+			mncc_shm_error_cb error)
+{
+	struct mncc_shm_offer offer = { 0, };
+	struct mncc_shm *shm;
+	struct cmsghdr *cmsg;
+	struct msghdr msg = { 0, };
+	struct iovec iov;
+	union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	int fds[3];
+
+	shm = talloc_zero(tall_mncc_ctx, struct mncc_shm);
+	if (!shm)
+		return -1;
+	shm->conn = conn;
+	shm->recv = recv;
+	shm->error = error;
+	shm->msc_doorbell = -1;
+	shm->doorbell.fd = -1;
+	INIT_LLIST_HEAD(&shm->overflow);
+	shm->retry.cb = retry_cb;
+	shm->retry.data = shm;
+
+	shm->memfd = memfd_create("osmo-sip-connector-mncc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (shm->memfd < 0 || ftruncate(shm->memfd, sizeof(*shm->area)) != 0) {
+		LOGP(DMNCC, LOGL_ERROR, "Failed to create the memfd: %s\n",
+			strerror(errno));
+		goto error;
+	}
+	/* the MSC must not be able to pull the memory away */
+	fcntl(shm->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+
+	shm->area = mmap(NULL, sizeof(*shm->area), PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, shm->memfd, 0);
+	if (shm->area == MAP_FAILED) {
+		shm->area = NULL;
+		LOGP(DMNCC, LOGL_ERROR, "Failed to map the rings: %s\n",
+			strerror(errno));
+		goto error;
+	}
+	shm->area->magic = MNCC_SHM_MAGIC;
+	shm->area->version = MNCC_SHM_VERSION;
+
+	shm->msc_doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	shm->doorbell.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (shm->msc_doorbell < 0 || shm->doorbell.fd < 0) {
+		LOGP(DMNCC, LOGL_ERROR, "Failed to create the doorbells: %s\n",
+			strerror(errno));
+		goto error;
+	}
+	shm->doorbell.when = BSC_FD_READ;
+	shm->doorbell.cb = doorbell_cb;
+	shm->doorbell.data = shm;
+
+	offer.msg_type = MNCC_SHM_OFFER;
+	offer.version = MNCC_SHM_VERSION;
+	offer.size = sizeof(*shm->area);
+	offer.slots = MNCC_SHM_SLOTS;
+	offer.slot_size = MNCC_SHM_SLOT_SIZE;
+
+	iov.iov_base = &offer;
+	iov.iov_len = sizeof(offer);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	fds[0] = shm->memfd;
+	fds[1] = shm->msc_doorbell;
+	fds[2] = shm->doorbell.fd;
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(conn->fd.fd, &msg, MSG_NOSIGNAL) != sizeof(offer)) {
+		LOGP(DMNCC, LOGL_ERROR, "Failed to send the ring offer: %s\n",
+			strerror(errno));
+		goto error;
+	}
+
+	LOGP(DMNCC, LOGL_NOTICE, "Offered shared memory rings to the MSC\n");
+	conn->shm = shm;
+	return 0;
+
+error:
+	shm_free(shm);
+	return -1;
+}
+
+void mncc_shm_accepted(struct mncc_connection *conn, const char *buf, int len)
+{
+	struct mncc_shm *shm = conn->shm;
+	struct mncc_shm_accept accept;
+
+	if (!shm || shm->active) {
+		LOGP(DMNCC, LOGL_ERROR, "Unexpected ring accept\n");
+		return;
+	}
+
+	if (len != sizeof(accept)) {
+		LOGP(DMNCC, LOGL_ERROR, "Ring accept shorter than expected %d vs. %zu\n",
+			len, sizeof(accept));
+		goto fallback;
+	}
+
+	memcpy(&accept, buf, sizeof(accept));
+	if (accept.version != MNCC_SHM_VERSION || accept.result != 0) {
+		LOGP(DMNCC, LOGL_NOTICE, "MSC declined the rings version(%u) result(%d)\n",
+			accept.version, accept.result);
+		goto fallback;
+	}
+
+	if (osmo_fd_register(&shm->doorbell) != 0)
+		goto fallback;
+
+	LOGP(DMNCC, LOGL_NOTICE, "Using the shared memory rings\n");
+	shm->active = true;
+	conn->shm_active = true;
+	return;
+
+fallback:
+	mncc_shm_stop(conn);
+}
+
+void mncc_shm_stop(struct mncc_connection *conn)
+{
+	struct mncc_shm *shm = conn->shm;
+
+	if (!shm)
+		return;
+
+	conn->shm = NULL;
+	conn->shm_active = false;
+	shm_free(shm);
+}
+
+/*
+ * Put the message into the ring towards the MSC. A full ring is not
+ * an error, the message waits in the overflow list and is moved into
+ * the ring once the MSC made room. Only an MSC that stopped draining
+ * altogether is given up on.
+ */
+int mncc_shm_sendv(struct mncc_connection *conn, const struct iovec *iov, int iovcnt)
+{
+	struct mncc_shm *shm = conn->shm;
+	struct mncc_shm_slot *slot = NULL;
+	struct shm_overflow *msg;
+	char *out;
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; ++i)
+		len += iov[i].iov_len;
+	if (len > sizeof(slot->data))
+		return -1;
+
+	if (!llist_empty(&shm->overflow))
+		drain_overflow(shm);
+	if (llist_empty(&shm->overflow))
+		slot = mncc_shm_ring_reserve(&shm->area->to_msc);
+
+	if (!slot) {
+		if (shm->num_overflow == SHM_OVERFLOW_MAX) {
+			LOGP(DMNCC, LOGL_ERROR, "MNCC %s is not draining %u messages\n",
+				conn->name, shm->num_overflow);
+			return -1;
+		}
+		msg = talloc(shm, struct shm_overflow);
+		if (!msg)
+			return -1;
+		out = msg->data;
+		msg->len = len;
+		llist_add_tail(&msg->entry, &shm->overflow);
+		shm->num_overflow += 1;
+		conn->shm_stats.full += 1;
+		if (!osmo_timer_pending(&shm->retry)) {
+			kick(shm->msc_doorbell);
+			osmo_timer_schedule(&shm->retry, 0, SHM_RETRY_US);
+		}
+	} else
+		out = slot->data;
+
+	for (i = 0, len = 0; i < iovcnt; ++i) {
+		memcpy(out + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+	if (slot) {
+		slot->len = len;
+		commit_slot(shm);
+	}
+	return len;
+}
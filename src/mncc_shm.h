@@ -0,0 +1,117 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Shared memory transport for an MSC on the same host. After the
+ * hello we offer a memfd with a single producer, single consumer ring
+ * per direction and an eventfd doorbell for each. Once the MSC
+ * accepted, messages are exchanged through the rings and read in
+ * place. The socket stays open and still tells us when the MSC is gone.
+ *
+ * This header is shared with the MSC side in contrib/mncc-shm and
+ * must not depend on anything but libc.
+ */
+#define MNCC_SHM_OFFER		0x0480
+#define MNCC_SHM_ACCEPT		0x0481
+
+#define MNCC_SHM_MAGIC		0x4d4e5348
+#define MNCC_SHM_VERSION	1
+#define MNCC_SHM_SLOTS		512	/* power of two */
+#define MNCC_SHM_SLOT_SIZE	1024
+
+/*
+ * Sent with SCM_RIGHTS for the memfd, the doorbell of the MSC (we
+ * write it) and ours (the MSC writes it), in this order.
+ */
+struct mncc_shm_offer {
+	uint32_t	msg_type;
+	uint32_t	version;
+	uint32_t	size;
+	uint32_t	slots;
+	uint32_t	slot_size;
+};
+
+struct mncc_shm_accept {
+	uint32_t	msg_type;
+	uint32_t	version;
+	int32_t		result;		/* 0 or a negative errno */
+};
+
+struct mncc_shm_slot {
+	uint32_t	len;
+	uint32_t	reserved;
+	char		data[MNCC_SHM_SLOT_SIZE - 8];
+};
+
+/* head is only written by the producer, tail only by the consumer */
+struct mncc_shm_ring {
+	uint32_t	head __attribute__((aligned(64)));
+	uint32_t	tail __attribute__((aligned(64)));
+	struct mncc_shm_slot slots[MNCC_SHM_SLOTS] __attribute__((aligned(64)));
+};
+
+struct mncc_shm_area {
+	uint32_t	magic;
+	uint32_t	version;
+	struct mncc_shm_ring to_msc;
+	struct mncc_shm_ring from_msc;
+};
+
+/* The slot to fill next or NULL when the ring is full */
+static inline struct mncc_shm_slot *mncc_shm_ring_reserve(struct mncc_shm_ring *ring)
+{
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	if (ring->head - tail >= MNCC_SHM_SLOTS)
+		return NULL;
+	return &ring->slots[ring->head % MNCC_SHM_SLOTS];
+}
+
+/*
+ * Publish the reserved slot. Returns true when the consumer had
+ * drained the ring before and might be asleep on its doorbell. The
+ * fence pairs with the one in mncc_shm_ring_idle().
+ */
+static inline bool mncc_shm_ring_commit(struct mncc_shm_ring *ring)
+{
+	uint32_t head = ring->head;
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) == head;
+}
+
+/* The oldest message or NULL. It stays valid until released */
+static inline struct mncc_shm_slot *mncc_shm_ring_peek(struct mncc_shm_ring *ring)
+{
+	if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail)
+		return NULL;
+	return &ring->slots[ring->tail % MNCC_SHM_SLOTS];
+}
+
+static inline void mncc_shm_ring_release(struct mncc_shm_ring *ring)
+{
+	__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Check again after draining before going to sleep on the doorbell */
+static inline bool mncc_shm_ring_idle(struct mncc_shm_ring *ring)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail;
+}
+
+struct mncc_connection;
+struct iovec;
+
+typedef void (*mncc_shm_recv_cb)(struct mncc_connection *conn, char *buf, int len);
+typedef void (*mncc_shm_error_cb)(struct mncc_connection *conn);
+
+int mncc_shm_offer(struct mncc_connection *conn, mncc_shm_recv_cb recv,
+			mncc_shm_error_cb error);
+void mncc_shm_accepted(struct mncc_connection *conn, const char *buf, int len);
+void mncc_shm_stop(struct mncc_connection *conn);
+int mncc_shm_sendv(struct mncc_connection *conn, const struct iovec *iov, int iovcnt);
@@ -0,0 +1,414 @@
+/*
+ * (C) 2017 by Holger Hans Peter Freyther
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "mncc_uring.h"
+#include "mncc.h"
+#include "logging.h"
+
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/select.h>
+
+#include <talloc.h>
+
+#include <liburing.h>
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#define URING_ENTRIES		128
+#define URING_BGID		1
+#define URING_BUFS		64	/* power of two */
+#define URING_BUF_SIZE		4096
+#define URING_SLOTS		64
+#define URING_SLOT_SIZE		2048
+#define URING_BATCH		32
+#define URING_OVERFLOW_MAX	4096
+
+/* user_data of the receive, the sends use their slot */
+#define URING_RECV		((uint64_t) -1)
+
+extern void *tall_mncc_ctx;
+
+/* A message waiting for a free slot */
+struct uring_overflow {
+	struct llist_head entry;
+	unsigned int len;
+	char data[URING_SLOT_SIZE];
+};
+
+struct mncc_uring {
+	struct llist_head entry;
+	struct mncc_connection *conn;
+	mncc_uring_recv_cb recv;
+	mncc_uring_error_cb error;
+
+	struct io_uring ring;
+	struct io_uring_buf_ring *br;
+	char *bufs;
+	bool recv_armed;
+
+	/* completions are signalled on this one */
+	struct osmo_fd efd;
+
+	/*
+	 * Outgoing messages in order, the in flight ones first. Only one
+	 * linked batch is in flight so a later send can not overtake an
+	 * earlier one that had to wait for room in the socket.
+	 */
+	char slots[URING_SLOTS][URING_SLOT_SIZE];
+	unsigned int slot_len[URING_SLOTS];
+	unsigned int head;
+	unsigned int in_flight;
+	unsigned int queued;
+
+	/* all slots were taken, moved into them as sends complete */
+	struct llist_head overflow;
+	unsigned int num_overflow;
+};
+
+static LLIST_HEAD(g_urings);
+
+static void arm_recv(struct mncc_uring *uring)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&uring->ring);
+	if (!sqe)
+		return;
+
+	io_uring_prep_recv_multishot(sqe, uring->conn->fd.fd, NULL, 0, 0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	io_uring_sqe_set_data64(sqe, URING_RECV);
+	uring->recv_armed = true;
+	uring->conn->uring_stats.rearms += 1;
+}
+
+static void prep_sends(struct mncc_uring *uring)
+{
+	unsigned int i;
+
+	if (uring->queued == 0 || uring->in_flight > 0)
+		return;
+
+	for (i = 0; i < uring->queued; ++i) {
+		unsigned int slot = (uring->head + i) % URING_SLOTS;
+		struct io_uring_sqe *sqe;
+
+		/* the ring has room for all slots and the receive */
+		sqe = io_uring_get_sqe(&uring->ring);
+		io_uring_prep_send(sqe, uring->conn->fd.fd, uring->slots[slot],
+					uring->slot_len[slot], MSG_NOSIGNAL);
+		io_uring_sqe_set_data64(sqe, slot);
+		if (i + 1 < uring->queued)
+			sqe->flags |= IOSQE_IO_LINK;
+	}
+
+	uring->in_flight = uring->queued;
+	uring->queued = 0;
+	uring->conn->uring_stats.send_batches += 1;
+}
+
+static int submit(struct mncc_uring *uring)
+{
+	int rc;
+
+	prep_sends(uring);
+	if (io_uring_sq_ready(&uring->ring) == 0)
+		return 0;
+
+	uring->conn->uring_stats.enters += 1;
+	rc = io_uring_submit(&uring->ring);
+	if (rc < 0)
+		LOGP(DMNCC, LOGL_ERROR, "Failed to submit to io_uring: %s\n",
+			strerror(-rc));
+	return rc;
+}
+
+/*
+ * Returns false once the connection is gone, the uring is freed by
+ * then.
+ */
+static bool handle_cqe(struct mncc_uring *uring, uint64_t data, int res,
+			unsigned int flags)
+{
+	struct mncc_connection *conn = uring->conn;
+	unsigned int bid;
+	char *buf;
+
+	if (data != URING_RECV) {
+		if (res < 0) {
+			LOGP(DMNCC, LOGL_ERROR, "Failed to send %s. Re-connecting.\n",
+				strerror(-res));
+			uring->error(conn);
+			return false;
+		}
+		uring->head = (uring->head + 1) % URING_SLOTS;
+		uring->in_flight -= 1;
+		conn->uring_stats.sends += 1;
+		return true;
+	}
+
+	if (!(flags & IORING_CQE_F_MORE))
+		uring->recv_armed = false;
+
+	/* all buffers are in use, the receive is armed again below */
+	if (res == -ENOBUFS) {
+		conn->uring_stats.no_bufs += 1;
+		return true;
+	}
+	if (res <= 0) {
+		LOGP(DMNCC, LOGL_ERROR, "Failed to read %d/%s. Re-connecting.\n",
+			res, strerror(-res));
+		uring->error(conn);
+		return false;
+	}
+
+	bid = flags >> IORING_CQE_BUFFER_SHIFT;
+	buf = uring->bufs + bid * URING_BUF_SIZE;
+	conn->uring_stats.recvs += 1;
+
+	if (res <= 4) {
+		LOGP(DMNCC, LOGL_ERROR, "Data too short with: %d\n", res);
+		uring->error(conn);
+		return false;
+	}
+
+	uring->recv(conn, buf, res);
+
+	/* the connection might have been closed by the handler */
+	if (conn->uring != uring)
+		return false;
+
+	io_uring_buf_ring_add(uring->br, buf, URING_BUF_SIZE, bid,
+				io_uring_buf_ring_mask(URING_BUFS), 0);
+	io_uring_buf_ring_advance(uring->br, 1);
+	return true;
+}
+
+/* In order, nothing may overtake the overflow */
+static void refill_slots(struct mncc_uring *uring)
+{
+	struct uring_overflow *msg, *tmp;
+	unsigned int slot;
+
+	llist_for_each_entry_safe(msg, tmp, &uring->overflow, entry) {
+		if (uring->in_flight + uring->queued == URING_SLOTS)
+			return;
+		slot = (uring->head + uring->in_flight + uring->queued) % URING_SLOTS;
+		memcpy(uring->slots[slot], msg->data, msg->len);
+		uring->slot_len[slot] = msg->len;
+		uring->queued += 1;
+		uring->num_overflow -= 1;
+		llist_del(&msg->entry);
+		talloc_free(msg);
+	}
+}
+
+static int uring_completions(struct osmo_fd *fd, unsigned int what)
+{
+	struct mncc_uring *uring = fd->data;
+	struct {
+		uint64_t data;
+		int res;
+		unsigned int flags;
+	} done[URING_BATCH];
+	struct io_uring_cqe *cqe;
+	unsigned int head, i, count;
+	uint64_t events;
+
+	if (read(fd->fd, &events, sizeof(events)) < 0 && errno != EAGAIN)
+		LOGP(DMNCC, LOGL_ERROR, "Failed to read eventfd: %s\n",
+			strerror(errno));
+
+	do {
+		/* copy out first, a handler might free the ring */
+		count = 0;
+		io_uring_for_each_cqe(&uring->ring, head, cqe) {
+			done[count].data = cqe->user_data;
+			done[count].res = cqe->res;
+			done[count].flags = cqe->flags;
+			if (++count == URING_BATCH)
+				break;
+		}
+		io_uring_cq_advance(&uring->ring, count);
+
+		for (i = 0; i < count; ++i) {
+			if (!handle_cqe(uring, done[i].data, done[i].res, done[i].flags))
+				return 0;
+		}
+	} while (count == URING_BATCH);
+
+	/* submitted with the next flush */
+	refill_slots(uring);
+	if (!uring->recv_armed)
+		arm_recv(uring);
+	return 0;
+}
+
+int mncc_uring_start(struct mncc_connection *conn, mncc_uring_recv_cb recv,
+			mncc_uring_error_cb error)
+{
+	struct mncc_uring *uring;
+	unsigned int i;
+	int rc;
+
+	uring = talloc_zero(tall_mncc_ctx, struct mncc_uring);
+	if (!uring)
+		return -1;
+
+	uring->conn = conn;
+	uring->recv = recv;
+	uring->error = error;
+	uring->efd.fd = -1;
+	INIT_LLIST_HEAD(&uring->overflow);
+
+	rc = io_uring_queue_init(URING_ENTRIES, &uring->ring, 0);
+	if (rc < 0) {
+		LOGP(DMNCC, LOGL_ERROR, "Failed to set up io_uring: %s\n",
+			strerror(-rc));
+		talloc_free(uring);
+		return -1;
+	}
+
+	uring->bufs = talloc_size(uring, URING_BUFS * URING_BUF_SIZE);
+	uring->br = io_uring_setup_buf_ring(&uring->ring, URING_BUFS, URING_BGID,
+						0, &rc);
+	if (!uring->bufs || !uring->br) {
+		LOGP(DMNCC, LOGL_ERROR, "Failed to set up the buffer ring: %s\n",
+			strerror(-rc));
+		goto error;
+	}
+	for (i = 0; i < URING_BUFS; ++i)
+		io_uring_buf_ring_add(uring->br, uring->bufs + i * URING_BUF_SIZE,
+					URING_BUF_SIZE, i,
+					io_uring_buf_ring_mask(URING_BUFS), i);
+	io_uring_buf_ring_advance(uring->br, URING_BUFS);
+
+	uring->efd.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (uring->efd.fd < 0 || io_uring_register_eventfd(&uring->ring, uring->efd.fd) < 0) {
+		LOGP(DMNCC, LOGL_ERROR, "Failed to set up the completion eventfd\n");
+		goto error;
+	}
+	uring->efd.when = BSC_FD_READ;
+	uring->efd.cb = uring_completions;
+	uring->efd.data = uring;
+	if (osmo_fd_register(&uring->efd) != 0)
+		goto error;
+
+	conn->uring = uring;
+	llist_add_tail(&uring->entry, &g_urings);
+	arm_recv(uring);
+	submit(uring);
+	return 0;
+
+error:
+	if (uring->efd.fd >= 0)
+		close(uring->efd.fd);
+	if (uring->br)
+		io_uring_free_buf_ring(&uring->ring, uring->br, URING_BUFS, URING_BGID);
+	io_uring_queue_exit(&uring->ring);
+	talloc_free(uring);
+	return -1;
+}
+
+/* Tear down before the socket is closed. Pending sends are dropped */
+void mncc_uring_stop(struct mncc_connection *conn)
+{
+	struct mncc_uring *uring = conn->uring;
+
+	if (!uring)
+		return;
+
+	conn->uring = NULL;
+	llist_del(&uring->entry);
+	osmo_fd_unregister(&uring->efd);
+	close(uring->efd.fd);
+	io_uring_free_buf_ring(&uring->ring, uring->br, URING_BUFS, URING_BGID);
+	io_uring_queue_exit(&uring->ring);
+	talloc_free(uring);
+}
+
+static void copy_iov(char *out, const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; ++i) {
+		memcpy(out + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+}
+
+/*
+ * Queue a message. It goes out with the flush at the end of the loop
+ * iteration. When all slots are taken it waits in the overflow list
+ * until sends complete, nothing is received from in here.
+ */
+int mncc_uring_sendv(struct mncc_connection *conn, const struct iovec *iov, int iovcnt)
+{
+	struct mncc_uring *uring = conn->uring;
+	struct uring_overflow *msg;
+	unsigned int slot;
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; ++i)
+		len += iov[i].iov_len;
+	if (len > URING_SLOT_SIZE)
+		return -1;
+
+	if (uring->in_flight + uring->queued == URING_SLOTS
+	    || !llist_empty(&uring->overflow)) {
+		if (uring->num_overflow == URING_OVERFLOW_MAX) {
+			LOGP(DMNCC, LOGL_ERROR, "MNCC %s is not draining %u messages\n",
+				conn->name, uring->num_overflow);
+			return -1;
+		}
+		msg = talloc(uring, struct uring_overflow);
+		if (!msg)
+			return -1;
+		copy_iov(msg->data, iov, iovcnt);
+		msg->len = len;
+		llist_add_tail(&msg->entry, &uring->overflow);
+		uring->num_overflow += 1;
+		conn->uring_stats.full += 1;
+		return len;
+	}
+
+	slot = (uring->head + uring->in_flight + uring->queued) % URING_SLOTS;
+	copy_iov(uring->slots[slot], iov, iovcnt);
+	uring->slot_len[slot] = len;
+	uring->queued += 1;
+	return len;
+}
+
+/* Everything of this loop iteration with one io_uring_enter per ring */
+void mncc_uring_flush_all(void)
+{
+	struct mncc_uring *uring;
+
+	llist_for_each_entry(uring, &g_urings, entry)
+		submit(uring);
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+
+struct mncc_connection;
+struct iovec;
+
+typedef void (*mncc_uring_recv_cb)(struct mncc_connection *conn, char *buf, int len);
+typedef void (*mncc_uring_error_cb)(struct mncc_connection *conn);
+
+/*
+ * io_uring transport of the MNCC socket. A multishot receive keeps
+ * filling the provided buffers and outgoing messages are submitted
+ * together once per loop iteration by mncc_uring_flush_all().
+ */
+int mncc_uring_start(struct mncc_connection *conn, mncc_uring_recv_cb recv,
+			mncc_uring_error_cb error);
+void mncc_uring_stop(struct mncc_connection *conn);
+int mncc_uring_sendv(struct mncc_connection *conn, const struct iovec *iov, int iovcnt);
+void mncc_uring_flush_all(void);
@@ -0,0 +1,344 @@
+/*
+ * (C) 2017 by Holger Hans Peter Freyther
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "numbering.h"
+#include "logging.h"
+
+#include <talloc.h>
+
+#include <errno.h>
+#include <string.h>
+
+const struct value_string numbering_dir_names[] = {
+	{ NUMBERING_MO,		"mo"		},
+	{ NUMBERING_MT,		"mt"		},
+	{ 0, NULL },
+};
+
+const struct value_string numbering_field_names[] = {
+	{ NUMBERING_CALLED,	"called"	},
+	{ NUMBERING_CALLING,	"calling"	},
+	{ 0, NULL },
+};
+
+static inline int symbol(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c == '*')
+		return 10;
+	if (c == '#')
+		return 11;
+	return 12;
+}
+
+bool number_valid_digits(const char *digits)
+{
+	if (strlen(digits) > NUMBERING_MAX_LEN)
+		return false;
+	for (; *digits; ++digits)
+		if (symbol(*digits) == 12)
+			return false;
+	return true;
+}
+
+/* "all" matches every number */
+int number_rule_set_pattern(struct number_rule *rule, const char *pattern)
+{
+	size_t len;
+	int i;
+
+	if (strcmp(pattern, "all") == 0)
+		pattern = "";
+
+	len = strlen(pattern);
+	rule->exact = len > 0 && pattern[len - 1] == '$';
+	if (rule->exact)
+		len -= 1;
+	if (len > NUMBERING_MAX_LEN)
+		return -EINVAL;
+
+	for (i = 0; i < len; ++i)
+		if (pattern[i] != '.' && symbol(pattern[i]) == 12)
+			return -EINVAL;
+
+	memcpy(rule->pattern, pattern, len);
+	rule->pattern[len] = '\0';
+	rule->len = len;
+	return 0;
+}
+
+const char *number_rule_pattern(const struct number_rule *rule)
+{
+	static char buf[NUMBERING_MAX_LEN + 2];
+
+	if (rule->len == 0 && !rule->exact)
+		return "all";
+	snprintf(buf, sizeof(buf), "%s%s", rule->pattern, rule->exact ? "$" : "");
+	return buf;
+}
+
+static int find_rule(struct numbering_set *set, const struct number_rule *rule)
+{
+	int i;
+
+	for (i = 0; i < set->num_rules; ++i) {
+		if (set->rules[i].exact == rule->exact
+		    && strcmp(set->rules[i].pattern, rule->pattern) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * A rule with the same pattern is replaced and keeps its position. The
+ * old rules stay in place when the new ones do not compile, the DFA is
+ * only replaced on success.
+ */
+int numbering_add_rule(struct numbering_set *set, const struct number_rule *rule,
+			void *ctx)
+{
+	struct number_rule old;
+	unsigned int num_rules = set->num_rules;
+	int nr = find_rule(set, rule);
+	int rc;
+
+	if (nr < 0) {
+		if (set->num_rules == NUMBERING_MAX_RULES)
+			return -ENOSPC;
+		nr = set->num_rules++;
+	}
+
+	old = set->rules[nr];
+	set->rules[nr] = *rule;
+	rc = numbering_compile(set, ctx);
+	if (rc < 0) {
+		set->rules[nr] = old;
+		set->num_rules = num_rules;
+	}
+	return rc;
+}
+
+int numbering_del_rule(struct numbering_set *set, const char *pattern,
+			void *ctx)
+{
+	struct number_rule rule;
+	int nr, rc;
+
+	if (number_rule_set_pattern(&rule, pattern) != 0)
+		return -EINVAL;
+	nr = find_rule(set, &rule);
+	if (nr < 0)
+		return -ENOENT;
+
+	rule = set->rules[nr];
+	memmove(&set->rules[nr], &set->rules[nr + 1],
+		(set->num_rules - nr - 1) * sizeof(set->rules[0]));
+	set->num_rules -= 1;
+	rc = numbering_compile(set, ctx);
+	if (rc < 0) {
+		memmove(&set->rules[nr + 1], &set->rules[nr],
+			(set->num_rules - nr) * sizeof(set->rules[0]));
+		set->rules[nr] = rule;
+		set->num_rules += 1;
+	}
+	return rc;
+}
+
+struct dfa_state {
+	unsigned int depth;
+	uint64_t alive;
+};
+
+static int find_state(struct dfa_state *states, unsigned int num_states,
+			unsigned int depth, uint64_t alive)
+{
+	unsigned int i;
+
+	for (i = 1; i < num_states; ++i)
+		if (states[i].depth == depth && states[i].alive == alive)
+			return i;
+	return -1;
+}
+
+/*
+ * Subset construction over the anchored patterns. All patterns start
+ * at the first digit so a state is fully described by the depth and
+ * the rules that are still alive.
+ */
+int numbering_compile(struct numbering_set *set, void *ctx)
+{
+	uint16_t (*next)[NUMBERING_SYMBOLS];
+	uint64_t *accept_prefix, *accept_exact;
+	struct dfa_state *states;
+	unsigned int num_states = 2, s, r, sym, i;
+
+	states = talloc_array(ctx, struct dfa_state, NUMBERING_MAX_STATES);
+	next = talloc_zero_size(ctx, sizeof(*next) * NUMBERING_MAX_STATES);
+	accept_prefix = talloc_zero_array(ctx, uint64_t, NUMBERING_MAX_STATES);
+	accept_exact = talloc_zero_array(ctx, uint64_t, NUMBERING_MAX_STATES);
+	if (!states || !next || !accept_prefix || !accept_exact)
+		goto error;
+
+	states[0].depth = 0;
+	states[0].alive = 0;
+	states[1].depth = 0;
+	states[1].alive = 0;
+	for (r = 0; r < set->num_rules; ++r)
+		states[1].alive |= 1ULL << r;
+
+	for (s = 1; s < num_states; ++s) {
+		unsigned int depth = states[s].depth;
+		uint64_t alive = states[s].alive;
+
+		for (r = 0; r < set->num_rules; ++r) {
+			const struct number_rule *rule = &set->rules[r];
+
+			if (!(alive & (1ULL << r)) || rule->len != depth)
+				continue;
+			if (rule->exact)
+				accept_exact[s] |= 1ULL << r;
+			else
+				accept_prefix[s] |= 1ULL << r;
+		}
+
+		for (sym = 0; sym < NUMBERING_SYMBOLS; ++sym) {
+			uint64_t to = 0;
+			int nr;
+
+			for (r = 0; r < set->num_rules; ++r) {
+				const struct number_rule *rule = &set->rules[r];
+				char c;
+
+				if (!(alive & (1ULL << r)) || rule->len <= depth)
+					continue;
+				c = rule->pattern[depth];
+				if (c == '.' || symbol(c) == sym)
+					to |= 1ULL << r;
+			}
+
+			if (!to)
+				continue;
+
+			nr = find_state(states, num_states, depth + 1, to);
+			if (nr < 0) {
+				if (num_states == NUMBERING_MAX_STATES)
+					goto error;
+				nr = num_states++;
+				states[nr].depth = depth + 1;
+				states[nr].alive = to;
+			}
+			next[s][sym] = nr;
+		}
+	}
+
+	talloc_free(states);
+	talloc_free(set->next);
+	talloc_free(set->accept_prefix);
+	talloc_free(set->accept_exact);
+	set->next = talloc_realloc_size(ctx, next, sizeof(*next) * num_states);
+	set->accept_prefix = talloc_realloc(ctx, accept_prefix, uint64_t, num_states);
+	set->accept_exact = talloc_realloc(ctx, accept_exact, uint64_t, num_states);
+	set->num_states = num_states;
+
+	/* TON/NPI are checked on the matches only */
+	memset(set->ton_mask, 0, sizeof(set->ton_mask));
+	memset(set->npi_mask, 0, sizeof(set->npi_mask));
+	set->any_mask = 0;
+	for (r = 0; r < set->num_rules; ++r) {
+		const struct number_rule *rule = &set->rules[r];
+		uint64_t bit = 1ULL << r;
+
+		for (i = 0; i < ARRAY_SIZE(set->ton_mask); ++i)
+			if (rule->ton < 0 || rule->ton == i)
+				set->ton_mask[i] |= bit;
+		for (i = 0; i < ARRAY_SIZE(set->npi_mask); ++i)
+			if (rule->npi < 0 || rule->npi == i)
+				set->npi_mask[i] |= bit;
+		if (rule->ton < 0 && rule->npi < 0)
+			set->any_mask |= bit;
+	}
+	return 0;
+
+error:
+	LOGP(DAPP, LOGL_ERROR, "Failed to compile %u number rules\n",
+		set->num_rules);
+	talloc_free(states);
+	talloc_free(next);
+	talloc_free(accept_prefix);
+	talloc_free(accept_exact);
+	return -ENOMEM;
+}
+
+/*
+ * Translate the digits with the first rule in config order that
+ * matches. Returns 1 if a rule was applied and 0 if no rule matched.
+ * The output is not touched then. -ENOSPC is returned if the result
+ * does not fit.
+ */
+int numbering_translate(struct numbering_set *set, const char *digits,
+			int *ton, int *npi, char *out, size_t out_len)
+{
+	const struct number_rule *rule;
+	unsigned int state = set->num_states ? 1 : 0;
+	uint64_t matched = 0;
+	size_t len, strip, prepend_len;
+	const char *in;
+
+	for (in = digits; *in && state; ++in) {
+		matched |= set->accept_prefix[state];
+		state = set->next[state][symbol(*in)];
+	}
+	if (state) {
+		matched |= set->accept_prefix[state];
+		if (!*in)
+			matched |= set->accept_exact[state];
+	}
+
+	if (*ton >= 0 && *ton < ARRAY_SIZE(set->ton_mask)
+	    && *npi >= 0 && *npi < ARRAY_SIZE(set->npi_mask))
+		matched &= set->ton_mask[*ton] & set->npi_mask[*npi];
+	else
+		matched &= set->any_mask;
+
+	if (!matched) {
+		set->untouched += 1;
+		return 0;
+	}
+
+	rule = &set->rules[__builtin_ctzll(matched)];
+	len = strlen(digits);
+	prepend_len = strlen(rule->prepend);
+	strip = OSMO_MIN(rule->strip, len);
+	digits += strip;
+	len -= strip;
+	if (prepend_len + len + 1 > out_len)
+		return -ENOSPC;
+
+	memcpy(out, rule->prepend, prepend_len);
+	memcpy(out + prepend_len, digits, len + 1);
+	if (rule->set_ton >= 0)
+		*ton = rule->set_ton;
+	if (rule->set_npi >= 0)
+		*npi = rule->set_npi;
+	set->translated += 1;
+	return 1;
+}
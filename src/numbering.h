@@ -0,0 +1,90 @@
+#pragma once
+
+#include <osmocom/core/utils.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define NUMBERING_MAX_RULES	64
+#define NUMBERING_MAX_STATES	4096
+#define NUMBERING_MAX_LEN	32
+
+/* digits, '*', '#' and everything else */
+#define NUMBERING_SYMBOLS	13
+
+enum numbering_dir {
+	NUMBERING_MO,		/* MNCC number to SIP user */
+	NUMBERING_MT,		/* SIP user to MNCC number */
+};
+
+enum numbering_field {
+	NUMBERING_CALLED,
+	NUMBERING_CALLING,
+};
+
+/**
+ * A rewrite of a number. The pattern is anchored at the start of
+ * the digits, '.' matches any single character and a trailing '$'
+ * requires the number to end with the pattern.
+ */
+struct number_rule {
+	char pattern[NUMBERING_MAX_LEN + 1];
+	uint8_t len;
+	bool exact;
+
+	/* -1 matches any */
+	int ton;
+	int npi;
+
+	uint8_t strip;
+	char prepend[NUMBERING_MAX_LEN + 1];
+
+	/* -1 keeps the value of the input */
+	int set_ton;
+	int set_npi;
+};
+
+/**
+ * Rules of one direction and field in config order. The rules are
+ * compiled into a DFA so that a number is translated in a single
+ * pass over its digits. A state of the DFA is the set of rules that
+ * still match after a number of digits.
+ */
+struct numbering_set {
+	struct number_rule rules[NUMBERING_MAX_RULES];
+	unsigned int num_rules;
+
+	/* state 0 is the dead state, state 1 the start */
+	uint16_t (*next)[NUMBERING_SYMBOLS];
+	uint64_t *accept_prefix;
+	uint64_t *accept_exact;
+	unsigned int num_states;
+	uint64_t ton_mask[8];
+	uint64_t npi_mask[16];
+	uint64_t any_mask;
+
+	/* statistics */
+	uint64_t translated;
+	uint64_t untouched;
+};
+
+struct numbering {
+	struct numbering_set sets[2][2];
+};
+
+extern const struct value_string numbering_dir_names[];
+extern const struct value_string numbering_field_names[];
+
+int number_rule_set_pattern(struct number_rule *rule, const char *pattern);
+bool number_valid_digits(const char *digits);
+const char *number_rule_pattern(const struct number_rule *rule);
+
+int numbering_add_rule(struct numbering_set *set, const struct number_rule *rule,
+			void *ctx);
+int numbering_del_rule(struct numbering_set *set, const char *pattern,
+			void *ctx);
+int numbering_compile(struct numbering_set *set, void *ctx);
+
+int numbering_translate(struct numbering_set *set, const char *digits,
+			int *ton, int *npi, char *out, size_t out_len);
@@ -0,0 +1,197 @@
+/*
+ * (C) 2017 by Holger Hans Peter Freyther
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "pacer.h"
+#include "logging.h"
+
+#define TOKEN		1000000ULL
+
+static int64_t elapsed_us(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000LL
+		+ (end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+static void refill(struct pacer *pacer, const struct timespec *now)
+{
+	uint64_t limit = pacer->burst * TOKEN;
+	int64_t us = elapsed_us(&pacer->last_refill, now);
+
+	pacer->last_refill = *now;
+	if (us <= 0)
+		return;
+
+	/* a full bucket is refilled after burst/rate seconds */
+	if (us > 60 * 1000000LL)
+		us = 60 * 1000000LL;
+
+	pacer->tokens += us * pacer->rate;
+	if (pacer->tokens > limit)
+		pacer->tokens = limit;
+}
+
+static void account_delay(struct pacer *pacer, uint32_t delay)
+{
+	pacer->delay_last = delay;
+	pacer->delay_total += delay;
+	if (delay > pacer->delay_max)
+		pacer->delay_max = delay;
+}
+
+static struct pacer_entry *dequeue(struct pacer *pacer)
+{
+	struct pacer_entry *entry;
+
+	entry = llist_first_entry(&pacer->queue, struct pacer_entry, entry);
+	llist_del(&entry->entry);
+	entry->in_queue = false;
+	pacer->length -= 1;
+	return entry;
+}
+
+static void schedule(struct pacer *pacer, const struct timespec *now)
+{
+	struct pacer_entry *head;
+	int64_t wait, expiry;
+
+	if (llist_empty(&pacer->queue))
+		return;
+
+	/* time until the next token and until the head expires */
+	wait = 0;
+	if (pacer->rate > 0 && pacer->tokens < TOKEN)
+		wait = (TOKEN - pacer->tokens + pacer->rate - 1) / pacer->rate;
+
+	head = llist_first_entry(&pacer->queue, struct pacer_entry, entry);
+	expiry = pacer->max_delay_ms * 1000LL - elapsed_us(&head->queued, now);
+	if (expiry < wait)
+		wait = expiry;
+	if (wait < 0)
+		wait = 0;
+
+	osmo_timer_schedule(&pacer->timer, wait / 1000000, wait % 1000000);
+}
+
+static void pacer_timeout(void *data)
+{
+	struct pacer *pacer = data;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	refill(pacer, &now);
+
+	while (!llist_empty(&pacer->queue)) {
+		struct pacer_entry *head;
+		int64_t delay;
+
+		head = llist_first_entry(&pacer->queue, struct pacer_entry, entry);
+		delay = elapsed_us(&head->queued, &now);
+
+		if (delay >= pacer->max_delay_ms * 1000LL) {
+			dequeue(pacer);
+			pacer->expired += 1;
+			pacer->expire(head);
+			continue;
+		}
+
+		/* the rate might have been disabled in the meantime */
+		if (pacer->rate > 0 && pacer->tokens < TOKEN)
+			break;
+
+		if (pacer->rate > 0)
+			pacer->tokens -= TOKEN;
+		dequeue(pacer);
+		pacer->sent_queued += 1;
+		account_delay(pacer, delay);
+		pacer->dispatch(head);
+	}
+
+	schedule(pacer, &now);
+}
+
+void pacer_init(struct pacer *pacer,
+		void (*dispatch)(struct pacer_entry *),
+		void (*expire)(struct pacer_entry *))
+{
+	INIT_LLIST_HEAD(&pacer->queue);
+	pacer->dispatch = dispatch;
+	pacer->expire = expire;
+	pacer->timer.cb = pacer_timeout;
+	pacer->timer.data = pacer;
+	pacer->tokens = pacer->burst * TOKEN;
+	clock_gettime(CLOCK_MONOTONIC, &pacer->last_refill);
+}
+
+/*
+ * Returns 0 if the entry was dispatched right away, 1 if it has been
+ * queued and -1 if the queue is full. In the last case the caller
+ * still owns the entry.
+ */
+int pacer_submit(struct pacer *pacer, struct pacer_entry *entry)
+{
+	struct timespec now;
+
+	if (pacer->rate == 0) {
+		pacer->sent_direct += 1;
+		pacer->dispatch(entry);
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	refill(pacer, &now);
+
+	/* keep the order and only bypass an empty queue */
+	if (llist_empty(&pacer->queue) && pacer->tokens >= TOKEN) {
+		pacer->tokens -= TOKEN;
+		pacer->sent_direct += 1;
+		pacer->dispatch(entry);
+		return 0;
+	}
+
+	if (pacer->length >= pacer->max_length) {
+		LOGP(DSIP, LOGL_ERROR, "Pacing queue full with %u entries\n",
+			pacer->length);
+		pacer->overflows += 1;
+		return -1;
+	}
+
+	entry->queued = now;
+	entry->in_queue = true;
+	llist_add_tail(&entry->entry, &pacer->queue);
+	pacer->length += 1;
+	if (pacer->length > pacer->max_length_seen)
+		pacer->max_length_seen = pacer->length;
+
+	if (!osmo_timer_pending(&pacer->timer))
+		schedule(pacer, &now);
+	return 1;
+}
+
+void pacer_cancel(struct pacer *pacer, struct pacer_entry *entry)
+{
+	if (!entry->in_queue)
+		return;
+
+	llist_del(&entry->entry);
+	entry->in_queue = false;
+	pacer->length -= 1;
+	if (llist_empty(&pacer->queue))
+		osmo_timer_del(&pacer->timer);
+}
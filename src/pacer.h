@@ -0,0 +1,62 @@
+#pragma once
+
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/timer.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * A request waiting for a token. Embedded by the user of the
+ * pacer.
+ */
+struct pacer_entry {
+	struct llist_head entry;
+	struct timespec queued;
+	bool in_queue;
+};
+
+/**
+ * Token bucket with a bounded wait queue. Smoothes a burst of
+ * requests to the configured rate. A rate of 0 disables pacing.
+ */
+struct pacer {
+	/* configuration */
+	unsigned int rate;
+	unsigned int burst;
+	unsigned int max_length;
+	unsigned int max_delay_ms;
+
+	/* tokens in millionths */
+	uint64_t tokens;
+	struct timespec last_refill;
+
+	struct llist_head queue;
+	unsigned int length;
+	struct osmo_timer_list timer;
+
+	/* a token is available, send it now */
+	void (*dispatch)(struct pacer_entry *);
+
+	/* waited longer than max_delay_ms */
+	void (*expire)(struct pacer_entry *);
+
+	/* statistics */
+	unsigned int max_length_seen;
+	uint64_t sent_direct;
+	uint64_t sent_queued;
+	uint64_t overflows;
+	uint64_t expired;
+
+	/* added delay in microseconds for queued requests */
+	uint64_t delay_total;
+	uint32_t delay_last;
+	uint32_t delay_max;
+};
+
+void pacer_init(struct pacer *pacer,
+		void (*dispatch)(struct pacer_entry *),
+		void (*expire)(struct pacer_entry *));
+int pacer_submit(struct pacer *pacer, struct pacer_entry *entry);
+void pacer_cancel(struct pacer *pacer, struct pacer_entry *entry);
@@ -0,0 +1,186 @@
+/*
+ * (C) 2017 by Holger Hans Peter Freyther
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "ratelimit.h"
+#include "logging.h"
+
+#include <talloc.h>
+
+#include <string.h>
+#include <time.h>
+
+static uint32_t hash_key(const char *key)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*key) {
+		hash ^= (uint8_t) *key++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+
+/*
+ * (Re-)allocate the table after the size was changed. The counters
+ * start from scratch.
+ */
+int ratelimit_configure(struct ratelimit *rl, void *ctx)
+{
+	uint32_t nbuckets = 1;
+
+	talloc_free(rl->entries);
+	talloc_free(rl->buckets);
+	rl->entries = NULL;
+	rl->buckets = NULL;
+	rl->used = 0;
+	INIT_LLIST_HEAD(&rl->lru);
+
+	if (rl->limit == 0)
+		return 0;
+
+	while (nbuckets < rl->size)
+		nbuckets <<= 1;
+
+	rl->entries = talloc_zero_array(ctx, struct ratelimit_entry, rl->size);
+	rl->buckets = talloc_zero_array(ctx, uint32_t, nbuckets);
+	if (!rl->entries || !rl->buckets) {
+		LOGP(DAPP, LOGL_ERROR, "Failed to allocate rate limit of %u\n",
+			rl->size);
+		talloc_free(rl->entries);
+		talloc_free(rl->buckets);
+		rl->entries = NULL;
+		rl->buckets = NULL;
+		return -1;
+	}
+
+	rl->bucket_mask = nbuckets - 1;
+	return 0;
+}
+
+static struct ratelimit_entry *lookup(struct ratelimit *rl,
+					const char *key, uint32_t hash)
+{
+	uint32_t idx = rl->buckets[hash & rl->bucket_mask];
+
+	while (idx) {
+		struct ratelimit_entry *entry = &rl->entries[idx - 1];
+
+		if (entry->hash == hash && strcmp(entry->key, key) == 0)
+			return entry;
+		idx = entry->next;
+	}
+
+	return NULL;
+}
+
+static void unlink_entry(struct ratelimit *rl, struct ratelimit_entry *entry)
+{
+	uint32_t *link = &rl->buckets[entry->hash & rl->bucket_mask];
+	uint32_t idx = entry - rl->entries + 1;
+
+	while (*link != idx)
+		link = &rl->entries[*link - 1].next;
+	*link = entry->next;
+}
+
+static struct ratelimit_entry *insert(struct ratelimit *rl,
+					const char *key, uint32_t hash)
+{
+	struct ratelimit_entry *entry;
+	uint32_t *bucket;
+
+	if (rl->used < rl->size) {
+		entry = &rl->entries[rl->used++];
+	} else {
+		/* evict the least recently seen subscriber */
+		entry = llist_entry(rl->lru.prev, struct ratelimit_entry, lru);
+		unlink_entry(rl, entry);
+		llist_del(&entry->lru);
+		rl->evicted += 1;
+	}
+
+	memset(entry, 0, sizeof(*entry));
+	snprintf(entry->key, sizeof(entry->key), "%s", key);
+	entry->hash = hash;
+
+	bucket = &rl->buckets[hash & rl->bucket_mask];
+	entry->next = *bucket;
+	*bucket = entry - rl->entries + 1;
+	llist_add(&entry->lru, &rl->lru);
+	return entry;
+}
+
+/*
+ * Account an attempt of key and return false if the subscriber is
+ * above the limit. The window is approximated by weighting the count
+ * of the previous window with the part of it that still overlaps.
+ */
+bool ratelimit_check(struct ratelimit *rl, const char *key)
+{
+	struct ratelimit_entry *entry;
+	uint64_t now, window_ms, window, weight;
+	char stored[sizeof(entry->key)];
+	uint32_t hash;
+
+	if (rl->limit == 0 || !rl->entries || !key || !key[0])
+		return true;
+
+	/* what the entry keeps, a longer key would never match again */
+	snprintf(stored, sizeof(stored), "%s", key);
+	key = stored;
+
+	hash = hash_key(key);
+	entry = lookup(rl, key, hash);
+	if (!entry)
+		entry = insert(rl, key, hash);
+	else
+		llist_move(&entry->lru, &rl->lru);
+
+	now = now_ms();
+	window_ms = rl->window * 1000ULL;
+	window = now / window_ms;
+
+	if (entry->window + 1 == window) {
+		entry->prev_count = entry->cur_count;
+		entry->cur_count = 0;
+	} else if (entry->window != window) {
+		entry->prev_count = 0;
+		entry->cur_count = 0;
+	}
+	entry->window = window;
+
+	weight = window_ms - now % window_ms;
+	if (entry->prev_count * weight / window_ms + entry->cur_count >= rl->limit) {
+		rl->rejected += 1;
+		return false;
+	}
+
+	entry->cur_count += 1;
+	rl->accepted += 1;
+	return true;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <osmocom/core/linuxlist.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct ratelimit_entry {
+	struct llist_head lru;
+
+	/* hash chain as index + 1, 0 terminates */
+	uint32_t next;
+	uint32_t hash;
+
+	/* approximated sliding window */
+	uint64_t window;
+	uint32_t prev_count;
+	uint32_t cur_count;
+
+	char key[33];
+};
+
+/**
+ * Call attempts per subscriber in a fixed size table. The least
+ * recently seen subscriber is evicted when the table is full. Every
+ * attempt is O(1) and memory is bounded by the table size.
+ */
+struct ratelimit {
+	/* configuration. A limit of 0 disables the check */
+	unsigned int limit;
+	unsigned int window;
+	unsigned int size;
+
+	struct ratelimit_entry *entries;
+	uint32_t *buckets;
+	uint32_t bucket_mask;
+	unsigned int used;
+	struct llist_head lru;
+
+	/* statistics */
+	uint64_t accepted;
+	uint64_t rejected;
+	uint64_t evicted;
+};
+
+int ratelimit_configure(struct ratelimit *rl, void *ctx);
+bool ratelimit_check(struct ratelimit *rl, const char *key);
@@ -0,0 +1,665 @@
+/*
+ * (C) 2017 by Holger Hans Peter Freyther
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "replication.h"
+#include "app.h"
+#include "logging.h"
+
+#include <osmocom/core/socket.h>
+
+#include <talloc.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+extern void *tall_mncc_ctx;
+
+const struct value_string replication_role_names[] = {
+	{ REPLICATION_NONE,		"none"		},
+	{ REPLICATION_ACTIVE,		"active"	},
+	{ REPLICATION_STANDBY,		"standby"	},
+	{ 0, NULL },
+};
+
+static int start_active(struct replication *repl);
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* A batch the socket had no room for */
+struct replication_msg {
+	struct llist_head entry;
+	unsigned int len;
+	char data[0];
+};
+
+static void drop_queue(struct replication *repl)
+{
+	struct replication_msg *msg, *tmp;
+
+	llist_for_each_entry_safe(msg, tmp, &repl->out_queue, entry) {
+		llist_del(&msg->entry);
+		talloc_free(msg);
+	}
+	repl->out_queued = 0;
+}
+
+static void close_link(struct replication *repl)
+{
+	if (repl->link.fd < 0)
+		return;
+
+	osmo_fd_unregister(&repl->link);
+	close(repl->link.fd);
+	repl->link.fd = -1;
+	repl->connected = false;
+	repl->resync = false;
+	drop_queue(repl);
+}
+
+/*
+ * Active side
+ */
+static void reset_batch(struct replication *repl)
+{
+	repl->out_len = sizeof(struct replication_hdr);
+	repl->out_entries = 0;
+	repl->out_flags = 0;
+}
+
+static void fill_hdr(struct replication *repl, struct replication_hdr *hdr,
+			unsigned int entries, uint16_t flags)
+{
+	hdr->version = REPLICATION_VERSION;
+	hdr->seq = ++repl->seq;
+	hdr->sent_ns = now_ns();
+	hdr->entries = entries;
+	hdr->flags = flags;
+	hdr->reserved = 0;
+}
+
+/* Best effort, the standby reconnects instead of taking over */
+static void send_dropped(struct replication *repl, int fd)
+{
+	struct replication_hdr hdr;
+
+	fill_hdr(repl, &hdr, 0, REPLICATION_F_DROPPED);
+	send(fd, &hdr, sizeof(hdr), MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+static void drop_standby(struct replication *repl)
+{
+	drop_queue(repl);
+	send_dropped(repl, repl->link.fd);
+	close_link(repl);
+}
+
+/*
+ * Deltas must not block the calls. They wait behind a slow standby up
+ * to REPLICATION_MAX_QUEUE and are then replaced by a new snapshot once
+ * the socket has room again.
+ */
+static void queue_batch(struct replication *repl)
+{
+	struct replication_msg *msg = NULL;
+
+	if (repl->in_snapshot || repl->out_queued + repl->out_len <= REPLICATION_MAX_QUEUE)
+		msg = talloc_size(repl, sizeof(*msg) + repl->out_len);
+	if (!msg) {
+		LOGP(DAPP, LOGL_ERROR, "Standby falls behind, resyncing\n");
+		repl->overruns += 1;
+		drop_queue(repl);
+		repl->resync = true;
+		repl->link.when |= BSC_FD_WRITE;
+		return;
+	}
+
+	msg->len = repl->out_len;
+	memcpy(msg->data, repl->out, repl->out_len);
+	llist_add_tail(&msg->entry, &repl->out_queue);
+	repl->out_queued += msg->len;
+	repl->link.when |= BSC_FD_WRITE;
+}
+
+static void send_batch(struct replication *repl)
+{
+	int rc;
+
+	if (!repl->connected || repl->resync)
+		return reset_batch(repl);
+
+	fill_hdr(repl, (struct replication_hdr *) repl->out, repl->out_entries,
+		repl->out_flags);
+
+	/* a batch must not overtake the queued ones */
+	if (!llist_empty(&repl->out_queue)) {
+		queue_batch(repl);
+		return reset_batch(repl);
+	}
+
+	rc = send(repl->link.fd, repl->out, repl->out_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		queue_batch(repl);
+	} else if (rc != repl->out_len) {
+		LOGP(DAPP, LOGL_ERROR, "Dropping the standby after a failed send: %s\n",
+			strerror(errno));
+		drop_standby(repl);
+	} else {
+		repl->batches += 1;
+		repl->bytes += rc;
+	}
+	reset_batch(repl);
+}
+
+/* Until the socket is full, the rest goes out when it is writable again */
+static void drain_queue(struct replication *repl)
+{
+	struct replication_msg *msg, *tmp;
+	int rc;
+
+	llist_for_each_entry_safe(msg, tmp, &repl->out_queue, entry) {
+		rc = send(repl->link.fd, msg->data, msg->len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (rc != msg->len) {
+			LOGP(DAPP, LOGL_ERROR, "Dropping the standby after a failed send: %s\n",
+				strerror(errno));
+			drop_standby(repl);
+			return;
+		}
+
+		repl->batches += 1;
+		repl->bytes += rc;
+		repl->out_queued -= msg->len;
+		llist_del(&msg->entry);
+		talloc_free(msg);
+	}
+	repl->link.when &= ~BSC_FD_WRITE;
+}
+
+static void add_entry(struct replication *repl, uint16_t type,
+			const void *data, unsigned int len)
+{
+	struct replication_entry entry = { .type = type, .len = len };
+
+	if (!repl->connected || repl->resync)
+		return;
+
+	if (repl->out_len + sizeof(entry) + len > REPLICATION_MAX_MSG)
+		send_batch(repl);
+
+	memcpy(repl->out + repl->out_len, &entry, sizeof(entry));
+	memcpy(repl->out + repl->out_len + sizeof(entry), data, len);
+	repl->out_len += sizeof(entry) + len;
+	repl->out_entries += 1;
+}
+
+static void sink_update(struct callstate_sink *sink, const struct callstate_record *rec)
+{
+	struct replication *repl = container_of(sink, struct replication, sink);
+
+	add_entry(repl, REPLICATION_UPDATE, rec, callstate_record_len(rec));
+	repl->updates += 1;
+}
+
+static void sink_remove(struct callstate_sink *sink, uint32_t id)
+{
+	struct replication *repl = container_of(sink, struct replication, sink);
+
+	add_entry(repl, REPLICATION_REMOVE, &id, sizeof(id));
+	repl->removes += 1;
+}
+
+static void sink_flush(struct callstate_sink *sink)
+{
+	struct replication *repl = container_of(sink, struct replication, sink);
+
+	if (repl->out_entries > 0)
+		send_batch(repl);
+}
+
+/* The whole table is queued at once and streamed as the standby reads */
+static void send_snapshot(struct replication *repl)
+{
+	repl->in_snapshot = true;
+	reset_batch(repl);
+	repl->out_flags = REPLICATION_F_SNAPSHOT;
+	send_batch(repl);
+
+	callstate_snapshot(&repl->sink);
+	if (repl->out_entries > 0)
+		send_batch(repl);
+
+	repl->out_flags = REPLICATION_F_SYNCED;
+	send_batch(repl);
+	repl->in_snapshot = false;
+}
+
+static int link_cb(struct osmo_fd *fd, unsigned int what)
+{
+	struct replication *repl = fd->data;
+	char buf[16];
+
+	/* the standby only ever closes the link */
+	if (what & BSC_FD_READ) {
+		if (recv(fd->fd, buf, sizeof(buf), MSG_DONTWAIT) <= 0) {
+			LOGP(DAPP, LOGL_NOTICE, "Standby disconnected\n");
+			close_link(repl);
+			return 0;
+		}
+	}
+
+	if (what & BSC_FD_WRITE) {
+		drain_queue(repl);
+		if (repl->link.fd >= 0 && repl->resync && llist_empty(&repl->out_queue)) {
+			repl->resync = false;
+			send_snapshot(repl);
+		}
+	}
+	return 0;
+}
+
+static int standby_accept(struct osmo_fd *fd, unsigned int what)
+{
+	struct replication *repl = fd->data;
+	int sock, size = 4 * REPLICATION_MAX_MSG;
+
+	sock = accept(fd->fd, NULL, NULL);
+	if (sock < 0) {
+		LOGP(DAPP, LOGL_ERROR, "Failed to accept the standby: %s\n",
+			strerror(errno));
+		return 0;
+	}
+
+	/* evicting the first one would make it take over */
+	if (repl->link.fd >= 0) {
+		LOGP(DAPP, LOGL_ERROR, "A standby is connected already, rejecting another one\n");
+		send_dropped(repl, sock);
+		close(sock);
+		repl->rejects += 1;
+		return 0;
+	}
+
+	/* room for a few batches before the standby falls behind */
+	setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+	repl->link.fd = sock;
+	repl->link.when = BSC_FD_READ;
+	repl->link.cb = link_cb;
+	repl->link.data = repl;
+	if (osmo_fd_register(&repl->link) != 0) {
+		close(sock);
+		repl->link.fd = -1;
+		return 0;
+	}
+
+	LOGP(DAPP, LOGL_NOTICE, "Standby connected, sending the call table\n");
+	repl->connected = true;
+	repl->connects += 1;
+	send_snapshot(repl);
+	return 0;
+}
+
+/*
+ * Standby side
+ */
+static unsigned int call_bucket(uint32_t id)
+{
+	return (id * 2654435761u) & (REPLICATION_HASH_SIZE - 1);
+}
+
+static struct replication_call *find_call(struct replication *repl, uint32_t id)
+{
+	struct replication_call *call;
+
+	llist_for_each_entry(call, &repl->calls[call_bucket(id)], entry)
+		if (call->rec.id == id)
+			return call;
+	return NULL;
+}
+
+static void remove_call(struct replication *repl, struct replication_call *call)
+{
+	llist_del(&call->entry);
+	talloc_free(call);
+	repl->num_calls -= 1;
+}
+
+static void forget_calls(struct replication *repl)
+{
+	struct replication_call *call, *tmp;
+	unsigned int i;
+
+	for (i = 0; i < REPLICATION_HASH_SIZE; ++i)
+		llist_for_each_entry_safe(call, tmp, &repl->calls[i], entry)
+			remove_call(repl, call);
+}
+
+static void mirror_update(struct replication *repl, const char *data, unsigned int len)
+{
+	struct replication_call *call;
+	uint32_t id;
+
+	if (len < sizeof(id) || len > sizeof(call->rec))
+		return;
+	memcpy(&id, data, sizeof(id));
+
+	call = find_call(repl, id);
+	if (!call) {
+		call = talloc_zero(repl, struct replication_call);
+		if (!call)
+			return;
+		llist_add(&call->entry, &repl->calls[call_bucket(id)]);
+		repl->num_calls += 1;
+	}
+
+	/* a record without the dialog part */
+	memset(&call->rec, 0, sizeof(call->rec));
+	memcpy(&call->rec, data, len);
+	repl->updates += 1;
+}
+
+static void mirror_remove(struct replication *repl, const char *data, unsigned int len)
+{
+	struct replication_call *call;
+	uint32_t id;
+
+	if (len != sizeof(id))
+		return;
+	memcpy(&id, data, sizeof(id));
+
+	call = find_call(repl, id);
+	if (call)
+		remove_call(repl, call);
+	repl->removes += 1;
+}
+
+static void account_lag(struct replication *repl, const struct replication_hdr *hdr)
+{
+	uint64_t now = now_ns(), lag = 0;
+
+	if (now > hdr->sent_ns)
+		lag = (now - hdr->sent_ns) / 1000;
+
+	repl->lag_last_us = lag;
+	if (lag > repl->lag_max_us)
+		repl->lag_max_us = lag;
+	repl->lag_avg_us = repl->lag_avg_us ? (repl->lag_avg_us * 7 + lag) / 8 : lag;
+}
+
+static void handle_batch(struct replication *repl, const char *buf, unsigned int len)
+{
+	struct replication_hdr hdr;
+	struct replication_entry entry;
+	unsigned int pos, i;
+
+	if (len < sizeof(hdr))
+		return;
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (hdr.version != REPLICATION_VERSION) {
+		LOGP(DAPP, LOGL_ERROR, "Replication version %u, expected %u\n",
+			hdr.version, REPLICATION_VERSION);
+		return;
+	}
+
+	if (hdr.flags & REPLICATION_F_SNAPSHOT) {
+		forget_calls(repl);
+		repl->synced = false;
+	} else if (repl->last_seq && hdr.seq != repl->last_seq + 1)
+		repl->seq_gaps += 1;
+	repl->last_seq = hdr.seq;
+	repl->batches += 1;
+	repl->bytes += len;
+	account_lag(repl, &hdr);
+
+	pos = sizeof(hdr);
+	for (i = 0; i < hdr.entries; ++i) {
+		if (pos + sizeof(entry) > len)
+			break;
+		memcpy(&entry, buf + pos, sizeof(entry));
+		pos += sizeof(entry);
+		if (pos + entry.len > len)
+			break;
+
+		if (entry.type == REPLICATION_UPDATE)
+			mirror_update(repl, buf + pos, entry.len);
+		else if (entry.type == REPLICATION_REMOVE)
+			mirror_remove(repl, buf + pos, entry.len);
+		pos += entry.len;
+	}
+
+	if (hdr.flags & REPLICATION_F_HANDOVER) {
+		LOGP(DAPP, LOGL_NOTICE, "Active hands over to a new instance\n");
+		repl->handover = true;
+	}
+
+	if (hdr.flags & REPLICATION_F_DROPPED) {
+		LOGP(DAPP, LOGL_NOTICE, "Active drops this standby\n");
+		repl->dropped = true;
+	}
+
+	if (hdr.flags & REPLICATION_F_SYNCED) {
+		LOGP(DAPP, LOGL_NOTICE, "Mirroring %u calls of the active\n",
+			repl->num_calls);
+		repl->synced = true;
+	}
+}
+
+/*
+ * The calls of the active can not be continued without its sockets.
+ * MNCC and SIP are started here and both sides are told to drop them.
+ */
+static void takeover(struct replication *repl)
+{
+	struct app_config *app = repl->app;
+	struct replication_call *call, *tmp;
+	unsigned int i;
+
+	LOGP(DAPP, LOGL_NOTICE, "Active is gone, taking over with %u calls\n",
+		repl->num_calls);
+
+	close_link(repl);
+	osmo_timer_del(&repl->reconnect);
+	app->replication.role = REPLICATION_ACTIVE;
+	repl->takeover(app);
+
+	for (i = 0; i < REPLICATION_HASH_SIZE; ++i) {
+		llist_for_each_entry_safe(call, tmp, &repl->calls[i], entry) {
+			callstate_recover(app, &call->rec);
+			remove_call(repl, call);
+		}
+	}
+
+	/* now a standby can follow us */
+	start_active(repl);
+}
+
+static int connect_active(struct replication *repl);
+
+static int standby_read(struct osmo_fd *fd, unsigned int what)
+{
+	struct replication *repl = fd->data;
+	int rc;
+
+	rc = recv(fd->fd, repl->in, REPLICATION_MAX_MSG, 0);
+	if (rc > 0) {
+		handle_batch(repl, repl->in, rc);
+		return 0;
+	}
+
+	close_link(repl);
+	if (repl->handover || repl->dropped) {
+		/* the active or the new instance sends a new snapshot */
+		forget_calls(repl);
+		repl->handover = false;
+		repl->dropped = false;
+		repl->synced = false;
+		osmo_timer_schedule(&repl->reconnect, 1, 0);
+		return 0;
+	}
+
+	/* the link can break while the active still runs */
+	if (connect_active(repl) == 0) {
+		LOGP(DAPP, LOGL_NOTICE, "Lost the link but the active still answers\n");
+		return 0;
+	}
+	takeover(repl);
+	return 0;
+}
+
+static int connect_active(struct replication *repl)
+{
+	const char *path = repl->app->replication.path;
+	int rc;
+
+	repl->link.cb = standby_read;
+	repl->link.data = repl;
+	rc = osmo_sock_unix_init_ofd(&repl->link, SOCK_SEQPACKET, 0,
+					path, OSMO_SOCK_F_CONNECT);
+	if (rc < 0) {
+		repl->link.fd = -1;
+		return -1;
+	}
+
+	LOGP(DAPP, LOGL_NOTICE, "Connected to the active on %s\n", path);
+	repl->connected = true;
+	repl->connects += 1;
+	repl->last_seq = 0;
+	return 0;
+}
+
+/*
+ * Only a standby that loses its link takes over. Without a link it
+ * keeps trying, so a rejected or dropped standby never takes over.
+ */
+static void standby_connect(void *data)
+{
+	struct replication *repl = data;
+
+	if (connect_active(repl) == 0)
+		return;
+
+	LOGP(DAPP, LOGL_ERROR, "No active on %s yet. Retrying\n",
+		repl->app->replication.path);
+	osmo_timer_schedule(&repl->reconnect, 1, 0);
+}
+
+static int start_active(struct replication *repl)
+{
+	const char *path = repl->app->replication.path;
+	int rc;
+
+	repl->listen_fd.cb = standby_accept;
+	repl->listen_fd.data = repl;
+	unlink(path);
+	rc = osmo_sock_unix_init_ofd(&repl->listen_fd, SOCK_SEQPACKET, 0,
+					path, OSMO_SOCK_F_BIND);
+	if (rc < 0) {
+		LOGP(DAPP, LOGL_ERROR, "Failed to listen for a standby on %s\n", path);
+		return -1;
+	}
+
+	repl->sink.update = sink_update;
+	repl->sink.remove = sink_remove;
+	repl->sink.flush = sink_flush;
+	callstate_sink_add(&repl->sink);
+	reset_batch(repl);
+	return 0;
+}
+
+/*
+ * The last message of this instance, the queue goes out first. The
+ * process exits next so blocking is fine, but not on a stuck standby.
+ */
+void replication_handover(struct replication *repl)
+{
+	struct timeval timeout = { .tv_sec = 1 };
+	struct replication_msg *msg, *tmp;
+	int rc;
+
+	if (!repl->connected || repl->resync)
+		return;
+
+	repl->in_snapshot = true;
+	reset_batch(repl);
+	repl->out_flags = REPLICATION_F_HANDOVER;
+	send_batch(repl);
+	repl->in_snapshot = false;
+	if (repl->link.fd < 0)
+		return;
+
+	setsockopt(repl->link.fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	llist_for_each_entry_safe(msg, tmp, &repl->out_queue, entry) {
+		rc = send(repl->link.fd, msg->data, msg->len, MSG_NOSIGNAL);
+		if (rc != msg->len) {
+			LOGP(DAPP, LOGL_ERROR, "Failed to hand over to the standby: %s\n",
+				strerror(errno));
+			return;
+		}
+		repl->out_queued -= msg->len;
+		llist_del(&msg->entry);
+		talloc_free(msg);
+	}
+}
+
+int replication_start(struct app_config *app, void (*takeover)(struct app_config *app))
+{
+	struct replication *repl;
+	unsigned int i;
+
+	if (app->replication.role == REPLICATION_NONE)
+		return 0;
+
+	repl = talloc_zero(tall_mncc_ctx, struct replication);
+	if (!repl)
+		return -1;
+	repl->app = app;
+	repl->takeover = takeover;
+	repl->link.fd = -1;
+	repl->reconnect.cb = standby_connect;
+	repl->reconnect.data = repl;
+	for (i = 0; i < REPLICATION_HASH_SIZE; ++i)
+		INIT_LLIST_HEAD(&repl->calls[i]);
+	INIT_LLIST_HEAD(&repl->out_queue);
+
+	repl->out = talloc_size(repl, REPLICATION_MAX_MSG);
+	repl->in = talloc_size(repl, REPLICATION_MAX_MSG);
+	if (!repl->out || !repl->in) {
+		talloc_free(repl);
+		return -1;
+	}
+	app->replication.state = repl;
+
+	if (app->replication.role == REPLICATION_ACTIVE)
+		return start_active(repl);
+
+	osmo_timer_schedule(&repl->reconnect, 0, 0);
+	return 0;
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include "callstate.h"
+
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/select.h>
+#include <osmocom/core/timer.h>
+#include <osmocom/core/utils.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct app_config;
+
+enum replication_role {
+	REPLICATION_NONE,
+	REPLICATION_ACTIVE,
+	REPLICATION_STANDBY,
+};
+
+extern const struct value_string replication_role_names[];
+
+#define REPLICATION_VERSION	1
+#define REPLICATION_MAX_MSG	(64 * 1024)
+#define REPLICATION_HASH_SIZE	4096	/* power of two */
+/* deltas queued behind a slow standby before it gets a new snapshot */
+#define REPLICATION_MAX_QUEUE	(16 * 1024 * 1024)
+
+/* first message of a snapshot, the standby forgets what it had */
+#define REPLICATION_F_SNAPSHOT	0x01
+/* last message of a snapshot */
+#define REPLICATION_F_SYNCED	0x02
+/* the active hands over to a new instance, follow it instead of taking over */
+#define REPLICATION_F_HANDOVER	0x04
+/* the active closes the link on purpose, reconnect instead of taking over */
+#define REPLICATION_F_DROPPED	0x08
+
+/* A batch of entries per loop iteration of the active */
+struct replication_hdr {
+	uint32_t	version;
+	uint32_t	seq;
+	uint64_t	sent_ns;	/* CLOCK_MONOTONIC of the active */
+	uint16_t	entries;
+	uint16_t	flags;
+	uint32_t	reserved;
+};
+
+enum {
+	REPLICATION_UPDATE,		/* a struct callstate_record */
+	REPLICATION_REMOVE,		/* the uint32_t id of the call */
+};
+
+struct replication_entry {
+	uint16_t	type;
+	uint16_t	len;		/* of the data that follows */
+};
+
+/* A call of the active as seen by the standby */
+struct replication_call {
+	struct llist_head entry;
+	struct callstate_record rec;
+};
+
+/*
+ * The active streams the changed calls to a standby on the same host
+ * which takes over MNCC and SIP once the active is gone.
+ */
+struct replication {
+	struct app_config *app;
+	void (*takeover)(struct app_config *app);
+
+	struct osmo_fd listen_fd;
+	struct osmo_fd link;
+	struct osmo_timer_list reconnect;
+	bool connected;
+
+	/* active: the batch being built */
+	struct callstate_sink sink;
+	char *out;
+	unsigned int out_len;
+	unsigned int out_entries;
+	uint16_t out_flags;
+	uint32_t seq;
+	/* the batches are queued even above REPLICATION_MAX_QUEUE */
+	bool in_snapshot;
+	/* the deltas did not fit, a snapshot follows once there is room */
+	bool resync;
+	/* batches the socket had no room for, in order */
+	struct llist_head out_queue;
+	unsigned int out_queued;
+
+	/* standby: the mirrored calls */
+	char *in;
+	struct llist_head calls[REPLICATION_HASH_SIZE];
+	unsigned int num_calls;
+	uint32_t last_seq;
+	bool synced;
+	bool handover;
+	bool dropped;
+
+	/* statistics */
+	uint64_t connects;
+	uint64_t batches;
+	uint64_t updates;
+	uint64_t removes;
+	uint64_t bytes;
+	uint64_t overruns;
+	uint64_t rejects;
+	uint64_t seq_gaps;
+	uint64_t lag_last_us;
+	uint64_t lag_avg_us;
+	uint64_t lag_max_us;
+};
+
+int replication_start(struct app_config *app, void (*takeover)(struct app_config *app));
+void replication_handover(struct replication *repl);
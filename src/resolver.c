@@ -0,0 +1,292 @@
+/*
+ * (C) 2017 by Holger Hans Peter Freyther
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "resolver.h"
+#include "app.h"
+#include "logging.h"
+
+#include <talloc.h>
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct resolve_entry {
+	unsigned int nr;
+	char *name;
+
+	/* filled in by the thread */
+	int rc;
+	unsigned int ms;
+	char addr[INET_ADDRSTRLEN];
+};
+
+/* The thread only fills in the entries and sets done */
+struct resolve_job {
+	int wfd;
+	bool done;
+	unsigned int num_entries;
+	struct resolve_entry entries[SIP_TRUNK_MAX];
+};
+
+static unsigned int elapsed_ms(const struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1000
+		+ (end.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static void resolve_entry(struct resolve_entry *entry)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_INET,
+		.ai_socktype = SOCK_DGRAM,
+	};
+	struct addrinfo *res;
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	entry->rc = getaddrinfo(entry->name, NULL, &hints, &res);
+	entry->ms = elapsed_ms(&start);
+	if (entry->rc != 0)
+		return;
+
+	inet_ntop(AF_INET, &((struct sockaddr_in *) res->ai_addr)->sin_addr,
+			entry->addr, sizeof(entry->addr));
+	freeaddrinfo(res);
+}
+
+static void free_job(struct resolve_job *job)
+{
+	unsigned int i;
+
+	for (i = 0; i < job->num_entries; ++i)
+		free(job->entries[i].name);
+	free(job);
+}
+
+static void *resolver_main(void *data)
+{
+	struct resolve_job *job = data;
+	unsigned int i;
+	char c = 0;
+	int rc;
+
+	for (i = 0; i < job->num_entries; ++i)
+		resolve_entry(&job->entries[i]);
+
+	/* the byte only wakes up the main loop, a refresh finds done as well */
+	__atomic_store_n(&job->done, true, __ATOMIC_RELEASE);
+	do {
+		rc = write(job->wfd, &c, 1);
+	} while (rc < 0 && errno == EINTR);
+	return NULL;
+}
+
+static void apply_entry(struct app_config *app, struct resolve_entry *entry)
+{
+	struct sip_resolver *resolver = &app->sip.resolver;
+	struct sip_trunk *trunk;
+
+	resolver->lookups += 1;
+	resolver->last_ms = entry->ms;
+	resolver->total_ms += entry->ms;
+	if (entry->ms > resolver->max_ms)
+		resolver->max_ms = entry->ms;
+
+	/* the trunk was removed or changed while resolving */
+	llist_for_each_entry(trunk, &app->sip.trunks, entry)
+		if (trunk->nr == entry->nr)
+			break;
+	if (&trunk->entry == &app->sip.trunks || !trunk->remote_addr
+	    || strcmp(trunk->remote_addr, entry->name) != 0)
+		return;
+
+	trunk->resolve_ms = entry->ms;
+	if (entry->rc != 0) {
+		/* keep using the last known address */
+		LOGP(DSIP, LOGL_ERROR, "trunk(%s) failed to resolve %s: %s\n",
+			trunk->name, entry->name, gai_strerror(entry->rc));
+		resolver->failures += 1;
+		trunk->resolve_failures += 1;
+		return;
+	}
+
+	if (!trunk->resolved_addr || strcmp(trunk->resolved_addr, entry->addr) != 0)
+		LOGP(DSIP, LOGL_NOTICE, "trunk(%s) %s resolved to %s in %ums\n",
+			trunk->name, entry->name, entry->addr, entry->ms);
+	talloc_free(trunk->resolved_addr);
+	trunk->resolved_addr = talloc_strdup(trunk, entry->addr);
+}
+
+static bool job_done(struct sip_resolver *resolver)
+{
+	return resolver->job && __atomic_load_n(&resolver->job->done, __ATOMIC_ACQUIRE);
+}
+
+/* The thread has finished, take over its results */
+static void reap_job(struct app_config *app)
+{
+	struct sip_resolver *resolver = &app->sip.resolver;
+	struct resolve_job *job = resolver->job;
+	unsigned int i;
+
+	pthread_join(resolver->thread, NULL);
+	resolver->job = NULL;
+	resolver->busy = false;
+	resolver->runs += 1;
+
+	for (i = 0; i < job->num_entries; ++i)
+		apply_entry(app, &job->entries[i]);
+	free_job(job);
+}
+
+static int resolver_done(struct osmo_fd *fd, unsigned int what)
+{
+	struct app_config *app = fd->data;
+	struct sip_resolver *resolver = &app->sip.resolver;
+	char buf[16];
+
+	if (read(fd->fd, buf, sizeof(buf)) <= 0 || !job_done(resolver))
+		return 0;
+
+	reap_job(app);
+	if (resolver->refresh_pending) {
+		resolver->refresh_pending = false;
+		sip_resolver_refresh(app);
+	}
+	return 0;
+}
+
+static void refresh_timer_cb(void *data)
+{
+	struct app_config *app = data;
+
+	sip_resolver_refresh(app);
+	sip_resolver_schedule(app);
+}
+
+void sip_resolver_schedule(struct app_config *app)
+{
+	struct sip_resolver *resolver = &app->sip.resolver;
+
+	osmo_timer_del(&resolver->refresh_timer);
+	if (resolver->refresh_interval > 0 && resolver->ofd.cb)
+		osmo_timer_schedule(&resolver->refresh_timer,
+					resolver->refresh_interval, 0);
+}
+
+int sip_resolver_init(struct app_config *app)
+{
+	struct sip_resolver *resolver = &app->sip.resolver;
+	int fds[2];
+
+	if (pipe(fds) != 0) {
+		LOGP(DSIP, LOGL_ERROR, "Failed to create resolver pipe: %s\n",
+			strerror(errno));
+		return -1;
+	}
+
+	resolver->refresh_timer.cb = refresh_timer_cb;
+	resolver->refresh_timer.data = app;
+	resolver->ofd.fd = fds[0];
+	resolver->ofd.when = BSC_FD_READ;
+	resolver->ofd.cb = resolver_done;
+	resolver->ofd.data = app;
+	resolver->wfd = fds[1];
+	if (osmo_fd_register(&resolver->ofd) != 0) {
+		close(fds[0]);
+		close(fds[1]);
+		resolver->ofd.cb = NULL;
+		return -1;
+	}
+
+	sip_resolver_schedule(app);
+	return sip_resolver_refresh(app);
+}
+
+/*
+ * Resolve the addresses of all trunks in the background. The trunks
+ * keep their current address until the thread is done.
+ */
+int sip_resolver_refresh(struct app_config *app)
+{
+	struct sip_resolver *resolver = &app->sip.resolver;
+	struct resolve_job *job;
+	struct sip_trunk *trunk;
+	int rc;
+
+	/* called while reading the config. sip_resolver_init starts it */
+	if (!resolver->ofd.cb)
+		return 0;
+
+	/* the wake up of the last run got lost */
+	if (job_done(resolver))
+		reap_job(app);
+
+	if (resolver->busy) {
+		resolver->refresh_pending = true;
+		return 0;
+	}
+
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return -ENOMEM;
+	job->wfd = resolver->wfd;
+
+	llist_for_each_entry(trunk, &app->sip.trunks, entry) {
+		struct resolve_entry *entry = &job->entries[job->num_entries];
+
+		if (!trunk->remote_addr)
+			continue;
+		entry->nr = trunk->nr;
+		entry->name = strdup(trunk->remote_addr);
+		if (!entry->name) {
+			free_job(job);
+			return -ENOMEM;
+		}
+		job->num_entries += 1;
+	}
+
+	if (job->num_entries == 0) {
+		free_job(job);
+		return 0;
+	}
+
+	rc = pthread_create(&resolver->thread, NULL, resolver_main, job);
+	if (rc != 0) {
+		LOGP(DSIP, LOGL_ERROR, "Failed to start resolver: %s\n",
+			strerror(rc));
+		free_job(job);
+		return -rc;
+	}
+
+	resolver->job = job;
+	resolver->busy = true;
+	return 0;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <osmocom/core/select.h>
+#include <osmocom/core/timer.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct app_config;
+struct resolve_job;
+
+/**
+ * Resolves the remote addresses of all trunks on a separate thread
+ * and refreshes them periodically. INVITEs and probes are sent to
+ * the resolved address so that a slow DNS server never delays the
+ * setup of a call. getaddrinfo does not report a TTL, the refresh
+ * interval is configured instead.
+ */
+struct sip_resolver {
+	unsigned int refresh_interval;
+	struct osmo_timer_list refresh_timer;
+
+	bool busy;
+	bool refresh_pending;
+	pthread_t thread;
+	struct resolve_job *job;
+	struct osmo_fd ofd;
+	int wfd;
+
+	/* statistics */
+	uint64_t runs;
+	uint64_t lookups;
+	uint64_t failures;
+	unsigned int last_ms;
+	unsigned int max_ms;
+	uint64_t total_ms;
+};
+
+int sip_resolver_init(struct app_config *app);
+int sip_resolver_refresh(struct app_config *app);
+void sip_resolver_schedule(struct app_config *app);
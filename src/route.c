@@ -0,0 +1,660 @@
+/*
+ * (C) 2017 by Holger Hans Peter Freyther
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "route.h"
+#include "app.h"
+#include "logging.h"
+#include "mncc_protocol.h"
+
+#include <osmocom/core/utils.h>
+
+#include <talloc.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+extern void *tall_mncc_ctx;
+
+/*
+ * The routing table is read from a file with one route per line:
+ *
+ *	PREFIX TRUNK [strip N] [prepend DIGITS] [codec NAME]
+ *
+ * PREFIX is matched against the dialed number including a leading
+ * '+' for international numbers, "default" matches every number.
+ * The longest prefix wins. A prefix can be listed once per codec,
+ * a route with a codec is only used for calls with that codec.
+ */
+
+static const char route_digits[] = "0123456789*#+";
+
+static const struct value_string route_codec_names[] = {
+	{ 0,				"any"		},
+	{ GSM_TCHF_FRAME,		"GSM"		},
+	{ GSM_TCHF_FRAME_EFR,		"GSM-EFR"	},
+	{ GSM_TCHH_FRAME,		"GSM-HR-08"	},
+	{ GSM_TCH_FRAME_AMR,		"AMR"		},
+	{ 0, NULL },
+};
+
+static inline int digit_index(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c == '*')
+		return 10;
+	if (c == '#')
+		return 11;
+	if (c == '+')
+		return 12;
+	return -1;
+}
+
+static bool valid_digits(const char *str)
+{
+	if (strlen(str) > ROUTE_PREFIX_LEN)
+		return false;
+	for (; *str; ++str)
+		if (digit_index(*str) < 0)
+			return false;
+	return true;
+}
+
+uint32_t route_codec_parse(const char *name)
+{
+	int rc = get_string_value(route_codec_names, name);
+	return rc < 0 ? UINT32_MAX : rc;
+}
+
+/* One parsed line of the file */
+struct route_line {
+	uint8_t digits[ROUTE_PREFIX_LEN];
+	uint8_t len;
+	uint8_t strip;
+	uint8_t prepend_len;
+	char prepend[ROUTE_PREFIX_LEN];
+	uint16_t trunk;
+	uint32_t payload_msg_type;
+	uint32_t line;
+};
+
+static int cmp_line(const void *_a, const void *_b)
+{
+	const struct route_line *a = _a, *b = _b;
+	int rc;
+
+	rc = memcmp(a->digits, b->digits, OSMO_MIN(a->len, b->len));
+	if (rc != 0)
+		return rc;
+	if (a->len != b->len)
+		return a->len < b->len ? -1 : 1;
+	if (a->payload_msg_type != b->payload_msg_type)
+		return a->payload_msg_type < b->payload_msg_type ? -1 : 1;
+	return a->line < b->line ? -1 : 1;
+}
+
+static int intern_trunk(struct route_table *table, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < table->num_trunks; ++i)
+		if (strcmp(table->trunks[i], name) == 0)
+			return i;
+
+	if (table->num_trunks == UINT16_MAX)
+		return -1;
+	table->trunks = talloc_realloc(table, table->trunks, char *,
+					table->num_trunks + 1);
+	if (!table->trunks)
+		return -1;
+	table->trunks[i] = talloc_strdup(table->trunks, name);
+	table->num_trunks += 1;
+	return i;
+}
+
+static bool parse_line(struct route_table *table, char *buf,
+			struct route_line *line)
+{
+	char *save, *prefix, *trunk, *key, *val;
+	int i, nr;
+
+	prefix = strtok_r(buf, " \t\r\n", &save);
+	trunk = strtok_r(NULL, " \t\r\n", &save);
+	if (!prefix || !trunk)
+		return false;
+
+	if (strcmp(prefix, "default") == 0)
+		prefix = "";
+	if (!valid_digits(prefix))
+		return false;
+	line->len = strlen(prefix);
+	for (i = 0; i < line->len; ++i)
+		line->digits[i] = digit_index(prefix[i]);
+
+	nr = intern_trunk(table, trunk);
+	if (nr < 0)
+		return false;
+	line->trunk = nr;
+
+	while ((key = strtok_r(NULL, " \t\r\n", &save))) {
+		val = strtok_r(NULL, " \t\r\n", &save);
+		if (!val)
+			return false;
+
+		if (strcmp(key, "strip") == 0) {
+			nr = atoi(val);
+			if (nr < 0 || nr > ROUTE_PREFIX_LEN)
+				return false;
+			line->strip = nr;
+		} else if (strcmp(key, "prepend") == 0) {
+			if (!valid_digits(val))
+				return false;
+			line->prepend_len = strlen(val);
+			memcpy(line->prepend, val, line->prepend_len);
+		} else if (strcmp(key, "codec") == 0) {
+			line->payload_msg_type = route_codec_parse(val);
+			if (line->payload_msg_type == UINT32_MAX)
+				return false;
+		} else
+			return false;
+	}
+
+	return true;
+}
+
+static struct route_line *read_lines(struct route_table *table, FILE *file,
+					size_t *num_lines)
+{
+	struct route_line *lines = NULL;
+	size_t num = 0, alloc = 0;
+	unsigned int nr = 0;
+	char buf[256];
+
+	while (fgets(buf, sizeof(buf), file)) {
+		char *str = buf + strspn(buf, " \t");
+
+		nr += 1;
+		if (*str == '#' || *str == '\n' || *str == '\r' || *str == '\0')
+			continue;
+
+		if (num == alloc) {
+			alloc = alloc ? alloc * 2 : 1024;
+			lines = talloc_realloc(table, lines, struct route_line, alloc);
+			if (!lines) {
+				table->error = ENOMEM;
+				return NULL;
+			}
+		}
+
+		memset(&lines[num], 0, sizeof(lines[num]));
+		lines[num].line = nr;
+		if (!parse_line(table, str, &lines[num])) {
+			if (table->bad_lines++ == 0)
+				table->first_bad_line = nr;
+			continue;
+		}
+		num += 1;
+	}
+
+	*num_lines = num;
+	return lines;
+}
+
+struct route_builder {
+	struct route_table *table;
+	const struct route_line *lines;
+
+	/* per unique prefix: first line, offset in the pool, first route */
+	uint32_t *keys;
+	uint32_t *key_offsets;
+	int32_t *key_routes;
+	size_t num_keys;
+};
+
+static inline uint8_t key_digit(const struct route_builder *b,
+				size_t key, unsigned int pos)
+{
+	return b->lines[b->keys[key]].digits[pos];
+}
+
+static inline uint8_t key_len(const struct route_builder *b, size_t key)
+{
+	return b->lines[b->keys[key]].len;
+}
+
+/*
+ * Build the node for the sorted keys [lo, hi) that share the first
+ * depth digits. The common digits of the range become the label of
+ * the node. The children of a node are reserved in one go and then
+ * filled so that they are next to each other.
+ */
+static void build_node(struct route_builder *b, uint32_t idx,
+			size_t lo, size_t hi, unsigned int depth)
+{
+	struct route_table *table = b->table;
+	struct route_node *node = &table->nodes[idx];
+	unsigned int len = 0, first_len, last_len;
+	uint32_t child;
+	uint16_t mask = 0;
+	size_t i, j;
+
+	first_len = key_len(b, lo);
+	last_len = key_len(b, hi - 1);
+	while (depth + len < first_len && depth + len < last_len
+	       && key_digit(b, lo, depth + len) == key_digit(b, hi - 1, depth + len))
+		len += 1;
+
+	node->label = b->key_offsets[lo] + depth;
+	node->label_len = len;
+	node->route = -1;
+	depth += len;
+
+	/* the shortest key sorts first */
+	if (first_len == depth) {
+		node->route = b->key_routes[lo];
+		lo += 1;
+	}
+
+	for (i = lo; i < hi; ++i)
+		mask |= 1 << key_digit(b, i, depth);
+	node->child_mask = mask;
+	node->first_child = table->num_nodes;
+	table->num_nodes += __builtin_popcount(mask);
+
+	child = node->first_child;
+	for (i = lo; i < hi; i = j) {
+		uint8_t digit = key_digit(b, i, depth);
+
+		for (j = i + 1; j < hi && key_digit(b, j, depth) == digit; ++j)
+			;
+		build_node(b, child++, i, j, depth + 1);
+	}
+}
+
+static int build_table(struct route_table *table, struct route_line *lines,
+			size_t num_lines)
+{
+	struct route_builder b = { .table = table, .lines = lines };
+	uint32_t *route_lines;
+	size_t i, pool_len = 0, pool_pos = 0;
+
+	qsort(lines, num_lines, sizeof(*lines), cmp_line);
+
+	b.keys = talloc_array(table, uint32_t, num_lines);
+	b.key_offsets = talloc_array(table, uint32_t, num_lines);
+	b.key_routes = talloc_array(table, int32_t, num_lines);
+	route_lines = talloc_array(table, uint32_t, num_lines);
+	table->routes = talloc_array(table, struct route, num_lines);
+	if (!b.keys || !b.key_offsets || !b.key_routes || !route_lines
+	    || !table->routes)
+		return -ENOMEM;
+
+	/* group the routes of the same prefix into a list */
+	for (i = 0; i < num_lines; ++i) {
+		const struct route_line *line = &lines[i];
+		const struct route_line *key = NULL;
+		struct route *route;
+
+		if (b.num_keys)
+			key = &lines[b.keys[b.num_keys - 1]];
+
+		if (key && key->len == line->len
+		    && memcmp(key->digits, line->digits, line->len) == 0) {
+			/* sorted by codec and the first line wins */
+			if (lines[i - 1].payload_msg_type == line->payload_msg_type) {
+				table->duplicates += 1;
+				continue;
+			}
+			table->routes[table->num_routes - 1].next = table->num_routes;
+		} else {
+			b.keys[b.num_keys] = i;
+			b.key_routes[b.num_keys] = table->num_routes;
+			b.num_keys += 1;
+			pool_len += line->len;
+		}
+
+		route_lines[table->num_routes] = i;
+		route = &table->routes[table->num_routes++];
+		route->next = -1;
+		route->strip = line->strip;
+		route->prepend_len = line->prepend_len;
+		route->trunk = line->trunk;
+		route->payload_msg_type = line->payload_msg_type;
+		pool_len += line->prepend_len;
+	}
+
+	/* prefixes and prepends are kept as characters in one pool */
+	table->pool = talloc_size(table, pool_len + 1);
+	if (!table->pool)
+		return -ENOMEM;
+
+	for (i = 0; i < b.num_keys; ++i) {
+		const struct route_line *line = &lines[b.keys[i]];
+		unsigned int pos;
+
+		b.key_offsets[i] = pool_pos;
+		for (pos = 0; pos < line->len; ++pos)
+			table->pool[pool_pos++] = route_digits[line->digits[pos]];
+	}
+	for (i = 0; i < table->num_routes; ++i) {
+		const struct route_line *line = &lines[route_lines[i]];
+
+		table->routes[i].prepend = pool_pos;
+		memcpy(&table->pool[pool_pos], line->prepend, line->prepend_len);
+		pool_pos += line->prepend_len;
+	}
+	table->pool[pool_pos] = '\0';
+
+	/* a compressed trie has less than two nodes per prefix */
+	if (b.num_keys > 0) {
+		table->nodes = talloc_array(table, struct route_node, 2 * b.num_keys);
+		if (!table->nodes)
+			return -ENOMEM;
+		table->num_nodes = 1;
+		build_node(&b, 0, 0, b.num_keys, 0);
+		table->nodes = talloc_realloc(table, table->nodes,
+					struct route_node, table->num_nodes);
+	}
+
+	table->routes = talloc_realloc(table, table->routes, struct route,
+					OSMO_MAX(table->num_routes, 1));
+	talloc_free(b.keys);
+	talloc_free(b.key_offsets);
+	talloc_free(b.key_routes);
+	talloc_free(route_lines);
+
+	table->bytes = table->num_nodes * sizeof(struct route_node)
+			+ table->num_routes * sizeof(struct route)
+			+ pool_len + 1;
+	return 0;
+}
+
+/*
+ * Runs on the loader thread. The table is a talloc hierarchy of its
+ * own so nothing is shared with the main thread until it is handed
+ * over. Errors are reported in the table as we can not log here.
+ */
+static struct route_table *route_table_load(const char *path)
+{
+	struct route_table *table;
+	struct route_line *lines;
+	struct timespec start, end;
+	size_t num_lines = 0;
+	FILE *file;
+	int rc;
+
+	table = talloc_zero(NULL, struct route_table);
+	if (!table)
+		return NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	file = fopen(path, "r");
+	if (!file) {
+		table->error = errno;
+		return table;
+	}
+	lines = read_lines(table, file, &num_lines);
+	fclose(file);
+	if (table->error)
+		return table;
+
+	rc = build_table(table, lines, num_lines);
+	talloc_free(lines);
+	if (rc < 0) {
+		table->error = -rc;
+		return table;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	table->build_ms = (end.tv_sec - start.tv_sec) * 1000
+			+ (end.tv_nsec - start.tv_nsec) / 1000000;
+	return table;
+}
+
+struct route_job {
+	char *path;
+	int wfd;
+};
+
+static void *route_loader_main(void *data)
+{
+	struct route_job *job = data;
+	struct route_table *table;
+
+	table = route_table_load(job->path);
+
+	/* a pointer is written to the pipe in one piece */
+	if (write(job->wfd, &table, sizeof(table)) != sizeof(table))
+		talloc_free(table);
+	free(job->path);
+	free(job);
+	return NULL;
+}
+
+static int start_loader(struct routing *routing)
+{
+	struct route_job *job;
+	int rc;
+
+	job = malloc(sizeof(*job));
+	if (!job)
+		return -ENOMEM;
+	job->path = strdup(routing->path);
+	job->wfd = routing->wfd;
+	if (!job->path) {
+		free(job);
+		return -ENOMEM;
+	}
+
+	rc = pthread_create(&routing->thread, NULL, route_loader_main, job);
+	if (rc != 0) {
+		free(job->path);
+		free(job);
+		return -rc;
+	}
+
+	routing->loading = true;
+	return 0;
+}
+
+/* The loader is done and the main loop takes over the table */
+static int route_loaded(struct osmo_fd *fd, unsigned int what)
+{
+	struct routing *routing = fd->data;
+	struct route_table *table;
+	int rc;
+
+	rc = read(fd->fd, &table, sizeof(table));
+	if (rc != sizeof(table))
+		return 0;
+
+	pthread_join(routing->thread, NULL);
+	routing->loading = false;
+
+	if (!table || table->error) {
+		LOGP(DAPP, LOGL_ERROR, "Failed to load route table %s: %s\n",
+			routing->path, strerror(table ? table->error : ENOMEM));
+		routing->reload_failures += 1;
+		talloc_free(table);
+	} else {
+		if (table->bad_lines)
+			LOGP(DAPP, LOGL_ERROR,
+				"Route table %s: skipped %u bad lines, first at %u\n",
+				routing->path, table->bad_lines, table->first_bad_line);
+		LOGP(DAPP, LOGL_NOTICE,
+			"Route table %s loaded with %zu routes in %ums\n",
+			routing->path, table->num_routes, table->build_ms);
+
+		talloc_steal(tall_mncc_ctx, table);
+		talloc_free(routing->table);
+		routing->table = table;
+		routing->reloads += 1;
+	}
+
+	if (routing->reload_pending) {
+		routing->reload_pending = false;
+		routing_reload(routing);
+	}
+	return 0;
+}
+
+int routing_init(struct app_config *app)
+{
+	struct routing *routing = &app->routing;
+	int fds[2];
+
+	if (pipe(fds) != 0) {
+		LOGP(DAPP, LOGL_ERROR, "Failed to create route loader pipe: %s\n",
+			strerror(errno));
+		return -1;
+	}
+
+	routing->ofd.fd = fds[0];
+	routing->ofd.when = BSC_FD_READ;
+	routing->ofd.cb = route_loaded;
+	routing->ofd.data = routing;
+	routing->wfd = fds[1];
+	if (osmo_fd_register(&routing->ofd) != 0) {
+		close(fds[0]);
+		close(fds[1]);
+		routing->ofd.cb = NULL;
+		return -1;
+	}
+
+	return routing_reload(routing);
+}
+
+/*
+ * Load the configured table in the background. The current table
+ * stays in use until the new one is complete.
+ */
+int routing_reload(struct routing *routing)
+{
+	int rc;
+
+	/* called while reading the config. routing_init loads it */
+	if (!routing->ofd.cb)
+		return 0;
+
+	if (!routing->path) {
+		talloc_free(routing->table);
+		routing->table = NULL;
+		return 0;
+	}
+
+	if (routing->loading) {
+		routing->reload_pending = true;
+		return 0;
+	}
+
+	rc = start_loader(routing);
+	if (rc < 0)
+		LOGP(DAPP, LOGL_ERROR, "Failed to start route loader: %s\n",
+			strerror(-rc));
+	return rc;
+}
+
+static const struct route *match_codec(const struct route_table *table,
+					int32_t nr, uint32_t payload_msg_type)
+{
+	const struct route *any = NULL;
+
+	for (; nr >= 0; nr = table->routes[nr].next) {
+		const struct route *route = &table->routes[nr];
+
+		if (route->payload_msg_type == payload_msg_type)
+			return route;
+		if (route->payload_msg_type == 0)
+			any = route;
+	}
+
+	return any;
+}
+
+/*
+ * Longest prefix match. Every node compares its label and then
+ * jumps to the child of the next digit, the last route seen wins.
+ */
+const struct route *route_lookup(struct routing *routing, const char *number,
+				uint32_t payload_msg_type)
+{
+	const struct route_table *table = routing->table;
+	const struct route_node *node;
+	const struct route *route, *best = NULL;
+	size_t len, pos = 0;
+
+	routing->lookups += 1;
+	if (!table || table->num_nodes == 0) {
+		routing->misses += 1;
+		return NULL;
+	}
+
+	len = strlen(number);
+	node = &table->nodes[0];
+	for (;;) {
+		int digit;
+
+		if (node->label_len > len - pos
+		    || memcmp(&table->pool[node->label], &number[pos],
+				node->label_len) != 0)
+			break;
+		pos += node->label_len;
+
+		route = match_codec(table, node->route, payload_msg_type);
+		if (route)
+			best = route;
+
+		if (pos == len)
+			break;
+		digit = digit_index(number[pos]);
+		if (digit < 0 || (node->child_mask & (1 << digit)) == 0)
+			break;
+
+		node = &table->nodes[node->first_child +
+			__builtin_popcount(node->child_mask & ((1 << digit) - 1))];
+		pos += 1;
+	}
+
+	if (best)
+		routing->hits += 1;
+	else
+		routing->misses += 1;
+	return best;
+}
+
+const char *route_trunk_name(const struct route_table *table,
+				const struct route *route)
+{
+	return table->trunks[route->trunk];
+}
+
+char *route_rewrite(void *ctx, const struct route_table *table,
+			const struct route *route, const char *number)
+{
+	size_t strip = OSMO_MIN(route->strip, strlen(number));
+
+	return talloc_asprintf(ctx, "%.*s%s", route->prepend_len,
+				&table->pool[route->prepend], number + strip);
+}
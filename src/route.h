@@ -0,0 +1,96 @@
+#pragma once
+
+#include <osmocom/core/select.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ROUTE_PREFIX_LEN	32
+
+struct app_config;
+
+/**
+ * Node of the compressed digit trie. The label holds the digits
+ * that were merged into this node, the children are stored next
+ * to each other and are indexed by the rank of their digit in the
+ * child mask.
+ */
+struct route_node {
+	uint32_t label;		/* offset into the digit pool */
+	uint32_t first_child;
+	int32_t route;		/* first route of the prefix or -1 */
+	uint16_t child_mask;
+	uint8_t label_len;
+};
+
+struct route {
+	/* next route of the same prefix or -1 */
+	int32_t next;
+
+	uint32_t prepend;	/* offset into the digit pool */
+	uint8_t prepend_len;
+	uint8_t strip;
+	uint16_t trunk;		/* index into the trunk names */
+
+	/* 0 matches any codec */
+	uint32_t payload_msg_type;
+};
+
+/**
+ * An immutable routing table. It is built in one go and replaced
+ * as a whole on a reload.
+ */
+struct route_table {
+	struct route_node *nodes;
+	size_t num_nodes;
+	struct route *routes;
+	size_t num_routes;
+	char *pool;
+	char **trunks;
+	size_t num_trunks;
+
+	/* result of the load */
+	int error;
+	unsigned int bad_lines;
+	unsigned int first_bad_line;
+	unsigned int duplicates;
+	size_t bytes;
+	unsigned int build_ms;
+};
+
+/**
+ * The active table and the state of a reload. The table is built
+ * on a separate thread and handed back through a pipe so that the
+ * main loop never waits for it.
+ */
+struct routing {
+	const char *path;
+	struct route_table *table;
+
+	bool loading;
+	bool reload_pending;
+	pthread_t thread;
+	struct osmo_fd ofd;
+	int wfd;
+
+	/* statistics */
+	uint64_t lookups;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t reloads;
+	uint64_t reload_failures;
+};
+
+int routing_init(struct app_config *app);
+int routing_reload(struct routing *routing);
+
+const struct route *route_lookup(struct routing *routing, const char *number,
+				uint32_t payload_msg_type);
+const char *route_trunk_name(const struct route_table *table,
+				const struct route *route);
+char *route_rewrite(void *ctx, const struct route_table *table,
+				const struct route *route, const char *number);
+
+uint32_t route_codec_parse(const char *name);
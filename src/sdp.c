@@ -22,6 +22,7 @@
 #include "call.h"
 #include "logging.h"
 #include "app.h"
+#include "codec.h"
 
 #include <talloc.h>
 
@@ -36,19 +37,17 @@
  * We want to decide on the audio codec later but we need to see
  * if it is even including some of the supported ones.
  */
-bool sdp_screen_sdp(const sip_t *sip)
+bool sdp_screen_data(const char *sdp_data)
 {
-	const char *sdp_data;
 	sdp_parser_t *parser;
 	sdp_session_t *sdp;
 	sdp_media_t *media;
 
-	if (!sip->sip_payload || !sip->sip_payload->pl_data) {
+	if (!sdp_data) {
 		LOGP(DSIP, LOGL_ERROR, "No SDP file\n");
 		return false;
 	}
 
-	sdp_data = sip->sip_payload->pl_data;
 	parser = sdp_parse(NULL, sdp_data, strlen(sdp_data), 0);
 	if (!parser) {
 		LOGP(DSIP, LOGL_ERROR, "Failed to parse SDP\n");
@@ -90,21 +89,30 @@ success:
 	return true;
 }
 
-bool sdp_extract_sdp(struct sip_call_leg *leg, const sip_t *sip, bool any_codec)
+/*
+ * Take the connection and the port and payload type of the first audio
+ * codec, of the wanted codec of the leg unless any_codec is set. With a
+ * policy the GSM codecs of an offer are remembered as well and the one
+ * the policy picks for this combination is taken instead.
+ */
+static bool extract_media(struct sip_call_leg *leg, const char *sdp_data,
+			bool any_codec, struct codec_policy *policy)
 {
 	sdp_connection_t *conn;
 	sdp_session_t *sdp;
 	sdp_parser_t *parser;
 	sdp_media_t *media;
-	const char *sdp_data;
+	const struct codec_choice *choice;
+	uint16_t ports[_NUM_CODECS];
+	uint32_t pts[_NUM_CODECS];
+	uint32_t caps = 0;
 	bool found_conn = false, found_map = false;
 
-	if (!sip->sip_payload || !sip->sip_payload->pl_data) {
+	if (!sdp_data) {
 		LOGP(DSIP, LOGL_ERROR, "leg(%p) but no SDP file\n", leg);
 		return false;
 	}
 
-	sdp_data = sip->sip_payload->pl_data;
 	parser = sdp_parse(NULL, sdp_data, strlen(sdp_data), 0);
 	if (!parser) {
 		LOGP(DSIP, LOGL_ERROR, "leg(%p) failed to parse SDP\n",
@@ -139,30 +147,78 @@ bool sdp_extract_sdp(struct sip_call_leg *leg, const sip_t *sip, bool any_codec)
 			continue;
 
 		for (map = media->m_rtpmaps; map; map = map->rm_next) {
-			if (!any_codec && strcasecmp(map->rm_encoding, leg->wanted_codec) != 0)
+			int codec;
+
+			if (!found_map && (any_codec
+			    || strcasecmp(map->rm_encoding, leg->wanted_codec) == 0)) {
+				leg->base.port = media->m_port;
+				leg->base.payload_type = map->rm_pt;
+				found_map = true;
+			}
+
+			if (!policy) {
+				if (found_map)
+					break;
 				continue;
+			}
 
-			leg->base.port = media->m_port;
-			leg->base.payload_type = map->rm_pt;
-			found_map = true;
-			break;
+			codec = codec_from_name(map->rm_encoding);
+			if (codec < 0 || (caps & (1 << codec)))
+				continue;
+			caps |= 1 << codec;
+			ports[codec] = media->m_port;
+			pts[codec] = map->rm_pt;
 		}
 
-		if (found_map)
+		if (found_map && !policy)
 			break;
 	}
+	sdp_parser_free(parser);
 
 	if (!found_conn || !found_map) {
 		LOGP(DSIP, LOGL_ERROR, "leg(%p) did not find %d/%d\n",
 			leg, found_conn, found_map);
-		sdp_parser_free(parser);
 		return false;
 	}
 
-	sdp_parser_free(parser);
+	if (!policy)
+		return true;
+
+	leg->base.codec_caps = caps;
+	if (policy->num_prefs == 0)
+		return true;
+
+	choice = &policy->choice[caps];
+	if (choice->codec < 0) {
+		policy->unmatched += 1;
+		return true;
+	}
+
+	policy->selected[choice->codec] += 1;
+	leg->base.port = ports[choice->codec];
+	leg->base.payload_type = pts[choice->codec];
+	leg->base.payload_msg_type = codec_payload_msg_type(choice->codec);
+	leg->wanted_codec = get_value_string(codec_names, choice->codec);
 	return true;
 }
 
+bool sdp_extract_data(struct sip_call_leg *leg, const char *sdp_data, bool any_codec)
+{
+	return extract_media(leg, sdp_data, any_codec, NULL);
+}
+
+/*
+ * Look at the audio codecs of an offer once. Remember which of the
+ * GSM codecs are offered and take the port and payload type of the
+ * one the codec policy picks for this combination. Without a policy
+ * the first codec is used and the MNCC side decides.
+ */
+bool sdp_extract_offer_data(struct sip_call_leg *leg, const char *sdp_data,
+				struct codec_policy *policy)
+{
+	return extract_media(leg, sdp_data, true, policy);
+}
+
 char *sdp_create_file(struct sip_call_leg *leg, struct call_leg *other)
 {
 	struct in_addr net = { .s_addr = ntohl(other->ip) };
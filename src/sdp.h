@@ -6,8 +6,12 @@
 
 struct sip_call_leg;
 struct call_leg;
+struct codec_policy;
 
-bool sdp_screen_sdp(const sip_t *sip);
-bool sdp_extract_sdp(struct sip_call_leg *leg, const sip_t *sip, bool any_codec);
+/* the SDP body is NUL terminated */
+bool sdp_screen_data(const char *sdp_data);
+bool sdp_extract_data(struct sip_call_leg *leg, const char *sdp_data, bool any_codec);
+bool sdp_extract_offer_data(struct sip_call_leg *leg, const char *sdp_data,
+				struct codec_policy *policy);
 
 char *sdp_create_file(struct sip_call_leg *, struct call_leg *);
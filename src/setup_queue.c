@@ -0,0 +1,133 @@
+/*
+ * (C) 2017 by Holger Hans Peter Freyther
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "setup_queue.h"
+#include "app.h"
+#include "logging.h"
+
+/*
+ * Releases free resources and new setups allocate them. When we
+ * are saturated the releases should not wait behind a burst of new
+ * calls. The MNCC and SIP code park new call attempts in here and
+ * the event loop runs them once all other events of the current
+ * iteration have been handled.
+ */
+#define SETUP_QUEUE_BUDGET	32
+
+struct setup_queue g_setup_queue;
+
+void setup_queue_init(void)
+{
+	INIT_LLIST_HEAD(&g_setup_queue.entries);
+}
+
+bool setup_queue_enabled(void)
+{
+	return g_app.setup_queue.max_length > 0;
+}
+
+bool setup_queue_add(struct setup_entry *entry)
+{
+	if (g_setup_queue.length >= g_app.setup_queue.max_length) {
+		LOGP(DAPP, LOGL_ERROR, "Setup queue full with %u entries\n",
+			g_setup_queue.length);
+		g_setup_queue.overflows += 1;
+		return false;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &entry->queued);
+	llist_add_tail(&entry->entry, &g_setup_queue.entries);
+	g_setup_queue.length += 1;
+	g_setup_queue.queued += 1;
+	if (g_setup_queue.length > g_setup_queue.max_length_seen)
+		g_setup_queue.max_length_seen = g_setup_queue.length;
+	return true;
+}
+
+void setup_queue_del(struct setup_entry *entry)
+{
+	llist_del(&entry->entry);
+	g_setup_queue.length -= 1;
+}
+
+struct setup_entry *setup_queue_find(void *owner, void *key)
+{
+	struct setup_entry *entry;
+
+	llist_for_each_entry(entry, &g_setup_queue.entries, entry) {
+		if (entry->owner == owner && entry->key == key)
+			return entry;
+	}
+
+	return NULL;
+}
+
+void setup_queue_flush(void *owner)
+{
+	struct setup_entry *entry, *tmp;
+
+	llist_for_each_entry_safe(entry, tmp, &g_setup_queue.entries, entry) {
+		if (entry->owner != owner)
+			continue;
+		setup_queue_del(entry);
+		g_setup_queue.flushed += 1;
+		entry->drop(entry);
+	}
+}
+
+static void account_delay(struct setup_entry *entry)
+{
+	struct timespec now;
+	int64_t delay;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	delay = (now.tv_sec - entry->queued.tv_sec) * 1000000
+		+ (now.tv_nsec - entry->queued.tv_nsec) / 1000;
+	if (delay < 0)
+		delay = 0;
+
+	g_setup_queue.delay_last = delay;
+	g_setup_queue.delay_total += delay;
+	if (delay > g_setup_queue.delay_max)
+		g_setup_queue.delay_max = delay;
+}
+
+/*
+ * Run the parked setups. Called from the event loop after all
+ * other events have been dispatched. Returns the number of entries
+ * that are still pending.
+ */
+int setup_queue_run(void)
+{
+	int budget = SETUP_QUEUE_BUDGET;
+
+	while (budget-- > 0 && !llist_empty(&g_setup_queue.entries)) {
+		struct setup_entry *entry;
+
+		entry = llist_first_entry(&g_setup_queue.entries,
+					struct setup_entry, entry);
+		setup_queue_del(entry);
+		account_delay(entry);
+		g_setup_queue.processed += 1;
+		entry->run(entry);
+	}
+
+	return g_setup_queue.length;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <osmocom/core/linuxlist.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * A new call attempt that has been parked behind release and
+ * cleanup work. The MNCC and SIP code embed this and provide
+ * the callbacks. Both callbacks own the entry and must free it.
+ */
+struct setup_entry {
+	struct llist_head entry;
+	struct timespec queued;
+
+	/* connection/agent the attempt arrived on and a lookup key */
+	void *owner;
+	void *key;
+
+	/* continue with the call setup */
+	void (*run)(struct setup_entry *);
+
+	/* the attempt will not be processed. Reject it */
+	void (*drop)(struct setup_entry *);
+};
+
+struct setup_queue {
+	struct llist_head entries;
+	unsigned int length;
+
+	/* statistics */
+	unsigned int max_length_seen;
+	uint64_t queued;
+	uint64_t processed;
+	uint64_t overflows;
+	uint64_t flushed;
+
+	/* deferral delay in microseconds */
+	uint64_t delay_total;
+	uint32_t delay_last;
+	uint32_t delay_max;
+};
+
+extern struct setup_queue g_setup_queue;
+
+void setup_queue_init(void);
+bool setup_queue_enabled(void);
+
+bool setup_queue_add(struct setup_entry *entry);
+void setup_queue_del(struct setup_entry *entry);
+struct setup_entry *setup_queue_find(void *owner, void *key);
+void setup_queue_flush(void *owner);
+
+int setup_queue_run(void);
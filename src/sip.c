@@ -21,130 +21,262 @@
 #include "sip.h"
 #include "app.h"
 #include "call.h"
+#include "callstate.h"
 #include "logging.h"
 #include "sdp.h"
+#include "setup_queue.h"
+#include "sip_builtin.h"
+#include "sip_leg.h"
 
 #include <osmocom/core/utils.h>
 
 #include <sofia-sip/sip_status.h>
+#include <sofia-sip/tport_tag.h>
 
 #include <talloc.h>
 
 #include <string.h>
+#include <unistd.h>
 
 extern void *tall_mncc_ctx;
 
-static void sip_release_call(struct call_leg *_leg);
-static void sip_ring_call(struct call_leg *_leg);
-static void sip_connect_call(struct call_leg *_leg);
-static void sip_dtmf_call(struct call_leg *_leg, int keypad);
+const struct value_string sip_engine_names[] = {
+	{ SIP_ENGINE_SOFIA,		"sofia"		},
+	{ SIP_ENGINE_BUILTIN,		"builtin"	},
+	{ 0, NULL },
+};
 
-static void call_progress(struct sip_call_leg *leg, const sip_t *sip, int status)
-{
-	struct call_leg *other = call_leg_other(&leg->base);
-
-	if (!other)
-		return;
+/* A parked INVITE, see setup_queue.c */
+struct sip_setup_entry {
+	struct setup_entry base;
+	struct sip_agent *agent;
+	nua_saved_event_t saved[1];
+};
 
-	/* Extract SDP for session in progress with matching codec */
-	if (status == 183)
-		sdp_extract_sdp(leg, sip, false);
+static int start_invite(struct sip_call_leg *leg, struct sip_trunk *trunk);
+static void send_invite(struct sip_agent *agent, struct sip_call_leg *leg,
+			const char *calling_num, const char *called_num);
 
-	LOGP(DSIP, LOGL_NOTICE, "leg(%p) is now rining.\n", leg);
-	other->ring_call(other);
+static const char *sip_payload(const sip_t *sip)
+{
+	if (!sip || !sip->sip_payload)
+		return NULL;
+	return sip->sip_payload->pl_data;
 }
 
-static void call_connect(struct sip_call_leg *leg, const sip_t *sip)
+static void nua_leg_respond(struct sip_call_leg *leg, int status,
+				const char *phrase, const char *sdp)
 {
-	/* extract SDP file and if compatible continue */
-	struct call_leg *other = call_leg_other(&leg->base);
+	nua_respond(leg->nua_handle, status, phrase,
+			TAG_IF(sdp, NUTAG_MEDIA_ENABLE(0)),
+			TAG_IF(sdp, SIPTAG_CONTENT_TYPE_STR("application/sdp")),
+			TAG_IF(sdp, SIPTAG_PAYLOAD_STR(sdp)),
+			TAG_END());
+}
 
-	if (!other) {
-		LOGP(DSIP, LOGL_ERROR, "leg(%p) connected but leg gone\n", leg);
-		nua_cancel(leg->nua_handle, TAG_END());
-		return;
-	}
+static void nua_leg_info(struct sip_call_leg *leg, const char *content_type,
+				const char *payload)
+{
+	nua_info(leg->nua_handle,
+		NUTAG_MEDIA_ENABLE(0),
+		SIPTAG_CONTENT_TYPE_STR(content_type),
+		SIPTAG_PAYLOAD_STR(payload), TAG_END());
+}
 
-	if (!sdp_extract_sdp(leg, sip, false)) {
-		LOGP(DSIP, LOGL_ERROR, "leg(%p) incompatible audio, releasing\n", leg);
+/* the leg is released once nua_r_bye or nua_r_cancel arrives */
+static bool nua_leg_hangup(struct sip_call_leg *leg)
+{
+	if (leg->state == SIP_CC_CONNECTED)
+		nua_bye(leg->nua_handle, TAG_END());
+	else
 		nua_cancel(leg->nua_handle, TAG_END());
-		other->release_call(other);
-		return;
-	}
+	return false;
+}
 
-	LOGP(DSIP, LOGL_NOTICE, "leg(%p) is now connected.\n", leg);
-	leg->state = SIP_CC_CONNECTED;
-	other->connect_call(other);
-	nua_ack(leg->nua_handle, TAG_END());
+static void nua_leg_drop(struct sip_call_leg *leg)
+{
+	nua_handle_destroy(leg->nua_handle);
+	leg->nua_handle = NULL;
 }
 
+static const struct sip_leg_ops nua_leg_ops = {
+	.respond = nua_leg_respond,
+	.info = nua_leg_info,
+	.hangup = nua_leg_hangup,
+	.drop = nua_leg_drop,
+};
+
 static void new_call(struct sip_agent *agent, nua_handle_t *nh,
 			const sip_t *sip)
 {
-	struct call *call;
 	struct sip_call_leg *leg;
 	const char *from = NULL, *to = NULL;
+	int status;
 
 	LOGP(DSIP, LOGL_DEBUG, "Incoming call handle(%p)\n", nh);
 
-	if (!sdp_screen_sdp(sip)) {
-		LOGP(DSIP, LOGL_ERROR, "No supported codec.\n");
-		nua_respond(nh, SIP_406_NOT_ACCEPTABLE, TAG_END());
+	if (sip->sip_to)
+		to = sip->sip_to->a_url->url_user;
+	if (sip->sip_from)
+		from = sip->sip_from->a_url->url_user;
+
+	leg = sip_leg_incoming(agent, &nua_leg_ops, from, to, sip_payload(sip), &status);
+	if (!leg) {
+		nua_respond(nh, status, sip_status_phrase(status), TAG_END());
 		nua_handle_destroy(nh);
 		return;
 	}
 
-	call = call_sip_create();
-	if (!call) {
-		LOGP(DSIP, LOGL_ERROR, "No supported codec.\n");
+	leg->nua_handle = nh;
+	nua_handle_bind(nh, leg);
+	if (sip->sip_call_id)
+		leg->call_id = talloc_strdup(leg, sip->sip_call_id->i_id);
+
+	app_route_call(leg->base.call,
+			talloc_strdup(leg, from),
+			talloc_strdup(leg, to));
+}
+
+static void run_setup_entry(struct setup_entry *_entry)
+{
+	struct sip_setup_entry *entry = (struct sip_setup_entry *) _entry;
+	nua_event_data_t const *data = nua_event_data(entry->saved);
+
+	new_call(entry->agent, data->e_nh, sip_object(data->e_msg));
+	nua_destroy_event(entry->saved);
+	talloc_free(entry);
+}
+
+static void drop_setup_entry(struct setup_entry *_entry)
+{
+	struct sip_setup_entry *entry = (struct sip_setup_entry *) _entry;
+	nua_handle_t *nh = entry->base.key;
+
+	LOGP(DSIP, LOGL_ERROR, "Dropping queued invite handle(%p)\n", nh);
+	nua_respond(nh, SIP_503_SERVICE_UNAVAILABLE, TAG_END());
+	nua_handle_destroy(nh);
+	nua_destroy_event(entry->saved);
+	talloc_free(entry);
+}
+
+/*
+ * Park the INVITE until the releases of this loop iteration have
+ * been handled. The event is saved as the sip_t only lives for the
+ * duration of the callback.
+ */
+static void queue_call(struct sip_agent *agent, nua_handle_t *nh,
+			const sip_t *sip)
+{
+	struct sip_setup_entry *entry;
+
+	if (!setup_queue_enabled())
+		return new_call(agent, nh, sip);
+
+	entry = talloc_zero(tall_mncc_ctx, struct sip_setup_entry);
+	if (!entry) {
+		LOGP(DSIP, LOGL_ERROR, "Failed to queue invite handle(%p)\n", nh);
 		nua_respond(nh, SIP_500_INTERNAL_SERVER_ERROR, TAG_END());
 		nua_handle_destroy(nh);
 		return;
 	}
 
-	if (sip->sip_to)
-		to = sip->sip_to->a_url->url_user;
-	if (sip->sip_from)
-		from = sip->sip_from->a_url->url_user;
+	entry->base.owner = agent;
+	entry->base.key = nh;
+	entry->base.run = run_setup_entry;
+	entry->base.drop = drop_setup_entry;
+	entry->agent = agent;
 
-	if (!to || !from) {
-		LOGP(DSIP, LOGL_ERROR, "Unknown from/to for invite.\n");
-		nua_respond(nh, SIP_406_NOT_ACCEPTABLE, TAG_END());
+	if (nua_save_event(agent->nua, entry->saved) != 1) {
+		LOGP(DSIP, LOGL_ERROR, "Failed to save invite handle(%p)\n", nh);
+		nua_respond(nh, SIP_500_INTERNAL_SERVER_ERROR, TAG_END());
 		nua_handle_destroy(nh);
+		talloc_free(entry);
 		return;
 	}
 
-	leg = (struct sip_call_leg *) call->initial;
-	leg->state = SIP_CC_DLG_CNFD;
-	leg->dir = SIP_DIR_MO;
-
-	/*
-	 * FIXME/TODO.. we need to select the codec at some point. But it is
-	 * not this place. It starts with the TCH/F vs. TCH/H selection based
-	 * on the offered codecs, and then RTP_CREATE should have it. So both
-	 * are GSM related... and do not belong here. Just pick the first codec
-	 * so the IP addresss port and payload type is set.
-	 */
-	if (!sdp_extract_sdp(leg, sip, true)) {
-		LOGP(DSIP, LOGL_ERROR, "leg(%p) no audio, releasing\n", leg);
-		nua_respond(nh, SIP_406_NOT_ACCEPTABLE, TAG_END());
-		nua_handle_destroy(nh);
-		call_leg_release(&leg->base);
+	if (!setup_queue_add(&entry->base))
+		drop_setup_entry(&entry->base);
+}
+
+static void cancel_queued_call(struct sip_agent *agent, nua_handle_t *nh)
+{
+	struct sip_setup_entry *entry;
+
+	entry = (struct sip_setup_entry *) setup_queue_find(agent, nh);
+	if (!entry)
 		return;
+
+	LOGP(DSIP, LOGL_NOTICE, "Canceled queued invite handle(%p)\n", nh);
+	setup_queue_del(&entry->base);
+	nua_handle_destroy(nh);
+	nua_destroy_event(entry->saved);
+	talloc_free(entry);
+}
+
+/*
+ * The INVITE failed with a server error or a timeout before the
+ * remote started to ring. Try it on the next trunk of the group.
+ */
+static bool retry_invite(struct sip_call_leg *leg, int status)
+{
+	struct sip_trunk *trunk, *old_trunk = leg->trunk;
+	nua_handle_t *old_handle = leg->nua_handle;
+
+	if (status < 500 && status != 408)
+		return false;
+	if (leg->alerted || !old_trunk)
+		return false;
+
+	trunk = sip_trunk_select(leg->agent->app, leg->tried_trunks);
+	if (!trunk)
+		return false;
+
+	LOGP(DSIP, LOGL_NOTICE, "leg(%p) trunk(%s) failed with %d, trying trunk(%s)\n",
+		leg, old_trunk->name, status, trunk->name);
+
+	sip_trunk_unbind(leg);
+	if (start_invite(leg, trunk) != 0) {
+		leg->nua_handle = old_handle;
+		return false;
 	}
 
-	leg->base.release_call = sip_release_call;
-	leg->base.ring_call = sip_ring_call;
-	leg->base.connect_call = sip_connect_call;
-	leg->base.dtmf = sip_dtmf_call;
-	leg->agent = agent;
-	leg->nua_handle = nh;
-	nua_handle_bind(nh, leg);
-	leg->sdp_payload = talloc_strdup(leg, sip->sip_payload->pl_data);
+	old_trunk->failovers += 1;
+	nua_handle_destroy(old_handle);
+	return true;
+}
 
-	app_route_call(call,
-			talloc_strdup(leg, from),
-			talloc_strdup(leg, to));
+/*
+ * The PBX wants credentials. Remember the challenge for the trunk and
+ * let nua answer it on the same dialog, the INVITE is resent with the
+ * same Call-ID and the next CSeq. This happens once per leg, a second
+ * challenge means the credentials are not accepted.
+ */
+static bool retry_auth(struct sip_call_leg *leg, const sip_t *sip, int status)
+{
+	struct sip_auth *auth;
+	char *cred;
+
+	if (status != 401 && status != 407)
+		return false;
+	if (leg->auth_retried || !leg->trunk)
+		return false;
+	auth = &leg->trunk->auth;
+	if (!sip_auth_challenge(auth, leg->trunk, sip, status, leg->auth_nonce))
+		return false;
+
+	cred = talloc_asprintf(leg, "Digest:\"%s\":%s:%s",
+				auth->realm, auth->username, auth->password);
+	if (!cred)
+		return false;
+
+	LOGP(DSIP, LOGL_DEBUG, "leg(%p) trunk(%s) challenged with %d, authenticating\n",
+		leg, leg->trunk->name, status);
+	leg->auth_retried = true;
+	leg->state = SIP_CC_INITIAL;
+	nua_authenticate(leg->nua_handle, NUTAG_AUTH(cred), TAG_END());
+	sip_trunk_invite_sent(leg);
+	talloc_free(cred);
+	return true;
 }
 
 void nua_callback(nua_event_t event, int status, char const *phrase, nua_t *nua, nua_magic_t *magic, nua_handle_t *nh, nua_hmagic_t *hmagic, sip_t const *sip, tagi_t tags[])
@@ -155,197 +287,195 @@ void nua_callback(nua_event_t event, int status, char const *phrase, nua_t *nua,
 	if (event == nua_r_invite) {
 		struct sip_call_leg *leg;
 		leg = (struct sip_call_leg *) hmagic;
+		callstate_changed(leg->base.call);
+		if (!leg->call_id && sip && sip->sip_call_id)
+			leg->call_id = talloc_strdup(leg, sip->sip_call_id->i_id);
+		if (sip && sip->sip_cseq)
+			leg->cseq = sip->sip_cseq->cs_seq;
 
 		/* MT call is moving forward */
+		sip_trunk_account(leg, status);
+		if (status >= 200 && leg->trunk)
+			sip_trunk_invite_done(leg);
 
 		/* The dialogue is now confirmed */
 		if (leg->state == SIP_CC_INITIAL)
 			leg->state = SIP_CC_DLG_CNFD;
 
 		if (status == 180 || status == 183)
-			call_progress(leg, sip, status);
-		else if (status == 200)
-			call_connect(leg, sip);
-		else if (status >= 300) {
-			struct call_leg *other = call_leg_other(&leg->base);
+			sip_leg_progress(leg, status, sip_payload(sip));
+		else if (status == 200) {
+			if (sip_leg_answered(leg, sip_payload(sip)))
+				nua_ack(leg->nua_handle, TAG_END());
+		} else if (status >= 300) {
+			if (retry_auth(leg, sip, status))
+				return;
+			if (retry_invite(leg, status))
+				return;
 
 			LOGP(DSIP, LOGL_ERROR, "leg(%p) unknown err, releasing.\n", leg);
 			nua_cancel(leg->nua_handle, TAG_END());
-			nua_handle_destroy(leg->nua_handle);
-			call_leg_release(&leg->base);
-
-			if (other)
-				other->release_call(other);
+			sip_leg_release_both(leg);
 		}
 	} else if (event == nua_r_bye || event == nua_r_cancel) {
 		/* our bye or hang up is answered */
 		struct sip_call_leg *leg = (struct sip_call_leg *) hmagic;
 		LOGP(DSIP, LOGL_NOTICE, "leg(%p) got resp to %s\n",
 			leg, event == nua_r_bye ? "bye" : "cancel");
-		nua_handle_destroy(leg->nua_handle);
-		call_leg_release(&leg->base);
+		sip_leg_release(leg);
 	} else if (event == nua_i_bye) {
 		/* our remote has hung up */
 		struct sip_call_leg *leg = (struct sip_call_leg *) hmagic;
-		struct call_leg *other = call_leg_other(&leg->base);
 
 		LOGP(DSIP, LOGL_ERROR, "leg(%p) got bye, releasing.\n", leg);
-		nua_handle_destroy(leg->nua_handle);
-		call_leg_release(&leg->base);
-
-		if (other)
-			other->release_call(other);
+		sip_leg_release_both(leg);
 	} else if (event == nua_i_invite) {
 		/* new incoming leg */
 
 		if (status == 100)
-			new_call((struct sip_agent *) magic, nh, sip);
+			queue_call((struct sip_agent *) magic, nh, sip);
 	} else if (event == nua_i_cancel) {
-		struct sip_call_leg *leg;
-		struct call_leg *other;
-
 		LOGP(DSIP, LOGL_ERROR, "Canceled on leg(%p)\n", hmagic);
 
-		leg = (struct sip_call_leg *) hmagic;
-		other = call_leg_other(&leg->base);
-
-		nua_handle_destroy(leg->nua_handle);
-		call_leg_release(&leg->base);
-		if (other)
-			other->release_call(other);
+		/* still waiting in the setup queue */
+		if (!hmagic)
+			return cancel_queued_call((struct sip_agent *) magic, nh);
+
+		sip_leg_release_both((struct sip_call_leg *) hmagic);
+	} else if (event == nua_r_method) {
+		/* the BYE for a dialog of a previous instance */
+		if (status < 200)
+			return;
+		LOGP(DSIP, LOGL_NOTICE, "Recovered dialog handle(%p) released with %d\n",
+			nh, status);
+		nua_handle_destroy(nh);
+	} else if (event == nua_r_options) {
+		/* only the trunk health probes send OPTIONS */
+		sip_trunk_probe_result((struct sip_trunk *) hmagic, status);
 	}
 }
 
 
-static void sip_release_call(struct call_leg *_leg)
+static void send_invite(struct sip_agent *agent, struct sip_call_leg *leg,
+			const char *calling_num, const char *called_num)
 {
-	struct sip_call_leg *leg;
+	struct call_leg *other = leg->base.call->initial;
 
-	OSMO_ASSERT(_leg->type == CALL_TYPE_SIP);
-	leg = (struct sip_call_leg *) _leg;
-
-	/*
-	 * If a dialogue is not confirmed yet, we can probably not do much
-	 * but wait for the timeout. For a confirmed one we can send cancel
-	 * and for a connected one bye. I don't see how sofia-sip is going
-	 * to help us here.
-	 */
-	switch (leg->state) {
-	case SIP_CC_INITIAL:
-		LOGP(DSIP, LOGL_NOTICE, "Canceling leg(%p) in int state\n", leg);
-		nua_handle_destroy(leg->nua_handle);
-		call_leg_release(&leg->base);
-		break;
-	case SIP_CC_DLG_CNFD:
-		LOGP(DSIP, LOGL_NOTICE, "Canceling leg(%p) in cnfd state\n", leg);
-		if (leg->dir == SIP_DIR_MT)
-			nua_cancel(leg->nua_handle, TAG_END());
-		else {
-			nua_respond(leg->nua_handle, SIP_486_BUSY_HERE,
-					TAG_END());
-			nua_handle_destroy(leg->nua_handle);
-			call_leg_release(&leg->base);
-		}
-		break;
-	case SIP_CC_CONNECTED:
-		LOGP(DSIP, LOGL_NOTICE, "Ending leg(%p) in con\n", leg);
-		nua_bye(leg->nua_handle, TAG_END());
-		break;
+	char *from = talloc_asprintf(leg, "sip:%s@%s:%d",
+				calling_num,
+				agent->app->sip.local_addr,
+				agent->app->sip.local_port);
+	char *to = talloc_asprintf(leg, "sip:%s@%s:%d%s",
+				called_num,
+				leg->trunk->remote_addr,
+				leg->trunk->remote_port,
+				sip_trunk_uri_params(leg->trunk));
+	char *sdp = sdp_create_file(leg, other);
+	struct sip_auth *auth = &leg->trunk->auth;
+	char *authorization, *proxy;
+
+	/* skip the DNS lookup of sofia with the address of the resolver */
+	proxy = sip_trunk_proxy(leg->trunk, leg);
+
+	/* answer the last challenge of the trunk without waiting for one */
+	authorization = sip_auth_header(auth, leg, "INVITE", to);
+	talloc_free(leg->auth_nonce);
+	leg->auth_nonce = NULL;
+	if (authorization) {
+		auth->proactive += 1;
+		leg->auth_nonce = talloc_strdup(leg, auth->nonce);
 	}
-}
 
-static void sip_ring_call(struct call_leg *_leg)
-{
-	struct sip_call_leg *leg;
-
-	OSMO_ASSERT(_leg->type == CALL_TYPE_SIP);
-	leg = (struct sip_call_leg *) _leg;
+	nua_invite(leg->nua_handle,
+			SIPTAG_FROM_STR(from),
+			SIPTAG_TO_STR(to),
+			TAG_IF(proxy, NUTAG_PROXY(proxy)),
+			NUTAG_MEDIA_ENABLE(0),
+			SIPTAG_CONTENT_TYPE_STR("application/sdp"),
+			SIPTAG_PAYLOAD_STR(sdp),
+			TAG_IF(authorization && !auth->proxy,
+				SIPTAG_AUTHORIZATION_STR(authorization)),
+			TAG_IF(authorization && auth->proxy,
+				SIPTAG_PROXY_AUTHORIZATION_STR(authorization)),
+			TAG_END());
 
-	nua_respond(leg->nua_handle, SIP_180_RINGING, TAG_END());
+	talloc_free(from);
+	talloc_free(to);
+	talloc_free(sdp);
+	talloc_free(authorization);
+	talloc_free(proxy);
+	sip_trunk_invite_sent(leg);
 }
 
-static void sip_connect_call(struct call_leg *_leg)
+void sip_paced_invite(struct pacer_entry *entry)
 {
-	struct call_leg *other;
 	struct sip_call_leg *leg;
-	char *sdp;
-
-	OSMO_ASSERT(_leg->type == CALL_TYPE_SIP);
-	leg = (struct sip_call_leg *) _leg;
-
-	/*
-	 * TODO/FIXME: check if resulting codec is compatible..
-	 */
 
-	other = call_leg_other(&leg->base);
-	if (!other) {
-		sip_release_call(&leg->base);
+	leg = container_of(entry, struct sip_call_leg, pacer_entry);
+	callstate_changed(leg->base.call);
+	if (leg->agent->builtin) {
+		sip_builtin_paced_invite(leg);
 		return;
 	}
 
-	sdp = sdp_create_file(leg, other);
-
-	leg->state = SIP_CC_CONNECTED;
-	nua_respond(leg->nua_handle, SIP_200_OK,
-			NUTAG_MEDIA_ENABLE(0),
-			SIPTAG_CONTENT_TYPE_STR("application/sdp"),
-			SIPTAG_PAYLOAD_STR(sdp),
-			TAG_END());
-	talloc_free(sdp);
+	send_invite(leg->agent, leg, leg->base.call->source,
+			leg->base.call->dest);
 }
 
-static void sip_dtmf_call(struct call_leg *_leg, int keypad)
+void sip_paced_invite_expired(struct pacer_entry *entry)
 {
 	struct sip_call_leg *leg;
-	char *buf;
 
-	OSMO_ASSERT(_leg->type == CALL_TYPE_SIP);
-	leg = (struct sip_call_leg *) _leg;
+	leg = container_of(entry, struct sip_call_leg, pacer_entry);
+	if (leg->agent->builtin) {
+		sip_builtin_paced_invite_expired(leg);
+		return;
+	}
 
-	buf = talloc_asprintf(leg, "Signal=%c\nDuration=160\n", keypad);
-	nua_info(leg->nua_handle,
-		NUTAG_MEDIA_ENABLE(0),
-		SIPTAG_CONTENT_TYPE_STR("application/dtmf-relay"),
-		SIPTAG_PAYLOAD_STR(buf), TAG_END());
-	talloc_free(buf);
+	LOGP(DSIP, LOGL_ERROR, "leg(%p) waited too long for INVITE, releasing.\n", leg);
+	sip_leg_release_both(leg);
 }
 
-static int send_invite(struct sip_agent *agent, struct sip_call_leg *leg,
-			const char *calling_num, const char *called_num)
+/*
+ * Bind the leg to the trunk and hand the INVITE to the pacer of
+ * that trunk. On failure the leg is left unbound without a handle.
+ */
+static int start_invite(struct sip_call_leg *leg, struct sip_trunk *trunk)
 {
-	struct call_leg *other = leg->base.call->initial;
-
-	char *from = talloc_asprintf(leg, "sip:%s@%s:%d",
-				calling_num,
-				agent->app->sip.local_addr,
-				agent->app->sip.local_port);
-	char *to = talloc_asprintf(leg, "sip:%s@%s:%d",
-				called_num,
-				agent->app->sip.remote_addr,
-				agent->app->sip.remote_port);
-	char *sdp = sdp_create_file(leg, other);
+	leg->nua_handle = nua_handle(leg->agent->nua, leg, TAG_END());
+	if (!leg->nua_handle) {
+		LOGP(DSIP, LOGL_ERROR, "Failed to allocate nua for call(%u)\n",
+			leg->base.call->id);
+		trunk->trial_pending = false;
+		return -1;
+	}
 
 	leg->state = SIP_CC_INITIAL;
-	leg->dir = SIP_DIR_MT;
-	nua_invite(leg->nua_handle,
-			SIPTAG_FROM_STR(from),
-			SIPTAG_TO_STR(to),
-			NUTAG_MEDIA_ENABLE(0),
-			SIPTAG_CONTENT_TYPE_STR("application/sdp"),
-			SIPTAG_PAYLOAD_STR(sdp),
-			TAG_END());
+	leg->auth_retried = false;
+	sip_trunk_bind(trunk, leg);
+
+	/* smooth bursts of INVITEs towards the PBX */
+	if (pacer_submit(&trunk->invite_pacer, &leg->pacer_entry) < 0) {
+		LOGP(DSIP, LOGL_ERROR, "No room to pace INVITE for call(%u)\n",
+			leg->base.call->id);
+		sip_trunk_unbind(leg);
+		trunk->trial_pending = false;
+		nua_handle_destroy(leg->nua_handle);
+		leg->nua_handle = NULL;
+		return -1;
+	}
 
-	leg->base.call->remote = &leg->base;
-	talloc_free(from);
-	talloc_free(to);
-	talloc_free(sdp);
 	return 0;
 }
 
-int sip_create_remote_leg(struct sip_agent *agent, struct call *call)
+int sip_create_remote_leg(struct sip_agent *agent, struct call *call,
+			struct sip_trunk *trunk)
 {
 	struct sip_call_leg *leg;
 
+	if (agent->builtin)
+		return sip_builtin_create_remote_leg(agent, call, trunk);
+
 	leg = talloc_zero(call, struct sip_call_leg);
 	if (!leg) {
 		LOGP(DSIP, LOGL_ERROR, "Failed to allocate leg for call(%u)\n",
@@ -355,19 +485,66 @@ int sip_create_remote_leg(struct sip_agent *agent, struct call *call)
 
 	leg->base.type = CALL_TYPE_SIP;
 	leg->base.call = call;
-	leg->base.release_call = sip_release_call;
-	leg->base.dtmf = sip_dtmf_call;
-	leg->agent = agent;
+	sip_leg_init(leg, agent, &nua_leg_ops);
+	leg->dir = SIP_DIR_MT;
 
-	leg->nua_handle = nua_handle(agent->nua, leg, TAG_END());
-	if (!leg->nua_handle) {
-		LOGP(DSIP, LOGL_ERROR, "Failed to allocate nua for call(%u)\n",
+	trunk = sip_trunk_select_preferred(agent->app, trunk);
+	if (!trunk) {
+		LOGP(DSIP, LOGL_ERROR, "No trunk available for call(%u)\n",
 			call->id);
 		talloc_free(leg);
 		return -2;
 	}
 
-	return send_invite(agent, leg, call->source, call->dest);
+	call->remote = &leg->base;
+	if (start_invite(leg, trunk) != 0) {
+		call->remote = NULL;
+		talloc_free(leg);
+		return -3;
+	}
+
+	return 0;
+}
+
+/*
+ * nua only sends a BYE inside a dialog it created. A handle with the
+ * saved Call-ID and tags makes the BYE look like one to the peer and
+ * the next CSeq keeps it in order.
+ */
+int sip_release_dialog(struct sip_agent *agent, const struct callstate_dialog *dlg)
+{
+	nua_handle_t *nh;
+	char *from, *to, *cseq;
+
+	if (!agent->nua || !dlg->call_id[0] || !dlg->local_tag[0]
+	    || !dlg->remote_tag[0] || !dlg->remote_uri[0])
+		return -1;
+
+	from = talloc_asprintf(tall_mncc_ctx, "<%s>;tag=%s",
+				dlg->local_uri, dlg->local_tag);
+	to = talloc_asprintf(tall_mncc_ctx, "<%s>;tag=%s",
+				dlg->remote_uri, dlg->remote_tag);
+	cseq = talloc_asprintf(tall_mncc_ctx, "%u BYE", dlg->local_cseq + 1);
+
+	nh = nua_handle(agent->nua, NULL,
+			SIPTAG_FROM_STR(from),
+			SIPTAG_TO_STR(to),
+			SIPTAG_CALL_ID_STR(dlg->call_id),
+			TAG_END());
+	if (nh) {
+		LOGP(DSIP, LOGL_NOTICE, "Sending BYE for call-id(%s) handle(%p)\n",
+			dlg->call_id, nh);
+		nua_method(nh,
+			NUTAG_METHOD("BYE"),
+			NUTAG_URL(dlg->remote_target[0] ? dlg->remote_target : dlg->remote_uri),
+			SIPTAG_CSEQ_STR(cseq),
+			TAG_END());
+	}
+
+	talloc_free(from);
+	talloc_free(to);
+	talloc_free(cseq);
+	return nh ? 0 : -1;
 }
 
 char *make_sip_uri(struct sip_agent *agent)
@@ -389,13 +566,30 @@ void sip_agent_init(struct sip_agent *agent, struct app_config *app)
 
 	su_init();
 	su_home_init(&agent->home);
+#ifdef USE_NATIVE_LOOP
+	agent->root = su_root_create(NULL);
+#else
 	agent->root = su_glib_root_create(NULL);
+#endif
 	su_root_threading(agent->root, 0);
 }
 
 int sip_agent_start(struct sip_agent *agent)
 {
-	char *sip_uri = make_sip_uri(agent);
+	char *sip_uri;
+
+	/* no trunk probes, failover or TCP without nua */
+	if (agent->app->sip.engine == SIP_ENGINE_BUILTIN)
+		return sip_builtin_start(agent);
+
+	/* sofia binds on its own */
+	if (agent->app->sip.inherited_fd >= 0) {
+		LOGP(DSIP, LOGL_ERROR, "Inherited SIP socket needs the built-in engine\n");
+		close(agent->app->sip.inherited_fd);
+		agent->app->sip.inherited_fd = -1;
+	}
+
+	sip_uri = make_sip_uri(agent);
 
 	agent->nua = nua_create(agent->root,
 				nua_callback, agent,
@@ -403,7 +597,12 @@ int sip_agent_start(struct sip_agent *agent)
 				NUTAG_AUTOACK(0),
 				NUTAG_AUTOALERT(0),
 				NUTAG_AUTOANSWER(0),
+				TPTAG_KEEPALIVE(agent->app->sip.tcp_keepalive * 1000),
 				TAG_END());
 	talloc_free(sip_uri);
-	return agent->nua ? 0 : -1;
+	if (!agent->nua)
+		return -1;
+
+	sip_trunks_start_probing(agent->app);
+	return 0;
 }
@@ -1,14 +1,29 @@
 #pragma once
 
+#include <osmocom/core/utils.h>
+
 #include <sofia-sip/su_wait.h>
 #include <sofia-sip/url.h>
 #include <sofia-sip/sip.h>
 #include <sofia-sip/nua_tag.h>
+#ifndef USE_NATIVE_LOOP
 #include <sofia-sip/su_glib.h>
+#endif
 #include <sofia-sip/nua.h>
 
 struct app_config;
 struct call;
+struct callstate_dialog;
+struct lsip_engine;
+struct pacer_entry;
+struct sip_trunk;
+
+enum sip_engine {
+	SIP_ENGINE_SOFIA,
+	SIP_ENGINE_BUILTIN,
+};
+
+extern const struct value_string sip_engine_names[];
 
 struct sip_agent {
 	struct app_config	*app;
@@ -16,9 +31,19 @@ struct sip_agent {
 	su_root_t		*root;
 
 	nua_t			*nua;
+
+	/* set when the built-in engine is used instead of nua */
+	struct lsip_engine	*builtin;
 };
 
 void sip_agent_init(struct sip_agent *agent, struct app_config *app);
 int sip_agent_start(struct sip_agent *agent);
 
-int sip_create_remote_leg(struct sip_agent *agent, struct call *call);
+int sip_create_remote_leg(struct sip_agent *agent, struct call *call,
+			struct sip_trunk *trunk);
+
+/* BYE for a connected nua dialog of a previous instance */
+int sip_release_dialog(struct sip_agent *agent, const struct callstate_dialog *dlg);
+
+void sip_paced_invite(struct pacer_entry *entry);
+void sip_paced_invite_expired(struct pacer_entry *entry);
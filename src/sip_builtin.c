@@ -0,0 +1,320 @@
+/*
+ * (C) 2017 by Holger Hans Peter Freyther
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * The SIP legs on top of the built-in engine of lsip.c. The call flow
+ * is the one of sip_leg.c but a leg is gone as soon as it is released,
+ * the engine finishes the CANCEL or BYE on its own.
+ */
+
+#include "sip_builtin.h"
+#include "app.h"
+#include "call.h"
+#include "callstate.h"
+#include "logging.h"
+#include "lsip.h"
+#include "sdp.h"
+#include "sip_leg.h"
+
+#include <sofia-sip/sip_status.h>
+
+#include <talloc.h>
+
+#include <arpa/inet.h>
+
+#include <stdio.h>
+#include <string.h>
+
+extern void *tall_mncc_ctx;
+
+static void builtin_respond(struct sip_call_leg *leg, int status,
+				const char *phrase, const char *sdp)
+{
+	lsip_respond(leg->dialog, status, phrase,
+			sdp ? "application/sdp" : NULL, sdp);
+}
+
+static void builtin_info(struct sip_call_leg *leg, const char *content_type,
+				const char *payload)
+{
+	lsip_info(leg->dialog, content_type, payload);
+}
+
+/* releasing the dialog sends the CANCEL or BYE */
+static bool builtin_hangup(struct sip_call_leg *leg)
+{
+	return true;
+}
+
+static void builtin_drop(struct sip_call_leg *leg)
+{
+	if (!leg->dialog)
+		return;
+	lsip_dialog_release(leg->dialog);
+	leg->dialog = NULL;
+}
+
+static const struct sip_leg_ops builtin_ops = {
+	.respond = builtin_respond,
+	.info = builtin_info,
+	.hangup = builtin_hangup,
+	.drop = builtin_drop,
+};
+
+static void new_call(struct lsip_dialog *dialog, const struct lsip_msg *msg)
+{
+	struct sip_agent *agent = dialog->engine->priv;
+	struct sip_call_leg *leg;
+	char from[64], to[64];
+	int status;
+
+	LOGP(DSIP, LOGL_DEBUG, "Incoming call dialog(%p)\n", dialog);
+
+	snprintf(from, sizeof(from), "%.*s", (int) msg->from_user.len, msg->from_user.p);
+	snprintf(to, sizeof(to), "%.*s", (int) msg->to_user.len, msg->to_user.p);
+
+	leg = sip_leg_incoming(agent, &builtin_ops,
+			msg->from_user.len > 0 && msg->from_user.len < sizeof(from) ? from : NULL,
+			msg->to_user.len > 0 && msg->to_user.len < sizeof(to) ? to : NULL,
+			msg->body, &status);
+	if (!leg) {
+		lsip_respond(dialog, status, sip_status_phrase(status), NULL, NULL);
+		return;
+	}
+
+	leg->dialog = dialog;
+	dialog->priv = leg;
+
+	app_route_call(leg->base.call,
+			talloc_strdup(leg, from),
+			talloc_strdup(leg, to));
+}
+
+/* The answer to our INVITE. A NULL msg is a timeout */
+static void invite_response(struct lsip_dialog *dialog, int status,
+				const struct lsip_msg *msg)
+{
+	struct sip_call_leg *leg = dialog->priv;
+
+	LOGP(DSIP, LOGL_DEBUG, "leg(%p) INVITE answered with %d\n", leg, status);
+	callstate_changed(leg->base.call);
+
+	sip_trunk_account(leg, status);
+	if (status >= 200 && leg->trunk)
+		sip_trunk_invite_done(leg);
+
+	if (leg->state == SIP_CC_INITIAL)
+		leg->state = SIP_CC_DLG_CNFD;
+
+	if (status == 180 || status == 183)
+		sip_leg_progress(leg, status, msg->body);
+	else if (status >= 200 && status < 300)
+		sip_leg_answered(leg, msg->body);
+	else if (status >= 300) {
+		LOGP(DSIP, LOGL_ERROR, "leg(%p) failed with %d, releasing.\n",
+			leg, status);
+		sip_leg_release_both(leg);
+	}
+}
+
+/* The remote hung up with a BYE or a CANCEL */
+static void dialog_ended(struct lsip_dialog *dialog, enum lsip_method method)
+{
+	struct sip_call_leg *leg = dialog->priv;
+
+	LOGP(DSIP, LOGL_ERROR, "leg(%p) got %s, releasing.\n",
+		leg, method == LSIP_BYE ? "bye" : "cancel");
+	sip_leg_release_both(leg);
+}
+
+static const struct lsip_callbacks builtin_callbacks = {
+	.invite = new_call,
+	.response = invite_response,
+	.ended = dialog_ended,
+};
+
+/* A connected leg of a previous instance, the dialog moves along */
+struct call_leg *sip_builtin_leg_restore(struct sip_agent *agent, struct call *call,
+					int dir, const struct lsip_dialog *saved)
+{
+	struct sip_call_leg *leg;
+
+	if (!agent->builtin)
+		return NULL;
+
+	leg = talloc_zero(call, struct sip_call_leg);
+	if (!leg) {
+		LOGP(DSIP, LOGL_ERROR, "Failed to allocate SIP leg\n");
+		return NULL;
+	}
+
+	leg->dialog = lsip_dialog_restore(agent->builtin, saved);
+	if (!leg->dialog) {
+		LOGP(DSIP, LOGL_ERROR, "No dialog left for call-id(%s)\n",
+			saved->call_id);
+		talloc_free(leg);
+		return NULL;
+	}
+
+	leg->base.type = CALL_TYPE_SIP;
+	leg->base.call = call;
+	sip_leg_init(leg, agent, &builtin_ops);
+	leg->state = SIP_CC_CONNECTED;
+	leg->dir = dir;
+	leg->dialog->priv = leg;
+	return &leg->base;
+}
+
+/*
+ * There is no resolver in the engine. The address of the trunk has
+ * to be numeric or resolved by the resolver of the trunks.
+ */
+static int trunk_peer(struct sip_trunk *trunk, struct sockaddr_in *peer)
+{
+	const char *addr = trunk->resolved_addr;
+
+	if (addr)
+		trunk->resolved_sends += 1;
+	else {
+		addr = trunk->remote_addr;
+		trunk->unresolved_sends += 1;
+	}
+
+	memset(peer, 0, sizeof(*peer));
+	peer->sin_family = AF_INET;
+	peer->sin_port = htons(trunk->remote_port);
+	return inet_pton(AF_INET, addr, &peer->sin_addr) == 1 ? 0 : -1;
+}
+
+void sip_builtin_paced_invite(struct sip_call_leg *leg)
+{
+	struct sip_trunk *trunk = leg->trunk;
+	struct call_leg *other = leg->base.call->initial;
+	struct sockaddr_in peer;
+	char *to, *sdp;
+
+	if (trunk_peer(trunk, &peer) != 0) {
+		LOGP(DSIP, LOGL_ERROR, "leg(%p) trunk(%s) has no IPv4 address, releasing.\n",
+			leg, trunk->name);
+		sip_leg_release_both(leg);
+		return;
+	}
+
+	to = talloc_asprintf(leg, "sip:%s@%s:%d",
+				leg->base.call->dest,
+				trunk->remote_addr,
+				trunk->remote_port);
+	sdp = sdp_create_file(leg, other);
+	leg->dialog = lsip_invite(leg->agent->builtin, &peer, to,
+					leg->base.call->source, sdp);
+	talloc_free(to);
+	talloc_free(sdp);
+
+	if (!leg->dialog) {
+		LOGP(DSIP, LOGL_ERROR, "leg(%p) failed to send INVITE, releasing.\n", leg);
+		sip_leg_release_both(leg);
+		return;
+	}
+
+	leg->dialog->priv = leg;
+	sip_trunk_invite_sent(leg);
+}
+
+void sip_builtin_paced_invite_expired(struct sip_call_leg *leg)
+{
+	LOGP(DSIP, LOGL_ERROR, "leg(%p) waited too long for INVITE, releasing.\n", leg);
+	sip_leg_release_both(leg);
+}
+
+int sip_builtin_create_remote_leg(struct sip_agent *agent, struct call *call,
+				struct sip_trunk *trunk)
+{
+	struct sip_call_leg *leg;
+
+	leg = talloc_zero(call, struct sip_call_leg);
+	if (!leg) {
+		LOGP(DSIP, LOGL_ERROR, "Failed to allocate leg for call(%u)\n",
+			call->id);
+		return -1;
+	}
+
+	leg->base.type = CALL_TYPE_SIP;
+	leg->base.call = call;
+	sip_leg_init(leg, agent, &builtin_ops);
+	leg->dir = SIP_DIR_MT;
+	leg->state = SIP_CC_INITIAL;
+
+	trunk = sip_trunk_select_preferred(agent->app, trunk);
+	if (!trunk) {
+		LOGP(DSIP, LOGL_ERROR, "No trunk available for call(%u)\n",
+			call->id);
+		talloc_free(leg);
+		return -2;
+	}
+
+	call->remote = &leg->base;
+	sip_trunk_bind(trunk, leg);
+
+	/* smooth bursts of INVITEs towards the PBX */
+	if (pacer_submit(&trunk->invite_pacer, &leg->pacer_entry) < 0) {
+		LOGP(DSIP, LOGL_ERROR, "No room to pace INVITE for call(%u)\n",
+			call->id);
+		sip_trunk_unbind(leg);
+		trunk->trial_pending = false;
+		call->remote = NULL;
+		talloc_free(leg);
+		return -3;
+	}
+
+	return 0;
+}
+
+int sip_builtin_start(struct sip_agent *agent)
+{
+	struct app_config *app = agent->app;
+	struct lsip_engine *engine;
+	int rc;
+
+	engine = talloc_zero(tall_mncc_ctx, struct lsip_engine);
+	if (!engine)
+		return -1;
+
+	if (lsip_engine_init(engine, engine, app->sip.builtin_dialogs,
+				&builtin_callbacks, agent) != 0) {
+		talloc_free(engine);
+		return -1;
+	}
+
+	if (app->sip.inherited_fd >= 0) {
+		rc = lsip_engine_adopt(engine, app->sip.inherited_fd);
+		app->sip.inherited_fd = -1;
+	} else
+		rc = lsip_engine_bind(engine, app->sip.local_addr, app->sip.local_port);
+	if (rc != 0) {
+		talloc_free(engine);
+		return -1;
+	}
+
+	LOGP(DSIP, LOGL_NOTICE, "Built-in SIP engine on %s:%d with %u dialogs\n",
+		engine->local_host, ntohs(engine->local.sin_port),
+		app->sip.builtin_dialogs);
+	agent->builtin = engine;
+	return 0;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+struct call;
+struct call_leg;
+struct lsip_dialog;
+struct sip_agent;
+struct sip_call_leg;
+struct sip_trunk;
+
+int sip_builtin_start(struct sip_agent *agent);
+
+int sip_builtin_create_remote_leg(struct sip_agent *agent, struct call *call,
+				struct sip_trunk *trunk);
+void sip_builtin_paced_invite(struct sip_call_leg *leg);
+void sip_builtin_paced_invite_expired(struct sip_call_leg *leg);
+struct call_leg *sip_builtin_leg_restore(struct sip_agent *agent, struct call *call,
+					int dir, const struct lsip_dialog *saved);
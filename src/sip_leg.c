@@ -0,0 +1,270 @@
+/*
+ * (C) 2017 by Holger Hans Peter Freyther
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "sip_leg.h"
+#include "app.h"
+#include "call.h"
+#include "logging.h"
+#include "sdp.h"
+
+#include <osmocom/core/utils.h>
+
+#include <talloc.h>
+
+#include <stdio.h>
+
+static void release_call(struct call_leg *_leg);
+static void ring_call(struct call_leg *_leg);
+static void early_media_call(struct call_leg *_leg);
+static void connect_call(struct call_leg *_leg);
+static void dtmf_call(struct call_leg *_leg, int keypad);
+
+void sip_leg_init(struct sip_call_leg *leg, struct sip_agent *agent,
+			const struct sip_leg_ops *ops)
+{
+	leg->agent = agent;
+	leg->ops = ops;
+	leg->base.release_call = release_call;
+	leg->base.ring_call = ring_call;
+	leg->base.connect_call = connect_call;
+	leg->base.dtmf = dtmf_call;
+}
+
+/*
+ * The engine independent part of an incoming INVITE. On failure NULL
+ * is returned and the engine answers the INVITE with the status. The
+ * leg is not routed yet, the engine binds its handle or dialog first.
+ */
+struct sip_call_leg *sip_leg_incoming(struct sip_agent *agent,
+					const struct sip_leg_ops *ops,
+					const char *from, const char *to,
+					const char *sdp, int *status)
+{
+	struct sip_call_leg *leg;
+	struct call *call;
+
+	if (!sdp_screen_data(sdp)) {
+		LOGP(DSIP, LOGL_ERROR, "No supported codec.\n");
+		*status = 406;
+		return NULL;
+	}
+
+	if (!to || !from) {
+		LOGP(DSIP, LOGL_ERROR, "Unknown from/to for invite.\n");
+		*status = 406;
+		return NULL;
+	}
+
+	/* a single source hammering us with call attempts */
+	if (!ratelimit_check(&agent->app->rate_limit.sip, from)) {
+		LOGP(DSIP, LOGL_ERROR, "From(%s) above call rate limit.\n", from);
+		*status = 503;
+		return NULL;
+	}
+
+	call = call_sip_create();
+	if (!call) {
+		LOGP(DSIP, LOGL_ERROR, "Failed to allocate call.\n");
+		*status = 500;
+		return NULL;
+	}
+
+	leg = (struct sip_call_leg *) call->initial;
+	leg->state = SIP_CC_DLG_CNFD;
+	leg->dir = SIP_DIR_MO;
+
+	/*
+	 * Pick the codec from the offer according to the codec policy. The
+	 * TCH/F vs. TCH/H decision is made from the same offer when the MNCC
+	 * leg is created.
+	 */
+	if (!sdp_extract_offer_data(leg, sdp, &g_app.codecs)) {
+		LOGP(DSIP, LOGL_ERROR, "leg(%p) no audio, releasing\n", leg);
+		call_leg_release(&leg->base);
+		*status = 406;
+		return NULL;
+	}
+
+	sip_leg_init(leg, agent, ops);
+	if (g_app.sip.early_media)
+		leg->base.early_media = early_media_call;
+	leg->sdp_payload = talloc_strdup(leg, sdp);
+	return leg;
+}
+
+/* Our INVITE rings on the other side */
+void sip_leg_progress(struct sip_call_leg *leg, int status, const char *sdp)
+{
+	struct call_leg *other = call_leg_other(&leg->base);
+
+	if (!other)
+		return;
+
+	/* Extract SDP for session in progress with matching codec */
+	if (status == 183)
+		sdp_extract_data(leg, sdp, false);
+
+	LOGP(DSIP, LOGL_NOTICE, "leg(%p) is now rining.\n", leg);
+	leg->alerted = true;
+	other->ring_call(other);
+}
+
+/* Our INVITE is answered, false if the leg is being released instead */
+bool sip_leg_answered(struct sip_call_leg *leg, const char *sdp)
+{
+	struct call_leg *other = call_leg_other(&leg->base);
+
+	if (!other) {
+		LOGP(DSIP, LOGL_ERROR, "leg(%p) connected but leg gone\n", leg);
+		release_call(&leg->base);
+		return false;
+	}
+
+	if (!sdp_extract_data(leg, sdp, false)) {
+		LOGP(DSIP, LOGL_ERROR, "leg(%p) incompatible audio, releasing\n", leg);
+		release_call(&leg->base);
+		other->release_call(other);
+		return false;
+	}
+
+	LOGP(DSIP, LOGL_NOTICE, "leg(%p) is now connected.\n", leg);
+	leg->state = SIP_CC_CONNECTED;
+	other->connect_call(other);
+	return true;
+}
+
+void sip_leg_release(struct sip_call_leg *leg)
+{
+	if (leg->ops)
+		leg->ops->drop(leg);
+	sip_trunk_unbind(leg);
+	call_leg_release(&leg->base);
+}
+
+/* Release the leg and the other one of the call */
+void sip_leg_release_both(struct sip_call_leg *leg)
+{
+	struct call_leg *other = call_leg_other(&leg->base);
+
+	sip_leg_release(leg);
+	if (other)
+		other->release_call(other);
+}
+
+static void release_call(struct call_leg *_leg)
+{
+	struct sip_call_leg *leg;
+
+	OSMO_ASSERT(_leg->type == CALL_TYPE_SIP);
+	leg = (struct sip_call_leg *) _leg;
+
+	switch (leg->state) {
+	case SIP_CC_INITIAL:
+		LOGP(DSIP, LOGL_NOTICE, "Canceling leg(%p) in int state\n", leg);
+		if (leg->trunk)
+			pacer_cancel(&leg->trunk->invite_pacer, &leg->pacer_entry);
+		break;
+	case SIP_CC_DLG_CNFD:
+		LOGP(DSIP, LOGL_NOTICE, "Canceling leg(%p) in cnfd state\n", leg);
+		if (leg->dir == SIP_DIR_MO)
+			leg->ops->respond(leg, 486, "Busy Here", NULL);
+		else if (!leg->ops->hangup(leg))
+			return;
+		break;
+	case SIP_CC_CONNECTED:
+		LOGP(DSIP, LOGL_NOTICE, "Ending leg(%p) in con\n", leg);
+		if (!leg->ops->hangup(leg))
+			return;
+		break;
+	}
+
+	sip_leg_release(leg);
+}
+
+static void ring_call(struct call_leg *_leg)
+{
+	struct sip_call_leg *leg;
+
+	OSMO_ASSERT(_leg->type == CALL_TYPE_SIP);
+	leg = (struct sip_call_leg *) _leg;
+
+	leg->ops->respond(leg, 180, "Ringing", NULL);
+}
+
+/*
+ * Answer the offer with a 183 while the call is being set up. The media
+ * is already connected on the MNCC side, the 200 OK repeats the same SDP.
+ */
+static void early_media_call(struct call_leg *_leg)
+{
+	struct call_leg *other;
+	struct sip_call_leg *leg;
+	char *sdp;
+
+	OSMO_ASSERT(_leg->type == CALL_TYPE_SIP);
+	leg = (struct sip_call_leg *) _leg;
+
+	other = call_leg_other(&leg->base);
+	if (!other || leg->early_media || leg->state == SIP_CC_CONNECTED)
+		return;
+
+	LOGP(DSIP, LOGL_DEBUG, "leg(%p) sending early media\n", leg);
+	sdp = sdp_create_file(leg, other);
+	leg->early_media = true;
+	leg->ops->respond(leg, 183, "Session Progress", sdp);
+	talloc_free(sdp);
+}
+
+static void connect_call(struct call_leg *_leg)
+{
+	struct call_leg *other;
+	struct sip_call_leg *leg;
+	char *sdp;
+
+	OSMO_ASSERT(_leg->type == CALL_TYPE_SIP);
+	leg = (struct sip_call_leg *) _leg;
+
+	/*
+	 * TODO/FIXME: check if resulting codec is compatible..
+	 */
+
+	other = call_leg_other(&leg->base);
+	if (!other) {
+		release_call(&leg->base);
+		return;
+	}
+
+	sdp = sdp_create_file(leg, other);
+	leg->state = SIP_CC_CONNECTED;
+	leg->ops->respond(leg, 200, "OK", sdp);
+	talloc_free(sdp);
+}
+
+static void dtmf_call(struct call_leg *_leg, int keypad)
+{
+	struct sip_call_leg *leg;
+	char buf[32];
+
+	OSMO_ASSERT(_leg->type == CALL_TYPE_SIP);
+	leg = (struct sip_call_leg *) _leg;
+
+	snprintf(buf, sizeof(buf), "Signal=%c\nDuration=160\n", keypad);
+	leg->ops->info(leg, "application/dtmf-relay", buf);
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+
+struct sip_agent;
+struct sip_call_leg;
+
+/**
+ * What the call flow of a SIP leg needs from the engine below it, nua
+ * in sip.c or the built-in one of lsip.c. The flow itself, answering
+ * and ending calls, is the same for both and lives in sip_leg.c.
+ */
+struct sip_leg_ops {
+	/* a response to the INVITE of an MO leg, sdp might be NULL */
+	void (*respond)(struct sip_call_leg *leg, int status, const char *phrase,
+			const char *sdp);
+	void (*info)(struct sip_call_leg *leg, const char *content_type,
+			const char *payload);
+	/* CANCEL or BYE, false when the leg waits for the answer */
+	bool (*hangup)(struct sip_call_leg *leg);
+	/* forget the handle or the dialog of the leg */
+	void (*drop)(struct sip_call_leg *leg);
+};
+
+struct sip_call_leg *sip_leg_incoming(struct sip_agent *agent,
+					const struct sip_leg_ops *ops,
+					const char *from, const char *to,
+					const char *sdp, int *status);
+void sip_leg_init(struct sip_call_leg *leg, struct sip_agent *agent,
+			const struct sip_leg_ops *ops);
+
+void sip_leg_progress(struct sip_call_leg *leg, int status, const char *sdp);
+bool sip_leg_answered(struct sip_call_leg *leg, const char *sdp);
+
+void sip_leg_release(struct sip_call_leg *leg);
+void sip_leg_release_both(struct sip_call_leg *leg);
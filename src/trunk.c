@@ -0,0 +1,406 @@
+/*
+ * (C) 2017 by Holger Hans Peter Freyther
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "trunk.h"
+#include "app.h"
+#include "call.h"
+#include "logging.h"
+
+#include <talloc.h>
+
+extern void *tall_mncc_ctx;
+
+const struct value_string sip_trunk_state_vals[] = {
+	{ SIP_TRUNK_UP,			"UP"		},
+	{ SIP_TRUNK_OPEN,		"OPEN"		},
+	{ SIP_TRUNK_HALF_OPEN,		"HALF-OPEN"	},
+	{ 0, NULL },
+};
+
+/*
+ * Where to send requests of the trunk to. Without a resolved address
+ * sofia resolves the host of the request URI itself.
+ */
+char *sip_trunk_proxy(struct sip_trunk *trunk, void *ctx)
+{
+	if (!trunk->resolved_addr) {
+		trunk->unresolved_sends += 1;
+		return NULL;
+	}
+
+	trunk->resolved_sends += 1;
+	return talloc_asprintf(ctx, "sip:%s:%d%s",
+				trunk->resolved_addr, trunk->remote_port,
+				sip_trunk_uri_params(trunk));
+}
+
+/*
+ * Anything but a server error or a timeout shows that the trunk is
+ * alive.
+ */
+void sip_trunk_account(struct sip_call_leg *leg, int status)
+{
+	if (!leg->trunk || status < 180)
+		return;
+
+	if (status >= 500 || status == 408) {
+		leg->trunk->call_failures += 1;
+		sip_trunk_failure(leg->trunk);
+	} else
+		sip_trunk_success(leg->trunk);
+}
+
+const struct value_string sip_transport_names[] = {
+	{ SIP_TRANSPORT_UDP,		"udp"		},
+	{ SIP_TRANSPORT_TCP,		"tcp"		},
+	{ 0, NULL },
+};
+
+const char *sip_trunk_uri_params(struct sip_trunk *trunk)
+{
+	return trunk->transport == SIP_TRANSPORT_TCP ? ";transport=tcp" : "";
+}
+
+static void send_probe(struct sip_trunk *trunk)
+{
+	struct sip_agent *agent = &trunk->app->sip.agent;
+	char *to, *proxy;
+
+	/* the previous one is still in flight */
+	if (trunk->probe_handle || !agent->nua || !trunk->remote_addr)
+		return;
+
+	to = talloc_asprintf(trunk, "sip:%s:%d%s",
+				trunk->remote_addr, trunk->remote_port,
+				sip_trunk_uri_params(trunk));
+	proxy = sip_trunk_proxy(trunk, trunk);
+	trunk->probe_handle = nua_handle(agent->nua, trunk,
+					SIPTAG_TO_STR(to),
+					TAG_IF(proxy, NUTAG_PROXY(proxy)),
+					TAG_END());
+	talloc_free(to);
+	talloc_free(proxy);
+	if (!trunk->probe_handle) {
+		LOGP(DSIP, LOGL_ERROR, "trunk(%s) failed to allocate probe\n",
+			trunk->name);
+		return;
+	}
+
+	trunk->probes += 1;
+	nua_options(trunk->probe_handle, TAG_END());
+}
+
+static void cooldown_expired(void *data)
+{
+	struct sip_trunk *trunk = data;
+
+	LOGP(DSIP, LOGL_NOTICE, "trunk(%s) cooled down, trying again\n",
+		trunk->name);
+	trunk->state = SIP_TRUNK_HALF_OPEN;
+	trunk->trial_pending = false;
+
+	if (trunk->app->sip.probe_interval > 0)
+		send_probe(trunk);
+}
+
+static void probe_trunks(void *data)
+{
+	struct app_config *app = data;
+	struct sip_trunk *trunk;
+
+	if (app->sip.probe_interval == 0)
+		return;
+
+	/* an open breaker waits for the cooldown */
+	llist_for_each_entry(trunk, &app->sip.trunks, entry) {
+		if (trunk->state == SIP_TRUNK_OPEN)
+			continue;
+		if (trunk->probe_wait > 0) {
+			trunk->probe_wait -= 1;
+			continue;
+		}
+		send_probe(trunk);
+	}
+
+	osmo_timer_schedule(&app->sip.probe_timer, app->sip.probe_interval, 0);
+}
+
+void sip_trunks_init(struct app_config *app)
+{
+	INIT_LLIST_HEAD(&app->sip.trunks);
+	app->sip.probe_timer.cb = probe_trunks;
+	app->sip.probe_timer.data = app;
+	app->sip.probe_interval = 0;
+	app->sip.breaker_threshold = 5;
+	app->sip.breaker_cooldown = 30;
+	app->sip.resolver.refresh_interval = 300;
+	app->sip.tcp_keepalive = 30;
+
+	app->sip.default_trunk = sip_trunk_alloc(app, "default");
+	app->sip.default_trunk->remote_addr = talloc_strdup(app->sip.default_trunk, "pbx");
+}
+
+struct sip_trunk *sip_trunk_alloc(struct app_config *app, const char *name)
+{
+	struct sip_trunk *trunk;
+	uint32_t used = 0;
+	unsigned int nr;
+
+	llist_for_each_entry(trunk, &app->sip.trunks, entry)
+		used |= 1 << trunk->nr;
+	for (nr = 0; nr < SIP_TRUNK_MAX; ++nr)
+		if ((used & (1 << nr)) == 0)
+			break;
+	if (nr == SIP_TRUNK_MAX) {
+		LOGP(DSIP, LOGL_ERROR, "No room for trunk(%s)\n", name);
+		return NULL;
+	}
+
+	trunk = talloc_zero(tall_mncc_ctx, struct sip_trunk);
+	if (!trunk)
+		return NULL;
+
+	trunk->app = app;
+	trunk->nr = nr;
+	trunk->name = talloc_strdup(trunk, name);
+	trunk->remote_port = 5060;
+	trunk->weight = 1;
+	trunk->max_calls = 0;
+	trunk->state = SIP_TRUNK_UP;
+	trunk->cooldown.cb = cooldown_expired;
+	trunk->cooldown.data = trunk;
+
+	trunk->invite_pacer.rate = 0;
+	trunk->invite_pacer.burst = 10;
+	trunk->invite_pacer.max_length = 256;
+	trunk->invite_pacer.max_delay_ms = 2000;
+	pacer_init(&trunk->invite_pacer, sip_paced_invite, sip_paced_invite_expired);
+
+	llist_add_tail(&trunk->entry, &app->sip.trunks);
+	return trunk;
+}
+
+struct sip_trunk *sip_trunk_find(struct app_config *app, const char *name)
+{
+	struct sip_trunk *trunk;
+
+	llist_for_each_entry(trunk, &app->sip.trunks, entry) {
+		if (strcmp(trunk->name, name) == 0)
+			return trunk;
+	}
+
+	return NULL;
+}
+
+/* The caller makes sure that no call is using the trunk */
+void sip_trunk_free(struct sip_trunk *trunk)
+{
+	OSMO_ASSERT(trunk->active_calls == 0);
+
+	osmo_timer_del(&trunk->cooldown);
+	osmo_timer_del(&trunk->invite_pacer.timer);
+	if (trunk->probe_handle)
+		nua_handle_destroy(trunk->probe_handle);
+	llist_del(&trunk->entry);
+	talloc_free(trunk);
+}
+
+static bool trunk_available(struct sip_trunk *trunk, uint32_t exclude)
+{
+	if (!trunk->remote_addr || trunk->weight == 0)
+		return false;
+	if (exclude & (1 << trunk->nr))
+		return false;
+	if (trunk->max_calls && trunk->active_calls >= trunk->max_calls)
+		return false;
+
+	switch (trunk->state) {
+	case SIP_TRUNK_UP:
+		return true;
+	case SIP_TRUNK_HALF_OPEN:
+		/* a single call to find out if it is back */
+		return !trunk->trial_pending;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Smooth weighted round robin over the trunks that are healthy and
+ * below their call limit. Trunks set in the exclude mask have been
+ * tried already.
+ */
+struct sip_trunk *sip_trunk_select(struct app_config *app, uint32_t exclude)
+{
+	struct sip_trunk *trunk, *best = NULL;
+	int total = 0;
+
+	llist_for_each_entry(trunk, &app->sip.trunks, entry) {
+		if (!trunk_available(trunk, exclude))
+			continue;
+
+		trunk->current_weight += trunk->weight;
+		total += trunk->weight;
+		if (!best || trunk->current_weight > best->current_weight)
+			best = trunk;
+	}
+
+	if (!best)
+		return NULL;
+
+	best->current_weight -= total;
+	if (best->state == SIP_TRUNK_HALF_OPEN)
+		best->trial_pending = true;
+	return best;
+}
+
+/*
+ * Use the trunk chosen by the routing table when it can take the
+ * call and fall back to the whole group otherwise.
+ */
+struct sip_trunk *sip_trunk_select_preferred(struct app_config *app,
+						struct sip_trunk *trunk)
+{
+	if (!trunk || !trunk_available(trunk, 0))
+		return sip_trunk_select(app, 0);
+
+	if (trunk->state == SIP_TRUNK_HALF_OPEN)
+		trunk->trial_pending = true;
+	return trunk;
+}
+
+void sip_trunk_bind(struct sip_trunk *trunk, struct sip_call_leg *leg)
+{
+	leg->trunk = trunk;
+	leg->tried_trunks |= 1 << trunk->nr;
+	trunk->active_calls += 1;
+	trunk->calls += 1;
+}
+
+void sip_trunk_unbind(struct sip_call_leg *leg)
+{
+	if (!leg->trunk)
+		return;
+
+	/* a trial call that never got an answer */
+	if (leg->trunk->state == SIP_TRUNK_HALF_OPEN)
+		leg->trunk->trial_pending = false;
+	sip_trunk_invite_done(leg);
+	leg->trunk->active_calls -= 1;
+	leg->trunk = NULL;
+}
+
+/* INVITE transactions waiting for a final response on the trunk */
+void sip_trunk_invite_sent(struct sip_call_leg *leg)
+{
+	struct sip_trunk *trunk = leg->trunk;
+
+	if (leg->invite_pending)
+		return;
+	leg->invite_pending = true;
+	trunk->invites_in_flight += 1;
+	if (trunk->invites_in_flight > trunk->max_invites_in_flight)
+		trunk->max_invites_in_flight = trunk->invites_in_flight;
+}
+
+void sip_trunk_invite_done(struct sip_call_leg *leg)
+{
+	if (!leg->invite_pending)
+		return;
+	leg->invite_pending = false;
+	leg->trunk->invites_in_flight -= 1;
+}
+
+void sip_trunk_success(struct sip_trunk *trunk)
+{
+	trunk->failures = 0;
+	trunk->trial_pending = false;
+	if (trunk->state == SIP_TRUNK_UP)
+		return;
+
+	LOGP(DSIP, LOGL_NOTICE, "trunk(%s) is back\n", trunk->name);
+	osmo_timer_del(&trunk->cooldown);
+	trunk->state = SIP_TRUNK_UP;
+}
+
+void sip_trunk_failure(struct sip_trunk *trunk)
+{
+	trunk->failures += 1;
+	trunk->trial_pending = false;
+
+	if (trunk->state == SIP_TRUNK_OPEN)
+		return;
+	if (trunk->state == SIP_TRUNK_UP
+	    && trunk->failures < trunk->app->sip.breaker_threshold)
+		return;
+
+	LOGP(DSIP, LOGL_ERROR, "trunk(%s) failed %u times, opening breaker\n",
+		trunk->name, trunk->failures);
+	trunk->state = SIP_TRUNK_OPEN;
+	trunk->breaker_trips += 1;
+	osmo_timer_schedule(&trunk->cooldown, trunk->app->sip.breaker_cooldown, 0);
+}
+
+/*
+ * Probes also open the TCP connections of the trunks before the first
+ * call needs them. Without periodic probing they are opened once.
+ */
+void sip_trunks_start_probing(struct app_config *app)
+{
+	struct sip_trunk *trunk;
+
+	if (!app->sip.agent.nua)
+		return;
+	if (app->sip.probe_interval == 0) {
+		llist_for_each_entry(trunk, &app->sip.trunks, entry)
+			if (trunk->transport == SIP_TRANSPORT_TCP)
+				send_probe(trunk);
+		return;
+	}
+	if (osmo_timer_pending(&app->sip.probe_timer))
+		return;
+	osmo_timer_schedule(&app->sip.probe_timer, 0, 0);
+}
+
+void sip_trunk_probe_result(struct sip_trunk *trunk, int status)
+{
+	LOGP(DSIP, LOGL_DEBUG, "trunk(%s) probe status(%d)\n",
+		trunk->name, status);
+
+	nua_handle_destroy(trunk->probe_handle);
+	trunk->probe_handle = NULL;
+
+	/* anything but a server error or timeout proves it is alive */
+	if (status >= 500 || status == 408) {
+		trunk->probe_failures += 1;
+		sip_trunk_failure(trunk);
+
+		/* reconnect to a TCP trunk less often while it is down */
+		if (trunk->transport == SIP_TRANSPORT_TCP) {
+			trunk->probe_backoff = OSMO_MIN(trunk->probe_backoff * 2 + 1,
+							SIP_TRUNK_MAX_BACKOFF);
+			trunk->probe_wait = trunk->probe_backoff;
+		}
+	} else {
+		trunk->probe_backoff = 0;
+		trunk->probe_wait = 0;
+		sip_trunk_success(trunk);
+	}
+}
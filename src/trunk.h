@@ -0,0 +1,107 @@
+#pragma once
+
+#include "auth.h"
+#include "pacer.h"
+
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/timer.h>
+#include <osmocom/core/utils.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SIP_TRUNK_MAX		32
+
+/* probe intervals to skip after failures of a TCP trunk */
+#define SIP_TRUNK_MAX_BACKOFF	63
+
+struct app_config;
+struct sip_call_leg;
+struct nua_handle_s;
+
+enum sip_transport {
+	SIP_TRANSPORT_UDP,
+	SIP_TRANSPORT_TCP,
+};
+
+enum sip_trunk_state {
+	SIP_TRUNK_UP,
+	SIP_TRUNK_OPEN,		/* circuit breaker tripped */
+	SIP_TRUNK_HALF_OPEN,	/* cooled down, waiting for a success */
+};
+
+/**
+ * One remote PBX of the trunk group. The trunk named "default"
+ * always exists and is configured directly in the sip node.
+ */
+struct sip_trunk {
+	struct llist_head entry;
+	struct app_config *app;
+	unsigned int nr;
+	const char *name;
+
+	/* configuration */
+	const char *remote_addr;
+	int remote_port;
+	unsigned int weight;
+	unsigned int max_calls;
+	enum sip_transport transport;
+
+	struct pacer invite_pacer;
+	struct sip_auth auth;
+
+	/* runtime state */
+	enum sip_trunk_state state;
+	int current_weight;
+	unsigned int active_calls;
+	unsigned int failures;
+	bool trial_pending;
+	struct osmo_timer_list cooldown;
+	struct nua_handle_s *probe_handle;
+	unsigned int probe_backoff;
+	unsigned int probe_wait;
+	unsigned int invites_in_flight;
+
+	/* filled in by the resolver */
+	char *resolved_addr;
+	unsigned int resolve_ms;
+
+	/* statistics */
+	uint64_t calls;
+	uint64_t call_failures;
+	uint64_t failovers;
+	uint64_t probes;
+	uint64_t probe_failures;
+	uint64_t breaker_trips;
+	uint64_t max_invites_in_flight;
+	uint64_t resolve_failures;
+	uint64_t resolved_sends;
+	uint64_t unresolved_sends;
+};
+
+void sip_trunks_init(struct app_config *app);
+struct sip_trunk *sip_trunk_alloc(struct app_config *app, const char *name);
+struct sip_trunk *sip_trunk_find(struct app_config *app, const char *name);
+void sip_trunk_free(struct sip_trunk *trunk);
+
+struct sip_trunk *sip_trunk_select(struct app_config *app, uint32_t exclude);
+struct sip_trunk *sip_trunk_select_preferred(struct app_config *app,
+						struct sip_trunk *trunk);
+void sip_trunk_bind(struct sip_trunk *trunk, struct sip_call_leg *leg);
+void sip_trunk_unbind(struct sip_call_leg *leg);
+void sip_trunk_invite_sent(struct sip_call_leg *leg);
+void sip_trunk_invite_done(struct sip_call_leg *leg);
+
+char *sip_trunk_proxy(struct sip_trunk *trunk, void *ctx);
+
+void sip_trunk_account(struct sip_call_leg *leg, int status);
+void sip_trunk_success(struct sip_trunk *trunk);
+void sip_trunk_failure(struct sip_trunk *trunk);
+
+void sip_trunks_start_probing(struct app_config *app);
+void sip_trunk_probe_result(struct sip_trunk *trunk, int status);
+
+const char *sip_trunk_uri_params(struct sip_trunk *trunk);
+
+extern const struct value_string sip_trunk_state_vals[];
+extern const struct value_string sip_transport_names[];
@@ -21,10 +21,16 @@
 #include "vty.h"
 #include "app.h"
 #include "call.h"
+#include "lsip.h"
 #include "mncc.h"
+#include "mncc_proxy.h"
+#include "replication.h"
+#include "setup_queue.h"
 
 #include <talloc.h>
 
+#include <errno.h>
+
 extern void *tall_mncc_ctx;
 
 struct app_config g_app;
@@ -44,12 +50,30 @@ static struct cmd_node mncc_node = {
 	1,
 };
 
+static struct cmd_node trunk_node = {
+	TRUNK_NODE,
+	"%s(config-sip-trunk)# ",
+	1,
+};
+
+static struct cmd_node mncc_conn_node = {
+	MNCC_CONN_NODE,
+	"%s(config-mncc-connection)# ",
+	1,
+};
+
 static struct cmd_node app_node = {
 	APP_NODE,
 	"%s(config-app)# ",
 	1,
 };
 
+static struct cmd_node replication_node = {
+	REPLICATION_NODE,
+	"%s(config-replication)# ",
+	1,
+};
+
 static struct vty_app_info vty_info = {
 	.name		= "OsmoMNCC",
 	.version	= PACKAGE_VERSION,
@@ -61,9 +85,18 @@ static struct vty_app_info vty_info = {
 static int mncc_vty_go_parent(struct vty *vty)
 {
 	switch (vty->node) {
+	case TRUNK_NODE:
+		vty->node = SIP_NODE;
+		vty->index = NULL;
+		break;
+	case MNCC_CONN_NODE:
+		vty->node = MNCC_NODE;
+		vty->index = NULL;
+		break;
 	case SIP_NODE:
 	case MNCC_NODE:
 	case APP_NODE:
+	case REPLICATION_NODE:
 		vty->node = CONFIG_NODE;
 		vty->index = NULL;
 		break;
@@ -83,26 +116,186 @@ static int mncc_vty_is_config_node(struct vty *vty, int node)
 	return node >= SIP_NODE;
 }
 
+static void config_write_trunk(struct vty *vty, struct sip_trunk *trunk,
+				const char *indent)
+{
+	if (trunk->remote_addr)
+		vty_out(vty, "%s remote %s %d%s", indent,
+			trunk->remote_addr, trunk->remote_port, VTY_NEWLINE);
+	vty_out(vty, "%s weight %u%s", indent, trunk->weight, VTY_NEWLINE);
+	vty_out(vty, "%s max-calls %u%s", indent, trunk->max_calls, VTY_NEWLINE);
+	vty_out(vty, "%s transport %s%s", indent,
+		get_value_string(sip_transport_names, trunk->transport), VTY_NEWLINE);
+	vty_out(vty, "%s invite-rate %u%s", indent,
+		trunk->invite_pacer.rate, VTY_NEWLINE);
+	vty_out(vty, "%s invite-burst %u%s", indent,
+		trunk->invite_pacer.burst, VTY_NEWLINE);
+	vty_out(vty, "%s invite-queue-length %u%s", indent,
+		trunk->invite_pacer.max_length, VTY_NEWLINE);
+	vty_out(vty, "%s invite-queue-delay %u%s", indent,
+		trunk->invite_pacer.max_delay_ms, VTY_NEWLINE);
+	if (trunk->auth.username)
+		vty_out(vty, "%s auth username %s password %s%s", indent,
+			trunk->auth.username, trunk->auth.password, VTY_NEWLINE);
+}
+
 static int config_write_sip(struct vty *vty)
 {
+	struct sip_trunk *trunk;
+
 	vty_out(vty, "sip%s", VTY_NEWLINE);
 	vty_out(vty, " local %s %d%s", g_app.sip.local_addr, g_app.sip.local_port, VTY_NEWLINE);
-	vty_out(vty, " remote %s %d%s", g_app.sip.remote_addr, g_app.sip.remote_port, VTY_NEWLINE);
+	config_write_trunk(vty, g_app.sip.default_trunk, "");
+	vty_out(vty, " probe-interval %u%s", g_app.sip.probe_interval, VTY_NEWLINE);
+	vty_out(vty, " breaker-threshold %u%s",
+		g_app.sip.breaker_threshold, VTY_NEWLINE);
+	vty_out(vty, " breaker-cooldown %u%s",
+		g_app.sip.breaker_cooldown, VTY_NEWLINE);
+	vty_out(vty, " tcp-keepalive %u%s",
+		g_app.sip.tcp_keepalive, VTY_NEWLINE);
+	vty_out(vty, " dns-refresh %u%s",
+		g_app.sip.resolver.refresh_interval, VTY_NEWLINE);
+	vty_out(vty, " %searly-media%s",
+		g_app.sip.early_media ? "" : "no ", VTY_NEWLINE);
+	vty_out(vty, " engine %s%s",
+		get_value_string(sip_engine_names, g_app.sip.engine), VTY_NEWLINE);
+	vty_out(vty, " builtin-dialogs %u%s",
+		g_app.sip.builtin_dialogs, VTY_NEWLINE);
+
+	/* the trunk sub nodes need to come last */
+	llist_for_each_entry(trunk, &g_app.sip.trunks, entry) {
+		if (trunk == g_app.sip.default_trunk)
+			continue;
+		vty_out(vty, " trunk %s%s", trunk->name, VTY_NEWLINE);
+		config_write_trunk(vty, trunk, " ");
+	}
 	return CMD_SUCCESS;
 }
 
+static void config_write_mncc_conn(struct vty *vty, struct mncc_connection *conn,
+					const char *indent)
+{
+	unsigned int i;
+
+	vty_out(vty, "%s socket-path %s%s", indent, conn->path, VTY_NEWLINE);
+	for (i = 0; i < conn->num_called_prefixes; ++i)
+		vty_out(vty, "%s called-prefix %s%s", indent,
+			conn->called_prefixes[i], VTY_NEWLINE);
+	for (i = 0; i < conn->num_imsi_prefixes; ++i)
+		vty_out(vty, "%s imsi-prefix %s%s", indent,
+			conn->imsi_prefixes[i], VTY_NEWLINE);
+}
+
 static int config_write_mncc(struct vty *vty)
 {
+	struct mncc_connection *conn;
+
 	vty_out(vty, "mncc%s", VTY_NEWLINE);
-	vty_out(vty, " socket-path %s%s", g_app.mncc.path, VTY_NEWLINE);
+	config_write_mncc_conn(vty, g_app.mncc.default_conn, "");
+	vty_out(vty, " proxy-path %s%s", g_app.mncc_proxy.path, VTY_NEWLINE);
+	vty_out(vty, " %sio-uring%s", g_app.mncc.io_uring ? "" : "no ", VTY_NEWLINE);
+	vty_out(vty, " %sshared-memory%s", g_app.mncc.shared_memory ? "" : "no ",
+		VTY_NEWLINE);
+
+	/* the connection sub nodes need to come last */
+	llist_for_each_entry(conn, &g_app.mncc.conns, entry) {
+		if (conn == g_app.mncc.default_conn)
+			continue;
+		vty_out(vty, " connection %s%s", conn->name, VTY_NEWLINE);
+		config_write_mncc_conn(vty, conn, " ");
+	}
 	return CMD_SUCCESS;
 }
 
+static void write_number_value(struct vty *vty, const char *name,
+				int value, const char *none)
+{
+	if (value < 0)
+		vty_out(vty, " %s %s", name, none);
+	else
+		vty_out(vty, " %s %d", name, value);
+}
+
+static void config_write_number_rules(struct vty *vty)
+{
+	int dir, field, i;
+
+	for (dir = NUMBERING_MO; dir <= NUMBERING_MT; ++dir) {
+		for (field = NUMBERING_CALLED; field <= NUMBERING_CALLING; ++field) {
+			struct numbering_set *set = &g_app.numbering.sets[dir][field];
+
+			for (i = 0; i < set->num_rules; ++i) {
+				struct number_rule *rule = &set->rules[i];
+
+				vty_out(vty, " number-rule %s %s %s",
+					get_value_string(numbering_dir_names, dir),
+					get_value_string(numbering_field_names, field),
+					number_rule_pattern(rule));
+				write_number_value(vty, "ton", rule->ton, "any");
+				write_number_value(vty, "npi", rule->npi, "any");
+				vty_out(vty, " strip %u prepend %s",
+					rule->strip,
+					rule->prepend[0] ? rule->prepend : "none");
+				write_number_value(vty, "set-ton", rule->set_ton, "keep");
+				write_number_value(vty, "set-npi", rule->set_npi, "keep");
+				vty_out(vty, "%s", VTY_NEWLINE);
+			}
+		}
+	}
+}
+
 static int config_write_app(struct vty *vty)
 {
+	unsigned int i;
+
 	vty_out(vty, "app%s", VTY_NEWLINE);
 	if (g_app.use_imsi_as_id)
 		vty_out(vty, " use-imsi%s", VTY_NEWLINE);
+	vty_out(vty, " setup-queue-length %u%s",
+		g_app.setup_queue.max_length, VTY_NEWLINE);
+	vty_out(vty, " rate-limit table-size %u%s",
+		g_app.rate_limit.mncc.size, VTY_NEWLINE);
+	if (g_app.rate_limit.mncc.limit)
+		vty_out(vty, " rate-limit mncc %u per %u%s",
+			g_app.rate_limit.mncc.limit, g_app.rate_limit.mncc.window,
+			VTY_NEWLINE);
+	if (g_app.rate_limit.sip.limit)
+		vty_out(vty, " rate-limit sip %u per %u%s",
+			g_app.rate_limit.sip.limit, g_app.rate_limit.sip.window,
+			VTY_NEWLINE);
+	if (g_app.routing.path)
+		vty_out(vty, " route-table %s%s", g_app.routing.path, VTY_NEWLINE);
+	vty_out(vty, " handover-path %s%s", g_app.handover.path, VTY_NEWLINE);
+	if (g_app.call_table.path)
+		vty_out(vty, " call-table %s%s", g_app.call_table.path, VTY_NEWLINE);
+	vty_out(vty, " call-table-slots %u%s", g_app.call_table.num_slots, VTY_NEWLINE);
+	config_write_number_rules(vty);
+	if (g_app.imsi_map.path)
+		vty_out(vty, " imsi-map %s%s", g_app.imsi_map.path, VTY_NEWLINE);
+	for (i = 0; i < g_app.local_bridge.num_prefixes; ++i)
+		vty_out(vty, " local-bridge prefix %s%s",
+			g_app.local_bridge.prefixes[i], VTY_NEWLINE);
+	if (g_app.local_bridge.imsi_map)
+		vty_out(vty, " local-bridge imsi-map%s", VTY_NEWLINE);
+	if (g_app.codecs.num_prefs > 0) {
+		vty_out(vty, " codec-preference");
+		for (i = 0; i < g_app.codecs.num_prefs; ++i)
+			vty_out(vty, " %s",
+				get_value_string(codec_names, g_app.codecs.prefs[i]));
+		vty_out(vty, "%s", VTY_NEWLINE);
+	}
+	vty_out(vty, " channel-rate %s%s",
+		get_value_string(channel_rate_names, g_app.codecs.rate), VTY_NEWLINE);
+	return CMD_SUCCESS;
+}
+
+static int config_write_replication(struct vty *vty)
+{
+	vty_out(vty, "replication%s", VTY_NEWLINE);
+	vty_out(vty, " role %s%s",
+		get_value_string(replication_role_names, g_app.replication.role),
+		VTY_NEWLINE);
+	vty_out(vty, " socket-path %s%s", g_app.replication.path, VTY_NEWLINE);
 	return CMD_SUCCESS;
 }
 
@@ -123,13 +316,227 @@ DEFUN(cfg_sip_local_addr, cfg_sip_local_addr_cmd,
 	return CMD_SUCCESS;
 }
 
+/* commands shared by the sip node (default trunk) and the trunk node */
+static struct sip_trunk *vty_trunk(struct vty *vty)
+{
+	if (vty->node == TRUNK_NODE)
+		return vty->index;
+	return g_app.sip.default_trunk;
+}
+
 DEFUN(cfg_sip_remote_addr, cfg_sip_remote_addr_cmd,
 	"remote ADDR <1-65534>",
 	"Remore information\nSIP hostname\nport\n")
 {
-	talloc_free((char *) g_app.sip.remote_addr);
-	g_app.sip.remote_addr = talloc_strdup(tall_mncc_ctx, argv[0]);
-	g_app.sip.remote_port = atoi(argv[1]);
+	struct sip_trunk *trunk = vty_trunk(vty);
+
+	talloc_free((char *) trunk->remote_addr);
+	trunk->remote_addr = talloc_strdup(trunk, argv[0]);
+	trunk->remote_port = atoi(argv[1]);
+	talloc_free(trunk->resolved_addr);
+	trunk->resolved_addr = NULL;
+	sip_resolver_refresh(&g_app);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_sip_weight, cfg_sip_weight_cmd,
+	"weight <0-1000>",
+	"Share of new calls for this trunk\nWeight. 0 to take it out of service\n")
+{
+	vty_trunk(vty)->weight = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_sip_max_calls, cfg_sip_max_calls_cmd,
+	"max-calls <0-65535>",
+	"Concurrent calls on this trunk\nNumber of calls. 0 for no limit\n")
+{
+	vty_trunk(vty)->max_calls = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_sip_invite_rate, cfg_sip_invite_rate_cmd,
+	"invite-rate <0-10000>",
+	"Pace outgoing INVITEs\nINVITEs per second. 0 to disable pacing\n")
+{
+	vty_trunk(vty)->invite_pacer.rate = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_sip_invite_burst, cfg_sip_invite_burst_cmd,
+	"invite-burst <1-10000>",
+	"Burst of INVITEs sent without pacing\nNumber of INVITEs\n")
+{
+	vty_trunk(vty)->invite_pacer.burst = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_sip_invite_queue_length, cfg_sip_invite_queue_length_cmd,
+	"invite-queue-length <0-65535>",
+	"Maximum number of paced INVITEs waiting\nNumber of INVITEs\n")
+{
+	vty_trunk(vty)->invite_pacer.max_length = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_sip_invite_queue_delay, cfg_sip_invite_queue_delay_cmd,
+	"invite-queue-delay <1-60000>",
+	"Maximum time a paced INVITE may wait\nMilliseconds\n")
+{
+	vty_trunk(vty)->invite_pacer.max_delay_ms = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_sip_trunk, cfg_sip_trunk_cmd,
+	"trunk NAME",
+	"Configure a remote PBX of the trunk group\nName of the trunk\n")
+{
+	struct sip_trunk *trunk;
+
+	trunk = sip_trunk_find(&g_app, argv[0]);
+	if (!trunk)
+		trunk = sip_trunk_alloc(&g_app, argv[0]);
+	if (!trunk) {
+		vty_out(vty, "%% Failed to create trunk %s%s", argv[0], VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+
+	vty->index = trunk;
+	vty->node = TRUNK_NODE;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_sip_no_trunk, cfg_sip_no_trunk_cmd,
+	"no trunk NAME",
+	NO_STR "Remove a remote PBX of the trunk group\nName of the trunk\n")
+{
+	struct sip_trunk *trunk;
+
+	trunk = sip_trunk_find(&g_app, argv[0]);
+	if (!trunk) {
+		vty_out(vty, "%% No trunk %s%s", argv[0], VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+	if (trunk == g_app.sip.default_trunk) {
+		vty_out(vty, "%% The default trunk can not be removed%s", VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+	if (trunk->active_calls > 0) {
+		vty_out(vty, "%% Trunk %s still has %u calls%s",
+			trunk->name, trunk->active_calls, VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+
+	sip_trunk_free(trunk);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_sip_auth, cfg_sip_auth_cmd,
+	"auth username USER password PASS",
+	"Digest authentication towards the PBX\n"
+	"User name\nUser name\nPassword\nPassword\n")
+{
+	struct sip_trunk *trunk = vty_trunk(vty);
+
+	sip_auth_set(&trunk->auth, trunk, argv[0], argv[1]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_sip_no_auth, cfg_sip_no_auth_cmd,
+	"no auth",
+	NO_STR "Digest authentication towards the PBX\n")
+{
+	struct sip_trunk *trunk = vty_trunk(vty);
+
+	sip_auth_set(&trunk->auth, trunk, NULL, NULL);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_sip_probe_interval, cfg_sip_probe_interval_cmd,
+	"probe-interval <0-3600>",
+	"Send OPTIONS to every trunk\nInterval in seconds. 0 to disable\n")
+{
+	g_app.sip.probe_interval = atoi(argv[0]);
+	sip_trunks_start_probing(&g_app);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_sip_breaker_threshold, cfg_sip_breaker_threshold_cmd,
+	"breaker-threshold <1-100>",
+	"Take a trunk out of service after consecutive failures\n"
+	"Number of 5xx responses, timeouts or failed probes\n")
+{
+	g_app.sip.breaker_threshold = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_sip_breaker_cooldown, cfg_sip_breaker_cooldown_cmd,
+	"breaker-cooldown <1-3600>",
+	"Time before a failed trunk is tried again\nSeconds\n")
+{
+	g_app.sip.breaker_cooldown = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_sip_transport, cfg_sip_transport_cmd,
+	"transport (udp|tcp)",
+	"Transport towards the PBX\nUDP\nTCP with one persistent connection\n")
+{
+	struct sip_trunk *trunk = vty_trunk(vty);
+
+	trunk->transport = get_string_value(sip_transport_names, argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_sip_tcp_keepalive, cfg_sip_tcp_keepalive_cmd,
+	"tcp-keepalive <0-3600>",
+	"CRLF keepalive on TCP connections. Needs a restart\nSeconds. 0 to disable\n")
+{
+	g_app.sip.tcp_keepalive = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_sip_dns_refresh, cfg_sip_dns_refresh_cmd,
+	"dns-refresh <0-86400>",
+	"Resolve the trunk addresses again\nSeconds. 0 to only resolve on changes\n")
+{
+	g_app.sip.resolver.refresh_interval = atoi(argv[0]);
+	sip_resolver_schedule(&g_app);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_sip_early_media, cfg_sip_early_media_cmd,
+	"early-media",
+	"Send a 183 with SDP before the GSM side answers\n")
+{
+	g_app.sip.early_media = true;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_sip_no_early_media, cfg_sip_no_early_media_cmd,
+	"no early-media",
+	NO_STR "Send a 183 with SDP before the GSM side answers\n")
+{
+	g_app.sip.early_media = false;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_sip_engine, cfg_sip_engine_cmd,
+	"engine (sofia|builtin)",
+	"SIP stack to use. Needs a restart\n"
+	"sofia-sip with TCP, failover, authentication and probes\n"
+	"Built-in UDP engine with preallocated dialogs\n")
+{
+	g_app.sip.engine = get_string_value(sip_engine_names, argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_sip_builtin_dialogs, cfg_sip_builtin_dialogs_cmd,
+	"builtin-dialogs <16-65536>",
+	"Size of the dialog table of the built-in engine. Needs a restart\n"
+	"Number of dialogs\n")
+{
+	g_app.sip.builtin_dialogs = atoi(argv[0]);
 	return CMD_SUCCESS;
 }
 
@@ -141,12 +548,232 @@ DEFUN(cfg_mncc, cfg_mncc_cmd,
 	return CMD_SUCCESS;
 }
 
+/* commands shared by the mncc node (default connection) and the connection node */
+static struct mncc_connection *vty_mncc_conn(struct vty *vty)
+{
+	if (vty->node == MNCC_CONN_NODE)
+		return vty->index;
+	return g_app.mncc.default_conn;
+}
+
 DEFUN(cfg_mncc_path, cfg_mncc_path_cmd,
         "socket-path NAME",
 	"MNCC filepath\nFilename\n")
 {
-	talloc_free((char *) g_app.mncc.path);
-	g_app.mncc.path = talloc_strdup(tall_mncc_ctx, argv[0]);
+	struct mncc_connection *conn = vty_mncc_conn(vty);
+
+	/* used on the next connect */
+	talloc_free((char *) conn->path);
+	conn->path = talloc_strdup(conn, argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_mncc_proxy_path, cfg_mncc_proxy_path_cmd,
+	"proxy-path NAME",
+	"MNCC filepath the workers connect to when started with --proxy\nFilename\n")
+{
+	talloc_free((char *) g_app.mncc_proxy.path);
+	g_app.mncc_proxy.path = talloc_strdup(tall_mncc_ctx, argv[0]);
+	return CMD_SUCCESS;
+}
+
+static int find_prefix(char **prefixes, unsigned int num, const char *prefix)
+{
+	unsigned int i;
+
+	for (i = 0; i < num; ++i)
+		if (strcmp(prefixes[i], prefix) == 0)
+			return i;
+	return -1;
+}
+
+static int add_prefix(struct vty *vty, struct mncc_connection *conn,
+			char **prefixes, unsigned int *num, const char *prefix)
+{
+	if (find_prefix(prefixes, *num, prefix) >= 0)
+		return CMD_SUCCESS;
+	if (*num == MNCC_STEER_MAX_PREFIXES) {
+		vty_out(vty, "%% Only %d prefixes are possible%s",
+			MNCC_STEER_MAX_PREFIXES, VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+
+	prefixes[*num] = talloc_strdup(conn, prefix);
+	*num += 1;
+	return CMD_SUCCESS;
+}
+
+static int del_prefix(struct vty *vty, char **prefixes, unsigned int *num,
+			const char *prefix)
+{
+	int nr = find_prefix(prefixes, *num, prefix);
+
+	if (nr < 0) {
+		vty_out(vty, "%% Prefix %s is not configured%s", prefix, VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+
+	talloc_free(prefixes[nr]);
+	*num -= 1;
+	memmove(&prefixes[nr], &prefixes[nr + 1], (*num - nr) * sizeof(char *));
+	return CMD_SUCCESS;
+}
+
+#define CALLED_PREFIX_STR "Send calls to numbers starting with the prefix here\nPrefix\n"
+#define IMSI_PREFIX_STR "Send calls to IMSIs starting with the prefix here\nPrefix\n"
+
+DEFUN(cfg_mncc_called_prefix, cfg_mncc_called_prefix_cmd,
+	"called-prefix DIGITS",
+	CALLED_PREFIX_STR)
+{
+	struct mncc_connection *conn = vty_mncc_conn(vty);
+
+	return add_prefix(vty, conn, conn->called_prefixes,
+				&conn->num_called_prefixes, argv[0]);
+}
+
+DEFUN(cfg_mncc_no_called_prefix, cfg_mncc_no_called_prefix_cmd,
+	"no called-prefix DIGITS",
+	NO_STR CALLED_PREFIX_STR)
+{
+	struct mncc_connection *conn = vty_mncc_conn(vty);
+
+	return del_prefix(vty, conn->called_prefixes,
+				&conn->num_called_prefixes, argv[0]);
+}
+
+DEFUN(cfg_mncc_imsi_prefix, cfg_mncc_imsi_prefix_cmd,
+	"imsi-prefix DIGITS",
+	IMSI_PREFIX_STR)
+{
+	struct mncc_connection *conn = vty_mncc_conn(vty);
+
+	return add_prefix(vty, conn, conn->imsi_prefixes,
+				&conn->num_imsi_prefixes, argv[0]);
+}
+
+DEFUN(cfg_mncc_no_imsi_prefix, cfg_mncc_no_imsi_prefix_cmd,
+	"no imsi-prefix DIGITS",
+	NO_STR IMSI_PREFIX_STR)
+{
+	struct mncc_connection *conn = vty_mncc_conn(vty);
+
+	return del_prefix(vty, conn->imsi_prefixes,
+				&conn->num_imsi_prefixes, argv[0]);
+}
+
+DEFUN(cfg_mncc_connection, cfg_mncc_connection_cmd,
+	"connection NAME",
+	"Configure an additional MSC\nName of the connection\n")
+{
+	struct mncc_connection *conn;
+
+	conn = mncc_connection_find(&g_app, argv[0]);
+	if (!conn) {
+		conn = mncc_connection_alloc(&g_app, argv[0]);
+		if (!conn) {
+			vty_out(vty, "%% Failed to create connection %s%s",
+				argv[0], VTY_NEWLINE);
+			return CMD_WARNING;
+		}
+		conn->path = talloc_asprintf(conn, "/tmp/bsc_mncc_%s", argv[0]);
+	}
+
+	vty->index = conn;
+	vty->node = MNCC_CONN_NODE;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_mncc_no_connection, cfg_mncc_no_connection_cmd,
+	"no connection NAME",
+	NO_STR "Remove an additional MSC\nName of the connection\n")
+{
+	struct mncc_connection *conn;
+	unsigned int calls;
+
+	conn = mncc_connection_find(&g_app, argv[0]);
+	if (!conn) {
+		vty_out(vty, "%% No connection %s%s", argv[0], VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+	if (conn == g_app.mncc.default_conn) {
+		vty_out(vty, "%% The default connection can not be removed%s",
+			VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+	calls = mncc_connection_calls(conn);
+	if (calls > 0) {
+		vty_out(vty, "%% Connection %s still has %u calls%s",
+			conn->name, calls, VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+
+	mncc_connection_free(conn);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_mncc_io_uring, cfg_mncc_io_uring_cmd,
+	"io-uring",
+	"Use io_uring for the MNCC socket. Applies on the next connect\n")
+{
+#ifdef USE_IO_URING
+	g_app.mncc.io_uring = true;
+	return CMD_SUCCESS;
+#else
+	vty_out(vty, "%% Built without io_uring support%s", VTY_NEWLINE);
+	return CMD_WARNING;
+#endif
+}
+
+DEFUN(cfg_mncc_no_io_uring, cfg_mncc_no_io_uring_cmd,
+	"no io-uring",
+	NO_STR "Use io_uring for the MNCC socket. Applies on the next connect\n")
+{
+	g_app.mncc.io_uring = false;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_mncc_shared_memory, cfg_mncc_shared_memory_cmd,
+	"shared-memory",
+	"Offer shared memory rings to an MSC on the same host\n")
+{
+	g_app.mncc.shared_memory = true;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_mncc_no_shared_memory, cfg_mncc_no_shared_memory_cmd,
+	"no shared-memory",
+	NO_STR "Offer shared memory rings to an MSC on the same host\n")
+{
+	g_app.mncc.shared_memory = false;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_replication, cfg_replication_cmd,
+	"replication",
+	"Call state replication to a standby\n")
+{
+	vty->node = REPLICATION_NODE;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_replication_role, cfg_replication_role_cmd,
+	"role (none|active|standby)",
+	"Role of this connector, used on start\n"
+	"No replication\n"
+	"Handle calls and stream them to a standby\n"
+	"Mirror the calls of the active and take over when it is gone\n")
+{
+	g_app.replication.role = get_string_value(replication_role_names, argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_replication_path, cfg_replication_path_cmd,
+	"socket-path NAME",
+	"Filepath the active listens on\nFilename\n")
+{
+	talloc_free((char *) g_app.replication.path);
+	g_app.replication.path = talloc_strdup(tall_mncc_ctx, argv[0]);
 	return CMD_SUCCESS;
 }
 
@@ -173,6 +800,379 @@ DEFUN(cfg_no_use_imsi, cfg_no_use_imsi_cmd,
 	return CMD_SUCCESS;
 }
 
+DEFUN(cfg_setup_queue_length, cfg_setup_queue_length_cmd,
+	"setup-queue-length <0-65535>",
+	"Maximum number of new calls parked behind releases\n"
+	"Number of calls. 0 to process setups immediately\n")
+{
+	g_app.setup_queue.max_length = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+static struct ratelimit *rate_limit_by_name(const char *name)
+{
+	if (strcmp(name, "mncc") == 0)
+		return &g_app.rate_limit.mncc;
+	return &g_app.rate_limit.sip;
+}
+
+#define RATE_LIMIT_STR "Limit call attempts per subscriber\n"
+#define RATE_LIMIT_SIDE_STR "MNCC side by IMSI\nSIP side by From user\n"
+
+DEFUN(cfg_rate_limit, cfg_rate_limit_cmd,
+	"rate-limit (mncc|sip) <1-65535> per <1-86400>",
+	RATE_LIMIT_STR RATE_LIMIT_SIDE_STR
+	"Number of attempts\nPer time window\nWindow in seconds\n")
+{
+	struct ratelimit *rl = rate_limit_by_name(argv[0]);
+
+	rl->limit = atoi(argv[1]);
+	rl->window = atoi(argv[2]);
+	if (ratelimit_configure(rl, tall_mncc_ctx) != 0) {
+		vty_out(vty, "%% Failed to allocate the table%s", VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_no_rate_limit, cfg_no_rate_limit_cmd,
+	"no rate-limit (mncc|sip)",
+	NO_STR RATE_LIMIT_STR RATE_LIMIT_SIDE_STR)
+{
+	struct ratelimit *rl = rate_limit_by_name(argv[0]);
+
+	rl->limit = 0;
+	ratelimit_configure(rl, tall_mncc_ctx);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_rate_limit_size, cfg_rate_limit_size_cmd,
+	"rate-limit table-size <16-16777216>",
+	RATE_LIMIT_STR "Number of tracked subscribers per side\nSize\n")
+{
+	g_app.rate_limit.mncc.size = atoi(argv[0]);
+	g_app.rate_limit.sip.size = atoi(argv[0]);
+	if (ratelimit_configure(&g_app.rate_limit.mncc, tall_mncc_ctx) != 0
+	    || ratelimit_configure(&g_app.rate_limit.sip, tall_mncc_ctx) != 0) {
+		vty_out(vty, "%% Failed to allocate the table%s", VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+	return CMD_SUCCESS;
+}
+
+#define ROUTE_TABLE_STR "Longest prefix routing of MO calls\n"
+
+DEFUN(cfg_handover_path, cfg_handover_path_cmd,
+	"handover-path NAME",
+	"Filepath a connector started with --handover waits on\nFilename\n")
+{
+	talloc_free((char *) g_app.handover.path);
+	g_app.handover.path = talloc_strdup(tall_mncc_ctx, argv[0]);
+	return CMD_SUCCESS;
+}
+
+#define CALL_TABLE_STR "Calls kept in a mapped file across a crash\n"
+
+DEFUN(cfg_call_table, cfg_call_table_cmd,
+	"call-table PATH",
+	CALL_TABLE_STR "Filename\n")
+{
+	talloc_free((char *) g_app.call_table.path);
+	g_app.call_table.path = talloc_strdup(tall_mncc_ctx, argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_no_call_table, cfg_no_call_table_cmd,
+	"no call-table",
+	NO_STR CALL_TABLE_STR)
+{
+	talloc_free((char *) g_app.call_table.path);
+	g_app.call_table.path = NULL;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_call_table_slots, cfg_call_table_slots_cmd,
+	"call-table-slots <16-1048576>",
+	"Number of calls the call table holds, used at start\nSlots\n")
+{
+	g_app.call_table.num_slots = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_route_table, cfg_route_table_cmd,
+	"route-table PATH",
+	ROUTE_TABLE_STR "File with one route per line\n")
+{
+	talloc_free((char *) g_app.routing.path);
+	g_app.routing.path = talloc_strdup(tall_mncc_ctx, argv[0]);
+	routing_reload(&g_app.routing);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_no_route_table, cfg_no_route_table_cmd,
+	"no route-table",
+	NO_STR ROUTE_TABLE_STR)
+{
+	talloc_free((char *) g_app.routing.path);
+	g_app.routing.path = NULL;
+	routing_reload(&g_app.routing);
+	return CMD_SUCCESS;
+}
+
+DEFUN(reload_route_table, reload_route_table_cmd,
+	"route-table reload",
+	ROUTE_TABLE_STR "Load the file again in the background\n")
+{
+	if (!g_app.routing.path) {
+		vty_out(vty, "%% No route table configured%s", VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+	if (routing_reload(&g_app.routing) != 0) {
+		vty_out(vty, "%% Failed to start the reload%s", VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+	return CMD_SUCCESS;
+}
+
+#define IMSI_MAP_STR "Map IMSI and MSISDN for use-imsi\n"
+
+DEFUN(cfg_imsi_map, cfg_imsi_map_cmd,
+	"imsi-map PATH",
+	IMSI_MAP_STR "File built by contrib/imsi-map.py\n")
+{
+	talloc_free((char *) g_app.imsi_map.path);
+	g_app.imsi_map.path = talloc_strdup(tall_mncc_ctx, argv[0]);
+	if (imsi_map_reload(&g_app.imsi_map) != 0) {
+		vty_out(vty, "%% Failed to load %s%s", argv[0], VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_no_imsi_map, cfg_no_imsi_map_cmd,
+	"no imsi-map",
+	NO_STR IMSI_MAP_STR)
+{
+	talloc_free((char *) g_app.imsi_map.path);
+	g_app.imsi_map.path = NULL;
+	imsi_map_reload(&g_app.imsi_map);
+	return CMD_SUCCESS;
+}
+
+DEFUN(reload_imsi_map, reload_imsi_map_cmd,
+	"imsi-map reload",
+	IMSI_MAP_STR "Map the file again\n")
+{
+	if (!g_app.imsi_map.path) {
+		vty_out(vty, "%% No IMSI map configured%s", VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+	if (imsi_map_reload(&g_app.imsi_map) != 0) {
+		vty_out(vty, "%% Failed to load %s, keeping the old map%s",
+			g_app.imsi_map.path, VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+	return CMD_SUCCESS;
+}
+
+#define LOCAL_BRIDGE_STR "Connect calls between own subscribers without the PBX\n"
+
+static int find_local_prefix(const char *prefix)
+{
+	unsigned int i;
+
+	for (i = 0; i < g_app.local_bridge.num_prefixes; ++i)
+		if (strcmp(g_app.local_bridge.prefixes[i], prefix) == 0)
+			return i;
+	return -1;
+}
+
+DEFUN(cfg_local_bridge_prefix, cfg_local_bridge_prefix_cmd,
+	"local-bridge prefix DIGITS",
+	LOCAL_BRIDGE_STR "Dialed numbers starting with the prefix\nPrefix\n")
+{
+	unsigned int nr = g_app.local_bridge.num_prefixes;
+
+	if (find_local_prefix(argv[0]) >= 0)
+		return CMD_SUCCESS;
+	if (nr == LOCAL_BRIDGE_MAX_PREFIXES) {
+		vty_out(vty, "%% Only %d prefixes are possible%s",
+			LOCAL_BRIDGE_MAX_PREFIXES, VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+
+	g_app.local_bridge.prefixes[nr] = talloc_strdup(tall_mncc_ctx, argv[0]);
+	g_app.local_bridge.num_prefixes += 1;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_no_local_bridge_prefix, cfg_no_local_bridge_prefix_cmd,
+	"no local-bridge prefix DIGITS",
+	NO_STR LOCAL_BRIDGE_STR "Dialed numbers starting with the prefix\nPrefix\n")
+{
+	int nr = find_local_prefix(argv[0]);
+
+	if (nr < 0) {
+		vty_out(vty, "%% Prefix %s is not configured%s", argv[0], VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+
+	talloc_free(g_app.local_bridge.prefixes[nr]);
+	g_app.local_bridge.num_prefixes -= 1;
+	memmove(&g_app.local_bridge.prefixes[nr], &g_app.local_bridge.prefixes[nr + 1],
+		(g_app.local_bridge.num_prefixes - nr) * sizeof(char *));
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_local_bridge_imsi_map, cfg_local_bridge_imsi_map_cmd,
+	"local-bridge imsi-map",
+	LOCAL_BRIDGE_STR "Dialed numbers found in the IMSI map\n")
+{
+	g_app.local_bridge.imsi_map = true;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_no_local_bridge_imsi_map, cfg_no_local_bridge_imsi_map_cmd,
+	"no local-bridge imsi-map",
+	NO_STR LOCAL_BRIDGE_STR "Dialed numbers found in the IMSI map\n")
+{
+	g_app.local_bridge.imsi_map = false;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_codec_preference, cfg_codec_preference_cmd,
+	"codec-preference .CODECS",
+	"Codecs to pick from a SIP offer\n"
+	"GSM, GSM-EFR, GSM-HR-08 or AMR in order of preference\n")
+{
+	enum codec prefs[_NUM_CODECS];
+	uint32_t seen = 0;
+	int i;
+
+	if (argc > _NUM_CODECS) {
+		vty_out(vty, "%% Too many codecs%s", VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+
+	for (i = 0; i < argc; ++i) {
+		int codec = codec_from_name(argv[i]);
+
+		if (codec < 0) {
+			vty_out(vty, "%% Unknown codec %s%s", argv[i], VTY_NEWLINE);
+			return CMD_WARNING;
+		}
+		if (seen & (1 << codec)) {
+			vty_out(vty, "%% Codec %s listed twice%s", argv[i], VTY_NEWLINE);
+			return CMD_WARNING;
+		}
+		seen |= 1 << codec;
+		prefs[i] = codec;
+	}
+
+	memcpy(g_app.codecs.prefs, prefs, sizeof(prefs));
+	g_app.codecs.num_prefs = argc;
+	codec_policy_compile(&g_app.codecs);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_no_codec_preference, cfg_no_codec_preference_cmd,
+	"no codec-preference",
+	NO_STR "Codecs to pick from a SIP offer\n")
+{
+	g_app.codecs.num_prefs = 0;
+	codec_policy_compile(&g_app.codecs);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_channel_rate, cfg_channel_rate_cmd,
+	"channel-rate (full|dual|half)",
+	"Traffic channel to request for calls from SIP\n"
+	"TCH/F only\nTCH/F or TCH/H, full rate preferred\n"
+	"TCH/H or TCH/F, half rate preferred\n")
+{
+	g_app.codecs.rate = get_string_value(channel_rate_names, argv[0]);
+	codec_policy_compile(&g_app.codecs);
+	return CMD_SUCCESS;
+}
+
+static struct numbering_set *number_set_by_name(const char *dir,
+						const char *field)
+{
+	return &g_app.numbering.sets
+		[get_string_value(numbering_dir_names, dir)]
+		[get_string_value(numbering_field_names, field)];
+}
+
+static int number_value(const char *str)
+{
+	if (strcmp(str, "any") == 0 || strcmp(str, "keep") == 0)
+		return -1;
+	return atoi(str);
+}
+
+#define NUMBER_RULE_STR "Rewrite a number between MNCC and SIP\n" \
+	"GSM to SIP\nSIP to GSM\nCalled number\nCalling number\n" \
+	"Digits at the start, '.' for any digit, '$' at the end for the whole number, 'all' for every number\n"
+
+DEFUN(cfg_number_rule, cfg_number_rule_cmd,
+	"number-rule (mo|mt) (called|calling) PATTERN "
+	"ton (any|<0-7>) npi (any|<0-15>) strip <0-32> prepend (none|DIGITS) "
+	"set-ton (keep|<0-7>) set-npi (keep|<0-15>)",
+	NUMBER_RULE_STR
+	"Type of number to match\nAny type\nType of number\n"
+	"Numbering plan to match\nAny plan\nNumbering plan\n"
+	"Remove digits at the start\nNumber of digits\n"
+	"Add digits at the start\nAdd nothing\nDigits to add\n"
+	"Type of number of the result\nKeep the type\nType of number\n"
+	"Numbering plan of the result\nKeep the plan\nNumbering plan\n")
+{
+	struct numbering_set *set = number_set_by_name(argv[0], argv[1]);
+	struct number_rule rule = { 0, };
+	int rc;
+
+	if (number_rule_set_pattern(&rule, argv[2]) != 0) {
+		vty_out(vty, "%% Invalid pattern %s%s", argv[2], VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+
+	rule.ton = number_value(argv[3]);
+	rule.npi = number_value(argv[4]);
+	rule.strip = atoi(argv[5]);
+	if (strcmp(argv[6], "none") != 0) {
+		if (!number_valid_digits(argv[6])) {
+			vty_out(vty, "%% Invalid digits %s%s", argv[6], VTY_NEWLINE);
+			return CMD_WARNING;
+		}
+		snprintf(rule.prepend, sizeof(rule.prepend), "%s", argv[6]);
+	}
+	rule.set_ton = number_value(argv[7]);
+	rule.set_npi = number_value(argv[8]);
+
+	rc = numbering_add_rule(set, &rule, tall_mncc_ctx);
+	if (rc == -ENOSPC) {
+		vty_out(vty, "%% Only %d rules are possible%s",
+			NUMBERING_MAX_RULES, VTY_NEWLINE);
+		return CMD_WARNING;
+	} else if (rc != 0) {
+		vty_out(vty, "%% Failed to compile the rules%s", VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_no_number_rule, cfg_no_number_rule_cmd,
+	"no number-rule (mo|mt) (called|calling) PATTERN",
+	NO_STR NUMBER_RULE_STR)
+{
+	struct numbering_set *set = number_set_by_name(argv[0], argv[1]);
+
+	if (numbering_del_rule(set, argv[2], tall_mncc_ctx) != 0) {
+		vty_out(vty, "%% No rule with pattern %s%s", argv[2], VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+	return CMD_SUCCESS;
+}
+
 static void dump_leg(struct vty *vty, struct call_leg *leg, const char *kind)
 {
 	struct sip_call_leg *sip;
@@ -275,25 +1275,504 @@ DEFUN(show_calls_sum, show_calls_sum_cmd,
 	return CMD_SUCCESS;
 }
 
+static void dump_mncc_conn(struct vty *vty, struct mncc_connection *conn)
+{
+	unsigned int i;
+
+	vty_out(vty, "MNCC connection %s to path '%s' is in state %s%s",
+		conn->name, conn->path,
+		get_value_string(mncc_conn_state_vals, conn->state), VTY_NEWLINE);
+	vty_out(vty, " calls(%u) mo(%llu) mt(%llu) rx(%llu) tx(%llu) reconnects(%llu)%s",
+		mncc_connection_calls(conn),
+		(unsigned long long) conn->mo_calls,
+		(unsigned long long) conn->mt_calls,
+		(unsigned long long) conn->rx_msgs,
+		(unsigned long long) conn->tx_msgs,
+		(unsigned long long) conn->reconnects, VTY_NEWLINE);
+	for (i = 0; i < conn->num_called_prefixes; ++i)
+		vty_out(vty, " called-prefix %s%s", conn->called_prefixes[i], VTY_NEWLINE);
+	for (i = 0; i < conn->num_imsi_prefixes; ++i)
+		vty_out(vty, " imsi-prefix %s%s", conn->imsi_prefixes[i], VTY_NEWLINE);
+	if (conn->shm_active) {
+		vty_out(vty, " shared memory sent(%llu) received(%llu) kicks(%llu) "
+			"wakeups(%llu) full(%llu)%s",
+			(unsigned long long) conn->shm_stats.sent,
+			(unsigned long long) conn->shm_stats.received,
+			(unsigned long long) conn->shm_stats.kicks,
+			(unsigned long long) conn->shm_stats.wakeups,
+			(unsigned long long) conn->shm_stats.full,
+			VTY_NEWLINE);
+	}
+	if (conn->uring) {
+		vty_out(vty, " io_uring enters(%llu) recvs(%llu) sends(%llu) "
+			"send-batches(%llu)%s",
+			(unsigned long long) conn->uring_stats.enters,
+			(unsigned long long) conn->uring_stats.recvs,
+			(unsigned long long) conn->uring_stats.sends,
+			(unsigned long long) conn->uring_stats.send_batches,
+			VTY_NEWLINE);
+		vty_out(vty, " io_uring rearms(%llu) no-buffers(%llu) "
+			"send-full(%llu)%s",
+			(unsigned long long) conn->uring_stats.rearms,
+			(unsigned long long) conn->uring_stats.no_bufs,
+			(unsigned long long) conn->uring_stats.full,
+			VTY_NEWLINE);
+	}
+}
+
 DEFUN(show_mncc_conn, show_mncc_conn_cmd,
 	"show mncc-connection",
 	SHOW_STR "MNCC Connection state\n")
 {
-	vty_out(vty, "MNCC connection to path '%s' is in state %s%s",
-		g_app.mncc.path,
-		get_value_string(mncc_conn_state_vals, g_app.mncc.conn.state),
+	struct mncc_connection *conn;
+
+	llist_for_each_entry(conn, &g_app.mncc.conns, entry)
+		dump_mncc_conn(vty, conn);
+	vty_out(vty, "Locally bridged calls(%llu)%s",
+		(unsigned long long) g_app.local_bridge.calls, VTY_NEWLINE);
+	return CMD_SUCCESS;
+}
+
+static void dump_rx_stats(const char *name, const struct mncc_rx_stats *stats,
+				void *data)
+{
+	struct vty *vty = data;
+
+	if (stats->count == 0 && stats->bad_size == 0 && stats->unknown_leg == 0)
+		return;
+
+	vty_out(vty, " %-22s count(%llu) bad-size(%llu) unknown-leg(%llu) "
+		"avg(%lluns) max(%lluns)%s", name,
+		(unsigned long long) stats->count,
+		(unsigned long long) stats->bad_size,
+		(unsigned long long) stats->unknown_leg,
+		(unsigned long long) (stats->count ? stats->nsec / stats->count : 0),
+		(unsigned long long) stats->max_nsec, VTY_NEWLINE);
+}
+
+DEFUN(show_mncc_proxy, show_mncc_proxy_cmd,
+	"show mncc-proxy",
+	SHOW_STR "MNCC proxy and its workers\n")
+{
+	struct mncc_proxy *proxy = g_app.mncc_proxy.proxy;
+	struct mncc_proxy_worker *worker;
+
+	if (!proxy) {
+		vty_out(vty, "Not running as a proxy%s", VTY_NEWLINE);
+		return CMD_SUCCESS;
+	}
+
+	vty_out(vty, "MNCC proxy from '%s' to '%s' is in state %s%s",
+		g_app.mncc.default_conn->path, g_app.mncc_proxy.path,
+		get_value_string(mncc_conn_state_vals, proxy->msc_state), VTY_NEWLINE);
+	vty_out(vty, " calls(%u) rx(%llu) tx(%llu) reconnects(%llu)%s",
+		proxy->calls,
+		(unsigned long long) proxy->rx_msgs,
+		(unsigned long long) proxy->tx_msgs,
+		(unsigned long long) proxy->msc_reconnects, VTY_NEWLINE);
+	vty_out(vty, " unknown-callref(%llu) no-worker(%llu) orphaned(%llu)%s",
+		(unsigned long long) proxy->unknown_callref,
+		(unsigned long long) proxy->no_worker,
+		(unsigned long long) proxy->orphaned, VTY_NEWLINE);
+
+	llist_for_each_entry(worker, &proxy->workers, entry) {
+		vty_out(vty, " Worker(%u) %s calls(%u) mo(%llu) mt(%llu) rx(%llu) tx(%llu) "
+			"queued(%llu/%u bytes)%s",
+			worker->nr, worker->ready ? "ready" : "waiting",
+			worker->calls,
+			(unsigned long long) worker->mo_calls,
+			(unsigned long long) worker->mt_calls,
+			(unsigned long long) worker->rx_msgs,
+			(unsigned long long) worker->tx_msgs,
+			(unsigned long long) worker->queued_msgs,
+			worker->out_queued, VTY_NEWLINE);
+	}
+	return CMD_SUCCESS;
+}
+
+DEFUN(show_replication, show_replication_cmd,
+	"show replication",
+	SHOW_STR "Call state replication to the standby\n")
+{
+	struct replication *repl = g_app.replication.state;
+
+	vty_out(vty, "Replication role %s on '%s'%s",
+		get_value_string(replication_role_names, g_app.replication.role),
+		g_app.replication.path, VTY_NEWLINE);
+	if (!repl)
+		return CMD_SUCCESS;
+
+	vty_out(vty, " %s connects(%llu) seq(%u) last-seq(%u)%s",
+		repl->connected ? "connected" : "not connected",
+		(unsigned long long) repl->connects,
+		repl->seq, repl->last_seq, VTY_NEWLINE);
+	vty_out(vty, " batches(%llu) updates(%llu) removes(%llu) bytes(%llu)%s",
+		(unsigned long long) repl->batches,
+		(unsigned long long) repl->updates,
+		(unsigned long long) repl->removes,
+		(unsigned long long) repl->bytes, VTY_NEWLINE);
+	vty_out(vty, " overruns(%llu) seq-gaps(%llu) queued(%u) rejects(%llu)%s",
+		(unsigned long long) repl->overruns,
+		(unsigned long long) repl->seq_gaps, repl->out_queued,
+		(unsigned long long) repl->rejects, VTY_NEWLINE);
+	if (g_app.replication.role == REPLICATION_STANDBY) {
+		vty_out(vty, " lag last(%lluus) avg(%lluus) max(%lluus)%s",
+			(unsigned long long) repl->lag_last_us,
+			(unsigned long long) repl->lag_avg_us,
+			(unsigned long long) repl->lag_max_us, VTY_NEWLINE);
+		vty_out(vty, " mirrored calls(%u) %s%s", repl->num_calls,
+			repl->synced ? "synced" : "not synced", VTY_NEWLINE);
+	}
+	return CMD_SUCCESS;
+}
+
+DEFUN(show_call_table, show_call_table_cmd,
+	"show call-table",
+	SHOW_STR "Calls kept in a mapped file across a crash\n")
+{
+	struct call_table *table = &g_app.call_table;
+
+	if (!table->base) {
+		vty_out(vty, "No call table%s", VTY_NEWLINE);
+		return CMD_SUCCESS;
+	}
+
+	vty_out(vty, "Call table '%s' used(%u) slots(%u)%s",
+		table->path, table->used, table->num_slots, VTY_NEWLINE);
+	vty_out(vty, " updates(%llu) removes(%llu) full(%llu) recovered(%llu)%s",
+		(unsigned long long) table->updates,
+		(unsigned long long) table->removes,
+		(unsigned long long) table->full,
+		(unsigned long long) table->recovered, VTY_NEWLINE);
+	return CMD_SUCCESS;
+}
+
+DEFUN(show_mncc_stats, show_mncc_stats_cmd,
+	"show mncc-statistics",
+	SHOW_STR "Received MNCC messages by type\n")
+{
+	vty_out(vty, "Received MNCC messages%s", VTY_NEWLINE);
+	mncc_rx_stats_foreach(dump_rx_stats, vty);
+	return CMD_SUCCESS;
+}
+
+DEFUN(show_setup_queue, show_setup_queue_cmd,
+	"show setup-queue",
+	SHOW_STR "Parked call setups\n")
+{
+	struct setup_queue *queue = &g_setup_queue;
+
+	vty_out(vty, "Setup queue length %u/%u max(%u)%s",
+		queue->length, g_app.setup_queue.max_length,
+		queue->max_length_seen, VTY_NEWLINE);
+	vty_out(vty, " queued(%llu) processed(%llu) overflows(%llu) flushed(%llu)%s",
+		(unsigned long long) queue->queued,
+		(unsigned long long) queue->processed,
+		(unsigned long long) queue->overflows,
+		(unsigned long long) queue->flushed, VTY_NEWLINE);
+	vty_out(vty, " delay last(%uus) avg(%lluus) max(%uus)%s",
+		queue->delay_last,
+		(unsigned long long) (queue->processed ?
+			queue->delay_total / queue->processed : 0),
+		queue->delay_max, VTY_NEWLINE);
+	return CMD_SUCCESS;
+}
+
+static void dump_pacer(struct vty *vty, struct pacer *pacer)
+{
+	vty_out(vty, " rate(%u/s) burst(%u) queue %u/%u max(%u)%s",
+		pacer->rate, pacer->burst, pacer->length, pacer->max_length,
+		pacer->max_length_seen, VTY_NEWLINE);
+	vty_out(vty, " direct(%llu) queued(%llu) overflows(%llu) expired(%llu)%s",
+		(unsigned long long) pacer->sent_direct,
+		(unsigned long long) pacer->sent_queued,
+		(unsigned long long) pacer->overflows,
+		(unsigned long long) pacer->expired, VTY_NEWLINE);
+	vty_out(vty, " delay last(%uus) avg(%lluus) max(%uus)%s",
+		pacer->delay_last,
+		(unsigned long long) (pacer->sent_queued ?
+			pacer->delay_total / pacer->sent_queued : 0),
+		pacer->delay_max, VTY_NEWLINE);
+}
+
+DEFUN(show_sip_pacing, show_sip_pacing_cmd,
+	"show sip invite-pacing",
+	SHOW_STR "SIP\nPacing of outgoing INVITEs\n")
+{
+	struct sip_trunk *trunk;
+
+	llist_for_each_entry(trunk, &g_app.sip.trunks, entry) {
+		vty_out(vty, "INVITE pacing towards trunk %s%s",
+			trunk->name, VTY_NEWLINE);
+		dump_pacer(vty, &trunk->invite_pacer);
+	}
+	return CMD_SUCCESS;
+}
+
+DEFUN(show_sip_resolver, show_sip_resolver_cmd,
+	"show sip resolver",
+	SHOW_STR "SIP\nResolution of the trunk addresses\n")
+{
+	struct sip_resolver *resolver = &g_app.sip.resolver;
+
+	vty_out(vty, "Resolver refresh every %us%s%s",
+		resolver->refresh_interval,
+		resolver->busy ? ", resolving" : "", VTY_NEWLINE);
+	vty_out(vty, " runs(%llu) lookups(%llu) failures(%llu)%s",
+		(unsigned long long) resolver->runs,
+		(unsigned long long) resolver->lookups,
+		(unsigned long long) resolver->failures, VTY_NEWLINE);
+	vty_out(vty, " latency last(%ums) max(%ums) avg(%llums)%s",
+		resolver->last_ms, resolver->max_ms,
+		resolver->lookups ?
+			(unsigned long long) (resolver->total_ms / resolver->lookups) : 0ULL,
 		VTY_NEWLINE);
 	return CMD_SUCCESS;
 }
 
+DEFUN(show_sip_engine, show_sip_engine_cmd,
+	"show sip engine",
+	SHOW_STR "SIP\nThe SIP stack in use\n")
+{
+	struct lsip_engine *engine = g_app.sip.agent.builtin;
+
+	if (!engine) {
+		vty_out(vty, "Using sofia-sip%s", VTY_NEWLINE);
+		return CMD_SUCCESS;
+	}
+
+	vty_out(vty, "Using the built-in engine on %s:%u%s",
+		engine->local_host, ntohs(engine->local.sin_port), VTY_NEWLINE);
+	vty_out(vty, " dialogs(%u/%u) transactions(%u/%u) timers(%u)%s",
+		lsip_dialogs_in_use(engine), engine->num_dialogs,
+		lsip_txns_in_use(engine), engine->num_txns,
+		engine->timers, VTY_NEWLINE);
+	vty_out(vty, " rx(%llu) rx_bad(%llu) tx(%llu) tx_batches(%llu)%s",
+		(unsigned long long) engine->rx,
+		(unsigned long long) engine->rx_bad,
+		(unsigned long long) engine->tx,
+		(unsigned long long) engine->tx_batches, VTY_NEWLINE);
+	vty_out(vty, " retransmits(%llu) timeouts(%llu)%s",
+		(unsigned long long) engine->retransmits,
+		(unsigned long long) engine->timeouts, VTY_NEWLINE);
+	vty_out(vty, " dialogs_used(%llu) dialogs_exhausted(%llu)%s",
+		(unsigned long long) engine->dialogs_used,
+		(unsigned long long) engine->dialogs_exhausted, VTY_NEWLINE);
+	vty_out(vty, " transactions_used(%llu) transactions_exhausted(%llu)%s",
+		(unsigned long long) engine->txns_used,
+		(unsigned long long) engine->txns_exhausted, VTY_NEWLINE);
+	return CMD_SUCCESS;
+}
+
+DEFUN(show_sip_trunks, show_sip_trunks_cmd,
+	"show sip trunks",
+	SHOW_STR "SIP\nRemote PBXs of the trunk group\n")
+{
+	struct sip_trunk *trunk;
+
+	llist_for_each_entry(trunk, &g_app.sip.trunks, entry) {
+		vty_out(vty, "Trunk %s to %s:%d over %s is %s%s",
+			trunk->name, trunk->remote_addr, trunk->remote_port,
+			get_value_string(sip_transport_names, trunk->transport),
+			get_value_string(sip_trunk_state_vals, trunk->state),
+			VTY_NEWLINE);
+		vty_out(vty, " invites in flight %u max(%llu) probe_backoff(%u)%s",
+			trunk->invites_in_flight,
+			(unsigned long long) trunk->max_invites_in_flight,
+			trunk->probe_backoff, VTY_NEWLINE);
+		vty_out(vty, " weight(%u) calls %u/%u failures(%u)%s",
+			trunk->weight, trunk->active_calls, trunk->max_calls,
+			trunk->failures, VTY_NEWLINE);
+		vty_out(vty, " calls(%llu) call_failures(%llu) failovers(%llu) breaker_trips(%llu)%s",
+			(unsigned long long) trunk->calls,
+			(unsigned long long) trunk->call_failures,
+			(unsigned long long) trunk->failovers,
+			(unsigned long long) trunk->breaker_trips, VTY_NEWLINE);
+		vty_out(vty, " probes(%llu) probe_failures(%llu)%s",
+			(unsigned long long) trunk->probes,
+			(unsigned long long) trunk->probe_failures, VTY_NEWLINE);
+		vty_out(vty, " resolved(%s) in %ums resolve_failures(%llu) "
+			"resolved_sends(%llu) unresolved_sends(%llu)%s",
+			trunk->resolved_addr ? trunk->resolved_addr : "none",
+			trunk->resolve_ms,
+			(unsigned long long) trunk->resolve_failures,
+			(unsigned long long) trunk->resolved_sends,
+			(unsigned long long) trunk->unresolved_sends, VTY_NEWLINE);
+		if (trunk->auth.username)
+			vty_out(vty, " auth user(%s) realm(%s) nc(%u) challenges(%llu) "
+				"proactive(%llu) failures(%llu)%s",
+				trunk->auth.username,
+				trunk->auth.realm ? trunk->auth.realm : "none",
+				trunk->auth.nc,
+				(unsigned long long) trunk->auth.challenges,
+				(unsigned long long) trunk->auth.proactive,
+				(unsigned long long) trunk->auth.failures, VTY_NEWLINE);
+	}
+	return CMD_SUCCESS;
+}
+
+static void dump_rate_limit(struct vty *vty, const char *name,
+				struct ratelimit *rl)
+{
+	if (!rl->limit) {
+		vty_out(vty, "%s rate limit disabled%s", name, VTY_NEWLINE);
+		return;
+	}
+
+	vty_out(vty, "%s rate limit %u per %us, subscribers %u/%u%s",
+		name, rl->limit, rl->window, rl->used, rl->size, VTY_NEWLINE);
+	vty_out(vty, " accepted(%llu) rejected(%llu) evicted(%llu)%s",
+		(unsigned long long) rl->accepted,
+		(unsigned long long) rl->rejected,
+		(unsigned long long) rl->evicted, VTY_NEWLINE);
+}
+
+DEFUN(show_rate_limit, show_rate_limit_cmd,
+	"show rate-limit",
+	SHOW_STR "Call attempts per subscriber\n")
+{
+	dump_rate_limit(vty, "MNCC", &g_app.rate_limit.mncc);
+	dump_rate_limit(vty, "SIP", &g_app.rate_limit.sip);
+	return CMD_SUCCESS;
+}
+
+DEFUN(show_route_table, show_route_table_cmd,
+	"show route-table",
+	SHOW_STR ROUTE_TABLE_STR)
+{
+	struct routing *routing = &g_app.routing;
+	struct route_table *table = routing->table;
+
+	if (!table)
+		vty_out(vty, "No route table loaded%s", VTY_NEWLINE);
+	else {
+		vty_out(vty, "Route table %s%s%s", routing->path,
+			routing->loading ? " (reloading)" : "", VTY_NEWLINE);
+		vty_out(vty, " routes(%zu) nodes(%zu) trunks(%zu) bytes(%zu)%s",
+			table->num_routes, table->num_nodes, table->num_trunks,
+			table->bytes, VTY_NEWLINE);
+		vty_out(vty, " build(%ums) bad_lines(%u) duplicates(%u)%s",
+			table->build_ms, table->bad_lines, table->duplicates,
+			VTY_NEWLINE);
+	}
+	vty_out(vty, " lookups(%llu) hits(%llu) misses(%llu)%s",
+		(unsigned long long) routing->lookups,
+		(unsigned long long) routing->hits,
+		(unsigned long long) routing->misses, VTY_NEWLINE);
+	vty_out(vty, " reloads(%llu) reload_failures(%llu)%s",
+		(unsigned long long) routing->reloads,
+		(unsigned long long) routing->reload_failures, VTY_NEWLINE);
+	return CMD_SUCCESS;
+}
+
+DEFUN(show_route_lookup, show_route_lookup_cmd,
+	"show route-table lookup NUMBER (any|GSM|GSM-EFR|GSM-HR-08|AMR)",
+	SHOW_STR ROUTE_TABLE_STR "Find the route of a number\n"
+	"Dialed number\nAny codec\nGSM FR\nGSM EFR\nGSM HR\nAMR\n")
+{
+	struct routing *routing = &g_app.routing;
+	const struct route *route;
+	char *dest;
+
+	route = route_lookup(routing, argv[0], route_codec_parse(argv[1]));
+	if (!route) {
+		vty_out(vty, "No route for %s%s", argv[0], VTY_NEWLINE);
+		return CMD_SUCCESS;
+	}
+
+	dest = route_rewrite(tall_mncc_ctx, routing->table, route, argv[0]);
+	vty_out(vty, "%s to trunk %s as %s%s", argv[0],
+		route_trunk_name(routing->table, route), dest, VTY_NEWLINE);
+	talloc_free(dest);
+	return CMD_SUCCESS;
+}
+
+DEFUN(show_number_rules, show_number_rules_cmd,
+	"show number-rules",
+	SHOW_STR "Rewrite of numbers between MNCC and SIP\n")
+{
+	int dir, field;
+
+	for (dir = NUMBERING_MO; dir <= NUMBERING_MT; ++dir) {
+		for (field = NUMBERING_CALLED; field <= NUMBERING_CALLING; ++field) {
+			struct numbering_set *set = &g_app.numbering.sets[dir][field];
+
+			vty_out(vty, "%s %s rules(%u) states(%u)%s",
+				get_value_string(numbering_dir_names, dir),
+				get_value_string(numbering_field_names, field),
+				set->num_rules, set->num_states, VTY_NEWLINE);
+			vty_out(vty, " translated(%llu) untouched(%llu)%s",
+				(unsigned long long) set->translated,
+				(unsigned long long) set->untouched, VTY_NEWLINE);
+		}
+	}
+	return CMD_SUCCESS;
+}
+
+DEFUN(show_imsi_map, show_imsi_map_cmd,
+	"show imsi-map",
+	SHOW_STR IMSI_MAP_STR)
+{
+	struct imsi_map *map = &g_app.imsi_map;
+
+	if (!map->file)
+		vty_out(vty, "No IMSI map loaded%s", VTY_NEWLINE);
+	else
+		vty_out(vty, "IMSI map %s with %u subscribers (%zu bytes)%s",
+			map->path, map->file->count, map->file->len, VTY_NEWLINE);
+	vty_out(vty, " lookups(%llu) hits(%llu) misses(%llu)%s",
+		(unsigned long long) map->lookups,
+		(unsigned long long) map->hits,
+		(unsigned long long) map->misses, VTY_NEWLINE);
+	vty_out(vty, " reloads(%llu) reload_failures(%llu)%s",
+		(unsigned long long) map->reloads,
+		(unsigned long long) map->reload_failures, VTY_NEWLINE);
+	return CMD_SUCCESS;
+}
+
+DEFUN(show_codec_selection, show_codec_selection_cmd,
+	"show codec-selection",
+	SHOW_STR "Codecs picked from SIP offers\n")
+{
+	struct codec_policy *policy = &g_app.codecs;
+	int i;
+
+	if (policy->num_prefs == 0)
+		vty_out(vty, "No codec preference, using the first offered codec%s",
+			VTY_NEWLINE);
+	vty_out(vty, "Channel rate %s%s",
+		get_value_string(channel_rate_names, policy->rate), VTY_NEWLINE);
+	for (i = 0; i < _NUM_CODECS; ++i)
+		vty_out(vty, " %s selected(%llu)%s",
+			get_value_string(codec_names, i),
+			(unsigned long long) policy->selected[i], VTY_NEWLINE);
+	vty_out(vty, " no match(%llu)%s",
+		(unsigned long long) policy->unmatched, VTY_NEWLINE);
+	return CMD_SUCCESS;
+}
+
 void mncc_sip_vty_init(void)
 {
 	/* default values */
-	g_app.mncc.path = talloc_strdup(tall_mncc_ctx, "/tmp/bsc_mncc");
+	mncc_connections_init(&g_app);
+	g_app.mncc_proxy.path = talloc_strdup(tall_mncc_ctx, "/tmp/bsc_mncc_proxy");
+	g_app.replication.path = talloc_strdup(tall_mncc_ctx,
+					"/tmp/osmo_sip_connector_replication");
+	g_app.handover.path = talloc_strdup(tall_mncc_ctx,
+					"/tmp/osmo_sip_connector_handover");
 	g_app.sip.local_addr = talloc_strdup(tall_mncc_ctx, "127.0.0.1");
 	g_app.sip.local_port = 5060;
-	g_app.sip.remote_addr = talloc_strdup(tall_mncc_ctx, "pbx");
-	g_app.sip.remote_port = 5060;
+	g_app.sip.inherited_fd = -1;
+	g_app.call_table.num_slots = 16384;
+	sip_trunks_init(&g_app);
+	g_app.setup_queue.max_length = 256;
+	g_app.rate_limit.mncc.size = 65536;
+	g_app.rate_limit.sip.size = 65536;
+	g_app.sip.early_media = true;
+	g_app.sip.engine = SIP_ENGINE_SOFIA;
+	g_app.sip.builtin_dialogs = 4096;
+	g_app.codecs.rate = CHANNEL_RATE_FULL;
+	codec_policy_compile(&g_app.codecs);
 
 
 	vty_init(&vty_info);
@@ -302,17 +1781,111 @@ void mncc_sip_vty_init(void)
 	install_node(&sip_node, config_write_sip);
 	install_element(SIP_NODE, &cfg_sip_local_addr_cmd);
 	install_element(SIP_NODE, &cfg_sip_remote_addr_cmd);
+	install_element(SIP_NODE, &cfg_sip_weight_cmd);
+	install_element(SIP_NODE, &cfg_sip_max_calls_cmd);
+	install_element(SIP_NODE, &cfg_sip_invite_rate_cmd);
+	install_element(SIP_NODE, &cfg_sip_invite_burst_cmd);
+	install_element(SIP_NODE, &cfg_sip_invite_queue_length_cmd);
+	install_element(SIP_NODE, &cfg_sip_invite_queue_delay_cmd);
+	install_element(SIP_NODE, &cfg_sip_auth_cmd);
+	install_element(SIP_NODE, &cfg_sip_no_auth_cmd);
+	install_element(SIP_NODE, &cfg_sip_probe_interval_cmd);
+	install_element(SIP_NODE, &cfg_sip_breaker_threshold_cmd);
+	install_element(SIP_NODE, &cfg_sip_breaker_cooldown_cmd);
+	install_element(SIP_NODE, &cfg_sip_transport_cmd);
+	install_element(SIP_NODE, &cfg_sip_tcp_keepalive_cmd);
+	install_element(SIP_NODE, &cfg_sip_dns_refresh_cmd);
+	install_element(SIP_NODE, &cfg_sip_early_media_cmd);
+	install_element(SIP_NODE, &cfg_sip_no_early_media_cmd);
+	install_element(SIP_NODE, &cfg_sip_engine_cmd);
+	install_element(SIP_NODE, &cfg_sip_builtin_dialogs_cmd);
+	install_element(SIP_NODE, &cfg_sip_trunk_cmd);
+	install_element(SIP_NODE, &cfg_sip_no_trunk_cmd);
+
+	install_node(&trunk_node, NULL);
+	install_element(TRUNK_NODE, &cfg_sip_remote_addr_cmd);
+	install_element(TRUNK_NODE, &cfg_sip_weight_cmd);
+	install_element(TRUNK_NODE, &cfg_sip_max_calls_cmd);
+	install_element(TRUNK_NODE, &cfg_sip_invite_rate_cmd);
+	install_element(TRUNK_NODE, &cfg_sip_invite_burst_cmd);
+	install_element(TRUNK_NODE, &cfg_sip_invite_queue_length_cmd);
+	install_element(TRUNK_NODE, &cfg_sip_invite_queue_delay_cmd);
+	install_element(TRUNK_NODE, &cfg_sip_transport_cmd);
+	install_element(TRUNK_NODE, &cfg_sip_auth_cmd);
+	install_element(TRUNK_NODE, &cfg_sip_no_auth_cmd);
 
 	install_element(CONFIG_NODE, &cfg_mncc_cmd);
 	install_node(&mncc_node, config_write_mncc);
 	install_element(MNCC_NODE, &cfg_mncc_path_cmd);
+	install_element(MNCC_NODE, &cfg_mncc_proxy_path_cmd);
+	install_element(MNCC_NODE, &cfg_mncc_called_prefix_cmd);
+	install_element(MNCC_NODE, &cfg_mncc_no_called_prefix_cmd);
+	install_element(MNCC_NODE, &cfg_mncc_imsi_prefix_cmd);
+	install_element(MNCC_NODE, &cfg_mncc_no_imsi_prefix_cmd);
+	install_element(MNCC_NODE, &cfg_mncc_io_uring_cmd);
+	install_element(MNCC_NODE, &cfg_mncc_no_io_uring_cmd);
+	install_element(MNCC_NODE, &cfg_mncc_shared_memory_cmd);
+	install_element(MNCC_NODE, &cfg_mncc_no_shared_memory_cmd);
+	install_element(MNCC_NODE, &cfg_mncc_connection_cmd);
+	install_element(MNCC_NODE, &cfg_mncc_no_connection_cmd);
+
+	install_node(&mncc_conn_node, NULL);
+	install_element(MNCC_CONN_NODE, &cfg_mncc_path_cmd);
+	install_element(MNCC_CONN_NODE, &cfg_mncc_called_prefix_cmd);
+	install_element(MNCC_CONN_NODE, &cfg_mncc_no_called_prefix_cmd);
+	install_element(MNCC_CONN_NODE, &cfg_mncc_imsi_prefix_cmd);
+	install_element(MNCC_CONN_NODE, &cfg_mncc_no_imsi_prefix_cmd);
 
 	install_element(CONFIG_NODE, &cfg_app_cmd);
 	install_node(&app_node, config_write_app);
 	install_element(APP_NODE, &cfg_use_imsi_cmd);
 	install_element(APP_NODE, &cfg_no_use_imsi_cmd);
+	install_element(APP_NODE, &cfg_setup_queue_length_cmd);
+	install_element(APP_NODE, &cfg_rate_limit_cmd);
+	install_element(APP_NODE, &cfg_no_rate_limit_cmd);
+	install_element(APP_NODE, &cfg_rate_limit_size_cmd);
+	install_element(APP_NODE, &cfg_route_table_cmd);
+	install_element(APP_NODE, &cfg_no_route_table_cmd);
+	install_element(APP_NODE, &cfg_handover_path_cmd);
+	install_element(APP_NODE, &cfg_call_table_cmd);
+	install_element(APP_NODE, &cfg_no_call_table_cmd);
+	install_element(APP_NODE, &cfg_call_table_slots_cmd);
+	install_element(APP_NODE, &cfg_number_rule_cmd);
+	install_element(APP_NODE, &cfg_no_number_rule_cmd);
+	install_element(APP_NODE, &cfg_imsi_map_cmd);
+	install_element(APP_NODE, &cfg_no_imsi_map_cmd);
+	install_element(APP_NODE, &cfg_local_bridge_prefix_cmd);
+	install_element(APP_NODE, &cfg_no_local_bridge_prefix_cmd);
+	install_element(APP_NODE, &cfg_local_bridge_imsi_map_cmd);
+	install_element(APP_NODE, &cfg_no_local_bridge_imsi_map_cmd);
+	install_element(APP_NODE, &cfg_codec_preference_cmd);
+	install_element(APP_NODE, &cfg_no_codec_preference_cmd);
+	install_element(APP_NODE, &cfg_channel_rate_cmd);
+
+	install_element(CONFIG_NODE, &cfg_replication_cmd);
+	install_node(&replication_node, config_write_replication);
+	install_element(REPLICATION_NODE, &cfg_replication_role_cmd);
+	install_element(REPLICATION_NODE, &cfg_replication_path_cmd);
+
+	install_element(ENABLE_NODE, &reload_route_table_cmd);
+	install_element(ENABLE_NODE, &reload_imsi_map_cmd);
 
 	install_element_ve(&show_calls_cmd);
 	install_element_ve(&show_calls_sum_cmd);
 	install_element_ve(&show_mncc_conn_cmd);
+	install_element_ve(&show_mncc_stats_cmd);
+	install_element_ve(&show_mncc_proxy_cmd);
+	install_element_ve(&show_replication_cmd);
+	install_element_ve(&show_call_table_cmd);
+	install_element_ve(&show_setup_queue_cmd);
+	install_element_ve(&show_sip_pacing_cmd);
+	install_element_ve(&show_sip_trunks_cmd);
+	install_element_ve(&show_sip_resolver_cmd);
+	install_element_ve(&show_sip_engine_cmd);
+	install_element_ve(&show_rate_limit_cmd);
+	install_element_ve(&show_route_table_cmd);
+	install_element_ve(&show_route_lookup_cmd);
+	install_element_ve(&show_number_rules_cmd);
+	install_element_ve(&show_imsi_map_cmd);
+	install_element_ve(&show_codec_selection_cmd);
 }
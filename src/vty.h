@@ -7,6 +7,9 @@ enum {
 	SIP_NODE = _LAST_OSMOVTY_NODE + 1,
 	MNCC_NODE,
 	APP_NODE,
+	TRUNK_NODE,
+	MNCC_CONN_NODE,
+	REPLICATION_NODE,
 };
 
 void mncc_sip_vty_init();